@@ -123,6 +123,9 @@ typedef struct _OhmFactStoreTransaction OhmFactStoreTransaction;
 typedef struct _OhmFactStoreTransactionClass OhmFactStoreTransactionClass;
 typedef struct _OhmFactStoreTransactionPrivate OhmFactStoreTransactionPrivate;
 typedef struct _OhmFactStoreTransactionCOW OhmFactStoreTransactionCOW;
+typedef struct _OhmFactStoreSnapshot OhmFactStoreSnapshot;
+typedef struct _OhmFactStoreTxn OhmFactStoreTxn;
+typedef struct _OhmFactStoreWriter OhmFactStoreWriter;
 
 #define OHM_FACT_STORE_TYPE_VIEW (ohm_fact_store_view_get_type ())
 #define OHM_FACT_STORE_VIEW(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), OHM_FACT_STORE_TYPE_VIEW, OhmFactStoreView))
@@ -338,6 +341,137 @@ struct _OhmFactStoreViewClass {
 	OhmFactStoreSimpleViewClass parent_class;
 };
 
+/**
+ * OhmFactStoreLookupStats:
+ * @lookups: number of ohm_fact_store_get_facts_by_pattern () calls
+ * @indexed: number of those lookups that used a secondary index
+ * @candidates: number of facts matched against the patterns
+ *
+ * Pattern lookup statistics, see ohm_fact_store_get_lookup_stats ().
+ **/
+typedef struct _OhmFactStoreLookupStats {
+	guint lookups;
+	guint indexed;
+	guint64 candidates;
+} OhmFactStoreLookupStats;
+
+/**
+ * OhmFactStoreSymbolStats:
+ * @symbols: number of distinct strings in the symbol table
+ * @refs: number of references to them, from facts and patterns
+ * @bytes: memory used by the strings themselves
+ *
+ * String symbol table statistics, see ohm_fact_store_get_symbol_stats ().
+ * The string values of the facts in a store are interned in a table
+ * shared by the store and its facts, and released when no fact nor
+ * pattern uses them, even after the fact left the store.
+ **/
+typedef struct _OhmFactStoreSymbolStats {
+	guint symbols;
+	guint refs;
+	gsize bytes;
+} OhmFactStoreSymbolStats;
+
+#define OHM_FACT_STORE_STATS_BUCKETS 16
+
+/**
+ * OhmFactStoreStats:
+ * @facts: number of facts in the store
+ * @names: number of fact names with facts or patterns
+ * @patterns: number of patterns of the views
+ * @transparent_patterns: number of patterns of the transparent views
+ * @views: number of views with patterns
+ * @evaluations: number of matches of a fact against a pattern
+ * @hits: number of those that matched
+ * @transaction_depth: number of transactions open
+ * @max_transaction_depth: most transactions open at once so far
+ * @cow_length: number of changes logged by the open transactions
+ * @max_cow_length: most changes logged by a transaction so far
+ * @dispatches: number of changes dispatched to the views
+ * @dispatch_time: time spent dispatching them, in microseconds, while
+ * timed (see ohm_fact_store_set_timing ())
+ * @dispatch_histogram: number of timed dispatches that took less than
+ * 1, 2, 4... microseconds, the last bucket holding the longer ones
+ *
+ * Activity statistics, see ohm_fact_store_get_stats ().
+ **/
+typedef struct _OhmFactStoreStats {
+	guint facts;
+	guint names;
+	guint patterns;
+	guint transparent_patterns;
+	guint views;
+	guint64 evaluations;
+	guint64 hits;
+	guint transaction_depth;
+	guint max_transaction_depth;
+	guint cow_length;
+	guint max_cow_length;
+	guint64 dispatches;
+	guint64 dispatch_time;
+	guint64 dispatch_histogram[OHM_FACT_STORE_STATS_BUCKETS];
+} OhmFactStoreStats;
+
+/**
+ * OhmFactStoreNameStats:
+ * @name: the fact name
+ * @facts: number of facts of that name in the store
+ * @patterns: number of patterns of the views on that name
+ * @transparent_patterns: number of patterns of the transparent views
+ * @evaluations: number of matches of a fact against these patterns
+ * @hits: number of those that matched
+ *
+ * Statistics of a fact name, see ohm_fact_store_get_name_stats ().
+ **/
+typedef struct _OhmFactStoreNameStats {
+	GQuark name;
+	guint facts;
+	guint patterns;
+	guint transparent_patterns;
+	guint64 evaluations;
+	guint64 hits;
+} OhmFactStoreNameStats;
+
+/**
+ * OhmFactStorePatternStats:
+ * @pattern: the pattern, not referenced
+ * @view: its view, not referenced
+ * @transparent: whether @view is transparent
+ * @evaluations: number of matches of a fact against @pattern
+ * @hits: number of those that matched
+ *
+ * Statistics of a pattern, see ohm_fact_store_get_pattern_stats ().
+ **/
+typedef struct _OhmFactStorePatternStats {
+	OhmPattern* pattern;
+	OhmFactStoreView* view;
+	gboolean transparent;
+	guint64 evaluations;
+	guint64 hits;
+} OhmFactStorePatternStats;
+
+/**
+ * OhmFactStoreViewStats:
+ * @view: the view, not referenced
+ * @transparent: whether @view is transparent
+ * @patterns: number of patterns of @view
+ * @backlog: number of matches pending in the change set of @view
+ * @overflowed: whether that change set dropped matches
+ * @evaluations: number of matches of a fact against the patterns of @view
+ * @hits: number of those that matched
+ *
+ * Statistics of a view, see ohm_fact_store_get_view_stats ().
+ **/
+typedef struct _OhmFactStoreViewStats {
+	OhmFactStoreView* view;
+	gboolean transparent;
+	guint patterns;
+	guint backlog;
+	gboolean overflowed;
+	guint64 evaluations;
+	guint64 hits;
+} OhmFactStoreViewStats;
+
 typedef enum  {
 	OHM_FACT_STORE_EVENT_ADDED,
 	OHM_FACT_STORE_EVENT_REMOVED,
@@ -345,6 +479,117 @@ typedef enum  {
 	OHM_FACT_STORE_EVENT_LOOKUP
 } OhmFactStoreEvent;
 
+/**
+ * OhmFactStoreOverflow:
+ * @OHM_FACT_STORE_OVERFLOW_DROP_NEWEST: ignore new matches
+ * @OHM_FACT_STORE_OVERFLOW_DROP_OLDEST: discard the oldest entry
+ *
+ * What a change set does with a match once it reached its high-water
+ * mark, see ohm_fact_store_change_set_set_high_water ().
+ **/
+typedef enum  {
+	OHM_FACT_STORE_OVERFLOW_DROP_NEWEST,
+	OHM_FACT_STORE_OVERFLOW_DROP_OLDEST
+} OhmFactStoreOverflow;
+
+/**
+ * OhmFactStoreOpType:
+ * @OHM_FACT_STORE_OP_INSERT: insert the fact
+ * @OHM_FACT_STORE_OP_REMOVE: remove the fact
+ * @OHM_FACT_STORE_OP_UPDATE: set a field of the fact
+ *
+ * The kind of an #OhmFactStoreOp.
+ **/
+typedef enum  {
+	OHM_FACT_STORE_OP_INSERT,
+	OHM_FACT_STORE_OP_REMOVE,
+	OHM_FACT_STORE_OP_UPDATE
+} OhmFactStoreOpType;
+
+/**
+ * OhmFactStoreOp:
+ * @type: the operation
+ * @fact: the fact it applies to
+ * @field: the field to set, for %OHM_FACT_STORE_OP_UPDATE
+ * @value: the value to set, for %OHM_FACT_STORE_OP_UPDATE
+ *
+ * An operation of ohm_fact_store_apply_batch ().
+ **/
+typedef struct _OhmFactStoreOp {
+	OhmFactStoreOpType type;
+	OhmFact* fact;
+	GQuark field;
+	GValue value;
+} OhmFactStoreOp;
+
+#define OHM_FACT_STORE_ERROR (ohm_fact_store_error_quark ())
+
+/**
+ * OhmFactStoreError:
+ * @OHM_FACT_STORE_ERROR_IO: reading or writing failed
+ * @OHM_FACT_STORE_ERROR_FORMAT: the data is not a valid dump
+ * @OHM_FACT_STORE_ERROR_BUSY: the store is within a transaction
+ *
+ * The errors of the %OHM_FACT_STORE_ERROR domain.
+ **/
+typedef enum  {
+	OHM_FACT_STORE_ERROR_IO,
+	OHM_FACT_STORE_ERROR_FORMAT,
+	OHM_FACT_STORE_ERROR_BUSY
+} OhmFactStoreError;
+
+/**
+ * OhmFactStoreFormat:
+ * @OHM_FACT_STORE_FORMAT_TEXT: the debug text of ohm_fact_store_to_string ()
+ * @OHM_FACT_STORE_FORMAT_JSON: JSON, the facts as objects with a name and fields
+ *
+ * The formats of the text representation of facts and stores.
+ **/
+typedef enum  {
+	OHM_FACT_STORE_FORMAT_TEXT,
+	OHM_FACT_STORE_FORMAT_JSON
+} OhmFactStoreFormat;
+
+/**
+ * OhmPatternOp:
+ * @OHM_PATTERN_OP_EQ: the field is equal to the value
+ * @OHM_PATTERN_OP_LT: the field is less than the value
+ * @OHM_PATTERN_OP_LE: the field is less than or equal to the value
+ * @OHM_PATTERN_OP_GT: the field is greater than the value
+ * @OHM_PATTERN_OP_GE: the field is greater than or equal to the value
+ * @OHM_PATTERN_OP_RANGE: the field is between two values, inclusive
+ * @OHM_PATTERN_OP_PREFIX: the string field starts with the value
+ *
+ * The test of a pattern field on the value of a fact, see
+ * ohm_pattern_set_op (). Numbers are ordered by value, strings
+ * bytewise, and %FALSE is less than %TRUE.
+ **/
+typedef enum  {
+	OHM_PATTERN_OP_EQ,
+	OHM_PATTERN_OP_LT,
+	OHM_PATTERN_OP_LE,
+	OHM_PATTERN_OP_GT,
+	OHM_PATTERN_OP_GE,
+	OHM_PATTERN_OP_RANGE,
+	OHM_PATTERN_OP_PREFIX
+} OhmPatternOp;
+
+/**
+ * OhmFactStoreListener:
+ * @store: the #OhmFactStore
+ * @fact: the fact inserted, removed or updated
+ * @event: what happened to @fact
+ * @field: the field updated, or 0
+ * @value: the new value of @field, %NULL if it was removed
+ * @user_data: the data given to ohm_fact_store_add_listener ()
+ *
+ * A function called on each change of the facts of a store, like the
+ * #OhmFactStore::inserted, #OhmFactStore::removed and
+ * #OhmFactStore::updated signals, see ohm_fact_store_add_listener ().
+ **/
+typedef void (*OhmFactStoreListener) (OhmFactStore* store, OhmFact* fact, OhmFactStoreEvent event,
+				      GQuark field, GValue* value, gpointer user_data);
+
 OhmPair* ohm_pair_new (gpointer first, gpointer second, 
 		       GDestroyNotify first_destroy_func, GDestroyNotify second_destroy_func);
 void ohm_pair_free (OhmPair* self);
@@ -355,6 +600,7 @@ GValue* ohm_structure_qget (OhmStructure* self, GQuark field);
 void ohm_structure_set (OhmStructure* self, const char* field_name, GValue* value);
 GValue* ohm_structure_get (OhmStructure* self, const char* field_name);
 char* ohm_structure_to_string (OhmStructure* self);
+void ohm_structure_write (OhmStructure* self, GString* out, OhmFactStoreFormat format);
 void ohm_structure_value_to_string (const GValue* src, GValue* dest);
 GQuark ohm_structure_get_qname (OhmStructure* self);
 const char* ohm_structure_get_name (OhmStructure* self);
@@ -368,6 +614,10 @@ OhmFactStoreView* ohm_pattern_get_view (OhmPattern* self);
 void ohm_pattern_set_view (OhmPattern* self, OhmFactStoreView* value);
 OhmFact* ohm_pattern_get_fact (OhmPattern* self);
 void ohm_pattern_set_fact (OhmPattern* self, OhmFact* value);
+void ohm_pattern_set_op (OhmPattern* self, const char* field_name, OhmPatternOp op, GValue* value);
+void ohm_pattern_set_range (OhmPattern* self, const char* field_name, GValue* low, GValue* high);
+void ohm_pattern_set_prefix (OhmPattern* self, const char* field_name, const char* prefix);
+OhmPatternOp ohm_pattern_get_op (OhmPattern* self, const char* field_name);
 OhmPatternMatch* ohm_pattern_match_new (OhmFact* fact, OhmPattern* pattern, OhmFactStoreEvent event);
 char* ohm_pattern_match_to_string (OhmPatternMatch* self);
 OhmFact* ohm_pattern_match_get_fact (OhmPatternMatch* self);
@@ -379,9 +629,15 @@ GType ohm_pattern_get_type (void);
 OhmFact* ohm_fact_new (const char* name);
 GValue* ohm_fact_get (OhmFact* self, const char* field_name);
 void ohm_fact_set (OhmFact* self, const char* field_name, GValue* value);
+void ohm_fact_set_int (OhmFact* self, const char* field_name, gint val);
+void ohm_fact_set_string (OhmFact* self, const char* field_name, const char* val);
+void ohm_fact_set_boolean (OhmFact* self, const char* field_name, gboolean val);
+void ohm_fact_set_double (OhmFact* self, const char* field_name, gdouble val);
 OhmFactStore* ohm_fact_get_fact_store (OhmFact* self);
 GSList *ohm_fact_get_fields(OhmFact *self);
 void ohm_fact_set_fact_store (OhmFact* self, OhmFactStore* value);
+void ohm_fact_set_expiry (OhmFact* self, gint64 expiry);
+gint64 ohm_fact_get_expiry (OhmFact* self);
 GType ohm_fact_get_type (void);
 
 gboolean ohm_fact_store_insert (OhmFactStore* self, OhmFact* fact);
@@ -390,10 +646,63 @@ void ohm_fact_store_update (OhmFactStore* self, OhmFact* fact, GQuark field, GVa
 GSList* ohm_fact_store_get_facts_by_quark (OhmFactStore* self, GQuark qname);
 GSList* ohm_fact_store_get_facts_by_name (OhmFactStore* self, const char* name);
 GSList* ohm_fact_store_get_facts_by_pattern (OhmFactStore* self, OhmPattern* pattern);
+gboolean ohm_fact_store_add_index (OhmFactStore* self, const char* name, const char* field);
+gboolean ohm_fact_store_drop_index (OhmFactStore* self, const char* name, const char* field);
+gboolean ohm_fact_store_add_ordered_index (OhmFactStore* self, const char* name, const char* field);
+gboolean ohm_fact_store_drop_ordered_index (OhmFactStore* self, const char* name, const char* field);
+guint ohm_fact_store_get_index_probes (OhmFactStore* self, const char* name, const char* field);
+void ohm_fact_store_get_lookup_stats (OhmFactStore* self, OhmFactStoreLookupStats* stats);
+void ohm_fact_store_get_symbol_stats (OhmFactStore* self, OhmFactStoreSymbolStats* stats);
+void ohm_fact_store_get_stats (OhmFactStore* self, OhmFactStoreStats* stats);
+GArray* ohm_fact_store_get_name_stats (OhmFactStore* self);
+GArray* ohm_fact_store_get_pattern_stats (OhmFactStore* self);
+GArray* ohm_fact_store_get_view_stats (OhmFactStore* self);
+void ohm_fact_store_reset_stats (OhmFactStore* self);
+void ohm_fact_store_write_stats (OhmFactStore* self, GString* out, OhmFactStoreFormat format);
+void ohm_fact_store_set_thread_safe (OhmFactStore* self, gboolean thread_safe);
+gboolean ohm_fact_store_get_thread_safe (OhmFactStore* self);
+void ohm_fact_store_set_timing (OhmFactStore* self, gboolean timing);
+gboolean ohm_fact_store_get_timing (OhmFactStore* self);
+void ohm_fact_store_lock_names (OhmFactStore* self, const GQuark* names, guint n_names);
+void ohm_fact_store_unlock_names (OhmFactStore* self, const GQuark* names, guint n_names);
+void ohm_fact_store_apply_batch (OhmFactStore* self, OhmFactStoreOp* ops, guint n_ops);
+void ohm_fact_store_set_deferred_notify (OhmFactStore* self, gboolean deferred, gint priority);
+void ohm_fact_store_flush_notify (OhmFactStore* self);
+guint ohm_fact_store_add_listener (OhmFactStore* self, OhmFactStoreListener func, gpointer user_data, GDestroyNotify destroy);
+gboolean ohm_fact_store_remove_listener (OhmFactStore* self, guint id);
+OhmFactStoreSnapshot* ohm_fact_store_snapshot (OhmFactStore* self);
+OhmFactStoreSnapshot* ohm_fact_store_snapshot_ref (OhmFactStoreSnapshot* self);
+void ohm_fact_store_snapshot_unref (OhmFactStoreSnapshot* self);
+guint64 ohm_fact_store_snapshot_get_version (OhmFactStoreSnapshot* self);
+GSList* ohm_fact_store_snapshot_get_facts_by_quark (OhmFactStoreSnapshot* self, GQuark qname);
+GSList* ohm_fact_store_snapshot_get_facts_by_name (OhmFactStoreSnapshot* self, const char* name);
+GSList* ohm_fact_store_snapshot_get_facts_by_pattern (OhmFactStoreSnapshot* self, OhmPattern* pattern);
+OhmFactStoreTxn* ohm_fact_store_txn_begin (OhmFactStore* self);
+gboolean ohm_fact_store_txn_get (OhmFactStoreTxn* self, OhmFact* fact, const char* field_name, GValue* value);
+gboolean ohm_fact_store_txn_contains (OhmFactStoreTxn* self, OhmFact* fact);
+GSList* ohm_fact_store_txn_get_facts_by_pattern (OhmFactStoreTxn* self, OhmPattern* pattern);
+void ohm_fact_store_txn_set (OhmFactStoreTxn* self, OhmFact* fact, const char* field_name, GValue* value);
+void ohm_fact_store_txn_insert (OhmFactStoreTxn* self, OhmFact* fact);
+void ohm_fact_store_txn_remove (OhmFactStoreTxn* self, OhmFact* fact);
+gboolean ohm_fact_store_txn_commit (OhmFactStoreTxn* self);
+void ohm_fact_store_txn_abort (OhmFactStoreTxn* self);
+GQuark ohm_fact_store_error_quark (void);
+gboolean ohm_fact_store_dump (OhmFactStore* self, int fd, GError** error);
+gboolean ohm_fact_store_restore (OhmFactStore* self, int fd, GError** error);
+gboolean ohm_fact_store_journal_open (OhmFactStore* self, const char* path, GError** error);
+void ohm_fact_store_journal_close (OhmFactStore* self);
+void ohm_fact_store_journal_set_sync (OhmFactStore* self, guint n_commits, guint delay);
+void ohm_fact_store_journal_set_compact_size (OhmFactStore* self, gsize size);
+gboolean ohm_fact_store_journal_compact (OhmFactStore* self);
+void ohm_fact_store_journal_flush (OhmFactStore* self);
 void ohm_fact_store_transaction_push (OhmFactStore* self);
 void ohm_fact_store_transaction_pop (OhmFactStore* self, gboolean discard);
 OhmFactStore* ohm_fact_store_new (void);
 char* ohm_fact_store_to_string (OhmFactStore* self);
+OhmFactStoreWriter* ohm_fact_store_writer_new (OhmFactStore* store, OhmFactStoreFormat format);
+gboolean ohm_fact_store_writer_write (OhmFactStoreWriter* self, GString* out, guint max_facts);
+gboolean ohm_fact_store_writer_write_fd (OhmFactStoreWriter* self, int fd, guint max_facts, GError** error);
+void ohm_fact_store_writer_free (OhmFactStoreWriter* self);
 OhmFactStoreView* ohm_fact_store_new_view (OhmFactStore* self, GObject* listener);
 OhmFactStoreView* ohm_fact_store_new_transparent_view (OhmFactStore* self, GObject* listener);
 void ohm_fact_store_change_set_add_match (OhmFactStoreChangeSet* self, OhmPatternMatch* match);
@@ -402,6 +711,11 @@ void ohm_fact_store_change_set_reset (OhmFactStoreChangeSet* self);
 char* ohm_fact_store_change_set_to_string (OhmFactStoreChangeSet* self);
 OhmFactStoreChangeSet* ohm_fact_store_change_set_new (void);
 GSList* ohm_fact_store_change_set_get_matches (OhmFactStoreChangeSet* self);
+void ohm_fact_store_change_set_set_coalesce (OhmFactStoreChangeSet* self, gboolean coalesce);
+gboolean ohm_fact_store_change_set_get_coalesce (OhmFactStoreChangeSet* self);
+void ohm_fact_store_change_set_set_high_water (OhmFactStoreChangeSet* self, guint limit, OhmFactStoreOverflow overflow);
+gboolean ohm_fact_store_change_set_get_overflowed (OhmFactStoreChangeSet* self);
+const GQuark* ohm_fact_store_change_set_get_fields (OhmFactStoreChangeSet* self, OhmPatternMatch* match, guint* n_fields);
 GType ohm_fact_store_change_set_get_type (void);
 
 OhmFactStoreSimpleView* ohm_fact_store_simple_view_new (void);
@@ -418,6 +732,7 @@ GType ohm_fact_store_transaction_get_type (void);
 void ohm_fact_store_view_add (OhmFactStoreView* self, OhmStructure* interest);
 void ohm_fact_store_view_remove (OhmFactStoreView* self, OhmStructure* interest);
 char* ohm_fact_store_view_to_string (OhmFactStoreView* self);
+void ohm_fact_store_view_write (OhmFactStoreView* self, GString* out, OhmFactStoreFormat format);
 GType ohm_fact_store_view_get_type (void);
 GType ohm_fact_store_event_get_type (void);
 GType ohm_fact_store_get_type (void);
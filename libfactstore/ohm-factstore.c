@@ -21,6 +21,13 @@
  *
  */
 
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+
 #include <ohm/ohm-factstore.h>
 
 enum  {
@@ -28,15 +35,119 @@ enum  {
 	OHM_STRUCTURE_QNAME,
 	OHM_STRUCTURE_NAME
 };
-static void _ohm_structure_unset_and_free (void* p);
+typedef struct _OhmStructureField OhmStructureField;
+typedef struct _OhmStructureChunk OhmStructureChunk;
+
+/*
+ * The values of the fields live in the slots of fixed-size chunks,
+ * which never move: a value keeps its address while other fields come
+ * and go. @used has a bit per slot in use.
+ */
+#define OHM_STRUCTURE_CHUNK_SLOTS 4
+
+struct _OhmStructureChunk {
+	OhmStructureChunk* next;
+	guint used;
+	GValue slots[OHM_STRUCTURE_CHUNK_SLOTS];
+};
+
+struct _OhmStructureField {
+	GQuark field;
+	guint stamp;
+	GValue* value;
+	OhmStructureChunk* chunk;
+	const gchar* symbol;
+};
+
+/*
+ * The fields of a structure, kept in one array sorted by field quark.
+ * The first entries and the first chunk of values are part of the
+ * structure itself, so a small structure needs no allocation for its
+ * fields. A value given to ohm_structure_qset () keeps its own
+ * container, which @chunk is %NULL for. The @symbol of a field of a
+ * fact is the interned string it holds a reference to, see
+ * #OhmFactStoreSymbols. @fields_tail is the last node
+ * of the public list of fields. The @stamp of a field of a fact in a
+ * store changes whenever the field is set, see ohm_fact_store_txn_begin ().
+ */
+struct _OhmStructurePrivate {
+	OhmStructureField* entries;
+	guint n_fields;
+	guint n_alloc;
+	GSList* fields_tail;
+	OhmStructureChunk chunk;
+	OhmStructureField inline_entries[OHM_STRUCTURE_CHUNK_SLOTS];
+};
+
+#define OHM_STRUCTURE_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), OHM_TYPE_STRUCTURE, OhmStructurePrivate))
+static void _ohm_structure_store (OhmStructure* self, GQuark field, GValue* value);
+static void _ohm_structure_adopt (OhmStructure* self, GQuark field, GValue* value);
 static void ohm_structure_real_qset (OhmStructure* self, GQuark field, GValue* value);
 static void _ohm_structure_value_to_string_gvalue_transform (const GValue* src_value, GValue* dest_value);
 static GObject * ohm_structure_constructor (GType type, guint n_construct_properties, GObjectConstructParam * construct_properties);
 static gpointer ohm_structure_parent_class = NULL;
 static void ohm_structure_dispose (GObject * obj);
+typedef struct _OhmPatternField OhmPatternField;
+typedef struct _OhmPatternOpEntry OhmPatternOpEntry;
+typedef struct _OhmFactStoreAlpha OhmFactStoreAlpha;
+
 struct _OhmPatternPrivate {
 	OhmFactStoreView* _view;
 	OhmFact* _fact;
+	OhmPatternField* compiled;
+	guint n_compiled;
+	gboolean is_compiled;
+	guint serial;
+	OhmFactStoreAlpha* alpha;
+	GQuark alpha_field;
+	gboolean alpha_ranged;
+	gboolean interned;
+	guint64 evaluations;
+	guint64 hits;
+	GArray* ops;
+	OhmPatternOp pending_op;
+	GValue* pending_high;
+};
+
+/*
+ * The test of a field compared otherwise than for equality, see
+ * ohm_pattern_set_op (). The bound is the value of the field in the
+ * structure, @high is the upper bound of a range.
+ */
+struct _OhmPatternOpEntry {
+	GQuark field;
+	OhmPatternOp op;
+	GValue* high;
+};
+
+/*
+ * A field of a compiled pattern: the expected value is extracted from
+ * its #GValue once, so matching does not need to go through the pattern
+ * fields nor ohm_value_cmp () for the common types.
+ */
+typedef enum {
+	OHM_PATTERN_FIELD_INT,
+	OHM_PATTERN_FIELD_STRING,
+	OHM_PATTERN_FIELD_BOOLEAN,
+	OHM_PATTERN_FIELD_CHAR,
+	OHM_PATTERN_FIELD_POINTER,
+	OHM_PATTERN_FIELD_OTHER
+} OhmPatternFieldKind;
+
+struct _OhmPatternField {
+	GQuark field;
+	OhmPatternFieldKind kind;
+	GType type;
+	union {
+		gint i;
+		const gchar* s;
+		gboolean b;
+		gchar c;
+		gpointer p;
+	} v;
+	GValue* value;
+	OhmPatternOp op;
+	GValue* high;
 };
 
 #define OHM_PATTERN_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), OHM_TYPE_PATTERN, OhmPatternPrivate))
@@ -64,9 +175,34 @@ static void ohm_pattern_match_set_event (OhmPatternMatch* self, OhmFactStoreEven
 static gpointer ohm_pattern_match_parent_class = NULL;
 static void ohm_pattern_match_dispose (GObject * obj);
 static gpointer ohm_pattern_parent_class = NULL;
+static volatile gint ohm_pattern_serial = 0;
+static void ohm_pattern_real_qset (OhmStructure* base, GQuark field, GValue* value);
+static void ohm_pattern_compile (OhmPattern* self);
 static void ohm_pattern_dispose (GObject * obj);
+static void _ohm_fact_store_alpha_add (OhmFactStoreAlpha* self, OhmPattern* p);
+static void _ohm_fact_store_alpha_remove (OhmPattern* p);
+typedef struct _OhmFactStoreSymbols OhmFactStoreSymbols;
+static const gchar* _ohm_fact_store_symbol_ref (OhmFactStoreSymbols* self, const gchar* str);
+static void _ohm_fact_store_symbol_unref (OhmFactStoreSymbols* self, const gchar* sym);
+static OhmFactStoreSymbols* _ohm_fact_store_symbols_ref (OhmFactStoreSymbols* self);
+static void _ohm_fact_store_symbols_unref (OhmFactStoreSymbols* self);
+static void _ohm_fact_store_lock_name (OhmFactStore* self, GQuark qname);
+static void _ohm_fact_store_unlock_name (OhmFactStore* self, GQuark qname);
+static void _ohm_fact_store_lock_interest (OhmFactStore* self, gboolean write);
+static void _ohm_fact_store_unlock_interest (OhmFactStore* self, gboolean write);
+static void _ohm_fact_store_lock_shared (OhmFactStore* self);
+static void _ohm_fact_store_unlock_shared (OhmFactStore* self);
 struct _OhmFactPrivate {
 	OhmFactStore* _fact_store;
+	GHashTable* matched;
+	guint clock;
+	gint64 expiry;
+	guint64 timer_tick;
+	gint timer_slot;
+	OhmFact* timer_prev;
+	OhmFact* timer_next;
+	OhmFact* frozen;
+	struct _OhmFactStoreSymbols* symbols;
 };
 
 #define OHM_FACT_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), OHM_TYPE_FACT, OhmFactPrivate))
@@ -74,27 +210,497 @@ enum  {
 	OHM_FACT_DUMMY_PROPERTY,
 	OHM_FACT_FACT_STORE
 };
+/*
+ * How _ohm_fact_set_field () gets its value: moved out of a value of
+ * the caller, taken over, or moved out of a value borrowing a string
+ * of the caller, which is then interned or copied.
+ */
+typedef enum {
+	OHM_FACT_SET_MOVE,
+	OHM_FACT_SET_ADOPT,
+	OHM_FACT_SET_BORROW
+} OhmFactSetMode;
+static void _ohm_fact_set_field (OhmFact* self, GQuark field, GValue* value, OhmFactSetMode mode);
 static void ohm_fact_real_qset (OhmStructure* base, GQuark field, GValue* value);
 static gpointer ohm_fact_parent_class = NULL;
 static void ohm_fact_dispose (GObject * obj);
+typedef struct _OhmFactStoreFacts OhmFactStoreFacts;
+typedef struct _OhmFactStoreFieldIndex OhmFactStoreFieldIndex;
+typedef struct _OhmFactStoreOrderedIndex OhmFactStoreOrderedIndex;
+typedef struct _OhmFactStoreSkipNode OhmFactStoreSkipNode;
+
+/*
+ * State of ohm_fact_store_apply_batch (): the operations are applied
+ * name by name, and the alpha nodes of the current @qname are looked up
+ * once. @views collects the views to notify at the end.
+ */
+typedef struct _OhmFactStoreBatch {
+	GQuark qname;
+	OhmFactStoreAlpha* alpha;
+	OhmFactStoreAlpha* transp_alpha;
+	GHashTable* views;
+} OhmFactStoreBatch;
+
+/*
+ * The locks of a thread-safe store, see ohm_fact_store_set_thread_safe ().
+ * The facts of a name, their indexes and the transaction state are
+ * guarded by the shard of the name. @names guards the table of names,
+ * @interest the interest lists and the alpha networks, and @shared the
+ * statistics, the images and the version. The locks are taken in this
+ * order: shards (ascending), @names or @interest, the lock of a change
+ * set, @shared, the lock of the symbol table.
+ */
+#define OHM_FACT_STORE_N_SHARDS 16
+#define OHM_FACT_STORE_SHARD(qname) ((qname) % OHM_FACT_STORE_N_SHARDS)
+
+typedef struct _OhmFactStoreLocks {
+	GRecMutex shards[OHM_FACT_STORE_N_SHARDS];
+	GRWLock names;
+	GRWLock interest;
+	GMutex shared;
+} OhmFactStoreLocks;
+
+/*
+ * The dispatches of the changes of the names of a shard to the views,
+ * guarded by the lock of the shard. The time is only taken when timing
+ * is on, see ohm_fact_store_set_timing ().
+ */
+typedef struct _OhmFactStoreDispatchStats {
+	guint64 dispatches;
+	guint64 time;
+	guint64 histogram[OHM_FACT_STORE_STATS_BUCKETS];
+} OhmFactStoreDispatchStats;
+
+/*
+ * The expiry of the facts, see ohm_fact_set_expiry (): a hierarchical
+ * timer wheel of millisecond ticks. Each level has 64 slots, a slot
+ * spanning a whole turn of the level below, and the facts due beyond
+ * the last level wait in an extra slot. The facts are linked in their
+ * slot through their private data, and the slots of a level are
+ * cascaded to the levels below as @now, the next tick to process,
+ * reaches them: a fact moves at most once per level. @occupied has a
+ * bit per non-empty slot of a level. One timeout source of the default
+ * main context, due at tick @wake, services the whole wheel. Guarded by
+ * the shared lock.
+ */
+#define OHM_FACT_STORE_WHEEL_BITS 6
+#define OHM_FACT_STORE_WHEEL_SLOTS (1 << OHM_FACT_STORE_WHEEL_BITS)
+#define OHM_FACT_STORE_WHEEL_MASK (OHM_FACT_STORE_WHEEL_SLOTS - 1)
+#define OHM_FACT_STORE_WHEEL_LEVELS 4
+#define OHM_FACT_STORE_WHEEL_OVERFLOW (OHM_FACT_STORE_WHEEL_LEVELS * OHM_FACT_STORE_WHEEL_SLOTS)
+
+typedef struct _OhmFactStoreWheel {
+	guint64 now;
+	guint64 occupied[OHM_FACT_STORE_WHEEL_LEVELS];
+	OhmFact* slots[OHM_FACT_STORE_WHEEL_OVERFLOW + 1];
+	guint count;
+	GSource* source;
+	guint64 wake;
+} OhmFactStoreWheel;
+
 struct _OhmFactStorePrivate {
 	GSList* known_facts_qname;
+	GHashTable* facts;
 	GData* interest;
 	GData* transp_interest;
+	GHashTable* alpha;
+	GHashTable* transp_alpha;
+	OhmFactStoreSymbols* symbols;
+	OhmFactStoreLookupStats lookup_stats;
+	OhmFactStoreStats stats;
+	OhmFactStoreDispatchStats dispatch_stats[OHM_FACT_STORE_N_SHARDS];
+	gboolean timing;
+	OhmFactStoreBatch* batch;
+	GHashTable* images;
+	guint64 version;
+	OhmFactStoreLocks* locks;
+	struct _OhmFactStoreJournal* journal;
+	gboolean notify_deferred;
+	gint notify_priority;
+	GHashTable* notify_views;
+	GSource* notify_source;
+	GPtrArray* listeners;
+	guint last_listener;
+	OhmFactStoreWheel* wheel;
+	guint n_patterns;
+};
+
+/*
+ * The committed facts of one name, as seen by the snapshots: frozen
+ * copies of the facts, and the secondary indexes the store had on them.
+ * An image is immutable once built and shared by all the snapshots
+ * taken until a committed change of a fact of that name.
+ */
+typedef struct _OhmFactStoreImage {
+	volatile gint ref_count;
+	GSList* facts;
+	GHashTable* indexes;
+} OhmFactStoreImage;
+
+struct _OhmFactStoreSnapshot {
+	volatile gint ref_count;
+	guint64 version;
+	GHashTable* images;
+};
+
+/*
+ * A dump of a store in progress, see ohm_fact_store_writer_new ().
+ * @facts holds a reference on the facts to write, in order, @next is
+ * the index of the first one not written yet. @buffer collects a chunk
+ * before it is written to a file descriptor.
+ */
+struct _OhmFactStoreWriter {
+	OhmFactStore* store;
+	OhmFactStoreFormat format;
+	GPtrArray* facts;
+	guint next;
+	gboolean started;
+	gboolean finished;
+	GString* buffer;
+};
+
+/*
+ * An optimistic transaction. @reads holds what the transaction saw of
+ * the store: the stamp of each (fact, field) it read, and for @field 0
+ * whether the fact was in the store. @names maps the names it listed
+ * to the version of their facts. @ops are the changes to make, in
+ * order, and @written maps each (fact, field) set to its last
+ * operation.
+ */
+typedef struct _OhmFactStoreTxnKey {
+	OhmFact* fact;
+	GQuark field;
+	guint n;
+} OhmFactStoreTxnKey;
+
+struct _OhmFactStoreTxn {
+	OhmFactStore* store;
+	GHashTable* reads;
+	GHashTable* names;
+	GArray* ops;
+	GHashTable* written;
+};
+
+/*
+ * The binary dump of a store, see ohm_fact_store_dump (). All the
+ * integers are little-endian:
+ *
+ *   "OHMF" version:u32
+ *   n_strings:u32 { length:u32 bytes }*
+ *   n_facts:u32 n_stored:u32 { name:u32 n_fields:u32 { field:u32 type:u8 value }* }*
+ *
+ * Names, field names and string values are indexes in the table of
+ * strings. The first @n_stored facts are in the store, the others are
+ * only referred to by a field of another fact. A fact value is the
+ * index of the fact, so the references between facts are kept.
+ */
+#define OHM_FACT_STORE_DUMP_MAGIC "OHMF"
+#define OHM_FACT_STORE_DUMP_VERSION 1
+#define OHM_FACT_STORE_DUMP_NONE G_MAXUINT32
+
+typedef enum {
+	OHM_FACT_STORE_DUMP_INT = 1,
+	OHM_FACT_STORE_DUMP_UINT,
+	OHM_FACT_STORE_DUMP_LONG,
+	OHM_FACT_STORE_DUMP_ULONG,
+	OHM_FACT_STORE_DUMP_INT64,
+	OHM_FACT_STORE_DUMP_UINT64,
+	OHM_FACT_STORE_DUMP_BOOLEAN,
+	OHM_FACT_STORE_DUMP_CHAR,
+	OHM_FACT_STORE_DUMP_UCHAR,
+	OHM_FACT_STORE_DUMP_FLOAT,
+	OHM_FACT_STORE_DUMP_DOUBLE,
+	OHM_FACT_STORE_DUMP_STRING,
+	OHM_FACT_STORE_DUMP_FACT
+} OhmFactStoreDumpType;
+
+/*
+ * The state of a dump: the strings and the facts met so far, each with
+ * its index. The facts in the store are indexed first, the facts they
+ * refer to are appended as they are met, unless @grow is unset. The
+ * journal keeps one for the lifetime of a snapshot, and holds a
+ * reference on each of its @facts.
+ */
+typedef struct _OhmFactStoreDump {
+	GHashTable* strings;
+	GByteArray* string_table;
+	guint n_strings;
+	GHashTable* index;
+	GPtrArray* facts;
+	gboolean grow;
+	GByteArray* body;
+} OhmFactStoreDump;
+
+typedef struct _OhmFactStoreRestore {
+	const guint8* pos;
+	const guint8* end;
+	gboolean valid;
+	GStringChunk* chunk;
+	GPtrArray* strings;
+	GArray* quarks;
+	GPtrArray* facts;
+} OhmFactStoreRestore;
+
+/*
+ * The write-ahead journal of a store, see ohm_fact_store_journal_open ().
+ * The journal file starts with a header, followed by one frame per
+ * commit:
+ *
+ *   "OHMJ" version:u32 generation:u64
+ *   { length:u32 checksum:u32 n_strings:u32 { length:u32 bytes }* { record }* }*
+ *
+ *   record: INSERT id:u32 name:u32 n_fields:u32 { field }*
+ *         | REMOVE id:u32
+ *         | SET id:u32 field
+ *
+ * with the fields encoded as in a dump, a type of 0 removing the field.
+ * The strings of a frame extend the table of strings, and the facts are
+ * known by their index, both carried on from the snapshot of the same
+ * generation ("OHMS" version:u32 generation:u64 followed by a dump).
+ *
+ * The committing threads encode the records in @encoder, under @lock,
+ * and queue the frames in @pending. @marks holds the length of the
+ * body at each open transaction or batch, and @removed the indexes of
+ * the facts removed meanwhile, forgotten once the outermost release
+ * commits their removal. The writer thread owns @fd
+ * and @size, and writes the frames and the snapshots queued by a
+ * compaction; @queued, @written and @synced count the frames.
+ */
+#define OHM_FACT_STORE_JOURNAL_MAGIC "OHMJ"
+#define OHM_FACT_STORE_JOURNAL_SNAPSHOT_MAGIC "OHMS"
+#define OHM_FACT_STORE_JOURNAL_VERSION 1
+#define OHM_FACT_STORE_JOURNAL_HEADER_SIZE 16
+#define OHM_FACT_STORE_JOURNAL_MAX_PENDING (4 << 20)
+
+typedef enum {
+	OHM_FACT_STORE_JOURNAL_INSERT = 1,
+	OHM_FACT_STORE_JOURNAL_REMOVE,
+	OHM_FACT_STORE_JOURNAL_SET
+} OhmFactStoreJournalRecord;
+
+typedef struct _OhmFactStoreJournalMark {
+	guint body;
+	guint facts;
+} OhmFactStoreJournalMark;
+
+typedef struct _OhmFactStoreJournal {
+	OhmFactStore* store;
+	gchar* path;
+	gchar* snapshot_path;
+	guint64 generation;
+	OhmFactStoreDump encoder;
+	guint framed_strings;
+	GArray* marks;
+	GArray* removed;
+	guint muted;
+	GMutex lock;
+	GCond wake;
+	GCond done;
+	GThread* writer;
+	gboolean stop;
+	int fd;
+	gsize size;
+	GByteArray* pending;
+	GByteArray* writing;
+	GByteArray* snapshot;
+	guint64 queued;
+	guint64 written;
+	guint64 synced;
+	gint64 unsynced_since;
+	guint flushing;
+	guint sync_commits;
+	guint sync_delay;
+	gsize compact_size;
+	guint compact_source;
+} OhmFactStoreJournal;
+
+/*
+ * All the facts of a given name. @facts is kept newest first. @index maps
+ * each #OhmFact to its link in @facts, so membership tests and removals
+ * do not need to walk the list. @field_indexes holds the secondary
+ * indexes declared with ohm_fact_store_add_index (), or %NULL, and
+ * @ordered_indexes those declared with ohm_fact_store_add_ordered_index ().
+ * @version changes whenever a fact is inserted or removed; it is drawn
+ * from a counter of the whole process, so that an entry freed once it
+ * has neither facts nor indexes, and made again, never repeats one.
+ */
+struct _OhmFactStoreFacts {
+	GList* facts;
+	GHashTable* index;
+	GHashTable* field_indexes;
+	GHashTable* ordered_indexes;
+	guint version;
+};
+
+/*
+ * A secondary index on one field: @values maps a field value to the set
+ * of facts (a #GHashTable used as a set) having that value.
+ */
+struct _OhmFactStoreFieldIndex {
+	GQuark field;
+	GHashTable* values;
+	guint probes;
+};
+
+/*
+ * An ordered index on one field: a skip list of the facts having an
+ * orderable value in the field, sorted by that value then by address,
+ * so that the facts whose value is in a range are found in O(log n + k).
+ * Each node keeps a copy of the value its fact was indexed with. @head
+ * has the OHM_FACT_STORE_SKIP_LEVELS links, a node has 1 link with a
+ * probability of 3/4, 2 with 3/16, and so on.
+ */
+#define OHM_FACT_STORE_SKIP_LEVELS 24
+
+struct _OhmFactStoreSkipNode {
+	GValue value;
+	OhmFact* fact;
+	OhmFactStoreSkipNode* next[1];
+};
+
+struct _OhmFactStoreOrderedIndex {
+	GQuark field;
+	OhmFactStoreSkipNode* head;
+	guint level;
+	guint length;
+	guint32 seed;
+	guint probes;
+};
+
+/*
+ * The alpha network of the patterns interested in one fact name. Each
+ * pattern is filed under one of its constant field tests: @tests maps a
+ * field quark to a #GHashTable from a field value to the #GSList of
+ * patterns testing that value. A changed fact thus only reaches the
+ * patterns whose test it passes. The patterns with no equality test
+ * but a comparison are filed in @ranges instead: a field quark maps to
+ * a #GPtrArray of patterns sorted by the lower bound of their test, so
+ * that a fact only reaches the patterns whose lower bound it passes.
+ * @other holds the patterns without a test, and the patterns bound to
+ * a fact instance. The patterns are owned by the interest lists, not
+ * by the network.
+ */
+struct _OhmFactStoreAlpha {
+	OhmFactStore* store;
+	GSList* other;
+	GHashTable* tests;
+	GHashTable* ranges;
+};
+
+/*
+ * The string values of the facts of a store, and the string constants of
+ * the patterns in its alpha networks, are interned in a symbol table:
+ * from the canonical string to its reference count. Two such strings are
+ * equal exactly when their pointers are. A fact keeps the symbols of its
+ * fields, and the table, after leaving the store, so a string read from
+ * a field stays valid until the field is set again or the fact goes
+ * away. The table thus has a lock of its own.
+ */
+struct _OhmFactStoreSymbols {
+	volatile gint ref_count;
+	GMutex lock;
+	GHashTable* table;
+	OhmFactStoreSymbolStats stats;
 };
 
 #define OHM_FACT_STORE_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), OHM_TYPE_FACT_STORE, OhmFactStorePrivate))
 enum  {
 	OHM_FACT_STORE_DUMMY_PROPERTY
 };
+enum  {
+	OHM_FACT_STORE_INSERTED_SIGNAL,
+	OHM_FACT_STORE_REMOVED_SIGNAL,
+	OHM_FACT_STORE_UPDATED_SIGNAL,
+	OHM_FACT_STORE_LAST_SIGNAL
+};
+static guint ohm_fact_store_signals[OHM_FACT_STORE_LAST_SIGNAL] = { 0 };
+
+/*
+ * A function registered with ohm_fact_store_add_listener (). The
+ * listeners of a store are an array of references to them, replaced
+ * as a whole when one is added or removed, so that a change in
+ * progress calls the listeners it started with, and @user_data is
+ * destroyed once the last such change is over.
+ */
+typedef struct _OhmFactStoreListenerEntry {
+	volatile gint ref_count;
+	guint id;
+	OhmFactStoreListener func;
+	gpointer user_data;
+	GDestroyNotify destroy;
+} OhmFactStoreListenerEntry;
 static void _ohm_fact_store_update_views (OhmFactStore* self, OhmFact* fact, OhmFactStoreEvent event, GQuark field, GValue *value);
+static void _ohm_fact_store_index_field (OhmFactStore* self, OhmFact* fact, GQuark field);
+static void _ohm_fact_store_touch (OhmFactStore* self, GQuark qname, OhmFact* fact);
+static void _ohm_fact_store_thaw (OhmFact* fact);
+static OhmFact* _ohm_fact_store_freeze_fact (OhmFact* fact);
+static void _ohm_fact_store_image_unref (OhmFactStoreImage* self);
+static void _ohm_fact_store_journal_log (OhmFactStore* self, OhmFactStoreOpType type, OhmFact* fact, GQuark field);
+static void _ohm_fact_store_journal_hold (OhmFactStore* self);
+static void _ohm_fact_store_journal_release (OhmFactStore* self, gboolean rollback);
+static void _ohm_fact_store_journal_mute (OhmFactStore* self, gboolean mute);
+static void _ohm_fact_store_journal_free (OhmFactStoreJournal* self);
+static void _ohm_fact_store_unindex_field (OhmFactStore* self, OhmFact* fact, GQuark field);
+static void _ohm_fact_store_queue_notify (OhmFactStore* self, OhmFactStoreView* view);
+static gboolean _ohm_fact_store_notify_idle (gpointer data);
+static void _ohm_fact_store_schedule_expiry (OhmFactStore* self, OhmFact* fact);
+static void _ohm_fact_store_cancel_expiry (OhmFactStore* self, OhmFact* fact);
+static void _ohm_fact_store_wheel_free (OhmFactStoreWheel* self);
+static guint _ohm_value_hash (gconstpointer v);
+static gboolean _ohm_value_orderable (GType type);
+static gint _ohm_value_order (const GValue* v1, const GValue* v2);
+static void _ohm_fact_store_ordered_index_free (OhmFactStoreOrderedIndex* self);
+static void _ohm_value_unset_and_free (gpointer p);
+static void _ohm_value_init_copy (GValue* dest, const GValue* src);
+static gboolean _ohm_value_equal (gconstpointer v1, gconstpointer v2);
 static gboolean ohm_fact_store_insert_internal (OhmFactStore* self, OhmFact* fact);
 static gboolean ohm_fact_store_remove_internal (OhmFactStore* self, OhmFact* fact);
 static void _g_slist_free_g_object_unref (GSList* self);
 static void _ohm_fact_store_delete_func (GSList* l);
 static void ohm_fact_store_set_view_interest (OhmFactStore* self, OhmFactStoreView* v);
+typedef struct _OhmFactStoreMatchRecord OhmFactStoreMatchRecord;
+static guint _ohm_fact_store_change_set_add_record (OhmFactStoreChangeSet* self, OhmFact* fact, OhmPattern* pattern, OhmFactStoreEvent event, GQuark field, OhmPatternMatch* match);
+static void _ohm_fact_store_change_set_remove_record (OhmFactStoreChangeSet* self, guint serial);
+static void _ohm_fact_store_change_set_clear (OhmFactStoreChangeSet* self);
+static void _ohm_fact_store_change_set_make_thread_safe (OhmFactStoreChangeSet* self);
+/*
+ * A match as the change sets keep it: the fact and the pattern are
+ * referenced, the OhmPatternMatch object is only created when someone
+ * asks for ohm_fact_store_change_set_get_matches (). The updated fields
+ * are @field, or @fields once several updates were coalesced; neither
+ * being set means any field may have changed.
+ */
+struct _OhmFactStoreMatchRecord {
+	OhmFact* fact;
+	OhmPattern* pattern;
+	OhmFactStoreEvent event;
+	guint serial;
+	GQuark field;
+	GArray* fields;
+	OhmPatternMatch* match;
+};
+/*
+ * A removed record is left as a hole, with a %NULL @fact, and the
+ * oldest live one is at @head: dropping a record moves nothing until
+ * the holes outnumber the @n_records live records and the array is
+ * compacted. @coalesce maps a fact and a pattern to their newest record.
+ */
+typedef struct _OhmFactStoreCoalesceKey {
+	OhmFact* fact;
+	OhmPattern* pattern;
+	guint pos;
+} OhmFactStoreCoalesceKey;
 struct _OhmFactStoreChangeSetPrivate {
+	GArray* records;
+	guint head;
+	guint n_records;
 	GSList* _matches;
+	guint n_listed;
+	GHashTable* coalesce;
+	guint high_water;
+	OhmFactStoreOverflow overflow;
+	gboolean overflowed;
+	GMutex* lock;
 };
 
 #define OHM_FACT_STORE_CHANGE_SET_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), OHM_FACT_STORE_TYPE_CHANGE_SET, OhmFactStoreChangeSetPrivate))
@@ -104,6 +710,8 @@ enum  {
 };
 static gpointer ohm_fact_store_change_set_parent_class = NULL;
 static void ohm_fact_store_change_set_dispose (GObject * obj);
+static void _ohm_fact_store_change_set_lock (OhmFactStoreChangeSet* self);
+static void _ohm_fact_store_change_set_unlock (OhmFactStoreChangeSet* self);
 struct _OhmFactStoreSimpleViewPrivate {
 	GObject* _listener;
 	OhmFactStore* _fact_store;
@@ -117,6 +725,11 @@ enum  {
 	OHM_FACT_STORE_SIMPLE_VIEW_FACT_STORE,
 	OHM_FACT_STORE_SIMPLE_VIEW_TRANSPARENT,
 };
+enum  {
+	OHM_FACT_STORE_SIMPLE_VIEW_UPDATED_SIGNAL,
+	OHM_FACT_STORE_SIMPLE_VIEW_LAST_SIGNAL
+};
+static guint ohm_fact_store_simple_view_signals[OHM_FACT_STORE_SIMPLE_VIEW_LAST_SIGNAL] = { 0 };
 static GObject * ohm_fact_store_simple_view_constructor (GType type, guint n_construct_properties, GObjectConstructParam * construct_properties);
 static gpointer ohm_fact_store_simple_view_parent_class = NULL;
 static void ohm_fact_store_simple_view_dispose (GObject * obj);
@@ -125,7 +738,16 @@ enum  {
 };
 static void _g_slist_free_ohm_pair_free (GSList* self);
 static void _g_slist_free_ohm_fact_store_transaction_cow_free (GSList* self);
+struct _OhmFactStoreTransactionPrivate {
+	GSList* modifications_tail;
+	guint n_modifications;
+	GSList* matches_tail;
+};
+
+#define OHM_FACT_STORE_TRANSACTION_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), OHM_FACT_STORE_TYPE_TRANSACTION, OhmFactStoreTransactionPrivate))
 static OhmFactStoreTransaction* ohm_fact_store_transaction_new (OhmFactStore* fact_store, GObject* listener);
+static void _ohm_fact_store_transaction_log (OhmFactStoreTransaction* self, OhmFactStoreTransactionCOW* cow);
+static void _ohm_fact_store_transaction_merge (OhmFactStoreTransaction* self, OhmFactStoreTransaction* child);
 static gboolean _ohm_fact_store_transaction_active(OhmFactStore *self);
 static gboolean _ohm_fact_store_transaction_rolledback(OhmFactStore *self);
 static gpointer ohm_fact_store_transaction_parent_class = NULL;
@@ -190,7 +812,8 @@ OhmPair* ohm_pair_new (gpointer first, gpointer second,
  *
  *
  * OhmStructure:
- * @fields:  the list of field names, as #GQuark, in #SList->@data
+ * @fields:  the list of field names, as #GQuark, in #SList->@data, in
+ * the order the fields were added
  *
  * #OhmStructure is used as a dynamic structure (like
  * GstStructure). it can have multiple dynamic fields of
@@ -228,15 +851,215 @@ OhmStructure* ohm_structure_new (const char* name) {
 }
 
 
-static void _ohm_structure_unset_and_free (void* p) {
-	GValue* v;
+/*
+ * Look @field up in the sorted field array of @self. Returns the entry,
+ * or %NULL and the position at which the field would be inserted.
+ */
+static OhmStructureField* _ohm_structure_lookup (OhmStructure* self, GQuark field, guint* pos) {
+	OhmStructureField* entries;
+	guint lo;
+	guint hi;
+
+	entries = self->priv->entries;
+	lo = 0;
+	hi = self->priv->n_fields;
+	while (lo < hi) {
+		guint mid = (lo + hi) / 2;
+
+		if (entries[mid].field == field) {
+			lo = mid;
+			break;
+		} else if (entries[mid].field < field) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (pos != NULL) {
+		*pos = lo;
+	}
+
+	return lo < self->priv->n_fields && entries[lo].field == field ? &entries[lo] : NULL;
+}
+
+
+/*
+ * Give up the value of @entry: a slot goes back to its chunk, an
+ * adopted container is freed.
+ */
+static void _ohm_structure_release (OhmStructureField* entry) {
+	if (entry->chunk == NULL) {
+		_ohm_value_unset_and_free (entry->value);
+		return;
+	}
+
+	g_value_unset (entry->value);
+	entry->chunk->used &= ~(1u << (entry->value - entry->chunk->slots));
+}
+
+
+/*
+ * Find a free slot for a new value of @self, adding a chunk if they are
+ * all in use.
+ */
+static GValue* _ohm_structure_slot_new (OhmStructure* self, OhmStructureChunk** chunk) {
+	OhmStructureChunk* c;
+	OhmStructureChunk* last;
+	guint i;
+
+	last = NULL;
+	for (c = &self->priv->chunk; c != NULL; c = c->next) {
+		if (c->used != (1u << OHM_STRUCTURE_CHUNK_SLOTS) - 1) {
+			break;
+		}
+		last = c;
+	}
+
+	if (c == NULL) {
+		c = g_slice_new0 (OhmStructureChunk);
+		last->next = c;
+	}
+
+	for (i = 0; c->used & (1u << i); i++) {
+	}
+	c->used |= 1u << i;
+	*chunk = c;
+
+	return &c->slots[i];
+}
+
+
+static void _ohm_structure_remove_at (OhmStructure* self, guint pos) {
+	GQuark field;
+
+	field = self->priv->entries[pos].field;
+	_ohm_structure_release (&self->priv->entries[pos]);
+
+	if (self->priv->fields_tail->data == GUINT_TO_POINTER (field)) {
+		self->fields = g_slist_remove (self->fields, GUINT_TO_POINTER (field));
+		self->priv->fields_tail = g_slist_last (self->fields);
+	} else {
+		self->fields = g_slist_remove (self->fields, GUINT_TO_POINTER (field));
+	}
+
+	self->priv->n_fields--;
+	memmove (&self->priv->entries[pos], &self->priv->entries[pos + 1],
+		 (self->priv->n_fields - pos) * sizeof (OhmStructureField));
+}
+
+
+/*
+ * Add @field at @pos of the field array of @self, holding @value, or a
+ * zeroed value of a new slot if @value is %NULL. The list of fields
+ * keeps the order in which they were added.
+ */
+static OhmStructureField* _ohm_structure_insert_at (OhmStructure* self, guint pos, GQuark field, GValue* value) {
+	OhmStructureField* entry;
+	GSList* node;
+
+	if (self->priv->n_fields == self->priv->n_alloc) {
+		self->priv->n_alloc *= 2;
+		if (self->priv->entries == self->priv->inline_entries) {
+			self->priv->entries = g_new (OhmStructureField, self->priv->n_alloc);
+			memcpy (self->priv->entries, self->priv->inline_entries, sizeof (self->priv->inline_entries));
+		} else {
+			self->priv->entries = g_renew (OhmStructureField, self->priv->entries, self->priv->n_alloc);
+		}
+	}
+
+	entry = &self->priv->entries[pos];
+	memmove (entry + 1, entry, (self->priv->n_fields - pos) * sizeof (OhmStructureField));
+	self->priv->n_fields++;
+	entry->field = field;
+	entry->stamp = 0;
+	entry->symbol = NULL;
+	if (value != NULL) {
+		entry->value = value;
+		entry->chunk = NULL;
+	} else {
+		entry->value = _ohm_structure_slot_new (self, &entry->chunk);
+	}
+
+	node = g_slist_alloc ();
+	node->data = GUINT_TO_POINTER (field);
+	if (self->priv->fields_tail != NULL) {
+		self->priv->fields_tail->next = node;
+	} else {
+		self->fields = node;
+	}
+	self->priv->fields_tail = node;
+
+	return entry;
+}
+
 
-	v = (GValue*) p;
+static GSList* _ohm_structure_get_fields (OhmStructure* self) {
+	return self->fields;
+}
+
+
+/*
+ * Move the content of @value into the field of @self, or remove @field
+ * if @value is %NULL. The container of @value is left to the caller,
+ * which may thus pass a value living on the stack: a field already set
+ * keeps its #GValue, and a new one takes a slot of @self, so this does
+ * not allocate a #GValue.
+ */
+static void _ohm_structure_store (OhmStructure* self, GQuark field, GValue* value) {
+	OhmStructureField* entry;
+	guint pos;
+
+	if (value == NULL) {
+		_ohm_structure_adopt (self, field, NULL);
+		return;
+	}
+
+	entry = _ohm_structure_lookup (self, field, &pos);
+	if (entry != NULL) {
+		g_value_unset (entry->value);
+		*entry->value = *value;
+		entry->stamp = 0;
+		return;
+	}
+
+	entry = _ohm_structure_insert_at (self, pos, field, NULL);
+	*entry->value = *value;
+}
+
+
+/*
+ * Set @field of @self to @value, which the structure takes over, or
+ * remove @field if @value is %NULL. The previous value is freed.
+ */
+static void _ohm_structure_adopt (OhmStructure* self, GQuark field, GValue* value) {
+	OhmStructureField* entry;
+	guint pos;
+
+	entry = _ohm_structure_lookup (self, field, &pos);
+
+	if (entry != NULL) {
+		if (value == NULL) {
+			_ohm_structure_remove_at (self, pos);
+		} else {
+			_ohm_structure_release (entry);
+			entry->value = value;
+			entry->chunk = NULL;
+			entry->stamp = 0;
+		}
+	} else if (value != NULL) {
+		_ohm_structure_insert_at (self, pos, field, value);
+	}
+}
+
+
+static void ohm_structure_real_qset (OhmStructure* self, GQuark field, GValue* value) {
+	g_return_if_fail (OHM_IS_STRUCTURE (self));
 
-	g_value_unset (v);
-	g_free (v);
+	_ohm_structure_adopt (self, field, value);
 }
 
+
 /**
  * ohm_structure_qset:
  * @self: a #OhmStructure
@@ -244,25 +1067,10 @@ static void _ohm_structure_unset_and_free (void* p) {
  * @value: a #GValue with an arbitrary type. If %NULL, then the @field is removed.
  *
  * Set a @field to @value.
- * @value should be allocated by the caller. It will be freed when #OhmStructure is destroyed or the field is removed.
+ * @value should be allocated by the caller. It is owned by @self
+ * afterwards, and freed when #OhmStructure is destroyed, or the field
+ * is set again or removed.
  **/
-static void ohm_structure_real_qset (OhmStructure* self, GQuark field, GValue* value) {
-	g_return_if_fail (OHM_IS_STRUCTURE (self));
-
-	if (value == NULL) {
-		self->fields = g_slist_remove (self->fields, GINT_TO_POINTER (field));
-		g_object_set_qdata (G_OBJECT (self), field, NULL);
-	} else {
-		if (g_slist_find (self->fields, GINT_TO_POINTER (field)) == NULL) {
-			self->fields = g_slist_append (self->fields, GINT_TO_POINTER (field));
-		}/*  else { */
-/* 			g_debug ("Field already set, reset"); */
-/* 		} */
-		g_object_set_qdata_full (G_OBJECT (self), field, value, _ohm_structure_unset_and_free);
-	}
-}
-
-
 void ohm_structure_qset (OhmStructure* self, GQuark field, GValue* value) {
 	OHM_STRUCTURE_GET_CLASS (self)->qset (self, field, value);
 }
@@ -273,10 +1081,16 @@ void ohm_structure_qset (OhmStructure* self, GQuark field, GValue* value) {
  * @self: a #OhmStructure
  * @field: the #GQuark name of the field to get
  *
- * Returns: The field value or %NULL if the field does not exist.
+ * Returns: The field value or %NULL if the field does not exist. The
+ * value is owned by @self, and stays valid until the field is set again
+ * or removed.
  **/
 GValue* ohm_structure_qget (OhmStructure* self, GQuark field) {
-	return ((GValue*) g_object_get_qdata (G_OBJECT (self), field));
+	OhmStructureField* entry;
+
+	entry = _ohm_structure_lookup (self, field, NULL);
+
+	return entry != NULL ? entry->value : NULL;
 }
 
 
@@ -286,8 +1100,7 @@ GValue* ohm_structure_qget (OhmStructure* self, GQuark field) {
  * @field: the name of the field to set
  * @value: a #GValue with an arbitrary type. If %NULL, then the @field is removed.
  *
- * Set a @field to @value.
- * @value should be allocated by the caller. It will be freed when #OhmStructure is destroyed or the field is removed.
+ * Set a @field to @value. See ohm_structure_qset ().
  **/
 void ohm_structure_set (OhmStructure* self, const char* field_name, GValue* value) {
 	g_return_if_fail (OHM_IS_STRUCTURE (self));
@@ -305,71 +1118,199 @@ void ohm_structure_set (OhmStructure* self, const char* field_name, GValue* valu
  * Returns: The field value or %NULL if the field does not exist.
  **/
 GValue* ohm_structure_get (OhmStructure* self, const char* field_name) {
-	return ((GValue*) g_object_get_data (G_OBJECT (self), field_name));
+	GQuark field;
+
+	field = g_quark_try_string (field_name);
+	if (field == 0) {
+		return NULL;
+	}
+
+	return ohm_structure_qget (self, field);
 }
 
 
-/**
- * ohm_structure_to_string:
- * @self: a #OhmStructure to dump to string
- *
- * Returns: an allocated string of debug/introspection information. (From vala version)
- **/
-char* ohm_structure_to_string (OhmStructure* self) {
-	char* ret;
-	gboolean first;
-	char* _tmp4;
-	GSList* q_collection;
-	GSList* q_it;
+static void _ohm_structure_write_json_string (GString* out, const char* str) {
+	const char* run;
+	const char* p;
 
-	g_return_val_if_fail (OHM_IS_STRUCTURE (self), NULL);
-	ret = g_strdup_printf ("%s (", ohm_structure_get_name (self));
-	first = TRUE;
+	g_string_append_c (out, '"');
+	for (run = p = str; *p != '\0'; p++) {
+		const char* escape;
 
-	q_collection = self->fields;
-	for (q_it = q_collection; q_it != NULL; q_it = q_it->next) {
-	  GQuark q;
-	  q = GPOINTER_TO_INT (q_it->data);
-	  {
-	    GValue* v;
-	    char* _tmp3;
-	    char* _tmp2;
-	    char* _tmp1;
-	    if (!first) {
-	      char* _tmp0;
-	      _tmp0 = NULL;
-	      ret = (_tmp0 = g_strconcat (ret, (", "), NULL), (ret = (g_free (ret), NULL)), _tmp0);
-	    } else {
-	      first = FALSE;
-	    }
-	    v = g_object_get_qdata (G_OBJECT (self), q);
-	    _tmp3 = NULL;
-	    _tmp2 = NULL;
-	    _tmp1 = NULL;
-	    ret = (_tmp3 = g_strconcat (ret, (_tmp2 = (g_strdup_printf ("%s = %s", g_quark_to_string (q), (_tmp1 = g_strdup_value_contents (v))))), NULL), (ret = (g_free (ret), NULL)), _tmp3);
-	    _tmp2 = (g_free (_tmp2), NULL);
-	    _tmp1 = (g_free (_tmp1), NULL);
-	  }
+		switch (*p) {
+		case '"':
+			escape = "\\\"";
+			break;
+		case '\\':
+			escape = "\\\\";
+			break;
+		case '\n':
+			escape = "\\n";
+			break;
+		case '\r':
+			escape = "\\r";
+			break;
+		case '\t':
+			escape = "\\t";
+			break;
+		default:
+			if ((guchar) *p >= 0x20) {
+				continue;
+			}
+			escape = NULL;
+			break;
+		}
+
+		g_string_append_len (out, run, p - run);
+		if (escape != NULL) {
+			g_string_append (out, escape);
+		} else {
+			g_string_append_printf (out, "\\u%04x", (guchar) *p);
+		}
+		run = p + 1;
 	}
+	g_string_append_len (out, run, p - run);
+	g_string_append_c (out, '"');
+}
+
 
-	_tmp4 = NULL;
-	return (_tmp4 = g_strconcat (ret, ")", NULL), (ret = (g_free (ret), NULL)), _tmp4);
+/*
+ * Numbers, booleans and strings are written as such, anything else as
+ * the string of its debug contents.
+ */
+static void _ohm_structure_write_json_value (GString* out, const GValue* value) {
+	gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar* contents;
+	gdouble d;
+
+	switch (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value))) {
+	case G_TYPE_BOOLEAN:
+		g_string_append (out, g_value_get_boolean (value) ? "true" : "false");
+		return;
+	case G_TYPE_INT:
+		g_string_append_printf (out, "%d", g_value_get_int (value));
+		return;
+	case G_TYPE_UINT:
+		g_string_append_printf (out, "%u", g_value_get_uint (value));
+		return;
+	case G_TYPE_LONG:
+		g_string_append_printf (out, "%ld", g_value_get_long (value));
+		return;
+	case G_TYPE_ULONG:
+		g_string_append_printf (out, "%lu", g_value_get_ulong (value));
+		return;
+	case G_TYPE_INT64:
+		g_string_append_printf (out, "%" G_GINT64_FORMAT, g_value_get_int64 (value));
+		return;
+	case G_TYPE_UINT64:
+		g_string_append_printf (out, "%" G_GUINT64_FORMAT, g_value_get_uint64 (value));
+		return;
+	case G_TYPE_FLOAT:
+	case G_TYPE_DOUBLE:
+		d = G_VALUE_HOLDS_FLOAT (value) ? g_value_get_float (value) : g_value_get_double (value);
+		/* JSON has no infinities, nor NaN */
+		if (isfinite (d)) {
+			g_string_append (out, g_ascii_dtostr (buffer, sizeof (buffer), d));
+		} else {
+			g_string_append (out, "null");
+		}
+		return;
+	case G_TYPE_STRING:
+		if (g_value_get_string (value) != NULL) {
+			_ohm_structure_write_json_string (out, g_value_get_string (value));
+		} else {
+			g_string_append (out, "null");
+		}
+		return;
+	default:
+		contents = g_strdup_value_contents (value);
+		_ohm_structure_write_json_string (out, contents);
+		g_free (contents);
+		return;
+	}
 }
 
 
 /**
- * ohm_structure_value_to_string:
- * @src: a @src value
- * @dest: a @dest value
+ * ohm_structure_write:
+ * @self: a #OhmStructure
+ * @out: the string to append to
+ * @format: the format to write in
  *
- * Convert a #GValue of type #OhmStructure to a string #GValue.
+ * Append the name and the fields of @self to @out, in time linear in
+ * the length of what is written.
  **/
-void ohm_structure_value_to_string (const GValue* src, GValue* dest) {
-	OhmStructure* s;
-	char* structstr;
+void ohm_structure_write (OhmStructure* self, GString* out, OhmFactStoreFormat format) {
+	guint i;
 
-	s = ohm_value_get_structure (src);
-	g_return_if_fail (s != NULL);
+	g_return_if_fail (OHM_IS_STRUCTURE (self));
+	g_return_if_fail (out != NULL);
+
+	if (format == OHM_FACT_STORE_FORMAT_JSON) {
+		g_string_append (out, "{\"name\": ");
+		_ohm_structure_write_json_string (out, ohm_structure_get_name (self));
+		g_string_append (out, ", \"fields\": {");
+		for (i = 0; i < self->priv->n_fields; i++) {
+			if (i > 0) {
+				g_string_append (out, ", ");
+			}
+			_ohm_structure_write_json_string (out, g_quark_to_string (self->priv->entries[i].field));
+			g_string_append (out, ": ");
+			_ohm_structure_write_json_value (out, self->priv->entries[i].value);
+		}
+		g_string_append (out, "}}");
+		return;
+	}
+
+	g_string_append (out, ohm_structure_get_name (self));
+	g_string_append (out, " (");
+	for (i = 0; i < self->priv->n_fields; i++) {
+		gchar* contents;
+
+		if (i > 0) {
+			g_string_append (out, ", ");
+		}
+		contents = g_strdup_value_contents (self->priv->entries[i].value);
+		g_string_append (out, g_quark_to_string (self->priv->entries[i].field));
+		g_string_append (out, " = ");
+		g_string_append (out, contents);
+		g_free (contents);
+	}
+	g_string_append_c (out, ')');
+}
+
+
+/**
+ * ohm_structure_to_string:
+ * @self: a #OhmStructure to dump to string
+ *
+ * Returns: an allocated string of debug/introspection information. (From vala version)
+ **/
+char* ohm_structure_to_string (OhmStructure* self) {
+	GString* out;
+
+	g_return_val_if_fail (OHM_IS_STRUCTURE (self), NULL);
+
+	out = g_string_new (NULL);
+	ohm_structure_write (self, out, OHM_FACT_STORE_FORMAT_TEXT);
+
+	return g_string_free (out, FALSE);
+}
+
+
+/**
+ * ohm_structure_value_to_string:
+ * @src: a @src value
+ * @dest: a @dest value
+ *
+ * Convert a #GValue of type #OhmStructure to a string #GValue.
+ **/
+void ohm_structure_value_to_string (const GValue* src, GValue* dest) {
+	OhmStructure* s;
+	char* structstr;
+
+	s = ohm_value_get_structure (src);
+	g_return_if_fail (s != NULL);
 
 	structstr = ohm_structure_to_string (s);
 	g_value_set_string (dest, structstr);
@@ -463,6 +1404,8 @@ static void ohm_structure_class_init (OhmStructureClass * klass) {
 	G_OBJECT_CLASS (klass)->dispose = ohm_structure_dispose;
 	OHM_STRUCTURE_CLASS (klass)->qset = ohm_structure_real_qset;
 
+	g_type_class_add_private (klass, sizeof (OhmStructurePrivate));
+
 	/**
 	 * OhmStructure:qname:
 	 *
@@ -484,6 +1427,9 @@ static void ohm_structure_class_init (OhmStructureClass * klass) {
 
 
 static void ohm_structure_init (OhmStructure * self) {
+	self->priv = OHM_STRUCTURE_GET_PRIVATE (self);
+	self->priv->entries = self->priv->inline_entries;
+	self->priv->n_alloc = OHM_STRUCTURE_CHUNK_SLOTS;
 	self->fields = NULL;
 }
 
@@ -496,6 +1442,30 @@ static void ohm_structure_dispose (GObject * obj) {
 	if (self->fields != NULL) {
 	  g_slist_free (self->fields);
 	  self->fields = NULL;
+	  self->priv->fields_tail = NULL;
+	}
+
+	if (self->priv->n_fields > 0) {
+	  guint i;
+
+	  for (i = 0; i < self->priv->n_fields; i++) {
+	    _ohm_structure_release (&self->priv->entries[i]);
+	  }
+	  self->priv->n_fields = 0;
+	}
+
+	if (self->priv->entries != self->priv->inline_entries) {
+	  g_free (self->priv->entries);
+	  self->priv->entries = self->priv->inline_entries;
+	  self->priv->n_alloc = OHM_STRUCTURE_CHUNK_SLOTS;
+	}
+
+	while (self->priv->chunk.next != NULL) {
+	  OhmStructureChunk* next;
+
+	  next = self->priv->chunk.next->next;
+	  g_slice_free (OhmStructureChunk, self->priv->chunk.next);
+	  self->priv->chunk.next = next;
 	}
 
 	G_OBJECT_CLASS (ohm_structure_parent_class)->dispose (obj);
@@ -559,61 +1529,382 @@ OhmPattern* ohm_pattern_new_for_fact (OhmFact* fact) {
 }
 
 
-/**
- * ohm_pattern_match:
- * @self: the pattern
- * @fact: the fact to match (not %NULL)
- * @event: the event that caused the match evaluation (ex: %OHM_FACT_STORE_EVENT_LOOKUP)
+static OhmPatternOpEntry* _ohm_pattern_lookup_op (OhmPattern* self, GQuark field) {
+	guint i;
+
+	for (i = 0; self->priv->ops != NULL && i < self->priv->ops->len; i++) {
+		OhmPatternOpEntry* e = &g_array_index (self->priv->ops, OhmPatternOpEntry, i);
+
+		if (e->field == field) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Whether the field of @self named @field is only tested for equality,
+ * and may thus be looked up in a hash.
+ */
+static gboolean _ohm_pattern_tests_equal (OhmPattern* self, GQuark field) {
+	return _ohm_pattern_lookup_op (self, field) == NULL;
+}
+
+
+/*
+ * Test the value @v of a fact against the bound @bound of a pattern
+ * field, with the operator @op. @v has the type of @bound.
+ */
+static gboolean _ohm_pattern_test_op (OhmPatternOp op, const GValue* bound, const GValue* high, const GValue* v) {
+	const gchar* s;
+
+	switch (op) {
+	case OHM_PATTERN_OP_LT:
+		return _ohm_value_order (v, bound) < 0;
+	case OHM_PATTERN_OP_LE:
+		return _ohm_value_order (v, bound) <= 0;
+	case OHM_PATTERN_OP_GT:
+		return _ohm_value_order (v, bound) > 0;
+	case OHM_PATTERN_OP_GE:
+		return _ohm_value_order (v, bound) >= 0;
+	case OHM_PATTERN_OP_RANGE:
+		return _ohm_value_order (v, bound) >= 0 && _ohm_value_order (v, high) <= 0;
+	case OHM_PATTERN_OP_PREFIX:
+		s = g_value_get_string (v);
+		return s != NULL && g_str_has_prefix (s, g_value_get_string (bound));
+	default:
+		return _ohm_value_order (v, bound) == 0;
+	}
+}
+
+
+/*
+ * ohm_pattern_compile:
  *
- * This method is used to get the facts from the #OhmFactStore, mainly
- * for debugging or by the #OhmFactStoreView views. You usually don't
- * have to match facts yourself, but instead rely on #OhmFactStoreView
- * functionnality.
+ * Build the compiled form of the pattern: a flat array of its fields,
+ * in the quark order of the structure, with the expected values
+ * extracted. The array points into the pattern values, so it is
+ * dropped whenever a field is set.
+ */
+static void ohm_pattern_compile (OhmPattern* self) {
+	OhmPatternField* pf;
+	guint i;
+
+	if (self->priv->is_compiled) {
+		return;
+	}
+
+	self->priv->n_compiled = OHM_STRUCTURE (self)->priv->n_fields;
+	self->priv->compiled = g_new0 (OhmPatternField, self->priv->n_compiled);
+
+	pf = self->priv->compiled;
+	for (i = 0; i < self->priv->n_compiled; i++, pf++) {
+		GValue* v;
+		GType type;
+
+		pf->field = OHM_STRUCTURE (self)->priv->entries[i].field;
+		v = OHM_STRUCTURE (self)->priv->entries[i].value;
+		type = G_VALUE_TYPE (v);
+
+		pf->type = type;
+		pf->value = v;
+		pf->op = OHM_PATTERN_OP_EQ;
+
+		if (self->priv->ops != NULL) {
+			OhmPatternOpEntry* e = _ohm_pattern_lookup_op (self, pf->field);
+
+			if (e != NULL) {
+				pf->op = e->op;
+				pf->high = e->high;
+			}
+		}
+
+		if (type == G_TYPE_INT) {
+			pf->kind = OHM_PATTERN_FIELD_INT;
+			pf->v.i = g_value_get_int (v);
+		} else if (type == G_TYPE_STRING) {
+			pf->kind = OHM_PATTERN_FIELD_STRING;
+			pf->v.s = g_value_get_string (v);
+		} else if (type == G_TYPE_BOOLEAN) {
+			pf->kind = OHM_PATTERN_FIELD_BOOLEAN;
+			pf->v.b = g_value_get_boolean (v);
+		} else if (type == G_TYPE_CHAR) {
+			pf->kind = OHM_PATTERN_FIELD_CHAR;
+			pf->v.c = g_value_get_schar (v);
+		} else if (type == G_TYPE_POINTER) {
+			pf->kind = OHM_PATTERN_FIELD_POINTER;
+			pf->v.p = g_value_get_pointer (v);
+		} else {
+			pf->kind = OHM_PATTERN_FIELD_OTHER;
+		}
+	}
+
+	/* a new serial for each compiled form: results cached by the facts
+	 * for a previous form of the pattern are never used again */
+	self->priv->serial = (guint) g_atomic_int_add (&ohm_pattern_serial, 1) + 1;
+	self->priv->is_compiled = TRUE;
+}
+
+
+/*
+ * ohm_pattern_references:
  *
- * Returns: a new #OhmPatternMatch if the @fact matches the pattern @self, or %NULL.
- **/
-OhmPatternMatch* ohm_pattern_match (OhmPattern* self, OhmFact* fact, OhmFactStoreEvent event) {
-	GSList* q_collection;
-	GSList* q_it;
+ * Returns: whether the compiled pattern @self tests @field, in which
+ * case a change of that field may change the result of matching a fact.
+ */
+static gboolean ohm_pattern_references (OhmPattern* self, GQuark field) {
+	guint lo;
+	guint hi;
+
+	lo = 0;
+	hi = self->priv->n_compiled;
+	while (lo < hi) {
+		guint mid = (lo + hi) / 2;
+		GQuark q = self->priv->compiled[mid].field;
+
+		if (q == field) {
+			return TRUE;
+		} else if (q < field) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
 
-	g_return_val_if_fail (OHM_IS_PATTERN (self), NULL);
-	g_return_val_if_fail (OHM_IS_FACT (fact), NULL);
+	return FALSE;
+}
+
+
+static void ohm_pattern_uncompile (OhmPattern* self) {
+	g_free (self->priv->compiled);
+	self->priv->compiled = NULL;
+	self->priv->n_compiled = 0;
+	self->priv->is_compiled = FALSE;
+}
+
+
+/*
+ * Record the operator of @field, a plain ohm_structure_set () of the
+ * field testing it for equality again. @high is owned by @self.
+ */
+static void _ohm_pattern_store_op (OhmPattern* self, GQuark field, OhmPatternOp op, GValue* high) {
+	OhmPatternOpEntry* e;
+
+	e = _ohm_pattern_lookup_op (self, field);
+	if (e != NULL) {
+		if (e->high != NULL) {
+			_ohm_value_unset_and_free (e->high);
+		}
+		g_array_remove_index_fast (self->priv->ops, e - (OhmPatternOpEntry*) self->priv->ops->data);
+	}
+
+	if (op == OHM_PATTERN_OP_EQ) {
+		if (high != NULL) {
+			_ohm_value_unset_and_free (high);
+		}
+		return;
+	}
+
+	if (self->priv->ops == NULL) {
+		self->priv->ops = g_array_new (FALSE, FALSE, sizeof (OhmPatternOpEntry));
+	}
+
+	g_array_set_size (self->priv->ops, self->priv->ops->len + 1);
+	e = &g_array_index (self->priv->ops, OhmPatternOpEntry, self->priv->ops->len - 1);
+	e->field = field;
+	e->op = op;
+	e->high = high;
+}
+
+
+static void ohm_pattern_real_qset (OhmStructure* base, GQuark field, GValue* value) {
+	OhmPattern* self;
+	OhmFactStoreAlpha* alpha;
+
+	self = OHM_PATTERN (base);
+	alpha = self->priv->alpha;
+
+	/* the pattern may have to be filed under another test */
+	if (alpha != NULL) {
+		_ohm_fact_store_lock_interest (alpha->store, TRUE);
+		_ohm_fact_store_alpha_remove (self);
+	}
+
+	ohm_pattern_uncompile (self);
+
+	OHM_STRUCTURE_CLASS (ohm_pattern_parent_class)->qset (base, field, value);
+	_ohm_pattern_store_op (self, field, value != NULL ? self->priv->pending_op : OHM_PATTERN_OP_EQ,
+			       self->priv->pending_high);
+	self->priv->pending_op = OHM_PATTERN_OP_EQ;
+	self->priv->pending_high = NULL;
+
+	if (alpha != NULL) {
+		_ohm_fact_store_alpha_add (alpha, self);
+		_ohm_fact_store_unlock_interest (alpha->store, TRUE);
+	}
+}
+
+
+/*
+ * Match the fields of @fact against the compiled pattern @self. Same
+ * semantics as the generic path of ohm_pattern_match (): every field of
+ * the pattern must be present in the fact, with the same type and an
+ * equal value, or one passing the operator of the field. Both field
+ * arrays are sorted by quark, so this is a single merge pass.
+ */
+static gboolean _ohm_pattern_match_compiled (OhmPattern* self, OhmFact* fact) {
+	OhmPatternField* pf;
+	OhmPatternField* end;
+	OhmStructureField* ff;
+	OhmStructureField* fend;
+	gboolean interned;
+
+	/* strings interned in the same table are compared by address */
+	interned = self->priv->interned && fact->priv->symbols == self->priv->alpha->store->priv->symbols;
+
+	pf = self->priv->compiled;
+	end = pf + self->priv->n_compiled;
+	ff = OHM_STRUCTURE (fact)->priv->entries;
+	fend = ff + OHM_STRUCTURE (fact)->priv->n_fields;
+
+	for (; pf < end; pf++) {
+		GValue* vfact;
+
+		while (ff < fend && ff->field < pf->field) {
+			ff++;
+		}
+
+		if (ff == fend || ff->field != pf->field) {
+			return FALSE;
+		}
+
+		vfact = ff->value;
+		if (G_VALUE_TYPE (vfact) != pf->type) {
+			return FALSE;
+		}
+
+		if (pf->op != OHM_PATTERN_OP_EQ) {
+			if (!_ohm_pattern_test_op (pf->op, pf->value, pf->high, vfact))
+				return FALSE;
+			continue;
+		}
+
+		switch (pf->kind) {
+		case OHM_PATTERN_FIELD_INT:
+			if (vfact->data[0].v_int != pf->v.i)
+				return FALSE;
+			break;
+		case OHM_PATTERN_FIELD_STRING:
+			if (interned && vfact->data[0].v_pointer == ff->symbol) {
+				if (vfact->data[0].v_pointer != pf->v.s)
+					return FALSE;
+			} else if (strcmp (g_value_get_string (vfact), pf->v.s) != 0) {
+				return FALSE;
+			}
+			break;
+		case OHM_PATTERN_FIELD_BOOLEAN:
+			if (g_value_get_boolean (vfact) != pf->v.b)
+				return FALSE;
+			break;
+		case OHM_PATTERN_FIELD_CHAR:
+			if (g_value_get_schar (vfact) != pf->v.c)
+				return FALSE;
+			break;
+		case OHM_PATTERN_FIELD_POINTER:
+			if (vfact->data[0].v_pointer != pf->v.p)
+				return FALSE;
+			break;
+		default:
+			if (ohm_value_cmp (pf->value, vfact) != 0)
+				return FALSE;
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Whether @fact matches @self, without building a #OhmPatternMatch.
+ */
+static gboolean _ohm_pattern_matches (OhmPattern* self, OhmFact* fact) {
+	OhmPatternOpEntry* e;
+	guint i;
 
 	if (self->priv->_fact == fact) {
-		return ohm_pattern_match_new (fact, self, event);
+		return TRUE;
 	}
 
 	if (ohm_structure_get_qname (OHM_STRUCTURE (fact)) != ohm_structure_get_qname (OHM_STRUCTURE (self))) {
-		return NULL;
+		return FALSE;
+	}
+
+	if (!self->priv->is_compiled && self->priv->_view != NULL) {
+		/* patterns of a view are recompiled lazily after a change */
+		ohm_pattern_compile (self);
 	}
 
-	q_collection = OHM_STRUCTURE (self)->fields;
+	if (self->priv->is_compiled) {
+		return _ohm_pattern_match_compiled (self, fact);
+	}
 
-	for (q_it = q_collection; q_it != NULL; q_it = q_it->next) {
+	for (i = 0; i < OHM_STRUCTURE (self)->priv->n_fields; i++) {
 	  GQuark q;
 	  GValue* vthis;
 	  GValue* vfact;
 
-	  q = GPOINTER_TO_INT (q_it->data);
+	  q = OHM_STRUCTURE (self)->priv->entries[i].field;
 	  
-	  vthis = g_object_get_qdata (G_OBJECT (self), q);
-	  vfact = g_object_get_qdata (G_OBJECT (fact), q);
+	  vthis = OHM_STRUCTURE (self)->priv->entries[i].value;
+	  vfact = ohm_structure_qget (OHM_STRUCTURE (fact), q);
 
 	  if ((vthis != NULL && vfact == NULL) || (vthis == NULL && vfact != NULL)) {
-	    return NULL;
+	    return FALSE;
 	  }
 	  
 	  if (vthis != NULL && vfact != NULL) {
 	    if (G_VALUE_TYPE (vthis) != G_VALUE_TYPE (vfact)) {
-	      return NULL;
+	      return FALSE;
+	    } else if (self->priv->ops != NULL && (e = _ohm_pattern_lookup_op (self, q)) != NULL) {
+	      if (!_ohm_pattern_test_op (e->op, vthis, e->high, vfact)) {
+		return FALSE;
+	      }
 	    } else {
 	      if (ohm_value_cmp (vthis, vfact) != 0) {
-		return NULL;
+		return FALSE;
 	      }
 	    }
 	  }
 	}
 	
+	return TRUE;
+}
+
+
+/**
+ * ohm_pattern_match:
+ * @self: the pattern
+ * @fact: the fact to match (not %NULL)
+ * @event: the event that caused the match evaluation (ex: %OHM_FACT_STORE_EVENT_LOOKUP)
+ *
+ * This method is used to get the facts from the #OhmFactStore, mainly
+ * for debugging or by the #OhmFactStoreView views. You usually don't
+ * have to match facts yourself, but instead rely on #OhmFactStoreView
+ * functionnality.
+ *
+ * Returns: a new #OhmPatternMatch if the @fact matches the pattern @self, or %NULL.
+ **/
+OhmPatternMatch* ohm_pattern_match (OhmPattern* self, OhmFact* fact, OhmFactStoreEvent event) {
+	g_return_val_if_fail (OHM_IS_PATTERN (self), NULL);
+	g_return_val_if_fail (OHM_IS_FACT (fact), NULL);
+
+	if (!_ohm_pattern_matches (self, fact)) {
+		return NULL;
+	}
+
 	return ohm_pattern_match_new (fact, self, event);
 }
 
@@ -644,13 +1935,115 @@ OhmFact* ohm_pattern_get_fact (OhmPattern* self) {
 
 
 void ohm_pattern_set_fact (OhmPattern* self, OhmFact* value) {
+	OhmFactStoreAlpha* alpha;
+
 	g_return_if_fail (OHM_IS_PATTERN (self));
 
+	alpha = self->priv->alpha;
+	if (alpha != NULL) {
+		_ohm_fact_store_lock_interest (alpha->store, TRUE);
+		_ohm_fact_store_alpha_remove (self);
+	}
+
 	if (self->priv->_fact != NULL) {
 	  g_object_unref (self->priv->_fact);
 	}
 
 	self->priv->_fact = g_object_ref (value);
+
+	if (alpha != NULL) {
+		_ohm_fact_store_alpha_add (alpha, self);
+		_ohm_fact_store_unlock_interest (alpha->store, TRUE);
+	}
+}
+
+
+/**
+ * ohm_pattern_set_op:
+ * @self: a #OhmPattern
+ * @field_name: the name of the field
+ * @op: the operator, not %OHM_PATTERN_OP_RANGE
+ * @value: the value compared to, owned by @self
+ *
+ * Set @field_name of @self to @value, and test the field of the facts
+ * with @op instead of for equality: with %OHM_PATTERN_OP_LT, the
+ * pattern matches the facts whose field is less than @value. The field
+ * of the fact must still have the type of @value, which must be a
+ * number, a boolean or a string. Setting the field again with
+ * ohm_structure_set () tests it for equality.
+ *
+ * The facts of a name having an ordered index on the field, see
+ * ohm_fact_store_add_ordered_index (), are looked up in that index.
+ **/
+void ohm_pattern_set_op (OhmPattern* self, const char* field_name, OhmPatternOp op, GValue* value) {
+	g_return_if_fail (OHM_IS_PATTERN (self));
+	g_return_if_fail (field_name != NULL);
+	g_return_if_fail (value != NULL);
+	g_return_if_fail (op != OHM_PATTERN_OP_RANGE);
+	g_return_if_fail (op == OHM_PATTERN_OP_EQ || _ohm_value_orderable (G_VALUE_TYPE (value)));
+	g_return_if_fail (op != OHM_PATTERN_OP_PREFIX || (G_VALUE_HOLDS_STRING (value) && g_value_get_string (value) != NULL));
+
+	self->priv->pending_op = op;
+	ohm_structure_set (OHM_STRUCTURE (self), field_name, value);
+}
+
+
+/**
+ * ohm_pattern_set_range:
+ * @self: a #OhmPattern
+ * @field_name: the name of the field
+ * @low: the lowest value matched, owned by @self
+ * @high: the highest value matched, owned by @self
+ *
+ * Match the facts whose @field_name is between @low and @high,
+ * inclusive, see ohm_pattern_set_op ().
+ **/
+void ohm_pattern_set_range (OhmPattern* self, const char* field_name, GValue* low, GValue* high) {
+	g_return_if_fail (OHM_IS_PATTERN (self));
+	g_return_if_fail (field_name != NULL);
+	g_return_if_fail (low != NULL && high != NULL);
+	g_return_if_fail (G_VALUE_TYPE (low) == G_VALUE_TYPE (high));
+	g_return_if_fail (_ohm_value_orderable (G_VALUE_TYPE (low)));
+
+	self->priv->pending_op = OHM_PATTERN_OP_RANGE;
+	self->priv->pending_high = high;
+	ohm_structure_set (OHM_STRUCTURE (self), field_name, low);
+}
+
+
+/**
+ * ohm_pattern_set_prefix:
+ * @self: a #OhmPattern
+ * @field_name: the name of the field
+ * @prefix: a string
+ *
+ * Match the facts whose string @field_name starts with @prefix, see
+ * ohm_pattern_set_op ().
+ **/
+void ohm_pattern_set_prefix (OhmPattern* self, const char* field_name, const char* prefix) {
+	g_return_if_fail (prefix != NULL);
+
+	ohm_pattern_set_op (self, field_name, OHM_PATTERN_OP_PREFIX, ohm_value_from_string (prefix));
+}
+
+
+/**
+ * ohm_pattern_get_op:
+ * @self: a #OhmPattern
+ * @field_name: the name of the field
+ *
+ * Returns: the operator testing @field_name, %OHM_PATTERN_OP_EQ if it
+ * is tested for equality or not set.
+ **/
+OhmPatternOp ohm_pattern_get_op (OhmPattern* self, const char* field_name) {
+	OhmPatternOpEntry* e;
+
+	g_return_val_if_fail (OHM_IS_PATTERN (self), OHM_PATTERN_OP_EQ);
+	g_return_val_if_fail (field_name != NULL, OHM_PATTERN_OP_EQ);
+
+	e = _ohm_pattern_lookup_op (self, g_quark_try_string (field_name));
+
+	return e != NULL ? e->op : OHM_PATTERN_OP_EQ;
 }
 
 
@@ -927,6 +2320,7 @@ static void ohm_pattern_class_init (OhmPatternClass * klass) {
 	G_OBJECT_CLASS (klass)->get_property = ohm_pattern_get_property;
 	G_OBJECT_CLASS (klass)->set_property = ohm_pattern_set_property;
 	G_OBJECT_CLASS (klass)->dispose = ohm_pattern_dispose;
+	OHM_STRUCTURE_CLASS (klass)->qset = ohm_pattern_real_qset;
 
 	/**
 	 * OhmPattern:view:
@@ -968,6 +2362,17 @@ static void ohm_pattern_dispose (GObject * obj) {
 	  self->priv->_fact = NULL;
 	}
 
+	ohm_pattern_uncompile (self);
+
+	if (self->priv->ops != NULL) {
+		while (self->priv->ops->len > 0) {
+			_ohm_pattern_store_op (self, g_array_index (self->priv->ops, OhmPatternOpEntry, 0).field,
+					       OHM_PATTERN_OP_EQ, NULL);
+		}
+		g_array_free (self->priv->ops, TRUE);
+		self->priv->ops = NULL;
+	}
+
 	G_OBJECT_CLASS (ohm_pattern_parent_class)->dispose (obj);
 }
 
@@ -1028,7 +2433,9 @@ GValue* ohm_fact_get (OhmFact* self, const char* field_name) {
  * @value: a #GValue with an arbitrary type. If %NULL, then the @field is removed.
  *
  * Set a @field to @value.
- * @value should be allocated by the caller. It will be freed when #OhmFact is destroyed, or the field is removed.
+ * @value should be allocated by the caller. It is owned by @self
+ * afterwards, and freed when #OhmFact is destroyed, or the field is set
+ * again or removed.
  **/
 void ohm_fact_set (OhmFact* self, const char* field_name, GValue* value) {
 	g_return_if_fail (OHM_IS_FACT (self));
@@ -1044,48 +2451,257 @@ void ohm_fact_set (OhmFact* self, const char* field_name, GValue* value) {
 }
 
 
-/**
- * ohm_fact_qset:
- * @self: a #OhmFact
- * @field: the #GQuark name of the field to set
- * @value: a #GValue with an arbitrary type. If %NULL, then the @field
- * is removed.
- *
- * Set a @field to @value.
- * @value should be allocated by the caller. It will be freed when
- * #OhmFact is destroyed or the field is removed.
- *
- * When setting a field, the associated :fact_store is notified and
- * collects modification in interested views.  The modification is
- * itself tracked by a #OhmFactStoreTransaction transaction that can
- * cancel and discard the changes, including the view notificiations.
+/*
+ * Common part of the typed setters: @value is an initialized #GValue
+ * owned by the caller, usually on its stack, whose content is moved
+ * into the fact as told by @mode. No #GValue is allocated on the way.
+ */
+static void _ohm_fact_qset_inline (OhmFact* self, GQuark field, GValue* value, OhmFactSetMode mode) {
+	const char* field_name;
+
+	field_name = g_quark_to_string (field);
+	if (field_name[0] == '_' && field_name[1] == '_' &&
+	    ohm_structure_qget (OHM_STRUCTURE (self), field) != NULL) {
+	  if (value != NULL)
+	    g_value_unset (value);
+	  return;
+	}
+
+	_ohm_fact_set_field (self, field, value, mode);
+}
+
+
+static void _ohm_fact_set_inline (OhmFact* self, const char* field_name, GValue* value, OhmFactSetMode mode) {
+	_ohm_fact_qset_inline (self, g_quark_from_string (field_name), value, mode);
+}
+
+
+/**
+ * ohm_fact_set_int:
+ * @self: a #OhmFact
+ * @field_name: the name of the field to set
+ * @val: the value
+ *
+ * Set a @field to the integer @val. Unlike ohm_fact_set () with
+ * ohm_value_from_int (), this does not allocate a #GValue.
  **/
-static void ohm_fact_real_qset (OhmStructure* base, GQuark field, GValue* value) {
-	OhmFact * self;
+void ohm_fact_set_int (OhmFact* self, const char* field_name, gint val) {
+	GValue value = {0,};
+
+	g_return_if_fail (OHM_IS_FACT (self));
+	g_return_if_fail (field_name != NULL);
+
+	g_value_init (&value, G_TYPE_INT);
+	g_value_set_int (&value, val);
+	_ohm_fact_set_inline (self, field_name, &value, OHM_FACT_SET_MOVE);
+}
+
+
+/**
+ * ohm_fact_set_string:
+ * @self: a #OhmFact
+ * @field_name: the name of the field to set
+ * @val: the value (not %NULL)
+ *
+ * Set a @field to the string @val. If @self is in a #OhmFactStore, the
+ * string is interned by the store, so that setting a field to a string
+ * already known to the store neither copies nor allocates.
+ **/
+void ohm_fact_set_string (OhmFact* self, const char* field_name, const char* val) {
+	GValue value = {0,};
+
+	g_return_if_fail (OHM_IS_FACT (self));
+	g_return_if_fail (field_name != NULL);
+	g_return_if_fail (val != NULL);
+
+	/* interned, or copied, once the fact is locked */
+	g_value_init (&value, G_TYPE_STRING);
+	g_value_set_static_string (&value, val);
+	_ohm_fact_set_inline (self, field_name, &value, OHM_FACT_SET_BORROW);
+}
+
+
+/**
+ * ohm_fact_set_boolean:
+ * @self: a #OhmFact
+ * @field_name: the name of the field to set
+ * @val: the value
+ *
+ * Set a @field to the boolean @val, without allocating a #GValue.
+ **/
+void ohm_fact_set_boolean (OhmFact* self, const char* field_name, gboolean val) {
+	GValue value = {0,};
+
+	g_return_if_fail (OHM_IS_FACT (self));
+	g_return_if_fail (field_name != NULL);
+
+	g_value_init (&value, G_TYPE_BOOLEAN);
+	g_value_set_boolean (&value, val);
+	_ohm_fact_set_inline (self, field_name, &value, OHM_FACT_SET_MOVE);
+}
+
+
+/**
+ * ohm_fact_set_double:
+ * @self: a #OhmFact
+ * @field_name: the name of the field to set
+ * @val: the value
+ *
+ * Set a @field to the double @val, without allocating a #GValue.
+ **/
+void ohm_fact_set_double (OhmFact* self, const char* field_name, gdouble val) {
+	GValue value = {0,};
+
+	g_return_if_fail (OHM_IS_FACT (self));
+	g_return_if_fail (field_name != NULL);
+
+	g_value_init (&value, G_TYPE_DOUBLE);
+	g_value_set_double (&value, val);
+	_ohm_fact_set_inline (self, field_name, &value, OHM_FACT_SET_MOVE);
+}
+
+
+/*
+ * Give @field of @self a new stamp. Stamps only grow, so a field which
+ * has the stamp it had has not been set since.
+ */
+static void _ohm_fact_stamp (OhmFact* self, GQuark field) {
+	OhmStructureField* entry;
 
-	self = OHM_FACT (base);
+	entry = _ohm_structure_lookup (OHM_STRUCTURE (self), field, NULL);
+	if (entry != NULL) {
+		entry->stamp = ++self->priv->clock;
+	}
+}
+
+
+static guint _ohm_fact_get_stamp (OhmFact* self, GQuark field) {
+	OhmStructureField* entry;
+
+	entry = _ohm_structure_lookup (OHM_STRUCTURE (self), field, NULL);
+
+	return entry != NULL ? entry->stamp : 0;
+}
+
+
+/*
+ * Set @field of @self to @value, as told by @mode (see
+ * _ohm_structure_store () and _ohm_structure_adopt ()), keeping the
+ * transaction, the indexes and the views up to date.
+ */
+static void _ohm_fact_set_field (OhmFact* self, GQuark field, GValue* value, OhmFactSetMode mode) {
+	OhmFactStore* store;
+	OhmStructureField* entry;
+	const gchar* old_sym;
+	const gchar* new_sym;
+	GQuark qname;
+
+	old_sym = NULL;
+	new_sym = NULL;
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (self));
+
+	/* the fact may have left the store while waiting for the lock */
+	for (;;) {
+		store = self->priv->_fact_store;
+		if (store == NULL) {
+			break;
+		}
+
+		_ohm_fact_store_lock_name (store, qname);
+		if (self->priv->_fact_store == store) {
+			break;
+		}
+		_ohm_fact_store_unlock_name (store, qname);
+	}
+
+	if (store == NULL && mode == OHM_FACT_SET_BORROW && value != NULL) {
+		g_value_set_string (value, g_value_get_string (value));
+	}
+
+	/* the symbol of the field is released once its value is replaced */
+	entry = _ohm_structure_lookup (OHM_STRUCTURE (self), field, NULL);
+	if (entry != NULL) {
+		old_sym = entry->symbol;
+		entry->symbol = NULL;
+	}
 
 	/*fixme ?#
 	 save previous value, if any*/
-	if (self->priv->_fact_store != NULL) {
+	if (store != NULL) {
 		OhmFactStoreTransaction* t;
+		GValue* old;
+
+		_ohm_fact_store_unindex_field (store, self, field);
+
+		if (value != NULL && G_VALUE_HOLDS_STRING (value) && g_value_get_string (value) != NULL) {
+			new_sym = _ohm_fact_store_symbol_ref (store->priv->symbols, g_value_get_string (value));
+			g_value_set_static_string (value, new_sym);
+		}
+
+		old = ohm_structure_qget (OHM_STRUCTURE (self), field);
 
-		t = (OhmFactStoreTransaction*) g_queue_peek_head (self->priv->_fact_store->transaction);
+		t = (OhmFactStoreTransaction*) g_queue_peek_head (store->transaction);
 		if (t != NULL) {
-			t->modifications = g_slist_prepend (t->modifications,
-							    ohm_fact_store_transaction_cow_new (self, OHM_FACT_STORE_EVENT_UPDATED, field, g_object_steal_qdata (G_OBJECT (self), field)));
+			/* a copy, so the field keeps its place among the others;
+			   it does not depend on the symbols either */
+			if (old != NULL) {
+				GValue* saved;
+
+				saved = g_new0 (GValue, 1);
+				_ohm_value_init_copy (saved, old);
+				old = saved;
+			}
+
+			_ohm_fact_store_transaction_log (t, ohm_fact_store_transaction_cow_new (self, OHM_FACT_STORE_EVENT_UPDATED, field, old));
 		}
 	}
 
-	OHM_STRUCTURE_CLASS (ohm_fact_parent_class)->qset (OHM_STRUCTURE (self), field, value);
+	if (mode == OHM_FACT_SET_ADOPT) {
+		_ohm_structure_adopt (OHM_STRUCTURE (self), field, value);
+	} else {
+		_ohm_structure_store (OHM_STRUCTURE (self), field, value);
+	}
+	if (new_sym != NULL) {
+		_ohm_structure_lookup (OHM_STRUCTURE (self), field, NULL)->symbol = new_sym;
+	}
+	_ohm_fact_stamp (self, field);
+
+	if (old_sym != NULL) {
+		_ohm_fact_store_symbol_unref (self->priv->symbols, old_sym);
+	}
 
 	/* inform the fact_store, and views, if not */
-	if (self->priv->_fact_store != NULL) {
-		ohm_fact_store_update (ohm_fact_get_fact_store (self), self, field, value);
+	if (store != NULL) {
+		_ohm_fact_store_index_field (store, self, field);
+		_ohm_fact_store_touch (store, qname, self);
+		ohm_fact_store_update (store, self, field, ohm_structure_qget (OHM_STRUCTURE (self), field));
+		_ohm_fact_store_journal_log (store, OHM_FACT_STORE_OP_UPDATE, self, field);
+		_ohm_fact_store_unlock_name (store, qname);
 	}
 }
 
 
+/**
+ * ohm_fact_qset:
+ * @self: a #OhmFact
+ * @field: the #GQuark name of the field to set
+ * @value: a #GValue with an arbitrary type. If %NULL, then the @field
+ * is removed.
+ *
+ * Set a @field to @value.
+ * @value should be allocated by the caller. It will be freed when
+ * #OhmFact is destroyed or the field is removed.
+ *
+ * When setting a field, the associated :fact_store is notified and
+ * collects modification in interested views.  The modification is
+ * itself tracked by a #OhmFactStoreTransaction transaction that can
+ * cancel and discard the changes, including the view notificiations.
+ **/
+static void ohm_fact_real_qset (OhmStructure* base, GQuark field, GValue* value) {
+	_ohm_fact_set_field (OHM_FACT (base), field, value, OHM_FACT_SET_ADOPT);
+}
+
+
 OhmFactStore* ohm_fact_get_fact_store (OhmFact* self) {
 	g_return_val_if_fail (OHM_IS_FACT (self), NULL);
 	return self->priv->_fact_store;
@@ -1094,7 +2710,7 @@ OhmFactStore* ohm_fact_get_fact_store (OhmFact* self) {
 
 GSList *ohm_fact_get_fields(OhmFact *self) {
 	g_return_val_if_fail (OHM_IS_FACT (self), NULL);
-	return OHM_STRUCTURE(self)->fields;
+	return _ohm_structure_get_fields (OHM_STRUCTURE (self));
 }
 
 
@@ -1108,6 +2724,11 @@ void ohm_fact_set_fact_store (OhmFact* self, OhmFactStore* value) {
 
 	self->priv->_fact_store = value;
 
+	/* match results are only tracked while the fact is in a store */
+	if (self->priv->matched != NULL) {
+		g_hash_table_remove_all (self->priv->matched);
+	}
+
 	if (self->priv->_fact_store != NULL) {
 		g_object_add_weak_pointer (G_OBJECT (self->priv->_fact_store),
 					   (void*)&self->priv->_fact_store);
@@ -1115,6 +2736,56 @@ void ohm_fact_set_fact_store (OhmFact* self, OhmFactStore* value) {
 }
 
 
+/**
+ * ohm_fact_set_expiry:
+ * @self: a #OhmFact
+ * @expiry: the monotonic time of the expiry, in microseconds, or 0
+ *
+ * Set the time, as given by g_get_monotonic_time (), at which @self is
+ * removed from its #OhmFactStore. The removal is made from the default
+ * main context, with ohm_fact_store_remove (): it is seen by the views,
+ * the listeners and the journal as any other, and the facts expiring
+ * together are removed in one transaction. A fact out of a store
+ * expires once inserted, at once if @expiry has passed meanwhile. The
+ * store services all its facts from a single timer, unlike a timeout
+ * source per fact. An @expiry of 0 cancels the expiry.
+ **/
+void ohm_fact_set_expiry (OhmFact* self, gint64 expiry) {
+	OhmFactStore* store;
+	GQuark qname;
+
+	g_return_if_fail (OHM_IS_FACT (self));
+	g_return_if_fail (expiry >= 0);
+
+	store = self->priv->_fact_store;
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (self));
+	if (store != NULL) {
+		_ohm_fact_store_lock_name (store, qname);
+		_ohm_fact_store_cancel_expiry (store, self);
+	}
+
+	self->priv->expiry = expiry;
+
+	if (store != NULL) {
+		_ohm_fact_store_schedule_expiry (store, self);
+		_ohm_fact_store_unlock_name (store, qname);
+	}
+}
+
+
+/**
+ * ohm_fact_get_expiry:
+ * @self: a #OhmFact
+ *
+ * Returns: the monotonic time at which @self expires, in microseconds,
+ * or 0, see ohm_fact_set_expiry ().
+ **/
+gint64 ohm_fact_get_expiry (OhmFact* self) {
+	g_return_val_if_fail (OHM_IS_FACT (self), 0);
+	return self->priv->expiry;
+}
+
+
 static void ohm_fact_get_property (GObject * object, guint property_id, GValue * value, GParamSpec * pspec) {
 	OhmFact * self;
 
@@ -1172,6 +2843,7 @@ static void ohm_fact_class_init (OhmFactClass * klass) {
 
 static void ohm_fact_init (OhmFact * self) {
 	self->priv = OHM_FACT_GET_PRIVATE (self);
+	self->priv->timer_slot = -1;
 }
 
 
@@ -1183,6 +2855,33 @@ static void ohm_fact_dispose (GObject * obj) {
 	if (self->priv->_fact_store != NULL) {
 	  g_object_remove_weak_pointer (G_OBJECT (self->priv->_fact_store),
 					(gpointer)&self->priv->_fact_store);
+	  self->priv->_fact_store = NULL;
+	}
+
+	if (self->priv->matched != NULL) {
+	  g_hash_table_destroy (self->priv->matched);
+	  self->priv->matched = NULL;
+	}
+
+	if (self->priv->frozen != NULL) {
+	  g_object_unref (self->priv->frozen);
+	  self->priv->frozen = NULL;
+	}
+
+	if (self->priv->symbols != NULL) {
+	  OhmStructurePrivate* priv;
+	  guint i;
+
+	  priv = OHM_STRUCTURE (self)->priv;
+	  for (i = 0; i < priv->n_fields; i++) {
+	    if (priv->entries[i].symbol != NULL) {
+	      _ohm_fact_store_symbol_unref (self->priv->symbols, priv->entries[i].symbol);
+	      priv->entries[i].symbol = NULL;
+	    }
+	  }
+
+	  _ohm_fact_store_symbols_unref (self->priv->symbols);
+	  self->priv->symbols = NULL;
 	}
 
 	G_OBJECT_CLASS (ohm_fact_parent_class)->dispose (obj);
@@ -1212,389 +2911,5951 @@ GType ohm_fact_get_type (void) {
 }
 
 
-static void _ohm_fact_store_update_views (OhmFactStore* self, OhmFact* fact, OhmFactStoreEvent event, GQuark field, GValue *value) {
-	GSList* patterns;
-	GSList* p_collection;
-	GSList* p_it;
-	OhmFactStoreTransaction* t;
+/*
+ * Match @fact against @p. The result is remembered by the fact, per
+ * compiled form of the pattern, so that an update of a field which the
+ * pattern does not test carries the previous result forward instead of
+ * running ohm_pattern_match () again. The remembered result stays
+ * current because a pattern only becomes reachable again through the
+ * alpha network by a change of the field it is filed under, which it
+ * tests and thus re-evaluates.
+ *
+ * The results are keyed by pattern, with the serial of its compiled
+ * form, so a recompiled pattern replaces its result. The results of
+ * the patterns gone are dropped along with the others once the fact
+ * remembers twice as many results as the store has patterns.
+ *
+ * The counts of ohm_fact_store_get_pattern_stats () are guarded by the
+ * lock of the name of the pattern, held by the caller.
+ */
+static gboolean _ohm_fact_store_match_pattern (OhmPattern* p, OhmFact* fact, OhmFactStoreEvent event, GQuark field) {
+	gboolean m;
+	GHashTable* matched;
+	gpointer result;
+	guint serial;
+
+	matched = fact->priv->matched;
+	serial = p->priv->serial & (G_MAXUINT >> 1);
+	p->priv->evaluations++;
+
+	if (event == OHM_FACT_STORE_EVENT_UPDATED && field != 0 &&
+	    matched != NULL && p->priv->is_compiled &&
+	    !ohm_pattern_references (p, field)) {
+		if (g_hash_table_lookup_extended (matched, p, NULL, &result) &&
+		    GPOINTER_TO_UINT (result) >> 1 == serial) {
+			m = GPOINTER_TO_UINT (result) & 1;
+			p->priv->hits += m;
+			return m;
+		}
+	}
 
-	g_return_if_fail (OHM_IS_FACT_STORE (self));
-	g_return_if_fail (OHM_IS_FACT (fact));
+	m = _ohm_pattern_matches (p, fact);
+	p->priv->hits += m;
 
-	t = (OhmFactStoreTransaction*) g_queue_peek_head (self->transaction);
+	if (event != OHM_FACT_STORE_EVENT_REMOVED && p->priv->is_compiled) {
+		if (matched == NULL) {
+			matched = fact->priv->matched = g_hash_table_new (g_direct_hash, g_direct_equal);
+		} else if (p->priv->alpha != NULL &&
+			   g_hash_table_size (matched) >= 2 * p->priv->alpha->store->priv->n_patterns + 8 &&
+			   g_hash_table_lookup (matched, p) == NULL) {
+			g_hash_table_remove_all (matched);
+		}
+		g_hash_table_insert (matched, p, GUINT_TO_POINTER (serial << 1 | (m ? 1 : 0)));
+	}
+
+	return m;
+}
 
-	patterns = g_datalist_id_get_data (&self->priv->interest, ohm_structure_get_qname (OHM_STRUCTURE (fact)));
 
-	p_collection = patterns;
-	for (p_it = p_collection; p_it != NULL; p_it = p_it->next) {
-	  OhmPatternMatch* m;
-	  OhmPattern* p;
+static void _ohm_fact_store_dispatch_pattern (OhmPattern* p, OhmFact* fact, OhmFactStoreEvent event, GQuark field, OhmFactStoreTransaction* t) {
+	OhmFactStoreView* v;
+	guint serial;
 
-	  p = (OhmPattern*) p_it->data;
-	  m = ohm_pattern_match (p, fact, event);
+	if (!_ohm_fact_store_match_pattern (p, fact, event, field)) {
+		return;
+	}
 
-	  if (m != NULL) {
-	    ohm_fact_store_change_set_add_match (OHM_FACT_STORE_SIMPLE_VIEW (ohm_pattern_get_view (p))->change_set, m);
+	v = ohm_pattern_get_view (p);
+	serial = _ohm_fact_store_change_set_add_record (OHM_FACT_STORE_SIMPLE_VIEW (v)->change_set, fact, p, event, field, NULL);
 
-	    if (t != NULL) {
-	      t->matches = g_slist_prepend (t->matches, 
-					    ohm_pair_new (g_object_ref (m), 
-							  g_object_ref (ohm_pattern_get_view (p)),
-							  g_object_unref, g_object_unref));
-	    }
-	    
-	    (m == NULL ? NULL : (m = (g_object_unref (m), NULL)));
-	  }
+	if (p->priv->alpha->store->priv->batch != NULL) {
+		g_hash_table_insert (p->priv->alpha->store->priv->batch->views, v, v);
 	}
 
-	switch (event) {
-	case OHM_FACT_STORE_EVENT_ADDED:
-		g_signal_emit_by_name (G_OBJECT (self), "inserted", fact);
-		break;
-	case OHM_FACT_STORE_EVENT_REMOVED:
-		g_signal_emit_by_name (G_OBJECT (self), "removed", fact);
-		break;
-	case OHM_FACT_STORE_EVENT_UPDATED:
-		g_signal_emit_by_name (G_OBJECT (self), "updated", fact, field, value);
-		break;
-	default:
-		break;
+	/* what a transaction matches is only notified once committed */
+	if (t == NULL) {
+		_ohm_fact_store_queue_notify (p->priv->alpha->store, v);
+	}
+
+	if (t != NULL && serial != 0) {
+		t->matches = g_slist_prepend (t->matches, 
+					      ohm_pair_new (GUINT_TO_POINTER (serial),
+							    g_object_ref (v),
+							    NULL, g_object_unref));
+		if (t->matches->next == NULL) {
+			t->priv->matches_tail = t->matches;
+		}
 	}
 }
 
 
-#undef SUPPRESS_DUPLICATES
-static void _ohm_fact_store_transaction_update_views(OhmFactStore *self, OhmFactStoreTransaction *t) {
-	GSList *it;
-	OhmFactStoreTransactionCOW *cow;
-#ifdef SUPPRESS_DUPLICATES
-	GSList *l;
-	OhmFactStoreTransactionCOW *recent, *found;
-#endif	
+static void _ohm_fact_store_match_patterns (GSList* patterns, OhmFact* fact, OhmFactStoreEvent event, GQuark field, OhmFactStoreTransaction* t) {
+	GSList* p_it;
 
-	t->modifications = g_slist_reverse(t->modifications);
-	for (it = t->modifications; it != NULL; it = it->next) {
-		cow = (OhmFactStoreTransactionCOW *) it->data;
+	for (p_it = patterns; p_it != NULL; p_it = p_it->next) {
+		_ohm_fact_store_dispatch_pattern ((OhmPattern*) p_it->data, fact, event, field, t);
+	}
+}
 
-		switch (cow->event) {
-		case OHM_FACT_STORE_EVENT_ADDED:
-			_ohm_fact_store_update_views(self, cow->fact, OHM_FACT_STORE_EVENT_ADDED, 0, NULL);
-			break;
-		case OHM_FACT_STORE_EVENT_REMOVED:
-			_ohm_fact_store_update_views(self, cow->fact, OHM_FACT_STORE_EVENT_REMOVED, 0, NULL);
-			break;
-		case OHM_FACT_STORE_EVENT_UPDATED:
-#ifdef SUPPRESS_DUPLICATES
-			found = NULL;
-			for (l = it->next; l != NULL; l = l->next) {
-				recent = (OhmFactStoreTransactionCOW *)l->data;
-				if (recent->fact == cow->fact && recent->field == cow->field)
-					found = recent;
-			}
-			
-			if (found == NULL)
-#endif
-				_ohm_fact_store_update_views(self, cow->fact, OHM_FACT_STORE_EVENT_UPDATED, cow->field,
-							     ohm_structure_qget(OHM_STRUCTURE(cow->fact), cow->field));
-			break;
-		default:
-			break;
-		}
+
+/*
+ * The lower bound of the comparison of @p on @field, or %NULL if it
+ * has none.
+ */
+static GValue* _ohm_pattern_low_bound (OhmPattern* p, GQuark field) {
+	OhmPatternOpEntry* e;
+
+	e = _ohm_pattern_lookup_op (p, field);
+	if (e == NULL || e->op == OHM_PATTERN_OP_LT || e->op == OHM_PATTERN_OP_LE) {
+		return NULL;
 	}
+
+	return ohm_structure_qget (OHM_STRUCTURE (p), field);
 }
 
-static void _ohm_fact_store_update_transparent_views (OhmFactStore* self, OhmFact* fact, OhmFactStoreEvent event, GQuark field, GValue *value) {
-	GSList* patterns;
-	GSList* p_collection;
-	GSList* p_it;
 
-	g_return_if_fail (OHM_IS_FACT_STORE (self));
-	g_return_if_fail (OHM_IS_FACT (fact));
+static gint _ohm_pattern_low_bound_order (const GValue* b1, const GValue* b2) {
+	if (b1 == NULL || b2 == NULL) {
+		return (b1 != NULL) - (b2 != NULL);
+	}
+
+	return _ohm_value_order (b1, b2);
+}
 
-	patterns = g_datalist_id_get_data (&self->priv->transp_interest, ohm_structure_get_qname (OHM_STRUCTURE (fact)));
 
-	p_collection = patterns;
-	for (p_it = p_collection; p_it != NULL; p_it = p_it->next) {
-	  OhmPatternMatch* m;
-	  OhmPattern* p;
+/*
+ * The number of patterns of the sorted @ranges whose lower bound on
+ * @field is at most @v: a fact with that value can only match these.
+ */
+static guint _ohm_fact_store_alpha_ranges_reach (GPtrArray* ranges, GQuark field, const GValue* v) {
+	guint lo;
+	guint hi;
+
+	lo = 0;
+	hi = ranges->len;
+	while (lo < hi) {
+		guint mid = (lo + hi) / 2;
+
+		if (_ohm_pattern_low_bound_order (_ohm_pattern_low_bound (g_ptr_array_index (ranges, mid), field), v) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
 
-	  p = (OhmPattern*) p_it->data;
-	  m = ohm_pattern_match (p, fact, event);
+	return lo;
+}
 
-	  if (m != NULL) {
-	    ohm_fact_store_change_set_add_match (OHM_FACT_STORE_SIMPLE_VIEW (ohm_pattern_get_view (p))->change_set, m);
 
-	    (m == NULL ? NULL : (m = (g_object_unref (m), NULL)));
-	  }
+/*
+ * Run @fact through the alpha network @alphas: only the patterns whose
+ * constant test the fact passes, and the untested ones, are matched.
+ */
+static OhmFactStoreAlpha* _ohm_fact_store_alpha_find (OhmFactStore* self, GHashTable* alphas, OhmFact* fact) {
+	OhmFactStoreBatch* batch;
+	GQuark qname;
+
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (fact));
+	batch = self->priv->batch;
+	if (batch != NULL && batch->qname == qname) {
+		return alphas == self->priv->alpha ? batch->alpha : batch->transp_alpha;
 	}
+
+	return g_hash_table_lookup (alphas, GUINT_TO_POINTER (qname));
 }
 
 
-static gboolean ohm_fact_store_insert_internal (OhmFactStore* self, OhmFact* fact) {
-	GSList* facts;
+static void _ohm_fact_store_alpha_dispatch (OhmFactStoreAlpha* alpha, OhmFact* fact, OhmFactStoreEvent event, GQuark field, OhmFactStoreTransaction* t) {
+	GHashTableIter iter;
+	gpointer key;
+	gpointer values;
 
-	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
-	g_return_val_if_fail (OHM_IS_FACT (fact), FALSE);
+	if (alpha == NULL) {
+		return;
+	}
 
-	facts = ohm_fact_store_get_facts_by_quark (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)));
+	_ohm_fact_store_match_patterns (alpha->other, fact, event, field, t);
 
-	if (ohm_fact_get_fact_store (fact) != NULL) {
-		return FALSE;
+	g_hash_table_iter_init (&iter, alpha->tests);
+	while (g_hash_table_iter_next (&iter, &key, &values)) {
+		GValue* v;
+
+		v = ohm_structure_qget (OHM_STRUCTURE (fact), GPOINTER_TO_UINT (key));
+		if (v == NULL) {
+			continue;
+		}
+
+		_ohm_fact_store_match_patterns (g_hash_table_lookup ((GHashTable*) values, v), fact, event, field, t);
 	}
 
-	if (g_slist_find (facts, fact) == NULL) {
-		ohm_fact_set_fact_store (fact, self);
+	if (alpha->ranges == NULL) {
+		return;
+	}
 
-		facts = g_slist_prepend (facts, g_object_ref (fact));
+	g_hash_table_iter_init (&iter, alpha->ranges);
+	while (g_hash_table_iter_next (&iter, &key, &values)) {
+		GPtrArray* ranges;
+		GValue* v;
+		guint i;
+		guint n;
 
-		g_object_set_qdata (G_OBJECT (self), ohm_structure_get_qname (OHM_STRUCTURE (fact)), facts);
+		v = ohm_structure_qget (OHM_STRUCTURE (fact), GPOINTER_TO_UINT (key));
+		if (v == NULL) {
+			continue;
+		}
 
-		return TRUE;
+		ranges = (GPtrArray*) values;
+		n = _ohm_fact_store_alpha_ranges_reach (ranges, GPOINTER_TO_UINT (key), v);
+		for (i = 0; i < n; i++) {
+			_ohm_fact_store_dispatch_pattern (g_ptr_array_index (ranges, i), fact, event, field, t);
+		}
 	}
-	return FALSE;
 }
 
 
-/**
- * ohm_fact_store_insert:
+/*
+ * Account for a dispatch of a change of @fact to the views, started at
+ * @start if timing is on, in the statistics of ohm_fact_store_get_stats ().
+ * Called with the name of @fact locked.
+ */
+static void _ohm_fact_store_account_dispatch (OhmFactStore* self, OhmFact* fact, gint64 start) {
+	OhmFactStoreDispatchStats* stats;
+	guint64 elapsed;
+	guint bucket;
+
+	stats = &self->priv->dispatch_stats[OHM_FACT_STORE_SHARD (ohm_structure_get_qname (OHM_STRUCTURE (fact)))];
+	stats->dispatches++;
+	if (!self->priv->timing) {
+		return;
+	}
+
+	elapsed = (guint64) MAX (g_get_monotonic_time () - start, 0);
+	for (bucket = 0; bucket < OHM_FACT_STORE_STATS_BUCKETS - 1; bucket++) {
+		if (elapsed < (G_GUINT64_CONSTANT (1) << bucket)) {
+			break;
+		}
+	}
+
+	stats->time += elapsed;
+	stats->histogram[bucket]++;
+}
+
+
+static void _ohm_fact_store_listener_entry_unref (OhmFactStoreListenerEntry* self) {
+	if (!g_atomic_int_dec_and_test (&self->ref_count)) {
+		return;
+	}
+
+	if (self->destroy != NULL) {
+		self->destroy (self->user_data);
+	}
+	g_slice_free (OhmFactStoreListenerEntry, self);
+}
+
+
+/*
+ * Tell the listeners and the signal handlers about a change of @fact.
+ * Nothing is marshalled when nobody listens.
+ */
+static void _ohm_fact_store_emit (OhmFactStore* self, OhmFact* fact, OhmFactStoreEvent event, GQuark field, GValue *value) {
+	GPtrArray* listeners;
+	guint signal;
+	guint i;
+
+	if (self->priv->listeners != NULL) {
+		_ohm_fact_store_lock_shared (self);
+		listeners = self->priv->listeners;
+		if (listeners != NULL) {
+			g_ptr_array_ref (listeners);
+		}
+		_ohm_fact_store_unlock_shared (self);
+
+		for (i = 0; listeners != NULL && i < listeners->len; i++) {
+			OhmFactStoreListenerEntry* e = g_ptr_array_index (listeners, i);
+
+			e->func (self, fact, event, field, value, e->user_data);
+		}
+
+		if (listeners != NULL) {
+			g_ptr_array_unref (listeners);
+		}
+	}
+
+	switch (event) {
+	case OHM_FACT_STORE_EVENT_ADDED:
+		signal = ohm_fact_store_signals[OHM_FACT_STORE_INSERTED_SIGNAL];
+		break;
+	case OHM_FACT_STORE_EVENT_REMOVED:
+		signal = ohm_fact_store_signals[OHM_FACT_STORE_REMOVED_SIGNAL];
+		break;
+	case OHM_FACT_STORE_EVENT_UPDATED:
+		signal = ohm_fact_store_signals[OHM_FACT_STORE_UPDATED_SIGNAL];
+		break;
+	default:
+		return;
+	}
+
+	if (!g_signal_has_handler_pending (self, signal, 0, FALSE)) {
+		return;
+	}
+
+	if (event == OHM_FACT_STORE_EVENT_UPDATED) {
+		g_signal_emit (self, signal, 0, fact, field, value);
+	} else {
+		g_signal_emit (self, signal, 0, fact);
+	}
+}
+
+
+static void _ohm_fact_store_update_views (OhmFactStore* self, OhmFact* fact, OhmFactStoreEvent event, GQuark field, GValue *value) {
+	OhmFactStoreTransaction* t;
+	gint64 start;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (OHM_IS_FACT (fact));
+
+	start = self->priv->timing ? g_get_monotonic_time () : 0;
+	t = (OhmFactStoreTransaction*) g_queue_peek_head (self->transaction);
+
+	_ohm_fact_store_lock_interest (self, FALSE);
+	_ohm_fact_store_alpha_dispatch (_ohm_fact_store_alpha_find (self, self->priv->alpha, fact), fact, event, field, t);
+	_ohm_fact_store_unlock_interest (self, FALSE);
+
+	_ohm_fact_store_emit (self, fact, event, field, value);
+	_ohm_fact_store_account_dispatch (self, fact, start);
+}
+
+
+static guint _ohm_fact_store_cow_hash (gconstpointer v) {
+	const OhmFactStoreTransactionCOW* cow = v;
+
+	return g_direct_hash (cow->fact) ^ cow->field;
+}
+
+
+static gboolean _ohm_fact_store_cow_equal (gconstpointer a, gconstpointer b) {
+	const OhmFactStoreTransactionCOW* ca = a;
+	const OhmFactStoreTransactionCOW* cb = b;
+
+	return ca->fact == cb->fact && ca->field == cb->field;
+}
+
+
+/*
+ * Replay a committed transaction to the views. Updates are replayed
+ * with the current value of the field, so only the last update of each
+ * (fact, field) is worth replaying. A fact added within the transaction
+ * is reported as added only, and one added and removed again is not
+ * reported at all. Everything is decided in one pass over the
+ * modifications, in the order they were made.
+ */
+static void _ohm_fact_store_transaction_update_views(OhmFactStore *self, OhmFactStoreTransaction *t) {
+	GSList *it;
+	OhmFactStoreTransactionCOW *cow;
+	GHashTable *added, *updated;
+	gboolean *skip;
+	gpointer prev;
+	guint i, n;
+
+	t->modifications = g_slist_reverse(t->modifications);
+	n = t->priv->n_modifications;
+	skip = g_new0(gboolean, n);
+	added = g_hash_table_new(g_direct_hash, g_direct_equal);
+	updated = g_hash_table_new(_ohm_fact_store_cow_hash, _ohm_fact_store_cow_equal);
+
+	for (it = t->modifications, i = 0; it != NULL; it = it->next, i++) {
+		cow = (OhmFactStoreTransactionCOW *) it->data;
+
+		switch (cow->event) {
+		case OHM_FACT_STORE_EVENT_ADDED:
+			g_hash_table_insert(added, cow->fact, GUINT_TO_POINTER(i + 1));
+			break;
+		case OHM_FACT_STORE_EVENT_REMOVED:
+			prev = g_hash_table_lookup(added, cow->fact);
+			if (prev != NULL) {
+				skip[GPOINTER_TO_UINT(prev) - 1] = TRUE;
+				skip[i] = TRUE;
+				g_hash_table_remove(added, cow->fact);
+			}
+			break;
+		case OHM_FACT_STORE_EVENT_UPDATED:
+			if (g_hash_table_lookup(added, cow->fact) != NULL) {
+				skip[i] = TRUE;
+				break;
+			}
+			prev = g_hash_table_lookup(updated, cow);
+			if (prev != NULL)
+				skip[GPOINTER_TO_UINT(prev) - 1] = TRUE;
+			g_hash_table_insert(updated, cow, GUINT_TO_POINTER(i + 1));
+			break;
+		default:
+			break;
+		}
+	}
+
+	g_hash_table_destroy(added);
+	g_hash_table_destroy(updated);
+
+	for (it = t->modifications, i = 0; it != NULL; it = it->next, i++) {
+		cow = (OhmFactStoreTransactionCOW *) it->data;
+
+		if (skip[i])
+			continue;
+
+		switch (cow->event) {
+		case OHM_FACT_STORE_EVENT_ADDED:
+			_ohm_fact_store_update_views(self, cow->fact, OHM_FACT_STORE_EVENT_ADDED, 0, NULL);
+			break;
+		case OHM_FACT_STORE_EVENT_REMOVED:
+			_ohm_fact_store_update_views(self, cow->fact, OHM_FACT_STORE_EVENT_REMOVED, 0, NULL);
+			break;
+		case OHM_FACT_STORE_EVENT_UPDATED:
+			_ohm_fact_store_update_views(self, cow->fact, OHM_FACT_STORE_EVENT_UPDATED, cow->field,
+						     ohm_structure_qget(OHM_STRUCTURE(cow->fact), cow->field));
+			break;
+		default:
+			break;
+		}
+	}
+
+	g_free(skip);
+}
+
+static void _ohm_fact_store_update_transparent_views (OhmFactStore* self, OhmFact* fact, OhmFactStoreEvent event, GQuark field, GValue *value) {
+	gint64 start;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (OHM_IS_FACT (fact));
+
+	start = self->priv->timing ? g_get_monotonic_time () : 0;
+	_ohm_fact_store_lock_interest (self, FALSE);
+	_ohm_fact_store_alpha_dispatch (_ohm_fact_store_alpha_find (self, self->priv->transp_alpha, fact), fact, event, field, NULL);
+	_ohm_fact_store_unlock_interest (self, FALSE);
+	_ohm_fact_store_account_dispatch (self, fact, start);
+}
+
+
+static gboolean _ohm_fact_store_alpha_hashable (GValue* value) {
+	GType type;
+
+	type = G_VALUE_TYPE (value);
+	if (type == G_TYPE_STRING) {
+		return g_value_get_string (value) != NULL;
+	}
+
+	return type == G_TYPE_INT || type == G_TYPE_BOOLEAN
+		|| type == G_TYPE_CHAR || type == G_TYPE_POINTER;
+}
+
+
+static OhmFactStoreAlpha* _ohm_fact_store_alpha_new (OhmFactStore* store) {
+	OhmFactStoreAlpha* self;
+
+	self = g_slice_new0 (OhmFactStoreAlpha);
+	self->store = store;
+	self->tests = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+					     (GDestroyNotify) g_hash_table_destroy);
+
+	return self;
+}
+
+
+/*
+ * Intern the string constants of the compiled pattern @p in @self, or
+ * release them if @intern is %FALSE.
+ */
+static void _ohm_fact_store_alpha_intern (OhmFactStore* self, OhmPattern* p, gboolean intern) {
+	guint i;
+
+	if (p->priv->interned == intern) {
+		return;
+	}
+
+	for (i = 0; i < p->priv->n_compiled; i++) {
+		OhmPatternField* pf = &p->priv->compiled[i];
+
+		if (pf->kind != OHM_PATTERN_FIELD_STRING || pf->v.s == NULL) {
+			continue;
+		}
+
+		if (intern) {
+			pf->v.s = _ohm_fact_store_symbol_ref (self->priv->symbols, pf->v.s);
+		} else {
+			_ohm_fact_store_symbol_unref (self->priv->symbols, pf->v.s);
+			pf->v.s = g_value_get_string (pf->value);
+		}
+	}
+
+	p->priv->interned = intern;
+}
+
+
+static void _ohm_fact_store_alpha_forget (gpointer p, gpointer store) {
+	_ohm_fact_store_alpha_intern (store, OHM_PATTERN (p), FALSE);
+	OHM_PATTERN (p)->priv->alpha = NULL;
+}
+
+
+static void _ohm_fact_store_alpha_free (OhmFactStoreAlpha* self) {
+	GHashTableIter iter;
+	GHashTableIter viter;
+	gpointer values;
+	gpointer patterns;
+
+	g_slist_foreach (self->other, _ohm_fact_store_alpha_forget, self->store);
+	g_slist_free (self->other);
+
+	g_hash_table_iter_init (&iter, self->tests);
+	while (g_hash_table_iter_next (&iter, NULL, &values)) {
+		g_hash_table_iter_init (&viter, (GHashTable*) values);
+		while (g_hash_table_iter_next (&viter, NULL, &patterns)) {
+			g_slist_foreach ((GSList*) patterns, _ohm_fact_store_alpha_forget, self->store);
+			g_slist_free ((GSList*) patterns);
+		}
+	}
+	g_hash_table_destroy (self->tests);
+
+	if (self->ranges != NULL) {
+		g_hash_table_iter_init (&iter, self->ranges);
+		while (g_hash_table_iter_next (&iter, NULL, &patterns)) {
+			g_ptr_array_foreach ((GPtrArray*) patterns, _ohm_fact_store_alpha_forget, self->store);
+		}
+		g_hash_table_destroy (self->ranges);
+	}
+
+	g_slice_free (OhmFactStoreAlpha, self);
+}
+
+
+static OhmFactStoreAlpha* _ohm_fact_store_alpha_lookup (OhmFactStore* self, GHashTable* alphas, GQuark qname) {
+	OhmFactStoreAlpha* alpha;
+
+	alpha = g_hash_table_lookup (alphas, GUINT_TO_POINTER (qname));
+	if (alpha == NULL) {
+		alpha = _ohm_fact_store_alpha_new (self);
+		g_hash_table_insert (alphas, GUINT_TO_POINTER (qname), alpha);
+	}
+
+	return alpha;
+}
+
+
+/*
+ * File @p, which has no equality test, in the ranges of @self under its
+ * first comparison.
+ */
+static void _ohm_fact_store_alpha_add_range (OhmFactStoreAlpha* self, OhmPattern* p) {
+	GPtrArray* ranges;
+	GValue* low;
+	GQuark field;
+	guint i;
+
+	field = g_array_index (p->priv->ops, OhmPatternOpEntry, 0).field;
+
+	if (self->ranges == NULL) {
+		self->ranges = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+						      (GDestroyNotify) g_ptr_array_unref);
+	}
+
+	ranges = g_hash_table_lookup (self->ranges, GUINT_TO_POINTER (field));
+	if (ranges == NULL) {
+		ranges = g_ptr_array_new ();
+		g_hash_table_insert (self->ranges, GUINT_TO_POINTER (field), ranges);
+	}
+
+	low = _ohm_pattern_low_bound (p, field);
+	i = low != NULL ? _ohm_fact_store_alpha_ranges_reach (ranges, field, low) : 0;
+
+	g_ptr_array_add (ranges, NULL);
+	memmove (ranges->pdata + i + 1, ranges->pdata + i, (ranges->len - 1 - i) * sizeof (gpointer));
+	ranges->pdata[i] = p;
+
+	p->priv->alpha_field = field;
+	p->priv->alpha_ranged = TRUE;
+}
+
+
+/*
+ * File @p in @self. The test is taken from a hashable field of the
+ * pattern, preferring a field already tested in this network so that
+ * dispatching a fact needs as few lookups as possible.
+ */
+static void _ohm_fact_store_alpha_add (OhmFactStoreAlpha* self, OhmPattern* p) {
+	guint i;
+	GQuark field;
+	GHashTable* values;
+	GValue* v;
+	GValue* key;
+	GSList* patterns;
+
+	g_return_if_fail (p->priv->alpha == NULL);
+
+	ohm_pattern_compile (p);
+	_ohm_fact_store_alpha_intern (self->store, p, TRUE);
+	self->store->priv->n_patterns++;
+
+	field = 0;
+	if (p->priv->_fact == NULL) {
+		for (i = 0; i < OHM_STRUCTURE (p)->priv->n_fields; i++) {
+			GQuark q = OHM_STRUCTURE (p)->priv->entries[i].field;
+
+			if (!_ohm_pattern_tests_equal (p, q) ||
+			    !_ohm_fact_store_alpha_hashable (OHM_STRUCTURE (p)->priv->entries[i].value)) {
+				continue;
+			}
+
+			if (field == 0) {
+				field = q;
+			}
+
+			if (g_hash_table_lookup (self->tests, GUINT_TO_POINTER (q)) != NULL) {
+				field = q;
+				break;
+			}
+		}
+	}
+
+	p->priv->alpha = self;
+	p->priv->alpha_field = field;
+	p->priv->alpha_ranged = FALSE;
+
+	if (field == 0 && p->priv->_fact == NULL && p->priv->ops != NULL && p->priv->ops->len > 0) {
+		_ohm_fact_store_alpha_add_range (self, p);
+		return;
+	}
+
+	if (field == 0) {
+		self->other = g_slist_prepend (self->other, p);
+		return;
+	}
+
+	values = g_hash_table_lookup (self->tests, GUINT_TO_POINTER (field));
+	if (values == NULL) {
+		values = g_hash_table_new_full (_ohm_value_hash, _ohm_value_equal,
+						_ohm_value_unset_and_free, NULL);
+		g_hash_table_insert (self->tests, GUINT_TO_POINTER (field), values);
+	}
+
+	v = ohm_structure_qget (OHM_STRUCTURE (p), field);
+	if (g_hash_table_lookup_extended (values, v, (gpointer*) &key, (gpointer*) &patterns)) {
+		g_hash_table_steal (values, key);
+	} else {
+		key = g_new0 (GValue, 1);
+		g_value_init (key, G_VALUE_TYPE (v));
+		g_value_copy (v, key);
+		patterns = NULL;
+	}
+
+	g_hash_table_insert (values, key, g_slist_prepend (patterns, p));
+}
+
+
+static void _ohm_fact_store_alpha_remove (OhmPattern* p) {
+	OhmFactStoreAlpha* self;
+	GHashTable* values;
+	GValue* key;
+	GSList* patterns;
+
+	self = p->priv->alpha;
+	g_return_if_fail (self != NULL);
+
+	_ohm_fact_store_alpha_intern (self->store, p, FALSE);
+	self->store->priv->n_patterns--;
+	p->priv->alpha = NULL;
+
+	if (p->priv->alpha_field == 0) {
+		self->other = g_slist_remove (self->other, p);
+		return;
+	}
+
+	if (p->priv->alpha_ranged) {
+		GPtrArray* ranges;
+
+		ranges = g_hash_table_lookup (self->ranges, GUINT_TO_POINTER (p->priv->alpha_field));
+		g_return_if_fail (ranges != NULL);
+
+		g_ptr_array_remove (ranges, p);
+		if (ranges->len == 0) {
+			g_hash_table_remove (self->ranges, GUINT_TO_POINTER (p->priv->alpha_field));
+		}
+		return;
+	}
+
+	values = g_hash_table_lookup (self->tests, GUINT_TO_POINTER (p->priv->alpha_field));
+	g_return_if_fail (values != NULL);
+
+	if (!g_hash_table_lookup_extended (values, ohm_structure_qget (OHM_STRUCTURE (p), p->priv->alpha_field),
+					   (gpointer*) &key, (gpointer*) &patterns)) {
+		g_return_if_reached ();
+	}
+
+	g_hash_table_steal (values, key);
+	patterns = g_slist_remove (patterns, p);
+
+	if (patterns != NULL) {
+		g_hash_table_insert (values, key, patterns);
+	} else {
+		_ohm_value_unset_and_free (key);
+		if (g_hash_table_size (values) == 0) {
+			g_hash_table_remove (self->tests, GUINT_TO_POINTER (p->priv->alpha_field));
+		}
+	}
+}
+
+
+static OhmFactStoreFacts* _ohm_fact_store_facts_new (void) {
+	OhmFactStoreFacts* self;
+
+	self = g_slice_new0 (OhmFactStoreFacts);
+	self->index = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	return self;
+}
+
+
+static void _ohm_fact_store_facts_changed (OhmFactStoreFacts* self) {
+	static volatile gint version = 0;
+
+	self->version = (guint) g_atomic_int_add (&version, 1) + 1;
+}
+
+
+static void _ohm_fact_store_facts_free (OhmFactStoreFacts* self) {
+	if (self->field_indexes != NULL) {
+		g_hash_table_destroy (self->field_indexes);
+	}
+
+	if (self->ordered_indexes != NULL) {
+		g_hash_table_destroy (self->ordered_indexes);
+	}
+
+	g_list_foreach (self->facts, (GFunc) g_object_unref, NULL);
+	g_list_free (self->facts);
+	g_hash_table_destroy (self->index);
+
+	g_slice_free (OhmFactStoreFacts, self);
+}
+
+
+static OhmFactStoreLocks* _ohm_fact_store_locks_new (void) {
+	OhmFactStoreLocks* self;
+	guint i;
+
+	self = g_slice_new0 (OhmFactStoreLocks);
+	for (i = 0; i < OHM_FACT_STORE_N_SHARDS; i++) {
+		g_rec_mutex_init (&self->shards[i]);
+	}
+	g_rw_lock_init (&self->names);
+	g_rw_lock_init (&self->interest);
+	g_mutex_init (&self->shared);
+
+	return self;
+}
+
+
+static void _ohm_fact_store_locks_free (OhmFactStoreLocks* self) {
+	guint i;
+
+	for (i = 0; i < OHM_FACT_STORE_N_SHARDS; i++) {
+		g_rec_mutex_clear (&self->shards[i]);
+	}
+	g_rw_lock_clear (&self->names);
+	g_rw_lock_clear (&self->interest);
+	g_mutex_clear (&self->shared);
+
+	g_slice_free (OhmFactStoreLocks, self);
+}
+
+
+/*
+ * The following do nothing unless the store is thread-safe.
+ */
+static void _ohm_fact_store_lock_name (OhmFactStore* self, GQuark qname) {
+	if (self->priv->locks != NULL) {
+		g_rec_mutex_lock (&self->priv->locks->shards[OHM_FACT_STORE_SHARD (qname)]);
+	}
+}
+
+
+static void _ohm_fact_store_unlock_name (OhmFactStore* self, GQuark qname) {
+	if (self->priv->locks != NULL) {
+		g_rec_mutex_unlock (&self->priv->locks->shards[OHM_FACT_STORE_SHARD (qname)]);
+	}
+}
+
+
+static void _ohm_fact_store_lock_shards (OhmFactStore* self, guint32 shards) {
+	guint i;
+
+	if (self->priv->locks == NULL) {
+		return;
+	}
+
+	for (i = 0; i < OHM_FACT_STORE_N_SHARDS; i++) {
+		if (shards & (1u << i)) {
+			g_rec_mutex_lock (&self->priv->locks->shards[i]);
+		}
+	}
+}
+
+
+static void _ohm_fact_store_unlock_shards (OhmFactStore* self, guint32 shards) {
+	guint i;
+
+	if (self->priv->locks == NULL) {
+		return;
+	}
+
+	for (i = OHM_FACT_STORE_N_SHARDS; i > 0; i--) {
+		if (shards & (1u << (i - 1))) {
+			g_rec_mutex_unlock (&self->priv->locks->shards[i - 1]);
+		}
+	}
+}
+
+
+#define OHM_FACT_STORE_ALL_SHARDS ((guint32) ((1ull << OHM_FACT_STORE_N_SHARDS) - 1))
+
+
+static void _ohm_fact_store_lock_interest (OhmFactStore* self, gboolean write) {
+	if (self->priv->locks == NULL) {
+		return;
+	}
+
+	if (write) {
+		g_rw_lock_writer_lock (&self->priv->locks->interest);
+	} else {
+		g_rw_lock_reader_lock (&self->priv->locks->interest);
+	}
+}
+
+
+static void _ohm_fact_store_unlock_interest (OhmFactStore* self, gboolean write) {
+	if (self->priv->locks == NULL) {
+		return;
+	}
+
+	if (write) {
+		g_rw_lock_writer_unlock (&self->priv->locks->interest);
+	} else {
+		g_rw_lock_reader_unlock (&self->priv->locks->interest);
+	}
+}
+
+
+static void _ohm_fact_store_lock_shared (OhmFactStore* self) {
+	if (self->priv->locks != NULL) {
+		g_mutex_lock (&self->priv->locks->shared);
+	}
+}
+
+
+static void _ohm_fact_store_unlock_shared (OhmFactStore* self) {
+	if (self->priv->locks != NULL) {
+		g_mutex_unlock (&self->priv->locks->shared);
+	}
+}
+
+
+static OhmFactStoreFacts* _ohm_fact_store_lookup_facts (OhmFactStore* self, GQuark qname) {
+	OhmFactStoreFacts* facts;
+
+	if (self->priv->locks == NULL) {
+		return (OhmFactStoreFacts*) g_hash_table_lookup (self->priv->facts, GUINT_TO_POINTER (qname));
+	}
+
+	g_rw_lock_reader_lock (&self->priv->locks->names);
+	facts = (OhmFactStoreFacts*) g_hash_table_lookup (self->priv->facts, GUINT_TO_POINTER (qname));
+	g_rw_lock_reader_unlock (&self->priv->locks->names);
+
+	return facts;
+}
+
+
+/*
+ * Get the facts named @qname, creating the entry if needed. The caller
+ * holds the shard of @qname, so nobody else can create it meanwhile.
+ */
+static OhmFactStoreFacts* _ohm_fact_store_ensure_facts (OhmFactStore* self, GQuark qname) {
+	OhmFactStoreFacts* facts;
+
+	facts = _ohm_fact_store_lookup_facts (self, qname);
+	if (facts != NULL) {
+		return facts;
+	}
+
+	facts = _ohm_fact_store_facts_new ();
+
+	if (self->priv->locks != NULL) {
+		g_rw_lock_writer_lock (&self->priv->locks->names);
+	}
+	g_hash_table_insert (self->priv->facts, GUINT_TO_POINTER (qname), facts);
+	if (self->priv->locks != NULL) {
+		g_rw_lock_writer_unlock (&self->priv->locks->names);
+	}
+
+	return facts;
+}
+
+
+/*
+ * Free the entry of the facts named @qname once it has neither facts
+ * nor indexes. The caller holds the shard of @qname.
+ */
+static void _ohm_fact_store_forget_facts (OhmFactStore* self, GQuark qname, OhmFactStoreFacts* facts) {
+	if (facts->facts != NULL || facts->field_indexes != NULL || facts->ordered_indexes != NULL) {
+		return;
+	}
+
+	if (self->priv->locks != NULL) {
+		g_rw_lock_writer_lock (&self->priv->locks->names);
+	}
+	g_hash_table_remove (self->priv->facts, GUINT_TO_POINTER (qname));
+	if (self->priv->locks != NULL) {
+		g_rw_lock_writer_unlock (&self->priv->locks->names);
+	}
+}
+
+
+static OhmFactStoreSymbols* _ohm_fact_store_symbols_new (void) {
+	OhmFactStoreSymbols* self;
+
+	self = g_slice_new0 (OhmFactStoreSymbols);
+	self->ref_count = 1;
+	g_mutex_init (&self->lock);
+	self->table = g_hash_table_new (g_str_hash, g_str_equal);
+
+	return self;
+}
+
+
+static OhmFactStoreSymbols* _ohm_fact_store_symbols_ref (OhmFactStoreSymbols* self) {
+	g_atomic_int_inc (&self->ref_count);
+
+	return self;
+}
+
+
+static void _ohm_fact_store_symbols_unref (OhmFactStoreSymbols* self) {
+	GHashTableIter iter;
+	gpointer sym;
+
+	if (!g_atomic_int_dec_and_test (&self->ref_count)) {
+		return;
+	}
+
+	g_hash_table_iter_init (&iter, self->table);
+	while (g_hash_table_iter_next (&iter, &sym, NULL)) {
+		g_free (sym);
+	}
+	g_hash_table_destroy (self->table);
+	g_mutex_clear (&self->lock);
+
+	g_slice_free (OhmFactStoreSymbols, self);
+}
+
+
+/*
+ * Get the canonical copy of @str in the symbol table @self, adding a
+ * reference to it.
+ */
+static const gchar* _ohm_fact_store_symbol_ref (OhmFactStoreSymbols* self, const gchar* str) {
+	gpointer sym;
+	gpointer refs;
+
+	g_mutex_lock (&self->lock);
+
+	if (g_hash_table_lookup_extended (self->table, str, &sym, &refs)) {
+		g_hash_table_insert (self->table, sym, GUINT_TO_POINTER (GPOINTER_TO_UINT (refs) + 1));
+	} else {
+		sym = g_strdup (str);
+		g_hash_table_insert (self->table, sym, GUINT_TO_POINTER (1));
+		self->stats.symbols++;
+		self->stats.bytes += strlen (sym) + 1;
+	}
+
+	self->stats.refs++;
+
+	g_mutex_unlock (&self->lock);
+
+	return sym;
+}
+
+
+static void _ohm_fact_store_symbol_unref (OhmFactStoreSymbols* self, const gchar* sym) {
+	guint refs;
+
+	g_mutex_lock (&self->lock);
+
+	refs = GPOINTER_TO_UINT (g_hash_table_lookup (self->table, sym));
+	if (refs == 0) {
+		g_mutex_unlock (&self->lock);
+		g_return_if_fail (refs > 0);
+	}
+
+	self->stats.refs--;
+
+	if (refs > 1) {
+		g_hash_table_insert (self->table, (gpointer) sym, GUINT_TO_POINTER (refs - 1));
+	} else {
+		g_hash_table_remove (self->table, sym);
+		self->stats.symbols--;
+		self->stats.bytes -= strlen (sym) + 1;
+		g_free ((gpointer) sym);
+	}
+
+	g_mutex_unlock (&self->lock);
+}
+
+
+/*
+ * Replace the string values of @fact by symbols of @self when it enters
+ * the store. The fact then holds the symbols, and the table, until its
+ * fields are set again or it goes away, wherever it is by then.
+ */
+static void _ohm_fact_store_intern_fact (OhmFactStore* self, OhmFact* fact) {
+	OhmFactStoreSymbols* old_symbols;
+	OhmStructurePrivate* priv;
+	guint i;
+
+	old_symbols = fact->priv->symbols;
+	priv = OHM_STRUCTURE (fact)->priv;
+	for (i = 0; i < priv->n_fields; i++) {
+		OhmStructureField* entry = &priv->entries[i];
+		const gchar* old_sym;
+		const gchar* str;
+
+		old_sym = entry->symbol;
+		entry->symbol = NULL;
+
+		if (G_VALUE_HOLDS_STRING (entry->value) && (str = g_value_get_string (entry->value)) != NULL) {
+			entry->symbol = _ohm_fact_store_symbol_ref (self->priv->symbols, str);
+			g_value_set_static_string (entry->value, entry->symbol);
+		}
+
+		if (old_sym != NULL) {
+			_ohm_fact_store_symbol_unref (old_symbols, old_sym);
+		}
+	}
+
+	if (old_symbols != self->priv->symbols) {
+		fact->priv->symbols = _ohm_fact_store_symbols_ref (self->priv->symbols);
+		if (old_symbols != NULL) {
+			_ohm_fact_store_symbols_unref (old_symbols);
+		}
+	}
+}
+
+
+static void _ohm_value_unset_and_free (gpointer p) {
+	g_value_unset ((GValue*) p);
+	g_free (p);
+}
+
+
+static OhmFactStoreFieldIndex* _ohm_fact_store_field_index_new (GQuark field) {
+	OhmFactStoreFieldIndex* self;
+
+	self = g_slice_new0 (OhmFactStoreFieldIndex);
+	self->field = field;
+	self->values = g_hash_table_new_full (_ohm_value_hash, _ohm_value_equal,
+					      _ohm_value_unset_and_free,
+					      (GDestroyNotify) g_hash_table_destroy);
+
+	return self;
+}
+
+
+static void _ohm_fact_store_field_index_free (OhmFactStoreFieldIndex* self) {
+	g_hash_table_destroy (self->values);
+
+	g_slice_free (OhmFactStoreFieldIndex, self);
+}
+
+
+static void _ohm_fact_store_field_index_add (OhmFactStoreFieldIndex* self, OhmFact* fact) {
+	GValue* value;
+	GHashTable* set;
+
+	value = ohm_structure_qget (OHM_STRUCTURE (fact), self->field);
+	if (value == NULL) {
+		return;
+	}
+
+	set = g_hash_table_lookup (self->values, value);
+	if (set == NULL) {
+		GValue* key;
+
+		key = g_new0 (GValue, 1);
+		g_value_init (key, G_VALUE_TYPE (value));
+		g_value_copy (value, key);
+
+		set = g_hash_table_new (g_direct_hash, g_direct_equal);
+		g_hash_table_insert (self->values, key, set);
+	}
+
+	g_hash_table_insert (set, fact, fact);
+}
+
+
+static void _ohm_fact_store_field_index_remove (OhmFactStoreFieldIndex* self, OhmFact* fact) {
+	GValue* value;
+	GHashTable* set;
+
+	value = ohm_structure_qget (OHM_STRUCTURE (fact), self->field);
+	if (value == NULL) {
+		return;
+	}
+
+	set = g_hash_table_lookup (self->values, value);
+	if (set == NULL) {
+		return;
+	}
+
+	g_hash_table_remove (set, fact);
+
+	if (g_hash_table_size (set) == 0) {
+		g_hash_table_remove (self->values, value);
+	}
+}
+
+
+static OhmFactStoreSkipNode* _ohm_fact_store_skip_node_new (guint levels) {
+	return g_malloc0 (sizeof (OhmFactStoreSkipNode) + (levels - 1) * sizeof (OhmFactStoreSkipNode*));
+}
+
+
+static void _ohm_fact_store_skip_node_free (OhmFactStoreSkipNode* node) {
+	if (G_IS_VALUE (&node->value)) {
+		g_value_unset (&node->value);
+	}
+	g_free (node);
+}
+
+
+static OhmFactStoreOrderedIndex* _ohm_fact_store_ordered_index_new (GQuark field) {
+	OhmFactStoreOrderedIndex* self;
+
+	self = g_slice_new0 (OhmFactStoreOrderedIndex);
+	self->field = field;
+	self->head = _ohm_fact_store_skip_node_new (OHM_FACT_STORE_SKIP_LEVELS);
+	self->level = 1;
+	self->seed = 0x9e3779b9u ^ field;
+
+	return self;
+}
+
+
+static void _ohm_fact_store_ordered_index_free (OhmFactStoreOrderedIndex* self) {
+	OhmFactStoreSkipNode* node;
+	OhmFactStoreSkipNode* next;
+
+	for (node = self->head; node != NULL; node = next) {
+		next = node->next[0];
+		_ohm_fact_store_skip_node_free (node);
+	}
+
+	g_slice_free (OhmFactStoreOrderedIndex, self);
+}
+
+
+/*
+ * The order of the facts in the skip list: by value, then by address.
+ */
+static gint _ohm_fact_store_skip_node_order (OhmFactStoreSkipNode* node, const GValue* value, OhmFact* fact) {
+	gint c;
+
+	c = _ohm_value_order (&node->value, value);
+	if (c != 0) {
+		return c;
+	}
+
+	return node->fact < fact ? -1 : (node->fact > fact ? 1 : 0);
+}
+
+
+/*
+ * Fill @update with the last node before (@value, @fact) at each level.
+ */
+static void _ohm_fact_store_ordered_index_find (OhmFactStoreOrderedIndex* self, const GValue* value, OhmFact* fact,
+						OhmFactStoreSkipNode** update) {
+	OhmFactStoreSkipNode* x;
+	gint l;
+
+	x = self->head;
+	for (l = self->level - 1; l >= 0; l--) {
+		while (x->next[l] != NULL && _ohm_fact_store_skip_node_order (x->next[l], value, fact) < 0) {
+			x = x->next[l];
+		}
+		update[l] = x;
+	}
+}
+
+
+static void _ohm_fact_store_ordered_index_add (OhmFactStoreOrderedIndex* self, OhmFact* fact) {
+	OhmFactStoreSkipNode* update[OHM_FACT_STORE_SKIP_LEVELS];
+	OhmFactStoreSkipNode* node;
+	GValue* value;
+	guint levels;
+	guint l;
+
+	value = ohm_structure_qget (OHM_STRUCTURE (fact), self->field);
+	if (value == NULL || !_ohm_value_orderable (G_VALUE_TYPE (value))) {
+		return;
+	}
+
+	_ohm_fact_store_ordered_index_find (self, value, fact, update);
+	node = update[0]->next[0];
+	if (node != NULL && _ohm_fact_store_skip_node_order (node, value, fact) == 0) {
+		return;
+	}
+
+	/* xorshift, two bits per level */
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 17;
+	self->seed ^= self->seed << 5;
+	for (levels = 1; levels < OHM_FACT_STORE_SKIP_LEVELS && (self->seed >> (2 * levels - 2) & 3) == 0; levels++)
+		;
+
+	for (l = self->level; l < levels; l++) {
+		update[l] = self->head;
+	}
+	self->level = MAX (self->level, levels);
+
+	node = _ohm_fact_store_skip_node_new (levels);
+	g_value_init (&node->value, G_VALUE_TYPE (value));
+	g_value_copy (value, &node->value);
+	node->fact = fact;
+
+	for (l = 0; l < levels; l++) {
+		node->next[l] = update[l]->next[l];
+		update[l]->next[l] = node;
+	}
+	self->length++;
+}
+
+
+static void _ohm_fact_store_ordered_index_remove (OhmFactStoreOrderedIndex* self, OhmFact* fact) {
+	OhmFactStoreSkipNode* update[OHM_FACT_STORE_SKIP_LEVELS];
+	OhmFactStoreSkipNode* node;
+	GValue* value;
+	guint l;
+
+	value = ohm_structure_qget (OHM_STRUCTURE (fact), self->field);
+	if (value == NULL || !_ohm_value_orderable (G_VALUE_TYPE (value))) {
+		return;
+	}
+
+	_ohm_fact_store_ordered_index_find (self, value, fact, update);
+	node = update[0]->next[0];
+	if (node == NULL || _ohm_fact_store_skip_node_order (node, value, fact) != 0) {
+		return;
+	}
+
+	for (l = 0; l < self->level && update[l]->next[l] == node; l++) {
+		update[l]->next[l] = node->next[l];
+	}
+	_ohm_fact_store_skip_node_free (node);
+
+	while (self->level > 1 && self->head->next[self->level - 1] == NULL) {
+		self->level--;
+	}
+	self->length--;
+}
+
+
+/*
+ * The first node of @self with a value of @type, not before @low if
+ * @low is not %NULL.
+ */
+static OhmFactStoreSkipNode* _ohm_fact_store_ordered_index_seek (OhmFactStoreOrderedIndex* self, GType type, const GValue* low) {
+	OhmFactStoreSkipNode* x;
+	gint l;
+
+	x = self->head;
+	for (l = self->level - 1; l >= 0; l--) {
+		while (x->next[l] != NULL) {
+			GValue* v = &x->next[l]->value;
+
+			if (G_VALUE_TYPE (v) > type ||
+			    (G_VALUE_TYPE (v) == type && (low == NULL || _ohm_value_order (v, low) >= 0))) {
+				break;
+			}
+			x = x->next[l];
+		}
+	}
+
+	return x->next[0];
+}
+
+
+static void _ohm_fact_store_facts_index_all (OhmFactStoreFacts* self, OhmFact* fact, gboolean add) {
+	GHashTableIter it;
+	gpointer idx;
+
+	if (self->field_indexes != NULL) {
+		g_hash_table_iter_init (&it, self->field_indexes);
+		while (g_hash_table_iter_next (&it, NULL, &idx)) {
+			if (add) {
+				_ohm_fact_store_field_index_add ((OhmFactStoreFieldIndex*) idx, fact);
+			} else {
+				_ohm_fact_store_field_index_remove ((OhmFactStoreFieldIndex*) idx, fact);
+			}
+		}
+	}
+
+	if (self->ordered_indexes != NULL) {
+		g_hash_table_iter_init (&it, self->ordered_indexes);
+		while (g_hash_table_iter_next (&it, NULL, &idx)) {
+			if (add) {
+				_ohm_fact_store_ordered_index_add ((OhmFactStoreOrderedIndex*) idx, fact);
+			} else {
+				_ohm_fact_store_ordered_index_remove ((OhmFactStoreOrderedIndex*) idx, fact);
+			}
+		}
+	}
+}
+
+
+/*
+ * Update the indexes on @field of the facts named like @fact, before
+ * (@add unset) and after (@add set) a change of the field.
+ */
+static void _ohm_fact_store_reindex_field (OhmFactStore* self, OhmFact* fact, GQuark field, gboolean add) {
+	OhmFactStoreFacts* facts;
+	OhmFactStoreFieldIndex* idx;
+	OhmFactStoreOrderedIndex* ordered;
+
+	facts = _ohm_fact_store_lookup_facts (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)));
+	if (facts == NULL) {
+		return;
+	}
+
+	idx = facts->field_indexes != NULL ? g_hash_table_lookup (facts->field_indexes, GUINT_TO_POINTER (field)) : NULL;
+	if (idx != NULL) {
+		if (add) {
+			_ohm_fact_store_field_index_add (idx, fact);
+		} else {
+			_ohm_fact_store_field_index_remove (idx, fact);
+		}
+	}
+
+	ordered = facts->ordered_indexes != NULL ? g_hash_table_lookup (facts->ordered_indexes, GUINT_TO_POINTER (field)) : NULL;
+	if (ordered != NULL) {
+		if (add) {
+			_ohm_fact_store_ordered_index_add (ordered, fact);
+		} else {
+			_ohm_fact_store_ordered_index_remove (ordered, fact);
+		}
+	}
+}
+
+
+static void _ohm_fact_store_index_field (OhmFactStore* self, OhmFact* fact, GQuark field) {
+	_ohm_fact_store_reindex_field (self, fact, field, TRUE);
+}
+
+
+static void _ohm_fact_store_unindex_field (OhmFactStore* self, OhmFact* fact, GQuark field) {
+	_ohm_fact_store_reindex_field (self, fact, field, FALSE);
+}
+
+
+static gboolean ohm_fact_store_insert_internal (OhmFactStore* self, OhmFact* fact) {
+	OhmFactStoreFacts* facts;
+	GQuark qname;
+	guint i;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (OHM_IS_FACT (fact), FALSE);
+
+	if (ohm_fact_get_fact_store (fact) != NULL) {
+		return FALSE;
+	}
+
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (fact));
+	facts = _ohm_fact_store_ensure_facts (self, qname);
+
+	if (g_hash_table_lookup (facts->index, fact) != NULL) {
+		return FALSE;
+	}
+
+	ohm_fact_set_fact_store (fact, self);
+	_ohm_fact_store_intern_fact (self, fact);
+	_ohm_fact_store_thaw (fact);
+
+	/* the fields may have changed while the fact was out of the store */
+	for (i = 0; i < OHM_STRUCTURE (fact)->priv->n_fields; i++) {
+		OHM_STRUCTURE (fact)->priv->entries[i].stamp = ++fact->priv->clock;
+	}
+	_ohm_fact_store_facts_changed (facts);
+
+	facts->facts = g_list_prepend (facts->facts, g_object_ref (fact));
+	g_hash_table_insert (facts->index, fact, facts->facts);
+	_ohm_fact_store_facts_index_all (facts, fact, TRUE);
+	_ohm_fact_store_schedule_expiry (self, fact);
+
+	return TRUE;
+}
+
+
+/**
+ * ohm_fact_store_insert:
+ * @self: a #OhmFactStore
+ * @fact: the fact to be added to the @self fact-store. (not %NULL)
+ *
+ * Insert a @fact to the @self fact-store. The @fact will be
+ * referenced by the fact-store and can hence be unrefed by the
+ * caller. The @fact will be unrefed when it is removed or the
+ * #OhmFactStore is destroyed.
+ *
+ * The insertion is reversible if there is a transaction on-going and it
+ * is rolled back (for back-tracking purpose, for instance). In that
+ * case, the @fact is referenced by the transaction itself, and stay
+ * alive until the transaction ends.
+ *
+ * The views that match the @fact will get notified, unless the
+ * transaction is canceled in between.
+ *
+ * Returns: %TRUE on success.
+ **/
+gboolean ohm_fact_store_insert (OhmFactStore* self, OhmFact* fact) {
+	GQuark qname;
+	gboolean inserted;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (OHM_IS_FACT (fact), FALSE);
+
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (fact));
+	_ohm_fact_store_lock_name (self, qname);
+
+	inserted = ohm_fact_store_insert_internal (self, fact);
+	if (inserted) {
+		OhmFactStoreTransaction* t;
+
+		if (self->priv->batch == NULL || self->priv->batch->qname != qname) {
+			_ohm_fact_store_lock_shared (self);
+			if (g_slist_find (self->priv->known_facts_qname, GINT_TO_POINTER (qname)) == NULL) {
+				self->priv->known_facts_qname = g_slist_prepend (self->priv->known_facts_qname,
+										 GINT_TO_POINTER (qname));
+			}
+			_ohm_fact_store_unlock_shared (self);
+		}
+
+		t = (OhmFactStoreTransaction*) g_queue_peek_head (self->transaction);
+		if (t != NULL) {
+			_ohm_fact_store_transaction_log (t, ohm_fact_store_transaction_cow_new (fact, OHM_FACT_STORE_EVENT_ADDED, 0, NULL));
+		}
+		_ohm_fact_store_touch (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)), fact);
+
+		_ohm_fact_store_update_transparent_views (self, fact, OHM_FACT_STORE_EVENT_ADDED, 0, NULL);
+	        
+		if (!_ohm_fact_store_transaction_rolledback(self) &&
+		    !_ohm_fact_store_transaction_active(self))
+			_ohm_fact_store_update_views (self, fact, OHM_FACT_STORE_EVENT_ADDED, 0, NULL);
+
+		_ohm_fact_store_journal_log (self, OHM_FACT_STORE_OP_INSERT, fact, 0);
+	}
+
+	_ohm_fact_store_unlock_name (self, qname);
+
+	return inserted;
+}
+
+
+static gboolean ohm_fact_store_remove_internal (OhmFactStore* self, OhmFact* fact) {
+	OhmFactStoreFacts* facts;
+	GList* found;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (OHM_IS_FACT (fact), FALSE);
+
+	facts = _ohm_fact_store_lookup_facts (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)));
+	if (facts == NULL) {
+		return FALSE;
+	}
+
+	found = g_hash_table_lookup (facts->index, fact);
+
+	if (found != NULL) {
+		_ohm_fact_store_facts_index_all (facts, fact, FALSE);
+		g_hash_table_remove (facts->index, fact);
+		facts->facts = g_list_delete_link (facts->facts, found);
+		_ohm_fact_store_facts_changed (facts);
+		_ohm_fact_store_forget_facts (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)), facts);
+		_ohm_fact_store_thaw (fact);
+		_ohm_fact_store_cancel_expiry (self, fact);
+		ohm_fact_set_fact_store (fact, NULL);
+		g_object_unref (G_OBJECT (fact));
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+/**
+ * ohm_fact_store_remove:
+ * @self: a #OhmFactStore
+ * @fact: the fact to be removed from @self fact-store. (not %NULL)
+ *
+ * Remove a @fact from the @self fact-store. The @fact will be
+ * un-referenced.
+ *
+ * The removal is reversible if there is a transaction on-going and it
+ * is rolled back (for back-tracking purpose, for instance). In that
+ * case, the @fact is referenced by the transaction itself, and stay
+ * alive until the transaction ends.
+ *
+ * The views that match the @fact will be notified, unless the
+ * transaction is canceled in between.
+ **/
+void ohm_fact_store_remove (OhmFactStore* self, OhmFact* fact) {
+	OhmFact* state;
+	GQuark qname;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (OHM_IS_FACT (fact));
+
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (fact));
+	_ohm_fact_store_lock_name (self, qname);
+
+	/* within a transaction, the log keeps the state the fact leaves
+	   the store in, for the images: it may change out of the store */
+	state = NULL;
+	if (!g_queue_is_empty (self->transaction) && fact->priv->_fact_store == self) {
+		if (fact->priv->frozen != NULL) {
+			state = g_object_ref (fact->priv->frozen);
+		} else {
+			state = _ohm_fact_store_freeze_fact (fact);
+		}
+	}
+
+	if (ohm_fact_store_remove_internal (self, fact)) {
+		OhmFactStoreTransaction* t;
+
+		t = (OhmFactStoreTransaction*) g_queue_peek_head (self->transaction);
+		if (t != NULL) {
+			GValue* value;
+
+			value = g_new0 (GValue, 1);
+			g_value_init (value, OHM_TYPE_FACT);
+			g_value_take_object (value, state);
+			state = NULL;
+			_ohm_fact_store_transaction_log (t, ohm_fact_store_transaction_cow_new (fact, OHM_FACT_STORE_EVENT_REMOVED, 0, value));
+		}
+		_ohm_fact_store_touch (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)), fact);
+
+		_ohm_fact_store_update_transparent_views (self, fact, OHM_FACT_STORE_EVENT_REMOVED, 0, NULL);
+
+		if (!_ohm_fact_store_transaction_rolledback(self) &&
+		    !_ohm_fact_store_transaction_active(self))
+			_ohm_fact_store_update_views (self, fact, OHM_FACT_STORE_EVENT_REMOVED, 0, NULL);
+
+		/* last, the journal may hold the last reference */
+		_ohm_fact_store_journal_log (self, OHM_FACT_STORE_OP_REMOVE, fact, 0);
+	}
+
+	if (state != NULL) {
+		g_object_unref (state);
+	}
+
+	_ohm_fact_store_unlock_name (self, qname);
+}
+
+
+/**
+ * ohm_fact_store_update:
+ * @self: a #OhmFactStore
+ * @fact: the fact to be updated. (not %NULL)
+ *
+ * <note>
+ * <para>
+ * This function is used internally. You should use ohm_fact_set ()
+ * functions if you modify a fact.
+ * </para>
+ * </note>
+ *
+ * Update a @fact from the @self fact-store.
+ *
+ * The update is reversible if there is a transaction on-going and it
+ * is rolled back (for back-tracking purpose, for instance). In that
+ * case, the modification is saved by the transaction.
+ *
+ * The views that match the @fact will be notified, unless the
+ * transaction is canceled in between.
+ **/
+void ohm_fact_store_update (OhmFactStore* self, OhmFact* fact, GQuark field, GValue* value) {
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (OHM_IS_FACT (fact));
+
+	_ohm_fact_store_lock_name (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)));
+
+	_ohm_fact_store_update_transparent_views (self, fact, OHM_FACT_STORE_EVENT_UPDATED, field, value);
+
+	if (!_ohm_fact_store_transaction_rolledback(self) &&
+	    !_ohm_fact_store_transaction_active(self))
+		_ohm_fact_store_update_views (self, fact, OHM_FACT_STORE_EVENT_UPDATED, field, value);
+
+	_ohm_fact_store_unlock_name (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)));
+}
+
+
+/**
+ * ohm_fact_store_get_facts_by_quark:
+ * @self: a #OhmFactStore
+ * @qname: #GQuark name of the facts to list
+ *
+ * This function is used mostly for debugging purposes. Better use a
+ * #OhmFactStoreView, for example, although you might need it.
+ *
+ * In a thread-safe store, the facts themselves may leave the store, and
+ * go away, unless @qname is locked with ohm_fact_store_lock_names ().
+ * Use a snapshot to read without locking.
+ *
+ * Returns: a new list of the weak #OhmFact that have the name @qname,
+ * newest first. The caller should free the list, but not unref the
+ * facts.
+ **/
+GSList* ohm_fact_store_get_facts_by_quark (OhmFactStore* self, GQuark qname) {
+	OhmFactStoreFacts* facts;
+	GSList* result;
+	GSList** tail;
+	GList* l;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
+
+	result = NULL;
+	tail = &result;
+	_ohm_fact_store_lock_name (self, qname);
+
+	facts = _ohm_fact_store_lookup_facts (self, qname);
+	for (l = facts != NULL ? facts->facts : NULL; l != NULL; l = l->next) {
+		*tail = g_slist_alloc ();
+		(*tail)->data = l->data;
+		tail = &(*tail)->next;
+	}
+
+	_ohm_fact_store_unlock_name (self, qname);
+
+	return result;
+}
+
+
+/**
+ * ohm_fact_store_get_facts_by_name:
+ * @self: a #OhmFactStore
+ * @name: name of the facts to list
+ *
+ * String version of ohm_fact_store_get_facts_by_quark ().
+ *
+ * Returns: a new list of weak #OhmFact, to be freed by the caller.
+ **/
+GSList* ohm_fact_store_get_facts_by_name (OhmFactStore* self, const char* name) {
+	GQuark qname;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
+	g_return_val_if_fail (name != NULL, NULL);
+
+	qname = g_quark_try_string (name);
+	if (qname == 0) {
+		return NULL;
+	}
+
+	return ohm_fact_store_get_facts_by_quark (self, qname);
+}
+
+
+static void _g_slist_free_g_object_unref (GSList* self) {
+	g_slist_foreach (self, ((GFunc) g_object_unref), NULL);
+	g_slist_free (self);
+}
+
+
+/*
+ * Find the smallest set of candidate facts for @pattern among the
+ * secondary indexes of its name. Returns %FALSE if no index applies,
+ * otherwise *@candidates is the set to match (%NULL if none can match).
+ */
+static gboolean _ohm_fact_store_probe_indexes (OhmFactStore* self, OhmPattern* pattern, GHashTable** candidates) {
+	OhmFactStoreFacts* facts;
+	OhmFactStoreFieldIndex* best_idx;
+	GHashTable* best;
+	guint i;
+
+	facts = _ohm_fact_store_lookup_facts (self, ohm_structure_get_qname (OHM_STRUCTURE (pattern)));
+	if (facts == NULL || facts->field_indexes == NULL || ohm_pattern_get_fact (pattern) != NULL) {
+		return FALSE;
+	}
+
+	best_idx = NULL;
+	best = NULL;
+
+	for (i = 0; i < OHM_STRUCTURE (pattern)->priv->n_fields; i++) {
+		OhmFactStoreFieldIndex* idx;
+		GHashTable* set;
+		GQuark q;
+
+		q = OHM_STRUCTURE (pattern)->priv->entries[i].field;
+		idx = g_hash_table_lookup (facts->field_indexes, GUINT_TO_POINTER (q));
+		if (idx == NULL || !_ohm_pattern_tests_equal (pattern, q)) {
+			continue;
+		}
+
+		set = g_hash_table_lookup (idx->values, ohm_structure_qget (OHM_STRUCTURE (pattern), q));
+		if (set == NULL) {
+			idx->probes++;
+			*candidates = NULL;
+			return TRUE;
+		}
+
+		if (best == NULL || g_hash_table_size (set) < g_hash_table_size (best)) {
+			best_idx = idx;
+			best = set;
+		}
+	}
+
+	if (best == NULL) {
+		return FALSE;
+	}
+
+	best_idx->probes++;
+	*candidates = best;
+
+	return TRUE;
+}
+
+
+/*
+ * Find the candidate facts for @pattern in the ordered indexes of its
+ * name: the facts whose value is within the bounds of the first field
+ * of @pattern having such an index. Returns %FALSE if no index applies,
+ * otherwise *@candidates is a new array of the facts to match.
+ */
+static gboolean _ohm_fact_store_probe_ordered_indexes (OhmFactStore* self, OhmPattern* pattern, GPtrArray** candidates) {
+	OhmFactStoreFacts* facts;
+	OhmFactStoreOrderedIndex* idx;
+	OhmFactStoreSkipNode* node;
+	OhmPatternOpEntry* e;
+	OhmPatternOp op;
+	GValue* bound;
+	GValue* high;
+	guint i;
+
+	facts = _ohm_fact_store_lookup_facts (self, ohm_structure_get_qname (OHM_STRUCTURE (pattern)));
+	if (facts == NULL || facts->ordered_indexes == NULL || ohm_pattern_get_fact (pattern) != NULL) {
+		return FALSE;
+	}
+
+	idx = NULL;
+	for (i = 0; idx == NULL && i < OHM_STRUCTURE (pattern)->priv->n_fields; i++) {
+		bound = OHM_STRUCTURE (pattern)->priv->entries[i].value;
+		if (_ohm_value_orderable (G_VALUE_TYPE (bound))) {
+			idx = g_hash_table_lookup (facts->ordered_indexes,
+						   GUINT_TO_POINTER (OHM_STRUCTURE (pattern)->priv->entries[i].field));
+		}
+	}
+
+	if (idx == NULL) {
+		return FALSE;
+	}
+
+	e = _ohm_pattern_lookup_op (pattern, idx->field);
+	op = e != NULL ? e->op : OHM_PATTERN_OP_EQ;
+	high = e != NULL ? e->high : NULL;
+	bound = ohm_structure_qget (OHM_STRUCTURE (pattern), idx->field);
+
+	idx->probes++;
+	*candidates = g_ptr_array_new ();
+
+	node = _ohm_fact_store_ordered_index_seek (idx, G_VALUE_TYPE (bound),
+						   op == OHM_PATTERN_OP_LT || op == OHM_PATTERN_OP_LE ? NULL : bound);
+	for (; node != NULL && G_VALUE_TYPE (&node->value) == G_VALUE_TYPE (bound); node = node->next[0]) {
+		if (!_ohm_pattern_test_op (op, bound, high, &node->value)) {
+			/* past the upper bound, or still on the excluded lower one */
+			if (op == OHM_PATTERN_OP_GT && _ohm_value_order (&node->value, bound) == 0) {
+				continue;
+			}
+			break;
+		}
+		g_ptr_array_add (*candidates, node->fact);
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * ohm_fact_store_get_facts_by_pattern:
+ * @self: a #OhmFactStore
+ * @pattern: a @pattern (not %NULL)
+ *
+ * Get the list of facts that match the #OhmPattern @pattern.
+ *
+ * If one of the fields bound by @pattern has been indexed with
+ * ohm_fact_store_add_index (), only the facts found through the index
+ * are matched, instead of every fact with the name of the pattern.
+ * Otherwise, an index declared with ohm_fact_store_add_ordered_index ()
+ * on one of the fields yields the facts within the bounds of its test.
+ *
+ * Returns: a new list of #OhmFact. The caller is responsible to unref
+ * elements and free the list.
+ **/
+GSList* ohm_fact_store_get_facts_by_pattern (OhmFactStore* self, OhmPattern* pattern) {
+	OhmFactStoreFacts* facts;
+	GSList* result;
+	GList* f_it;
+	GHashTable* candidates;
+	GPtrArray* ordered;
+	GQuark qname;
+	gboolean indexed;
+	guint n_candidates;
+	guint i;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
+	g_return_val_if_fail (OHM_IS_PATTERN (pattern), NULL);
+
+	result = NULL;
+	n_candidates = 0;
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (pattern));
+	_ohm_fact_store_lock_name (self, qname);
+
+	indexed = _ohm_fact_store_probe_indexes (self, pattern, &candidates);
+	if (indexed) {
+		GHashTableIter it;
+		gpointer f;
+
+		if (candidates != NULL) {
+			g_hash_table_iter_init (&it, candidates);
+			while (g_hash_table_iter_next (&it, &f, NULL)) {
+			  OhmPatternMatch* m;
+
+			  n_candidates++;
+			  m = ohm_pattern_match (pattern, OHM_FACT (f), OHM_FACT_STORE_EVENT_LOOKUP);
+
+			  if (m != NULL) {
+			    result = g_slist_prepend (result, m);
+			  }
+			}
+		}
+	} else if ((indexed = _ohm_fact_store_probe_ordered_indexes (self, pattern, &ordered))) {
+		for (i = ordered->len; i > 0; i--) {
+			OhmPatternMatch* m;
+
+			n_candidates++;
+			m = ohm_pattern_match (pattern, OHM_FACT (g_ptr_array_index (ordered, i - 1)), OHM_FACT_STORE_EVENT_LOOKUP);
+
+			if (m != NULL) {
+				result = g_slist_prepend (result, m);
+			}
+		}
+		g_ptr_array_free (ordered, TRUE);
+	} else {
+		facts = _ohm_fact_store_lookup_facts (self, qname);
+
+		for (f_it = facts != NULL ? facts->facts : NULL; f_it != NULL; f_it = f_it->next) {
+		  OhmFact* f;
+		  OhmPatternMatch* m;
+
+		  n_candidates++;
+		  f = g_object_ref (f_it->data);
+		  m = ohm_pattern_match (pattern, f, OHM_FACT_STORE_EVENT_LOOKUP);
+
+		  if (m != NULL) {
+		    result = g_slist_prepend (result, m);
+		    m = NULL;
+		  }
+
+		  g_object_unref (f);
+		}
+	}
+
+	_ohm_fact_store_unlock_name (self, qname);
+
+	_ohm_fact_store_lock_shared (self);
+	self->priv->lookup_stats.lookups++;
+	if (indexed) {
+		self->priv->lookup_stats.indexed++;
+	}
+	self->priv->lookup_stats.candidates += n_candidates;
+	_ohm_fact_store_unlock_shared (self);
+
+	return result;
+}
+
+
+/**
+ * ohm_fact_store_add_index:
+ * @self: a #OhmFactStore
+ * @name: the name of the facts to index
+ * @field: the name of the field to index
+ *
+ * Declare a secondary hash index on the @field of the facts named
+ * @name. The index is kept up to date as facts are inserted, removed
+ * or modified, and ohm_fact_store_get_facts_by_pattern () uses it for
+ * patterns binding @field.
+ *
+ * Returns: %TRUE if the index was created, %FALSE if it already existed.
+ **/
+gboolean ohm_fact_store_add_index (OhmFactStore* self, const char* name, const char* field) {
+	OhmFactStoreFacts* facts;
+	OhmFactStoreFieldIndex* idx;
+	GQuark qname;
+	GQuark qfield;
+	GList* f_it;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (name != NULL, FALSE);
+	g_return_val_if_fail (field != NULL, FALSE);
+
+	qname = g_quark_from_string (name);
+	qfield = g_quark_from_string (field);
+
+	_ohm_fact_store_lock_name (self, qname);
+	facts = _ohm_fact_store_ensure_facts (self, qname);
+
+	if (facts->field_indexes == NULL) {
+		facts->field_indexes = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+							      (GDestroyNotify) _ohm_fact_store_field_index_free);
+	} else if (g_hash_table_lookup (facts->field_indexes, GUINT_TO_POINTER (qfield)) != NULL) {
+		_ohm_fact_store_unlock_name (self, qname);
+		return FALSE;
+	}
+
+	idx = _ohm_fact_store_field_index_new (qfield);
+	for (f_it = facts->facts; f_it != NULL; f_it = f_it->next) {
+		_ohm_fact_store_field_index_add (idx, OHM_FACT (f_it->data));
+	}
+
+	g_hash_table_insert (facts->field_indexes, GUINT_TO_POINTER (qfield), idx);
+	_ohm_fact_store_touch (self, qname, NULL);
+	_ohm_fact_store_unlock_name (self, qname);
+
+	return TRUE;
+}
+
+
+/**
+ * ohm_fact_store_drop_index:
+ * @self: a #OhmFactStore
+ * @name: the name of the indexed facts
+ * @field: the name of the indexed field
+ *
+ * Drop an index declared with ohm_fact_store_add_index ().
+ *
+ * Returns: %TRUE if the index existed.
+ **/
+gboolean ohm_fact_store_drop_index (OhmFactStore* self, const char* name, const char* field) {
+	OhmFactStoreFacts* facts;
+	GQuark qname;
+	GQuark qfield;
+	gboolean found;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (name != NULL, FALSE);
+	g_return_val_if_fail (field != NULL, FALSE);
+
+	qname = g_quark_try_string (name);
+	qfield = g_quark_try_string (field);
+	if (qname == 0 || qfield == 0) {
+		return FALSE;
+	}
+
+	_ohm_fact_store_lock_name (self, qname);
+
+	facts = _ohm_fact_store_lookup_facts (self, qname);
+	if (facts == NULL || facts->field_indexes == NULL) {
+		_ohm_fact_store_unlock_name (self, qname);
+		return FALSE;
+	}
+
+	found = g_hash_table_remove (facts->field_indexes, GUINT_TO_POINTER (qfield));
+	_ohm_fact_store_touch (self, qname, NULL);
+
+	if (g_hash_table_size (facts->field_indexes) == 0) {
+		g_hash_table_destroy (facts->field_indexes);
+		facts->field_indexes = NULL;
+		_ohm_fact_store_forget_facts (self, qname, facts);
+	}
+
+	_ohm_fact_store_unlock_name (self, qname);
+
+	return found;
+}
+
+
+/**
+ * ohm_fact_store_add_ordered_index:
+ * @self: a #OhmFactStore
+ * @name: the name of the facts to index
+ * @field: the name of the field to index
+ *
+ * Declare an ordered index on the @field of the facts named @name,
+ * like ohm_fact_store_add_index (). The facts are kept sorted by the
+ * value of @field, so that ohm_fact_store_get_facts_by_pattern () finds
+ * the facts matching a comparison of the field, see
+ * ohm_pattern_set_op (), in logarithmic time, and returns them in the
+ * order of the index. Only numbers, booleans and strings are indexed.
+ *
+ * Returns: %TRUE if the index was created, %FALSE if it already existed.
+ **/
+gboolean ohm_fact_store_add_ordered_index (OhmFactStore* self, const char* name, const char* field) {
+	OhmFactStoreFacts* facts;
+	OhmFactStoreOrderedIndex* idx;
+	GQuark qname;
+	GQuark qfield;
+	GList* f_it;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (name != NULL, FALSE);
+	g_return_val_if_fail (field != NULL, FALSE);
+
+	qname = g_quark_from_string (name);
+	qfield = g_quark_from_string (field);
+
+	_ohm_fact_store_lock_name (self, qname);
+	facts = _ohm_fact_store_ensure_facts (self, qname);
+
+	if (facts->ordered_indexes == NULL) {
+		facts->ordered_indexes = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+								(GDestroyNotify) _ohm_fact_store_ordered_index_free);
+	} else if (g_hash_table_lookup (facts->ordered_indexes, GUINT_TO_POINTER (qfield)) != NULL) {
+		_ohm_fact_store_unlock_name (self, qname);
+		return FALSE;
+	}
+
+	idx = _ohm_fact_store_ordered_index_new (qfield);
+	for (f_it = facts->facts; f_it != NULL; f_it = f_it->next) {
+		_ohm_fact_store_ordered_index_add (idx, OHM_FACT (f_it->data));
+	}
+
+	g_hash_table_insert (facts->ordered_indexes, GUINT_TO_POINTER (qfield), idx);
+	_ohm_fact_store_touch (self, qname, NULL);
+	_ohm_fact_store_unlock_name (self, qname);
+
+	return TRUE;
+}
+
+
+/**
+ * ohm_fact_store_drop_ordered_index:
+ * @self: a #OhmFactStore
+ * @name: the name of the indexed facts
+ * @field: the name of the indexed field
+ *
+ * Drop an index declared with ohm_fact_store_add_ordered_index ().
+ *
+ * Returns: %TRUE if the index existed.
+ **/
+gboolean ohm_fact_store_drop_ordered_index (OhmFactStore* self, const char* name, const char* field) {
+	OhmFactStoreFacts* facts;
+	GQuark qname;
+	GQuark qfield;
+	gboolean found;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (name != NULL, FALSE);
+	g_return_val_if_fail (field != NULL, FALSE);
+
+	qname = g_quark_try_string (name);
+	qfield = g_quark_try_string (field);
+	if (qname == 0 || qfield == 0) {
+		return FALSE;
+	}
+
+	_ohm_fact_store_lock_name (self, qname);
+
+	facts = _ohm_fact_store_lookup_facts (self, qname);
+	if (facts == NULL || facts->ordered_indexes == NULL) {
+		_ohm_fact_store_unlock_name (self, qname);
+		return FALSE;
+	}
+
+	found = g_hash_table_remove (facts->ordered_indexes, GUINT_TO_POINTER (qfield));
+	_ohm_fact_store_touch (self, qname, NULL);
+
+	if (g_hash_table_size (facts->ordered_indexes) == 0) {
+		g_hash_table_destroy (facts->ordered_indexes);
+		facts->ordered_indexes = NULL;
+		_ohm_fact_store_forget_facts (self, qname, facts);
+	}
+
+	_ohm_fact_store_unlock_name (self, qname);
+
+	return found;
+}
+
+
+/**
+ * ohm_fact_store_get_index_probes:
+ * @self: a #OhmFactStore
+ * @name: the name of the indexed facts
+ * @field: the name of the indexed field
+ *
+ * Returns: the number of pattern lookups that were served by the
+ * indexes, hashed or ordered, on @field of the facts named @name, or 0
+ * if there is no such index.
+ **/
+guint ohm_fact_store_get_index_probes (OhmFactStore* self, const char* name, const char* field) {
+	OhmFactStoreFacts* facts;
+	OhmFactStoreFieldIndex* idx;
+	OhmFactStoreOrderedIndex* ordered;
+	GQuark qname;
+	GQuark qfield;
+	guint probes;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), 0);
+	g_return_val_if_fail (name != NULL, 0);
+	g_return_val_if_fail (field != NULL, 0);
+
+	qname = g_quark_try_string (name);
+	qfield = g_quark_try_string (field);
+	if (qname == 0 || qfield == 0) {
+		return 0;
+	}
+
+	probes = 0;
+	_ohm_fact_store_lock_name (self, qname);
+
+	facts = _ohm_fact_store_lookup_facts (self, qname);
+	if (facts != NULL && facts->field_indexes != NULL) {
+		idx = g_hash_table_lookup (facts->field_indexes, GUINT_TO_POINTER (qfield));
+		if (idx != NULL) {
+			probes = idx->probes;
+		}
+	}
+
+	if (facts != NULL && facts->ordered_indexes != NULL) {
+		ordered = g_hash_table_lookup (facts->ordered_indexes, GUINT_TO_POINTER (qfield));
+		if (ordered != NULL) {
+			probes += ordered->probes;
+		}
+	}
+
+	_ohm_fact_store_unlock_name (self, qname);
+
+	return probes;
+}
+
+
+/**
+ * ohm_fact_store_get_lookup_stats:
+ * @self: a #OhmFactStore
+ * @stats: where to store the statistics
+ *
+ * Get the pattern lookup statistics of @self, see #OhmFactStoreLookupStats.
+ **/
+void ohm_fact_store_get_lookup_stats (OhmFactStore* self, OhmFactStoreLookupStats* stats) {
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (stats != NULL);
+
+	_ohm_fact_store_lock_shared (self);
+	*stats = self->priv->lookup_stats;
+	_ohm_fact_store_unlock_shared (self);
+}
+
+
+/**
+ * ohm_fact_store_get_symbol_stats:
+ * @self: a #OhmFactStore
+ * @stats: where to store the statistics
+ *
+ * Get the size of the string symbol table of @self, see
+ * #OhmFactStoreSymbolStats.
+ **/
+void ohm_fact_store_get_symbol_stats (OhmFactStore* self, OhmFactStoreSymbolStats* stats) {
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (stats != NULL);
+
+	g_mutex_lock (&self->priv->symbols->lock);
+	*stats = self->priv->symbols->stats;
+	g_mutex_unlock (&self->priv->symbols->lock);
+}
+
+
+/*
+ * State of a walk over the names and the patterns of a store, to gather
+ * the statistics of ohm_fact_store_get_name_stats () and friends, or to
+ * @reset the counts of the patterns. @names and @views map a name or a
+ * view to its index in @name_stats or @view_stats.
+ */
+typedef struct _OhmFactStoreStatsWalk {
+	OhmFactStore* store;
+	gboolean transparent;
+	gboolean reset;
+	GHashTable* names;
+	GArray* name_stats;
+	GArray* pattern_stats;
+	GHashTable* views;
+	GArray* view_stats;
+} OhmFactStoreStatsWalk;
+
+
+static OhmFactStoreNameStats* _ohm_fact_store_stats_name (OhmFactStoreStatsWalk* walk, GQuark qname) {
+	gpointer index;
+
+	if (!g_hash_table_lookup_extended (walk->names, GUINT_TO_POINTER (qname), NULL, &index)) {
+		OhmFactStoreNameStats entry = { 0, };
+
+		entry.name = qname;
+		index = GUINT_TO_POINTER (walk->name_stats->len);
+		g_array_append_val (walk->name_stats, entry);
+		g_hash_table_insert (walk->names, GUINT_TO_POINTER (qname), index);
+	}
+
+	return &g_array_index (walk->name_stats, OhmFactStoreNameStats, GPOINTER_TO_UINT (index));
+}
+
+
+static OhmFactStoreViewStats* _ohm_fact_store_stats_view (OhmFactStoreStatsWalk* walk, OhmFactStoreView* view) {
+	gpointer index;
+
+	if (!g_hash_table_lookup_extended (walk->views, view, NULL, &index)) {
+		OhmFactStoreViewStats entry = { 0, };
+		OhmFactStoreChangeSet* change_set;
+
+		change_set = OHM_FACT_STORE_SIMPLE_VIEW (view)->change_set;
+		entry.view = view;
+		entry.transparent = walk->transparent;
+		_ohm_fact_store_change_set_lock (change_set);
+		entry.backlog = change_set->priv->n_records;
+		entry.overflowed = change_set->priv->overflowed;
+		_ohm_fact_store_change_set_unlock (change_set);
+
+		index = GUINT_TO_POINTER (walk->view_stats->len);
+		g_array_append_val (walk->view_stats, entry);
+		g_hash_table_insert (walk->views, view, index);
+	}
+
+	return &g_array_index (walk->view_stats, OhmFactStoreViewStats, GPOINTER_TO_UINT (index));
+}
+
+
+static void _ohm_fact_store_stats_walk_patterns (GQuark qname, gpointer patterns, gpointer data) {
+	OhmFactStoreStatsWalk* walk;
+	GSList* l;
+
+	walk = (OhmFactStoreStatsWalk*) data;
+
+	for (l = (GSList*) patterns; l != NULL; l = l->next) {
+		OhmPattern* p;
+		OhmFactStorePatternStats entry = { 0, };
+		OhmFactStoreNameStats* name;
+		OhmFactStoreViewStats* view;
+
+		p = OHM_PATTERN (l->data);
+		if (walk->reset) {
+			p->priv->evaluations = 0;
+			p->priv->hits = 0;
+			continue;
+		}
+
+		entry.pattern = p;
+		entry.view = ohm_pattern_get_view (p);
+		entry.transparent = walk->transparent;
+		entry.evaluations = p->priv->evaluations;
+		entry.hits = p->priv->hits;
+		g_array_append_val (walk->pattern_stats, entry);
+
+		name = _ohm_fact_store_stats_name (walk, qname);
+		if (walk->transparent) {
+			name->transparent_patterns++;
+		} else {
+			name->patterns++;
+		}
+		name->evaluations += entry.evaluations;
+		name->hits += entry.hits;
+
+		if (entry.view != NULL) {
+			view = _ohm_fact_store_stats_view (walk, entry.view);
+			view->patterns++;
+			view->evaluations += entry.evaluations;
+			view->hits += entry.hits;
+		}
+	}
+}
+
+
+static gint _ohm_fact_store_name_stats_cmp (gconstpointer a, gconstpointer b) {
+	const OhmFactStoreNameStats* na = a;
+	const OhmFactStoreNameStats* nb = b;
+
+	if (na->evaluations != nb->evaluations) {
+		return na->evaluations > nb->evaluations ? -1 : 1;
+	}
+
+	return (gint) nb->facts - (gint) na->facts;
+}
+
+
+static gint _ohm_fact_store_pattern_stats_cmp (gconstpointer a, gconstpointer b) {
+	const OhmFactStorePatternStats* pa = a;
+	const OhmFactStorePatternStats* pb = b;
+
+	if (pa->evaluations != pb->evaluations) {
+		return pa->evaluations > pb->evaluations ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+static gint _ohm_fact_store_view_stats_cmp (gconstpointer a, gconstpointer b) {
+	const OhmFactStoreViewStats* va = a;
+	const OhmFactStoreViewStats* vb = b;
+
+	if (va->evaluations != vb->evaluations) {
+		return va->evaluations > vb->evaluations ? -1 : 1;
+	}
+
+	return (gint) vb->backlog - (gint) va->backlog;
+}
+
+
+/*
+ * Walk the names and the patterns of @self, with all its names held so
+ * the counts are consistent, and sort the results, busiest first.
+ */
+static void _ohm_fact_store_stats_walk (OhmFactStore* self, OhmFactStoreStatsWalk* walk, gboolean reset) {
+	GHashTableIter iter;
+	gpointer qname;
+	gpointer facts;
+
+	memset (walk, 0, sizeof (*walk));
+	walk->store = self;
+	walk->reset = reset;
+	walk->names = g_hash_table_new (g_direct_hash, g_direct_equal);
+	walk->name_stats = g_array_new (FALSE, FALSE, sizeof (OhmFactStoreNameStats));
+	walk->pattern_stats = g_array_new (FALSE, FALSE, sizeof (OhmFactStorePatternStats));
+	walk->views = g_hash_table_new (g_direct_hash, g_direct_equal);
+	walk->view_stats = g_array_new (FALSE, FALSE, sizeof (OhmFactStoreViewStats));
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+	_ohm_fact_store_lock_interest (self, FALSE);
+
+	if (!reset) {
+		g_hash_table_iter_init (&iter, self->priv->facts);
+		while (g_hash_table_iter_next (&iter, &qname, &facts)) {
+			guint n;
+
+			n = g_hash_table_size (((OhmFactStoreFacts*) facts)->index);
+			if (n > 0) {
+				_ohm_fact_store_stats_name (walk, GPOINTER_TO_UINT (qname))->facts = n;
+			}
+		}
+	}
+
+	walk->transparent = FALSE;
+	g_datalist_foreach (&self->priv->interest, _ohm_fact_store_stats_walk_patterns, walk);
+	walk->transparent = TRUE;
+	g_datalist_foreach (&self->priv->transp_interest, _ohm_fact_store_stats_walk_patterns, walk);
+
+	_ohm_fact_store_unlock_interest (self, FALSE);
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	g_array_sort (walk->name_stats, _ohm_fact_store_name_stats_cmp);
+	g_array_sort (walk->pattern_stats, _ohm_fact_store_pattern_stats_cmp);
+	g_array_sort (walk->view_stats, _ohm_fact_store_view_stats_cmp);
+	g_hash_table_destroy (walk->names);
+	g_hash_table_destroy (walk->views);
+}
+
+
+static void _ohm_fact_store_stats_totals (OhmFactStore* self, OhmFactStoreStatsWalk* walk, OhmFactStoreStats* stats) {
+	GList* t_it;
+	guint i;
+	guint j;
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+	_ohm_fact_store_lock_shared (self);
+	*stats = self->priv->stats;
+	_ohm_fact_store_unlock_shared (self);
+
+	for (i = 0; i < OHM_FACT_STORE_N_SHARDS; i++) {
+		OhmFactStoreDispatchStats* d;
+
+		d = &self->priv->dispatch_stats[i];
+		stats->dispatches += d->dispatches;
+		stats->dispatch_time += d->time;
+		for (j = 0; j < OHM_FACT_STORE_STATS_BUCKETS; j++) {
+			stats->dispatch_histogram[j] += d->histogram[j];
+		}
+	}
+
+	stats->transaction_depth = g_queue_get_length (self->transaction);
+	stats->cow_length = 0;
+	for (t_it = self->transaction->head; t_it != NULL; t_it = t_it->next) {
+		if (t_it->data != NULL) {
+			stats->cow_length += ((OhmFactStoreTransaction*) t_it->data)->priv->n_modifications;
+		}
+	}
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	stats->facts = 0;
+	stats->names = walk->name_stats->len;
+	stats->patterns = 0;
+	stats->transparent_patterns = 0;
+	stats->views = walk->view_stats->len;
+	stats->evaluations = 0;
+	stats->hits = 0;
+	for (i = 0; i < walk->name_stats->len; i++) {
+		OhmFactStoreNameStats* name;
+
+		name = &g_array_index (walk->name_stats, OhmFactStoreNameStats, i);
+		stats->facts += name->facts;
+		stats->patterns += name->patterns;
+		stats->transparent_patterns += name->transparent_patterns;
+		stats->evaluations += name->evaluations;
+		stats->hits += name->hits;
+	}
+}
+
+
+/**
+ * ohm_fact_store_get_stats:
+ * @self: a #OhmFactStore
+ * @stats: where to store the statistics
+ *
+ * Get the activity statistics of @self, see #OhmFactStoreStats.
+ **/
+void ohm_fact_store_get_stats (OhmFactStore* self, OhmFactStoreStats* stats) {
+	OhmFactStoreStatsWalk walk;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (stats != NULL);
+
+	_ohm_fact_store_stats_walk (self, &walk, FALSE);
+	_ohm_fact_store_stats_totals (self, &walk, stats);
+	g_array_free (walk.name_stats, TRUE);
+	g_array_free (walk.pattern_stats, TRUE);
+	g_array_free (walk.view_stats, TRUE);
+}
+
+
+/**
+ * ohm_fact_store_get_name_stats:
+ * @self: a #OhmFactStore
+ *
+ * Get the statistics of each fact name with facts or patterns in @self,
+ * the names whose patterns are evaluated the most first.
+ *
+ * Returns: a #GArray of #OhmFactStoreNameStats, to free with g_array_free ().
+ **/
+GArray* ohm_fact_store_get_name_stats (OhmFactStore* self) {
+	OhmFactStoreStatsWalk walk;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
+
+	_ohm_fact_store_stats_walk (self, &walk, FALSE);
+	g_array_free (walk.pattern_stats, TRUE);
+	g_array_free (walk.view_stats, TRUE);
+
+	return walk.name_stats;
+}
+
+
+/**
+ * ohm_fact_store_get_pattern_stats:
+ * @self: a #OhmFactStore
+ *
+ * Get the statistics of each pattern of the views of @self, the most
+ * evaluated first.
+ *
+ * Returns: a #GArray of #OhmFactStorePatternStats, to free with g_array_free ().
+ **/
+GArray* ohm_fact_store_get_pattern_stats (OhmFactStore* self) {
+	OhmFactStoreStatsWalk walk;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
+
+	_ohm_fact_store_stats_walk (self, &walk, FALSE);
+	g_array_free (walk.name_stats, TRUE);
+	g_array_free (walk.view_stats, TRUE);
+
+	return walk.pattern_stats;
+}
+
+
+/**
+ * ohm_fact_store_get_view_stats:
+ * @self: a #OhmFactStore
+ *
+ * Get the statistics of each view of @self with patterns, the views
+ * whose patterns are evaluated the most first.
+ *
+ * Returns: a #GArray of #OhmFactStoreViewStats, to free with g_array_free ().
+ **/
+GArray* ohm_fact_store_get_view_stats (OhmFactStore* self) {
+	OhmFactStoreStatsWalk walk;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
+
+	_ohm_fact_store_stats_walk (self, &walk, FALSE);
+	g_array_free (walk.name_stats, TRUE);
+	g_array_free (walk.pattern_stats, TRUE);
+
+	return walk.view_stats;
+}
+
+
+/**
+ * ohm_fact_store_reset_stats:
+ * @self: a #OhmFactStore
+ *
+ * Reset the counts of ohm_fact_store_get_stats () and of the patterns,
+ * to measure from now on.
+ **/
+void ohm_fact_store_reset_stats (OhmFactStore* self) {
+	OhmFactStoreStatsWalk walk;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+
+	_ohm_fact_store_stats_walk (self, &walk, TRUE);
+	g_array_free (walk.name_stats, TRUE);
+	g_array_free (walk.pattern_stats, TRUE);
+	g_array_free (walk.view_stats, TRUE);
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+	memset (self->priv->dispatch_stats, 0, sizeof (self->priv->dispatch_stats));
+	_ohm_fact_store_lock_shared (self);
+	memset (&self->priv->stats, 0, sizeof (self->priv->stats));
+	_ohm_fact_store_unlock_shared (self);
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+}
+
+
+/**
+ * ohm_fact_store_write_stats:
+ * @self: a #OhmFactStore
+ * @out: the string to append to
+ * @format: the format to write in
+ *
+ * Append all the statistics of @self to @out: the totals, then the
+ * names, the patterns and the views, the busiest first.
+ **/
+void ohm_fact_store_write_stats (OhmFactStore* self, GString* out, OhmFactStoreFormat format) {
+	OhmFactStoreStatsWalk walk;
+	OhmFactStoreStats stats;
+	gboolean json;
+	guint i;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (out != NULL);
+
+	_ohm_fact_store_stats_walk (self, &walk, FALSE);
+	_ohm_fact_store_stats_totals (self, &walk, &stats);
+	json = format == OHM_FACT_STORE_FORMAT_JSON;
+
+	g_string_append_printf (out, json ?
+				"{\"facts\": %u, \"names\": %u, \"patterns\": %u, \"transparent_patterns\": %u, \"views\": %u, "
+				"\"evaluations\": %" G_GUINT64_FORMAT ", \"hits\": %" G_GUINT64_FORMAT ", "
+				"\"transaction_depth\": %u, \"max_transaction_depth\": %u, \"cow_length\": %u, \"max_cow_length\": %u, "
+				"\"dispatches\": %" G_GUINT64_FORMAT ", \"dispatch_time\": %" G_GUINT64_FORMAT ", \"dispatch_histogram\": [" :
+				"facts: %u, names: %u, patterns: %u, transparent patterns: %u, views: %u\n"
+				"evaluations: %" G_GUINT64_FORMAT ", hits: %" G_GUINT64_FORMAT "\n"
+				"transaction depth: %u (max %u), logged changes: %u (max %u)\n"
+				"dispatches: %" G_GUINT64_FORMAT ", dispatch time: %" G_GUINT64_FORMAT " us\n"
+				"dispatch histogram:",
+				stats.facts, stats.names, stats.patterns, stats.transparent_patterns, stats.views,
+				stats.evaluations, stats.hits,
+				stats.transaction_depth, stats.max_transaction_depth, stats.cow_length, stats.max_cow_length,
+				stats.dispatches, stats.dispatch_time);
+	for (i = 0; i < OHM_FACT_STORE_STATS_BUCKETS; i++) {
+		if (json) {
+			g_string_append_printf (out, i > 0 ? ", %" G_GUINT64_FORMAT : "%" G_GUINT64_FORMAT,
+						stats.dispatch_histogram[i]);
+		} else {
+			g_string_append_printf (out, " %s%u us: %" G_GUINT64_FORMAT,
+						i < OHM_FACT_STORE_STATS_BUCKETS - 1 ? "<" : ">=",
+						1u << MIN (i, OHM_FACT_STORE_STATS_BUCKETS - 2), stats.dispatch_histogram[i]);
+		}
+	}
+
+	g_string_append (out, json ? "],\n \"names\": [" : "\nnames:");
+	for (i = 0; i < walk.name_stats->len; i++) {
+		OhmFactStoreNameStats* name;
+
+		name = &g_array_index (walk.name_stats, OhmFactStoreNameStats, i);
+		if (json) {
+			g_string_append (out, i > 0 ? ",\n  {\"name\": " : "\n  {\"name\": ");
+			_ohm_structure_write_json_string (out, g_quark_to_string (name->name));
+		} else {
+			g_string_append (out, "\n  ");
+			g_string_append (out, g_quark_to_string (name->name));
+		}
+		g_string_append_printf (out, json ?
+					", \"facts\": %u, \"patterns\": %u, \"transparent_patterns\": %u, "
+					"\"evaluations\": %" G_GUINT64_FORMAT ", \"hits\": %" G_GUINT64_FORMAT "}" :
+					": facts: %u, patterns: %u, transparent patterns: %u, "
+					"evaluations: %" G_GUINT64_FORMAT ", hits: %" G_GUINT64_FORMAT,
+					name->facts, name->patterns, name->transparent_patterns,
+					name->evaluations, name->hits);
+	}
+
+	g_string_append (out, json ? "],\n \"patterns\": [" : "\npatterns:");
+	for (i = 0; i < walk.pattern_stats->len; i++) {
+		OhmFactStorePatternStats* pattern;
+
+		pattern = &g_array_index (walk.pattern_stats, OhmFactStorePatternStats, i);
+		g_string_append (out, json ? (i > 0 ? ",\n  {\"pattern\": " : "\n  {\"pattern\": ") : "\n  ");
+		ohm_structure_write (OHM_STRUCTURE (pattern->pattern), out, format);
+		g_string_append_printf (out, json ?
+					", \"view\": \"%p\", \"transparent\": %s, "
+					"\"evaluations\": %" G_GUINT64_FORMAT ", \"hits\": %" G_GUINT64_FORMAT "}" :
+					": view: %p%s, evaluations: %" G_GUINT64_FORMAT ", hits: %" G_GUINT64_FORMAT,
+					pattern->view,
+					json ? (pattern->transparent ? "true" : "false") : (pattern->transparent ? " (transparent)" : ""),
+					pattern->evaluations, pattern->hits);
+	}
+
+	g_string_append (out, json ? "],\n \"views\": [" : "\nviews:");
+	for (i = 0; i < walk.view_stats->len; i++) {
+		OhmFactStoreViewStats* view;
+
+		view = &g_array_index (walk.view_stats, OhmFactStoreViewStats, i);
+		g_string_append_printf (out, json ?
+					"%s\n  {\"view\": \"%p\", \"transparent\": %s, \"patterns\": %u, \"backlog\": %u, "
+					"\"overflowed\": %s, \"evaluations\": %" G_GUINT64_FORMAT ", \"hits\": %" G_GUINT64_FORMAT "}" :
+					"%s\n  %p%s: patterns: %u, backlog: %u%s, "
+					"evaluations: %" G_GUINT64_FORMAT ", hits: %" G_GUINT64_FORMAT,
+					json && i > 0 ? "," : "", view->view,
+					json ? (view->transparent ? "true" : "false") : (view->transparent ? " (transparent)" : ""),
+					view->patterns, view->backlog,
+					json ? (view->overflowed ? "true" : "false") : (view->overflowed ? " (overflowed)" : ""),
+					view->evaluations, view->hits);
+	}
+	g_string_append (out, json ? "]}\n" : "\n");
+
+	g_array_free (walk.name_stats, TRUE);
+	g_array_free (walk.pattern_stats, TRUE);
+	g_array_free (walk.view_stats, TRUE);
+}
+
+
+static void _ohm_fact_store_interest_make_thread_safe (GQuark id, gpointer patterns, gpointer unused) {
+	GSList* l;
+
+	for (l = (GSList*) patterns; l != NULL; l = l->next) {
+		OhmFactStoreView* v;
+
+		v = ohm_pattern_get_view (OHM_PATTERN (l->data));
+		if (v != NULL) {
+			_ohm_fact_store_change_set_make_thread_safe (OHM_FACT_STORE_SIMPLE_VIEW (v)->change_set);
+		}
+	}
+}
+
+
+/**
+ * ohm_fact_store_set_thread_safe:
+ * @self: a #OhmFactStore
+ * @thread_safe: whether @self may be used from several threads
+ *
+ * Make @self safe to use from several threads at once, or not. This
+ * must be called while a single thread uses @self, outside of any
+ * transaction.
+ *
+ * A thread-safe store locks the facts by name: the names are spread
+ * over a fixed number of shards, each with its own lock, so threads
+ * changing facts of different names seldom wait for each other. The
+ * lock of a name is held while a fact of that name is inserted,
+ * removed or changed, including while its views are updated and the
+ * ::inserted, ::removed and ::updated signals are emitted. A handler
+ * changing facts of other names should lock them first with
+ * ohm_fact_store_lock_names ().
+ *
+ * A transaction or a batch holds all the names until it ends. Reading
+ * without locks at all is done through ohm_fact_store_snapshot ().
+ *
+ * The change sets of the views of a thread-safe store may be read by
+ * the listener thread while the writers fill them.
+ **/
+void ohm_fact_store_set_thread_safe (OhmFactStore* self, gboolean thread_safe) {
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (g_queue_is_empty (self->transaction));
+
+	if (thread_safe == (self->priv->locks != NULL)) {
+		return;
+	}
+
+	if (!thread_safe) {
+		_ohm_fact_store_locks_free (self->priv->locks);
+		self->priv->locks = NULL;
+		return;
+	}
+
+	self->priv->locks = _ohm_fact_store_locks_new ();
+	g_datalist_foreach (&self->priv->interest, _ohm_fact_store_interest_make_thread_safe, NULL);
+	g_datalist_foreach (&self->priv->transp_interest, _ohm_fact_store_interest_make_thread_safe, NULL);
+}
+
+
+gboolean ohm_fact_store_get_thread_safe (OhmFactStore* self) {
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+
+	return self->priv->locks != NULL;
+}
+
+
+/**
+ * ohm_fact_store_set_timing:
+ * @self: a #OhmFactStore
+ * @timing: whether to time the dispatches of the changes
+ *
+ * Time the dispatches of the changes of @self to its views, for the
+ * @dispatch_time and @dispatch_histogram of ohm_fact_store_get_stats ().
+ * This reads the clock twice per change, so it is off by default. This
+ * must be called while a single thread uses @self.
+ **/
+void ohm_fact_store_set_timing (OhmFactStore* self, gboolean timing) {
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+
+	self->priv->timing = timing;
+}
+
+
+/**
+ * ohm_fact_store_get_timing:
+ * @self: a #OhmFactStore
+ *
+ * Returns: whether the dispatches of @self are timed, see
+ * ohm_fact_store_set_timing ().
+ **/
+gboolean ohm_fact_store_get_timing (OhmFactStore* self) {
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+
+	return self->priv->timing;
+}
+
+
+static guint32 _ohm_fact_store_shards_of (const GQuark* names, guint n_names) {
+	guint32 shards;
+	guint i;
+
+	shards = 0;
+	for (i = 0; i < n_names; i++) {
+		shards |= 1u << OHM_FACT_STORE_SHARD (names[i]);
+	}
+
+	return shards;
+}
+
+
+/**
+ * ohm_fact_store_lock_names:
+ * @self: a #OhmFactStore
+ * @names: the names of the facts to lock
+ * @n_names: the number of names
+ *
+ * Lock the facts of all the @names of a thread-safe store at once, to
+ * change them together without other threads seeing the intermediate
+ * states. The locks are always taken in the same order, whatever the
+ * order of @names, so threads locking overlapping sets of names do not
+ * deadlock. The thread may already hold some of @names, but no other
+ * name. Does nothing if @self is not thread-safe.
+ **/
+void ohm_fact_store_lock_names (OhmFactStore* self, const GQuark* names, guint n_names) {
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (names != NULL || n_names == 0);
+
+	_ohm_fact_store_lock_shards (self, _ohm_fact_store_shards_of (names, n_names));
+}
+
+
+/**
+ * ohm_fact_store_unlock_names:
+ * @self: a #OhmFactStore
+ * @names: the names given to ohm_fact_store_lock_names ()
+ * @n_names: the number of names
+ *
+ * Release the names locked with ohm_fact_store_lock_names ().
+ **/
+void ohm_fact_store_unlock_names (OhmFactStore* self, const GQuark* names, guint n_names) {
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (names != NULL || n_names == 0);
+
+	_ohm_fact_store_unlock_shards (self, _ohm_fact_store_shards_of (names, n_names));
+}
+
+
+/**
+ * ohm_fact_store_transaction_push:
+ * @self: a #OhmFactStore
+ *
+ * Start a new transaction (on top of the previous). Transactions
+ * nest: the views are only notified when the outermost one commits.
+ *
+ * In a thread-safe store, the thread holds every name from here until
+ * the matching ohm_fact_store_transaction_pop (), so it must not hold
+ * any name already.
+ **/
+void ohm_fact_store_transaction_push (OhmFactStore* self) {
+	OhmFactStoreTransaction* trans;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	trans = ohm_fact_store_transaction_new (self, G_OBJECT (self));
+
+	g_queue_push_head (self->transaction, trans);
+	_ohm_fact_store_journal_hold (self);
+
+	_ohm_fact_store_lock_shared (self);
+	self->priv->stats.max_transaction_depth = MAX (self->priv->stats.max_transaction_depth,
+						       g_queue_get_length (self->transaction));
+	_ohm_fact_store_unlock_shared (self);
+}
+
+
+/*
+ * Drop the frozen copy of @fact, once it does not match what the
+ * snapshots should see of it anymore. Called with the name of @fact
+ * locked.
+ */
+static void _ohm_fact_store_thaw (OhmFact* fact) {
+	if (fact->priv->frozen != NULL) {
+		g_object_unref (fact->priv->frozen);
+		fact->priv->frozen = NULL;
+	}
+}
+
+
+/*
+ * Called on every change of a fact named @qname, @fact being the
+ * changed fact or %NULL when only the indexes changed. A change made
+ * within a transaction is not committed yet, it is accounted for when
+ * the outermost transaction commits.
+ */
+static void _ohm_fact_store_touch (OhmFactStore* self, GQuark qname, OhmFact* fact) {
+	if (!g_queue_is_empty (self->transaction)) {
+		return;
+	}
+
+	if (fact != NULL) {
+		_ohm_fact_store_thaw (fact);
+	}
+
+	_ohm_fact_store_lock_shared (self);
+	self->priv->version++;
+	if (self->priv->images != NULL) {
+		g_hash_table_remove (self->priv->images, GUINT_TO_POINTER (qname));
+	}
+	_ohm_fact_store_unlock_shared (self);
+}
+
+
+static void _ohm_value_init_copy (GValue* dest, const GValue* src) {
+	g_value_init (dest, G_VALUE_TYPE (src));
+
+	/* never share the symbols of the store */
+	if (G_VALUE_HOLDS_STRING (src)) {
+		g_value_set_string (dest, g_value_get_string (src));
+	} else {
+		g_value_copy (src, dest);
+	}
+}
+
+
+static OhmFact* _ohm_fact_store_freeze_fact (OhmFact* fact) {
+	OhmFact* copy;
+	guint i;
+
+	copy = g_object_new (OHM_TYPE_FACT, "name", ohm_structure_get_name (OHM_STRUCTURE (fact)), NULL);
+	for (i = 0; i < OHM_STRUCTURE (fact)->priv->n_fields; i++) {
+		GValue value = {0,};
+
+		_ohm_value_init_copy (&value, OHM_STRUCTURE (fact)->priv->entries[i].value);
+		_ohm_structure_store (OHM_STRUCTURE (copy), OHM_STRUCTURE (fact)->priv->entries[i].field, &value);
+	}
+
+	return copy;
+}
+
+
+/*
+ * Start the image of the committed facts named @qname: each fact is
+ * represented by its frozen copy, made again only when the fact has
+ * changed since the last image. The modifications of the open
+ * transactions are undone on the new copies, newest first, as a
+ * rollback would; a kept copy already predates them. A fact removed
+ * within them starts again from the state it was removed in, which the
+ * log keeps: the fact may have changed since, in or out of the store,
+ * and a later insertion dropped the copy undone so far. Called with all
+ * the shards locked, the indexes are filled by
+ * _ohm_fact_store_image_index () once they are unlocked.
+ */
+static OhmFactStoreImage* _ohm_fact_store_image_new (OhmFactStore* self, GQuark qname, OhmFactStoreFacts* facts) {
+	OhmFactStoreImage* image;
+	GHashTable* copies;
+	GHashTable* fresh;
+	GHashTableIter iter;
+	gpointer copy;
+	GList* f_it;
+	GList* t_it;
+	GSList* l;
+
+	image = g_slice_new0 (OhmFactStoreImage);
+	image->ref_count = 1;
+	copies = g_hash_table_new (g_direct_hash, g_direct_equal);
+	fresh = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	for (f_it = facts != NULL ? facts->facts : NULL; f_it != NULL; f_it = f_it->next) {
+		OhmFact* fact;
+
+		fact = OHM_FACT (f_it->data);
+		if (fact->priv->frozen != NULL) {
+			copy = g_object_ref (fact->priv->frozen);
+		} else {
+			copy = _ohm_fact_store_freeze_fact (fact);
+			g_hash_table_insert (fresh, copy, copy);
+		}
+		g_hash_table_insert (copies, fact, copy);
+	}
+
+	for (t_it = self->transaction->head; t_it != NULL; t_it = t_it->next) {
+		OhmFactStoreTransaction* t;
+
+		t = (OhmFactStoreTransaction*) t_it->data;
+		if (t == NULL) {
+			continue;
+		}
+
+		for (l = t->modifications; l != NULL; l = l->next) {
+			OhmFactStoreTransactionCOW* cow;
+
+			cow = (OhmFactStoreTransactionCOW*) l->data;
+			if (ohm_structure_get_qname (OHM_STRUCTURE (cow->fact)) != qname) {
+				continue;
+			}
+
+			copy = g_hash_table_lookup (copies, cow->fact);
+			switch (cow->event) {
+			case OHM_FACT_STORE_EVENT_ADDED:
+				if (copy != NULL) {
+					g_hash_table_remove (copies, cow->fact);
+					g_hash_table_remove (fresh, copy);
+					g_object_unref (copy);
+				}
+				break;
+			case OHM_FACT_STORE_EVENT_REMOVED:
+				if (copy == NULL) {
+					copy = _ohm_fact_store_freeze_fact (cow->value != NULL ? OHM_FACT (g_value_get_object (cow->value)) : cow->fact);
+					g_hash_table_insert (fresh, copy, copy);
+					g_hash_table_insert (copies, cow->fact, copy);
+				}
+				break;
+			case OHM_FACT_STORE_EVENT_UPDATED:
+				if (copy != NULL && g_hash_table_lookup (fresh, copy) != NULL) {
+					if (cow->value != NULL) {
+						GValue value = {0,};
+
+						_ohm_value_init_copy (&value, cow->value);
+						_ohm_structure_store (OHM_STRUCTURE (copy), cow->field, &value);
+					} else {
+						_ohm_structure_store (OHM_STRUCTURE (copy), cow->field, NULL);
+					}
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	/* keep the order of the store, the facts removed since come last */
+	for (f_it = facts != NULL ? facts->facts : NULL; f_it != NULL; f_it = f_it->next) {
+		OhmFact* fact;
+
+		fact = OHM_FACT (f_it->data);
+		copy = g_hash_table_lookup (copies, fact);
+		if (copy == NULL) {
+			continue;
+		}
+
+		/* the committed state of the fact, until it changes */
+		if (fact->priv->frozen == NULL) {
+			fact->priv->frozen = g_object_ref (copy);
+		}
+		image->facts = g_slist_prepend (image->facts, copy);
+		g_hash_table_remove (copies, fact);
+	}
+	g_hash_table_iter_init (&iter, copies);
+	while (g_hash_table_iter_next (&iter, NULL, &copy)) {
+		image->facts = g_slist_prepend (image->facts, copy);
+	}
+	image->facts = g_slist_reverse (image->facts);
+	g_hash_table_destroy (copies);
+	g_hash_table_destroy (fresh);
+
+	if (facts != NULL && facts->field_indexes != NULL) {
+		gpointer field;
+
+		image->indexes = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_hash_table_destroy);
+		g_hash_table_iter_init (&iter, facts->field_indexes);
+		while (g_hash_table_iter_next (&iter, &field, NULL)) {
+			g_hash_table_insert (image->indexes, field,
+					     g_hash_table_new_full (_ohm_value_hash, _ohm_value_equal, NULL, (GDestroyNotify) g_ptr_array_unref));
+		}
+	}
+
+	return image;
+}
+
+
+/*
+ * Fill the indexes of a new @image. The copies are frozen, so this
+ * needs no lock of the store.
+ */
+static void _ohm_fact_store_image_index (OhmFactStoreImage* image) {
+	GHashTableIter iter;
+	gpointer field;
+	gpointer values;
+	GSList* l;
+
+	if (image->indexes == NULL) {
+		return;
+	}
+
+	g_hash_table_iter_init (&iter, image->indexes);
+	while (g_hash_table_iter_next (&iter, &field, &values)) {
+		for (l = image->facts; l != NULL; l = l->next) {
+			GPtrArray* set;
+			GValue* v;
+
+			v = ohm_structure_qget (OHM_STRUCTURE (l->data), GPOINTER_TO_UINT (field));
+			if (v == NULL) {
+				continue;
+			}
+
+			set = g_hash_table_lookup (values, v);
+			if (set == NULL) {
+				set = g_ptr_array_new ();
+				g_hash_table_insert (values, v, set);
+			}
+			g_ptr_array_add (set, l->data);
+		}
+	}
+}
+
+
+static OhmFactStoreImage* _ohm_fact_store_image_ref (OhmFactStoreImage* self) {
+	g_atomic_int_inc (&self->ref_count);
+
+	return self;
+}
+
+
+static void _ohm_fact_store_image_unref (OhmFactStoreImage* self) {
+	if (!g_atomic_int_dec_and_test (&self->ref_count)) {
+		return;
+	}
+
+	/* the indexes refer to the values of the facts */
+	if (self->indexes != NULL) {
+		g_hash_table_destroy (self->indexes);
+	}
+	_g_slist_free_g_object_unref (self->facts);
+
+	g_slice_free (OhmFactStoreImage, self);
+}
+
+
+/**
+ * ohm_fact_store_snapshot:
+ * @self: a #OhmFactStore
+ *
+ * Take a read-only snapshot of the committed facts of @self: the
+ * modifications of the open transactions are not part of it, nor any
+ * later change of the store.
+ *
+ * A fact is copied when a snapshot is first taken after it changed,
+ * and shared between the snapshots otherwise. A snapshot
+ * does not refer to @self, and can be read and released from any
+ * thread while the store keeps changing, provided the patterns used to
+ * look it up are not in a view. This is the way to read a thread-safe
+ * store without taking its locks.
+ *
+ * Returns: a new snapshot, to release with ohm_fact_store_snapshot_unref ().
+ **/
+OhmFactStoreSnapshot* ohm_fact_store_snapshot (OhmFactStore* self) {
+	OhmFactStoreSnapshot* snapshot;
+	GHashTableIter iter;
+	gpointer qname;
+	gpointer facts;
+	OhmFactStoreImage* image;
+	GSList* built;
+	GSList* l;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
+
+	/* a consistent cut: no name changes while the copies are taken */
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	if (self->priv->images == NULL) {
+		self->priv->images = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+							    (GDestroyNotify) _ohm_fact_store_image_unref);
+	}
+
+	snapshot = g_slice_new0 (OhmFactStoreSnapshot);
+	snapshot->ref_count = 1;
+	snapshot->version = self->priv->version;
+	snapshot->images = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+						  (GDestroyNotify) _ohm_fact_store_image_unref);
+
+	built = NULL;
+	g_hash_table_iter_init (&iter, self->priv->facts);
+	while (g_hash_table_iter_next (&iter, &qname, &facts)) {
+		_ohm_fact_store_lock_shared (self);
+		image = g_hash_table_lookup (self->priv->images, qname);
+		if (image != NULL) {
+			_ohm_fact_store_image_ref (image);
+		}
+		_ohm_fact_store_unlock_shared (self);
+
+		if (image == NULL) {
+			image = _ohm_fact_store_image_new (self, GPOINTER_TO_UINT (qname), facts);
+			built = g_slist_prepend (built, qname);
+		}
+
+		g_hash_table_insert (snapshot->images, qname, image);
+	}
+
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	for (l = built; l != NULL; l = l->next) {
+		_ohm_fact_store_image_index (g_hash_table_lookup (snapshot->images, l->data));
+	}
+
+	/* share the new images, unless the store changed in the meantime */
+	_ohm_fact_store_lock_shared (self);
+	if (self->priv->version == snapshot->version && self->priv->images != NULL) {
+		for (l = built; l != NULL; l = l->next) {
+			if (g_hash_table_lookup (self->priv->images, l->data) == NULL) {
+				g_hash_table_insert (self->priv->images, l->data,
+						     _ohm_fact_store_image_ref (g_hash_table_lookup (snapshot->images, l->data)));
+			}
+		}
+	}
+	_ohm_fact_store_unlock_shared (self);
+	g_slist_free (built);
+
+	g_hash_table_iter_init (&iter, snapshot->images);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &image)) {
+		if (image->facts == NULL) {
+			g_hash_table_iter_remove (&iter);
+		}
+	}
+
+	return snapshot;
+}
+
+
+OhmFactStoreSnapshot* ohm_fact_store_snapshot_ref (OhmFactStoreSnapshot* self) {
+	g_return_val_if_fail (self != NULL, NULL);
+
+	g_atomic_int_inc (&self->ref_count);
+
+	return self;
+}
+
+
+void ohm_fact_store_snapshot_unref (OhmFactStoreSnapshot* self) {
+	g_return_if_fail (self != NULL);
+
+	if (!g_atomic_int_dec_and_test (&self->ref_count)) {
+		return;
+	}
+
+	g_hash_table_destroy (self->images);
+	g_slice_free (OhmFactStoreSnapshot, self);
+}
+
+
+/**
+ * ohm_fact_store_snapshot_get_version:
+ * @self: a snapshot
+ *
+ * Returns: the version of the store the snapshot was taken at. The
+ * version of a store grows with each committed change, two snapshots
+ * of the same version hold the same facts.
+ **/
+guint64 ohm_fact_store_snapshot_get_version (OhmFactStoreSnapshot* self) {
+	g_return_val_if_fail (self != NULL, 0);
+
+	return self->version;
+}
+
+
+/**
+ * ohm_fact_store_snapshot_get_facts_by_quark:
+ * @self: a snapshot
+ * @qname: #GQuark name of the facts to list
+ *
+ * Returns: a weak list of the facts named @qname in the snapshot. The
+ * facts are copies, which must not be modified.
+ **/
+GSList* ohm_fact_store_snapshot_get_facts_by_quark (OhmFactStoreSnapshot* self, GQuark qname) {
+	OhmFactStoreImage* image;
+
+	g_return_val_if_fail (self != NULL, NULL);
+
+	image = g_hash_table_lookup (self->images, GUINT_TO_POINTER (qname));
+
+	return image != NULL ? image->facts : NULL;
+}
+
+
+GSList* ohm_fact_store_snapshot_get_facts_by_name (OhmFactStoreSnapshot* self, const char* name) {
+	GQuark qname;
+
+	g_return_val_if_fail (self != NULL, NULL);
+	g_return_val_if_fail (name != NULL, NULL);
+
+	qname = g_quark_try_string (name);
+	if (qname == 0) {
+		return NULL;
+	}
+
+	return ohm_fact_store_snapshot_get_facts_by_quark (self, qname);
+}
+
+
+/**
+ * ohm_fact_store_snapshot_get_facts_by_pattern:
+ * @self: a snapshot
+ * @pattern: a @pattern (not %NULL)
+ *
+ * Get the list of facts of the snapshot that match @pattern, using the
+ * indexes the store had on the facts, like
+ * ohm_fact_store_get_facts_by_pattern ().
+ *
+ * Returns: a new list of #OhmPatternMatch. The caller is responsible
+ * to unref elements and free the list.
+ **/
+GSList* ohm_fact_store_snapshot_get_facts_by_pattern (OhmFactStoreSnapshot* self, OhmPattern* pattern) {
+	OhmFactStoreImage* image;
+	GPtrArray* best;
+	GSList* result;
+	GSList* l;
+	guint i;
+
+	g_return_val_if_fail (self != NULL, NULL);
+	g_return_val_if_fail (OHM_IS_PATTERN (pattern), NULL);
+
+	image = g_hash_table_lookup (self->images, GUINT_TO_POINTER (ohm_structure_get_qname (OHM_STRUCTURE (pattern))));
+	if (image == NULL || ohm_pattern_get_fact (pattern) != NULL) {
+		return NULL;
+	}
+
+	result = NULL;
+	best = NULL;
+
+	for (i = 0; image->indexes != NULL && i < OHM_STRUCTURE (pattern)->priv->n_fields; i++) {
+		GHashTable* values;
+		GPtrArray* set;
+		GQuark q;
+
+		q = OHM_STRUCTURE (pattern)->priv->entries[i].field;
+		values = g_hash_table_lookup (image->indexes, GUINT_TO_POINTER (q));
+		if (values == NULL || !_ohm_pattern_tests_equal (pattern, q)) {
+			continue;
+		}
+
+		set = g_hash_table_lookup (values, OHM_STRUCTURE (pattern)->priv->entries[i].value);
+		if (set == NULL) {
+			return NULL;
+		}
+
+		if (best == NULL || set->len < best->len) {
+			best = set;
+		}
+	}
+
+	if (best != NULL) {
+		for (i = 0; i < best->len; i++) {
+			OhmPatternMatch* m;
+
+			m = ohm_pattern_match (pattern, OHM_FACT (g_ptr_array_index (best, i)), OHM_FACT_STORE_EVENT_LOOKUP);
+			if (m != NULL) {
+				result = g_slist_prepend (result, m);
+			}
+		}
+
+		return result;
+	}
+
+	for (l = image->facts; l != NULL; l = l->next) {
+		OhmPatternMatch* m;
+
+		m = ohm_pattern_match (pattern, OHM_FACT (l->data), OHM_FACT_STORE_EVENT_LOOKUP);
+		if (m != NULL) {
+			result = g_slist_prepend (result, m);
+		}
+	}
+
+	return result;
+}
+
+
+static void _ohm_fact_store_apply_op (OhmFactStore* self, OhmFactStoreOp* op) {
+	switch (op->type) {
+	case OHM_FACT_STORE_OP_INSERT:
+		ohm_fact_store_insert (self, op->fact);
+		break;
+	case OHM_FACT_STORE_OP_REMOVE:
+		ohm_fact_store_remove (self, op->fact);
+		break;
+	case OHM_FACT_STORE_OP_UPDATE:
+		if (G_IS_VALUE (&op->value)) {
+			GValue value;
+
+			/* moved into the fact */
+			value = op->value;
+			memset (&op->value, 0, sizeof (GValue));
+			_ohm_fact_qset_inline (op->fact, op->field, &value, OHM_FACT_SET_MOVE);
+		} else {
+			_ohm_fact_qset_inline (op->fact, op->field, NULL, OHM_FACT_SET_MOVE);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+
+/**
+ * ohm_fact_store_apply_batch:
+ * @self: a #OhmFactStore
+ * @ops: the operations
+ * @n_ops: the number of operations
+ *
+ * Apply many insertions, removals and updates at once. This has the
+ * same effect as the corresponding ohm_fact_store_insert (),
+ * ohm_fact_store_remove () and ohm_fact_set () calls, except that the
+ * operations are grouped by fact name, so the interests of the views
+ * are looked up once per name, and that each view which got new
+ * matches emits a single ::updated signal at the end. Operations on
+ * facts of the same name keep their relative order.
+ *
+ * The contents of the #GValue of an %OHM_FACT_STORE_OP_UPDATE are taken
+ * over, and the #GValue is cleared. An unset #GValue removes the field.
+ **/
+void ohm_fact_store_apply_batch (OhmFactStore* self, OhmFactStoreOp* ops, guint n_ops) {
+	OhmFactStoreBatch batch;
+	GHashTable* groups;
+	GArray* names;
+	GHashTableIter iter;
+	gpointer view;
+	guint i, j;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (ops != NULL || n_ops == 0);
+
+	for (i = 0; i < n_ops; i++) {
+		g_return_if_fail (OHM_IS_FACT (ops[i].fact));
+	}
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	if (self->priv->batch != NULL) {
+		_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+		g_warning ("ohm_fact_store_apply_batch () does not nest");
+		return;
+	}
+
+	/* the operations of each name, in order, and the names as they come */
+	groups = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_ptr_array_unref);
+	names = g_array_new (FALSE, FALSE, sizeof (GQuark));
+	for (i = 0; i < n_ops; i++) {
+		GPtrArray* group;
+		GQuark qname;
+
+		qname = ohm_structure_get_qname (OHM_STRUCTURE (ops[i].fact));
+		group = g_hash_table_lookup (groups, GUINT_TO_POINTER (qname));
+		if (group == NULL) {
+			group = g_ptr_array_new ();
+			g_hash_table_insert (groups, GUINT_TO_POINTER (qname), group);
+			g_array_append_val (names, qname);
+		}
+		g_ptr_array_add (group, &ops[i]);
+	}
+
+	batch.views = g_hash_table_new (g_direct_hash, g_direct_equal);
+	self->priv->batch = &batch;
+	_ohm_fact_store_journal_hold (self);
+
+	for (i = 0; i < names->len; i++) {
+		GPtrArray* group;
+
+		batch.alpha = g_hash_table_lookup (self->priv->alpha, GUINT_TO_POINTER (g_array_index (names, GQuark, i)));
+		batch.transp_alpha = g_hash_table_lookup (self->priv->transp_alpha, GUINT_TO_POINTER (g_array_index (names, GQuark, i)));
+
+		_ohm_fact_store_lock_shared (self);
+		if (g_slist_find (self->priv->known_facts_qname, GUINT_TO_POINTER (g_array_index (names, GQuark, i))) == NULL) {
+			self->priv->known_facts_qname = g_slist_prepend (self->priv->known_facts_qname,
+									 GUINT_TO_POINTER (g_array_index (names, GQuark, i)));
+		}
+		_ohm_fact_store_unlock_shared (self);
+		batch.qname = g_array_index (names, GQuark, i);
+
+		group = g_hash_table_lookup (groups, GUINT_TO_POINTER (batch.qname));
+		for (j = 0; j < group->len; j++) {
+			_ohm_fact_store_apply_op (self, g_ptr_array_index (group, j));
+		}
+	}
+
+	_ohm_fact_store_journal_release (self, FALSE);
+	self->priv->batch = NULL;
+	g_hash_table_destroy (groups);
+	g_array_free (names, TRUE);
+
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	g_hash_table_iter_init (&iter, batch.views);
+	while (g_hash_table_iter_next (&iter, &view, NULL)) {
+		if (self->priv->notify_deferred) {
+			_ohm_fact_store_queue_notify (self, view);
+		} else {
+			g_signal_emit (view, ohm_fact_store_simple_view_signals[OHM_FACT_STORE_SIMPLE_VIEW_UPDATED_SIGNAL], 0,
+				       OHM_FACT_STORE_SIMPLE_VIEW (view)->change_set);
+		}
+	}
+	g_hash_table_destroy (batch.views);
+}
+
+
+/*
+ * Queue the notification of @view, if the notifications of @self are
+ * deferred: the views are notified once each from an idle source of
+ * the default main context, however many changes they got meanwhile.
+ */
+static void _ohm_fact_store_queue_notify (OhmFactStore* self, OhmFactStoreView* view) {
+	if (!self->priv->notify_deferred) {
+		return;
+	}
+
+	_ohm_fact_store_lock_shared (self);
+
+	if (self->priv->notify_deferred) {
+		if (self->priv->notify_views == NULL) {
+			self->priv->notify_views = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+		}
+
+		if (g_hash_table_lookup (self->priv->notify_views, view) == NULL) {
+			g_hash_table_insert (self->priv->notify_views, g_object_ref (view), view);
+		}
+
+		if (self->priv->notify_source == NULL) {
+			self->priv->notify_source = g_idle_source_new ();
+			g_source_set_priority (self->priv->notify_source, self->priv->notify_priority);
+			g_source_set_callback (self->priv->notify_source, _ohm_fact_store_notify_idle, self, NULL);
+			g_source_attach (self->priv->notify_source, NULL);
+			g_source_unref (self->priv->notify_source);
+		}
+	}
+
+	_ohm_fact_store_unlock_shared (self);
+}
+
+
+static gboolean _ohm_fact_store_change_set_is_empty (OhmFactStoreChangeSet* self) {
+	gboolean empty;
+
+	_ohm_fact_store_change_set_lock (self);
+	empty = self->priv->n_records == 0;
+	_ohm_fact_store_change_set_unlock (self);
+
+	return empty;
+}
+
+
+static gboolean _ohm_fact_store_notify_idle (gpointer data) {
+	OhmFactStore* self;
+
+	self = OHM_FACT_STORE (data);
+
+	/* the changes made by the listeners are notified next time */
+	_ohm_fact_store_lock_shared (self);
+	if (self->priv->notify_source == g_main_current_source ()) {
+		self->priv->notify_source = NULL;
+	}
+	_ohm_fact_store_unlock_shared (self);
+
+	ohm_fact_store_flush_notify (self);
+
+	return FALSE;
+}
+
+
+/**
+ * ohm_fact_store_set_deferred_notify:
+ * @self: a #OhmFactStore
+ * @deferred: whether to defer the notifications
+ * @priority: the priority of the notifications, such as %G_PRIORITY_DEFAULT_IDLE
+ *
+ * Defer the notification of the views. By default, a view has its
+ * #OhmFactStoreSimpleView::updated signal emitted only at the end of
+ * ohm_fact_store_apply_batch (), and is otherwise expected to look at
+ * its change set by itself. Once deferred, the views having new
+ * matches are queued instead, and the signal is emitted once for each
+ * of them from an idle source of the default main context, at
+ * @priority, with all the changes made since: a burst of changes costs
+ * one callback per view. The changes made by a transaction are queued
+ * when it commits.
+ *
+ * Setting @deferred back to %FALSE notifies the queued views at once.
+ **/
+void ohm_fact_store_set_deferred_notify (OhmFactStore* self, gboolean deferred, gint priority) {
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+
+	_ohm_fact_store_lock_shared (self);
+	self->priv->notify_deferred = deferred;
+	self->priv->notify_priority = priority;
+	if (self->priv->notify_source != NULL) {
+		g_source_set_priority (self->priv->notify_source, priority);
+	}
+	_ohm_fact_store_unlock_shared (self);
+
+	if (!deferred) {
+		ohm_fact_store_flush_notify (self);
+	}
+}
+
+
+/**
+ * ohm_fact_store_flush_notify:
+ * @self: a #OhmFactStore
+ *
+ * Notify now the views queued by the deferred notification, see
+ * ohm_fact_store_set_deferred_notify (). The views whose change set has
+ * been reset meanwhile are not notified.
+ **/
+void ohm_fact_store_flush_notify (OhmFactStore* self) {
+	GHashTable* views;
+	GSource* source;
+	GHashTableIter iter;
+	gpointer view;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+
+	_ohm_fact_store_lock_shared (self);
+	views = self->priv->notify_views;
+	self->priv->notify_views = NULL;
+	source = self->priv->notify_source;
+	self->priv->notify_source = NULL;
+	_ohm_fact_store_unlock_shared (self);
+
+	if (source != NULL) {
+		g_source_destroy (source);
+	}
+
+	if (views == NULL) {
+		return;
+	}
+
+	g_hash_table_iter_init (&iter, views);
+	while (g_hash_table_iter_next (&iter, &view, NULL)) {
+		OhmFactStoreChangeSet* change_set;
+
+		change_set = OHM_FACT_STORE_SIMPLE_VIEW (view)->change_set;
+		if (!_ohm_fact_store_change_set_is_empty (change_set)) {
+			g_signal_emit (view, ohm_fact_store_simple_view_signals[OHM_FACT_STORE_SIMPLE_VIEW_UPDATED_SIGNAL], 0, change_set);
+		}
+	}
+
+	g_hash_table_destroy (views);
+}
+
+
+/*
+ * Replace the listeners of @self by a copy without the one numbered
+ * @remove, and with @add if not %NULL. Returns whether @remove was
+ * found.
+ */
+static gboolean _ohm_fact_store_replace_listeners (OhmFactStore* self, guint remove, OhmFactStoreListenerEntry* add) {
+	GPtrArray* old;
+	GPtrArray* listeners;
+	gboolean found;
+	guint i;
+
+	found = FALSE;
+	listeners = g_ptr_array_new_with_free_func ((GDestroyNotify) _ohm_fact_store_listener_entry_unref);
+
+	_ohm_fact_store_lock_shared (self);
+
+	old = self->priv->listeners;
+	for (i = 0; old != NULL && i < old->len; i++) {
+		OhmFactStoreListenerEntry* e = g_ptr_array_index (old, i);
+
+		if (e->id == remove) {
+			found = TRUE;
+			continue;
+		}
+		g_atomic_int_inc (&e->ref_count);
+		g_ptr_array_add (listeners, e);
+	}
+
+	if (add != NULL) {
+		add->id = ++self->priv->last_listener;
+		g_ptr_array_add (listeners, add);
+	}
+
+	if (listeners->len == 0) {
+		g_ptr_array_unref (listeners);
+		listeners = NULL;
+	}
+	self->priv->listeners = listeners;
+
+	_ohm_fact_store_unlock_shared (self);
+
+	/* the changes in progress hold their own reference */
+	if (old != NULL) {
+		g_ptr_array_unref (old);
+	}
+
+	return found;
+}
+
+
+/**
+ * ohm_fact_store_add_listener:
+ * @self: a #OhmFactStore
+ * @func: the function to call
+ * @user_data: the data to pass to @func
+ * @destroy: the function to destroy @user_data with, or %NULL
+ *
+ * Call @func on each insertion, removal and update of a fact of @self,
+ * as the #OhmFactStore::inserted, #OhmFactStore::removed and
+ * #OhmFactStore::updated signals are emitted, but without going
+ * through a #GClosure and the marshalling of the arguments. The
+ * listeners are called in the order they were added, before the signal
+ * handlers, in the thread making the change.
+ *
+ * Returns: the id of the listener, for ohm_fact_store_remove_listener ().
+ **/
+guint ohm_fact_store_add_listener (OhmFactStore* self, OhmFactStoreListener func, gpointer user_data, GDestroyNotify destroy) {
+	OhmFactStoreListenerEntry* e;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), 0);
+	g_return_val_if_fail (func != NULL, 0);
+
+	e = g_slice_new (OhmFactStoreListenerEntry);
+	e->ref_count = 1;
+	e->func = func;
+	e->user_data = user_data;
+	e->destroy = destroy;
+
+	_ohm_fact_store_replace_listeners (self, 0, e);
+
+	return e->id;
+}
+
+
+/**
+ * ohm_fact_store_remove_listener:
+ * @self: a #OhmFactStore
+ * @id: the id returned by ohm_fact_store_add_listener ()
+ *
+ * Remove a listener. A change in progress in another thread may still
+ * call it: its data is destroyed once that change is over.
+ *
+ * Returns: %TRUE if the listener was found.
+ **/
+gboolean ohm_fact_store_remove_listener (OhmFactStore* self, guint id) {
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (id != 0, FALSE);
+
+	return _ohm_fact_store_replace_listeners (self, id, NULL);
+}
+
+
+/* the index of the lowest bit set in @bits, not 0 */
+static guint _ohm_fact_store_wheel_first (guint64 bits) {
+	if ((guint32) bits != 0) {
+		return g_bit_nth_lsf ((guint32) bits, -1);
+	}
+
+	return 32 + g_bit_nth_lsf ((guint32) (bits >> 32), -1);
+}
+
+
+static guint64 _ohm_fact_store_wheel_rotate (guint64 bits, guint n) {
+	return n == 0 ? bits : (bits >> n) | (bits << (64 - n));
+}
+
+
+static guint64 _ohm_fact_store_wheel_time (void) {
+	return (guint64) g_get_monotonic_time () / 1000;
+}
+
+
+static void _ohm_fact_store_wheel_link (OhmFactStoreWheel* self, OhmFact* fact) {
+	guint64 tick;
+	guint64 delta;
+	guint level;
+	gint slot;
+
+	/* a fact already due expires with the next tick processed */
+	tick = MAX (fact->priv->timer_tick, self->now);
+	delta = tick - self->now;
+
+	for (level = 0; level < OHM_FACT_STORE_WHEEL_LEVELS; level++) {
+		if (delta < G_GUINT64_CONSTANT (1) << ((level + 1) * OHM_FACT_STORE_WHEEL_BITS)) {
+			break;
+		}
+	}
+
+	if (level < OHM_FACT_STORE_WHEEL_LEVELS) {
+		guint i;
+
+		i = (tick >> (level * OHM_FACT_STORE_WHEEL_BITS)) & OHM_FACT_STORE_WHEEL_MASK;
+		slot = level * OHM_FACT_STORE_WHEEL_SLOTS + i;
+		self->occupied[level] |= G_GUINT64_CONSTANT (1) << i;
+	} else {
+		slot = OHM_FACT_STORE_WHEEL_OVERFLOW;
+	}
+
+	fact->priv->timer_slot = slot;
+	fact->priv->timer_prev = NULL;
+	fact->priv->timer_next = self->slots[slot];
+	if (self->slots[slot] != NULL) {
+		self->slots[slot]->priv->timer_prev = fact;
+	}
+	self->slots[slot] = fact;
+}
+
+
+static void _ohm_fact_store_wheel_unlink (OhmFactStoreWheel* self, OhmFact* fact) {
+	gint slot;
+
+	slot = fact->priv->timer_slot;
+	if (fact->priv->timer_prev != NULL) {
+		fact->priv->timer_prev->priv->timer_next = fact->priv->timer_next;
+	} else {
+		self->slots[slot] = fact->priv->timer_next;
+	}
+	if (fact->priv->timer_next != NULL) {
+		fact->priv->timer_next->priv->timer_prev = fact->priv->timer_prev;
+	}
+
+	fact->priv->timer_slot = -1;
+	fact->priv->timer_prev = NULL;
+	fact->priv->timer_next = NULL;
+
+	if (self->slots[slot] == NULL && slot < OHM_FACT_STORE_WHEEL_OVERFLOW) {
+		self->occupied[slot / OHM_FACT_STORE_WHEEL_SLOTS] &= ~(G_GUINT64_CONSTANT (1) << (slot % OHM_FACT_STORE_WHEEL_SLOTS));
+	}
+}
+
+
+/* move the facts of @slot to where they belong now, a level below */
+static void _ohm_fact_store_wheel_cascade (OhmFactStoreWheel* self, gint slot) {
+	OhmFact* fact;
+
+	fact = self->slots[slot];
+	self->slots[slot] = NULL;
+	if (slot < OHM_FACT_STORE_WHEEL_OVERFLOW) {
+		self->occupied[slot / OHM_FACT_STORE_WHEEL_SLOTS] &= ~(G_GUINT64_CONSTANT (1) << (slot % OHM_FACT_STORE_WHEEL_SLOTS));
+	}
+
+	while (fact != NULL) {
+		OhmFact* next;
+
+		next = fact->priv->timer_next;
+		_ohm_fact_store_wheel_link (self, fact);
+		fact = next;
+	}
+}
+
+
+/*
+ * The next tick at which a slot of @self expires or cascades, from
+ * @now on. A slot of an upper level cascades when @now reaches its
+ * start, the current one has hence cascaded already unless @now is
+ * right at its start.
+ */
+static guint64 _ohm_fact_store_wheel_next (OhmFactStoreWheel* self) {
+	guint64 next;
+	guint level;
+
+	next = G_MAXUINT64;
+	for (level = 0; level < OHM_FACT_STORE_WHEEL_LEVELS; level++) {
+		guint shift;
+		guint64 block;
+		guint64 bits;
+		guint d;
+
+		if (self->occupied[level] == 0) {
+			continue;
+		}
+
+		shift = level * OHM_FACT_STORE_WHEEL_BITS;
+		block = self->now >> shift;
+		bits = _ohm_fact_store_wheel_rotate (self->occupied[level], block & OHM_FACT_STORE_WHEEL_MASK);
+		if ((self->now & ((G_GUINT64_CONSTANT (1) << shift) - 1)) != 0) {
+			bits &= ~G_GUINT64_CONSTANT (1);
+		}
+		d = bits != 0 ? _ohm_fact_store_wheel_first (bits) : OHM_FACT_STORE_WHEEL_SLOTS;
+		next = MIN (next, (block + d) << shift);
+	}
+
+	if (self->slots[OHM_FACT_STORE_WHEEL_OVERFLOW] != NULL) {
+		guint64 turn;
+
+		turn = (G_GUINT64_CONSTANT (1) << (OHM_FACT_STORE_WHEEL_LEVELS * OHM_FACT_STORE_WHEEL_BITS)) - 1;
+		next = MIN (next, (self->now + turn) & ~turn);
+	}
+
+	return next;
+}
+
+
+/* unlink the facts due by @tick into @expired, with a reference */
+static void _ohm_fact_store_wheel_advance (OhmFactStoreWheel* self, guint64 tick, GPtrArray* expired) {
+	while (self->now <= tick && self->count > 0) {
+		guint index;
+
+		index = self->now & OHM_FACT_STORE_WHEEL_MASK;
+		if (index == 0) {
+			guint level;
+
+			for (level = 1; level < OHM_FACT_STORE_WHEEL_LEVELS; level++) {
+				guint i;
+
+				i = (self->now >> (level * OHM_FACT_STORE_WHEEL_BITS)) & OHM_FACT_STORE_WHEEL_MASK;
+				_ohm_fact_store_wheel_cascade (self, level * OHM_FACT_STORE_WHEEL_SLOTS + i);
+				if (i != 0) {
+					break;
+				}
+			}
+			if (level == OHM_FACT_STORE_WHEEL_LEVELS) {
+				_ohm_fact_store_wheel_cascade (self, OHM_FACT_STORE_WHEEL_OVERFLOW);
+			}
+		}
+
+		while (self->slots[index] != NULL) {
+			OhmFact* fact;
+
+			fact = self->slots[index];
+			_ohm_fact_store_wheel_unlink (self, fact);
+			self->count--;
+			g_ptr_array_add (expired, g_object_ref (fact));
+		}
+
+		/* skip the ticks with nothing to do */
+		self->now++;
+		if (self->count > 0) {
+			self->now = MAX (self->now, MIN (_ohm_fact_store_wheel_next (self), tick + 1));
+		}
+	}
+
+	self->now = MAX (self->now, tick + 1);
+}
+
+
+static gboolean _ohm_fact_store_expire_timeout (gpointer data);
+
+/* make the source of @self due at the next tick to process */
+static void _ohm_fact_store_wheel_arm (OhmFactStore* self) {
+	OhmFactStoreWheel* wheel;
+	guint64 next;
+	guint64 now;
+
+	wheel = self->priv->wheel;
+	if (wheel->count == 0) {
+		if (wheel->source != NULL) {
+			g_source_destroy (wheel->source);
+			wheel->source = NULL;
+		}
+		return;
+	}
+
+	next = _ohm_fact_store_wheel_next (wheel);
+	if (wheel->source != NULL) {
+		if (wheel->wake <= next) {
+			return;
+		}
+		g_source_destroy (wheel->source);
+	}
+
+	now = _ohm_fact_store_wheel_time ();
+	wheel->wake = next;
+	wheel->source = g_timeout_source_new ((guint) MIN (next > now ? next - now : 0, G_MAXUINT));
+	g_source_set_callback (wheel->source, _ohm_fact_store_expire_timeout, self, NULL);
+	g_source_attach (wheel->source, NULL);
+	g_source_unref (wheel->source);
+}
+
+
+static void _ohm_fact_store_wheel_free (OhmFactStoreWheel* self) {
+	gint slot;
+
+	if (self->source != NULL) {
+		g_source_destroy (self->source);
+	}
+
+	/* the facts may outlive the store */
+	for (slot = 0; slot <= OHM_FACT_STORE_WHEEL_OVERFLOW; slot++) {
+		while (self->slots[slot] != NULL) {
+			_ohm_fact_store_wheel_unlink (self, self->slots[slot]);
+		}
+	}
+
+	g_free (self);
+}
+
+
+/* called with the name of @fact locked, as it enters @self */
+static void _ohm_fact_store_schedule_expiry (OhmFactStore* self, OhmFact* fact) {
+	OhmFactStoreWheel* wheel;
+
+	if (fact->priv->expiry == 0) {
+		return;
+	}
+
+	_ohm_fact_store_lock_shared (self);
+
+	if (self->priv->wheel == NULL) {
+		self->priv->wheel = g_new0 (OhmFactStoreWheel, 1);
+	}
+
+	wheel = self->priv->wheel;
+	if (wheel->count == 0) {
+		wheel->now = _ohm_fact_store_wheel_time ();
+	}
+
+	/* never early: round up to the next tick */
+	fact->priv->timer_tick = ((guint64) fact->priv->expiry + 999) / 1000;
+	_ohm_fact_store_wheel_link (wheel, fact);
+	wheel->count++;
+	_ohm_fact_store_wheel_arm (self);
+
+	_ohm_fact_store_unlock_shared (self);
+}
+
+
+static void _ohm_fact_store_cancel_expiry (OhmFactStore* self, OhmFact* fact) {
+	/* no fact of the store ever had an expiry */
+	if (self->priv->wheel == NULL) {
+		return;
+	}
+
+	_ohm_fact_store_lock_shared (self);
+
+	if (fact->priv->timer_slot >= 0) {
+		_ohm_fact_store_wheel_unlink (self->priv->wheel, fact);
+		self->priv->wheel->count--;
+		if (self->priv->wheel->count == 0) {
+			_ohm_fact_store_wheel_arm (self);
+		}
+	}
+
+	_ohm_fact_store_unlock_shared (self);
+}
+
+
+static gboolean _ohm_fact_store_expire_timeout (gpointer data) {
+	OhmFactStore* self;
+	OhmFactStoreWheel* wheel;
+	GPtrArray* expired;
+	gint64 now;
+	guint i;
+
+	self = OHM_FACT_STORE (data);
+	expired = g_ptr_array_new ();
+	now = g_get_monotonic_time ();
+
+	_ohm_fact_store_lock_shared (self);
+	wheel = self->priv->wheel;
+	if (wheel->source == g_main_current_source ()) {
+		wheel->source = NULL;
+	}
+	_ohm_fact_store_wheel_advance (wheel, (guint64) now / 1000, expired);
+	_ohm_fact_store_wheel_arm (self);
+	_ohm_fact_store_unlock_shared (self);
+
+	/* one commit for the facts expiring together */
+	if (expired->len > 1) {
+		ohm_fact_store_transaction_push (self);
+	}
+
+	for (i = 0; i < expired->len; i++) {
+		OhmFact* fact;
+
+		/* unless removed, or given a new expiry meanwhile */
+		fact = OHM_FACT (g_ptr_array_index (expired, i));
+		if (ohm_fact_get_fact_store (fact) == self && fact->priv->expiry != 0 && fact->priv->expiry <= now) {
+			ohm_fact_store_remove (self, fact);
+		}
+		g_object_unref (fact);
+	}
+
+	if (expired->len > 1) {
+		ohm_fact_store_transaction_pop (self, FALSE);
+	}
+
+	g_ptr_array_free (expired, TRUE);
+
+	return FALSE;
+}
+
+
+GQuark ohm_fact_store_error_quark (void) {
+	return g_quark_from_static_string ("ohm-fact-store-error-quark");
+}
+
+
+static void _ohm_fact_store_dump_u32 (GByteArray* data, guint32 value) {
+	value = GUINT32_TO_LE (value);
+	g_byte_array_append (data, (const guint8*) &value, sizeof (value));
+}
+
+
+static void _ohm_fact_store_dump_u64 (GByteArray* data, guint64 value) {
+	value = GUINT64_TO_LE (value);
+	g_byte_array_append (data, (const guint8*) &value, sizeof (value));
+}
+
+
+static void _ohm_fact_store_dump_init (OhmFactStoreDump* self) {
+	self->strings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	self->string_table = g_byte_array_new ();
+	self->n_strings = 0;
+	self->index = g_hash_table_new (g_direct_hash, g_direct_equal);
+	self->facts = g_ptr_array_new ();
+	self->grow = TRUE;
+	self->body = g_byte_array_new ();
+}
+
+
+static void _ohm_fact_store_dump_clear (OhmFactStoreDump* self) {
+	g_hash_table_destroy (self->strings);
+	g_byte_array_free (self->string_table, TRUE);
+	g_hash_table_destroy (self->index);
+	g_ptr_array_free (self->facts, TRUE);
+	g_byte_array_free (self->body, TRUE);
+}
+
+
+static guint32 _ohm_fact_store_dump_string (OhmFactStoreDump* self, const gchar* str) {
+	gpointer index;
+	guint32 length;
+
+	if (str == NULL) {
+		return OHM_FACT_STORE_DUMP_NONE;
+	}
+
+	index = g_hash_table_lookup (self->strings, str);
+	if (index == NULL) {
+		index = GUINT_TO_POINTER (++self->n_strings);
+		g_hash_table_insert (self->strings, g_strdup (str), index);
+
+		length = strlen (str);
+		_ohm_fact_store_dump_u32 (self->string_table, length);
+		g_byte_array_append (self->string_table, (const guint8*) str, length);
+	}
+
+	return GPOINTER_TO_UINT (index) - 1;
+}
+
+
+/* the index of @fact in the dump, which gets it one if needed and allowed */
+static guint32 _ohm_fact_store_dump_fact_index (OhmFactStoreDump* self, OhmFact* fact) {
+	gpointer index;
+
+	if (fact == NULL) {
+		return OHM_FACT_STORE_DUMP_NONE;
+	}
+
+	index = g_hash_table_lookup (self->index, fact);
+	if (index == NULL) {
+		if (!self->grow) {
+			return OHM_FACT_STORE_DUMP_NONE;
+		}
+		g_ptr_array_add (self->facts, fact);
+		index = GUINT_TO_POINTER (self->facts->len);
+		g_hash_table_insert (self->index, fact, index);
+	}
+
+	return GPOINTER_TO_UINT (index) - 1;
+}
+
+
+/* write @field set to @v, unless values of its type are not kept */
+static gboolean _ohm_fact_store_dump_field (OhmFactStoreDump* self, GQuark field, const GValue* v) {
+	guint8 type;
+	guint64 value;
+	guint size;
+
+	if (v == NULL) {
+		return FALSE;
+	}
+
+	size = 4;
+	switch (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (v))) {
+	case G_TYPE_INT:
+		type = OHM_FACT_STORE_DUMP_INT;
+		value = (guint32) v->data[0].v_int;
+		break;
+	case G_TYPE_UINT:
+		type = OHM_FACT_STORE_DUMP_UINT;
+		value = v->data[0].v_uint;
+		break;
+	case G_TYPE_LONG:
+		type = OHM_FACT_STORE_DUMP_LONG;
+		value = (gint64) v->data[0].v_long;
+		size = 8;
+		break;
+	case G_TYPE_ULONG:
+		type = OHM_FACT_STORE_DUMP_ULONG;
+		value = v->data[0].v_ulong;
+		size = 8;
+		break;
+	case G_TYPE_INT64:
+		type = OHM_FACT_STORE_DUMP_INT64;
+		value = v->data[0].v_int64;
+		size = 8;
+		break;
+	case G_TYPE_UINT64:
+		type = OHM_FACT_STORE_DUMP_UINT64;
+		value = v->data[0].v_uint64;
+		size = 8;
+		break;
+	case G_TYPE_BOOLEAN:
+		type = OHM_FACT_STORE_DUMP_BOOLEAN;
+		value = v->data[0].v_int != FALSE;
+		size = 1;
+		break;
+	case G_TYPE_CHAR:
+		type = OHM_FACT_STORE_DUMP_CHAR;
+		value = (guint8) v->data[0].v_int;
+		size = 1;
+		break;
+	case G_TYPE_UCHAR:
+		type = OHM_FACT_STORE_DUMP_UCHAR;
+		value = (guint8) v->data[0].v_uint;
+		size = 1;
+		break;
+	case G_TYPE_FLOAT: {
+		guint32 bits;
+
+		memcpy (&bits, &v->data[0].v_float, sizeof (bits));
+		type = OHM_FACT_STORE_DUMP_FLOAT;
+		value = bits;
+		break;
+	}
+	case G_TYPE_DOUBLE:
+		type = OHM_FACT_STORE_DUMP_DOUBLE;
+		memcpy (&value, &v->data[0].v_double, sizeof (value));
+		size = 8;
+		break;
+	case G_TYPE_STRING:
+		type = OHM_FACT_STORE_DUMP_STRING;
+		value = _ohm_fact_store_dump_string (self, g_value_get_string (v));
+		break;
+	case G_TYPE_OBJECT:
+		if (G_VALUE_HOLDS (v, OHM_TYPE_FACT)) {
+			type = OHM_FACT_STORE_DUMP_FACT;
+			value = _ohm_fact_store_dump_fact_index (self, g_value_get_object (v));
+			break;
+		}
+		/* fall through */
+	default:
+		/* pointers and other objects do not outlive the process */
+		return FALSE;
+	}
+
+	_ohm_fact_store_dump_u32 (self->body, _ohm_fact_store_dump_string (self, g_quark_to_string (field)));
+	g_byte_array_append (self->body, &type, 1);
+	if (size == 1) {
+		guint8 byte = value;
+
+		g_byte_array_append (self->body, &byte, 1);
+	} else if (size == 4) {
+		_ohm_fact_store_dump_u32 (self->body, value);
+	} else {
+		_ohm_fact_store_dump_u64 (self->body, value);
+	}
+
+	return TRUE;
+}
+
+
+static void _ohm_fact_store_dump_fact (OhmFactStoreDump* self, OhmFact* fact) {
+	OhmStructurePrivate* priv;
+	guint n_fields_at;
+	guint32 n_fields;
+	guint i;
+
+	priv = OHM_STRUCTURE (fact)->priv;
+	_ohm_fact_store_dump_u32 (self->body, _ohm_fact_store_dump_string (self, ohm_structure_get_name (OHM_STRUCTURE (fact))));
+	n_fields_at = self->body->len;
+	_ohm_fact_store_dump_u32 (self->body, 0);
+
+	n_fields = 0;
+	for (i = 0; i < priv->n_fields; i++) {
+		if (_ohm_fact_store_dump_field (self, priv->entries[i].field, priv->entries[i].value)) {
+			n_fields++;
+		}
+	}
+
+	n_fields = GUINT32_TO_LE (n_fields);
+	memcpy (self->body->data + n_fields_at, &n_fields, sizeof (n_fields));
+}
+
+
+/*
+ * Encode the facts of @self in @dump, with all the shards held and
+ * outside of any transaction. Returns the number of facts in the store.
+ */
+static guint32 _ohm_fact_store_dump_collect (OhmFactStore* self, OhmFactStoreDump* dump) {
+	GHashTableIter iter;
+	gpointer facts;
+	guint32 n_stored;
+	guint i;
+
+	/* the facts of the store come first, oldest first to keep their order */
+	g_hash_table_iter_init (&iter, self->priv->facts);
+	while (g_hash_table_iter_next (&iter, NULL, &facts)) {
+		GList* l;
+
+		for (l = g_list_last (((OhmFactStoreFacts*) facts)->facts); l != NULL; l = l->prev) {
+			_ohm_fact_store_dump_fact_index (dump, OHM_FACT (l->data));
+		}
+	}
+	n_stored = dump->facts->len;
+
+	/* and the facts they refer to are appended as they are met */
+	for (i = 0; i < dump->facts->len; i++) {
+		_ohm_fact_store_dump_fact (dump, g_ptr_array_index (dump->facts, i));
+	}
+
+	return n_stored;
+}
+
+
+static void _ohm_fact_store_dump_serialize (OhmFactStoreDump* dump, guint32 n_stored, GByteArray* data) {
+	g_byte_array_append (data, (const guint8*) OHM_FACT_STORE_DUMP_MAGIC, 4);
+	_ohm_fact_store_dump_u32 (data, OHM_FACT_STORE_DUMP_VERSION);
+	_ohm_fact_store_dump_u32 (data, dump->n_strings);
+	g_byte_array_append (data, dump->string_table->data, dump->string_table->len);
+	_ohm_fact_store_dump_u32 (data, dump->facts->len);
+	_ohm_fact_store_dump_u32 (data, n_stored);
+	g_byte_array_append (data, dump->body->data, dump->body->len);
+}
+
+
+static gboolean _ohm_fact_store_write_all (int fd, const guint8* data, gsize length, GError** error) {
+	while (length > 0) {
+		gssize n;
+
+		n = write (fd, data, length);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			g_set_error (error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_IO,
+				     "cannot write the fact store dump: %s", g_strerror (errno));
+			return FALSE;
+		}
+		data += n;
+		length -= n;
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * ohm_fact_store_dump:
+ * @self: a #OhmFactStore
+ * @fd: a file descriptor open for writing
+ * @error: return location for a #GError, or %NULL
+ *
+ * Write the facts of @self to @fd in a compact binary form, to be read
+ * back with ohm_fact_store_restore (), for instance by the next
+ * instance of the daemon after a restart. The facts are written with
+ * their names, fields and values. A field holding a fact refers to that
+ * fact, which is written as well even if it is not in the store. Fields
+ * holding pointers or other objects are left out.
+ *
+ * The store can not be dumped within a transaction.
+ *
+ * Returns: %TRUE on success, %FALSE if @error was set.
+ **/
+gboolean ohm_fact_store_dump (OhmFactStore* self, int fd, GError** error) {
+	OhmFactStoreDump dump;
+	GByteArray* data;
+	guint32 n_stored;
+	gboolean ok;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (fd >= 0, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	if (!g_queue_is_empty (self->transaction)) {
+		_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+		g_set_error (error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_BUSY,
+			     "cannot dump the fact store within a transaction");
+		return FALSE;
+	}
+
+	_ohm_fact_store_dump_init (&dump);
+	n_stored = _ohm_fact_store_dump_collect (self, &dump);
+
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	data = g_byte_array_sized_new (16 + dump.string_table->len + dump.body->len);
+	_ohm_fact_store_dump_serialize (&dump, n_stored, data);
+	ok = _ohm_fact_store_write_all (fd, data->data, data->len, error);
+
+	g_byte_array_free (data, TRUE);
+	_ohm_fact_store_dump_clear (&dump);
+
+	return ok;
+}
+
+
+static void _ohm_fact_store_unref_fact (gpointer fact) {
+	if (fact != NULL) {
+		g_object_unref (fact);
+	}
+}
+
+
+static void _ohm_fact_store_restore_init (OhmFactStoreRestore* self) {
+	self->pos = NULL;
+	self->end = NULL;
+	self->valid = TRUE;
+	self->chunk = g_string_chunk_new (4096);
+	self->strings = g_ptr_array_new ();
+	self->quarks = g_array_new (FALSE, TRUE, sizeof (GQuark));
+	self->facts = g_ptr_array_new_with_free_func (_ohm_fact_store_unref_fact);
+}
+
+
+/* read @data next, with the strings and facts read so far */
+static void _ohm_fact_store_restore_feed (OhmFactStoreRestore* self, const guint8* data, gsize length) {
+	self->pos = data;
+	self->end = data + length;
+	self->valid = TRUE;
+}
+
+
+static void _ohm_fact_store_restore_clear (OhmFactStoreRestore* self) {
+	g_string_chunk_free (self->chunk);
+	g_ptr_array_free (self->strings, TRUE);
+	g_array_free (self->quarks, TRUE);
+	g_ptr_array_free (self->facts, TRUE);
+}
+
+
+static guint64 _ohm_fact_store_restore_read (OhmFactStoreRestore* self, guint size) {
+	guint64 value;
+
+	if (!self->valid || (gsize) (self->end - self->pos) < size) {
+		self->valid = FALSE;
+		return 0;
+	}
+
+	if (size == 1) {
+		value = self->pos[0];
+	} else if (size == 4) {
+		guint32 v;
+
+		memcpy (&v, self->pos, sizeof (v));
+		value = GUINT32_FROM_LE (v);
+	} else {
+		memcpy (&value, self->pos, sizeof (value));
+		value = GUINT64_FROM_LE (value);
+	}
+	self->pos += size;
+
+	return value;
+}
+
+
+static gboolean _ohm_fact_store_restore_header (OhmFactStoreRestore* self, const gchar* magic, guint32 version) {
+	if (!self->valid || (gsize) (self->end - self->pos) < 4 || memcmp (self->pos, magic, 4) != 0) {
+		self->valid = FALSE;
+		return FALSE;
+	}
+	self->pos += 4;
+
+	if (_ohm_fact_store_restore_read (self, 4) != version) {
+		self->valid = FALSE;
+	}
+
+	return self->valid;
+}
+
+
+static void _ohm_fact_store_restore_strings (OhmFactStoreRestore* self, guint32 n_strings) {
+	guint i;
+
+	if (n_strings > (gsize) (self->end - self->pos) / 4) {
+		self->valid = FALSE;
+	}
+
+	for (i = 0; i < n_strings && self->valid; i++) {
+		guint32 length;
+
+		length = _ohm_fact_store_restore_read (self, 4);
+		if (!self->valid || length > (gsize) (self->end - self->pos)) {
+			self->valid = FALSE;
+			break;
+		}
+		g_ptr_array_add (self->strings, g_string_chunk_insert_len (self->chunk, (const gchar*) self->pos, length));
+		self->pos += length;
+	}
+	g_array_set_size (self->quarks, self->strings->len);
+}
+
+
+static guint32 _ohm_fact_store_restore_string (OhmFactStoreRestore* self, gboolean nullable) {
+	guint32 index;
+
+	index = _ohm_fact_store_restore_read (self, 4);
+	if (index >= self->strings->len && !(nullable && index == OHM_FACT_STORE_DUMP_NONE)) {
+		self->valid = FALSE;
+	}
+
+	return index;
+}
+
+
+static GQuark _ohm_fact_store_restore_quark (OhmFactStoreRestore* self, guint32 index) {
+	GQuark* quark;
+
+	quark = &g_array_index (self->quarks, GQuark, index);
+	if (*quark == 0) {
+		*quark = g_quark_from_string (g_ptr_array_index (self->strings, index));
+	}
+
+	return *quark;
+}
+
+
+/*
+ * Read a value of @type, into @value if not %NULL. A fact value must be
+ * the index of a known fact; @value is left unset for a type of 0.
+ */
+static void _ohm_fact_store_restore_value (OhmFactStoreRestore* self, guint8 type, GValue* value) {
+	guint64 raw = 0;
+
+	switch (type) {
+	case 0:
+		return;
+	case OHM_FACT_STORE_DUMP_BOOLEAN:
+	case OHM_FACT_STORE_DUMP_CHAR:
+	case OHM_FACT_STORE_DUMP_UCHAR:
+		raw = _ohm_fact_store_restore_read (self, 1);
+		break;
+	case OHM_FACT_STORE_DUMP_INT:
+	case OHM_FACT_STORE_DUMP_UINT:
+	case OHM_FACT_STORE_DUMP_FLOAT:
+		raw = _ohm_fact_store_restore_read (self, 4);
+		break;
+	case OHM_FACT_STORE_DUMP_LONG:
+	case OHM_FACT_STORE_DUMP_ULONG:
+	case OHM_FACT_STORE_DUMP_INT64:
+	case OHM_FACT_STORE_DUMP_UINT64:
+	case OHM_FACT_STORE_DUMP_DOUBLE:
+		raw = _ohm_fact_store_restore_read (self, 8);
+		break;
+	case OHM_FACT_STORE_DUMP_STRING:
+		raw = _ohm_fact_store_restore_string (self, TRUE);
+		break;
+	case OHM_FACT_STORE_DUMP_FACT:
+		raw = _ohm_fact_store_restore_read (self, 4);
+		if (raw >= self->facts->len && raw != OHM_FACT_STORE_DUMP_NONE) {
+			self->valid = FALSE;
+		}
+		break;
+	default:
+		self->valid = FALSE;
+		break;
+	}
+
+	if (value == NULL || !self->valid) {
+		return;
+	}
+
+	switch (type) {
+	case OHM_FACT_STORE_DUMP_INT:
+		g_value_init (value, G_TYPE_INT);
+		g_value_set_int (value, (gint32) raw);
+		break;
+	case OHM_FACT_STORE_DUMP_UINT:
+		g_value_init (value, G_TYPE_UINT);
+		g_value_set_uint (value, raw);
+		break;
+	case OHM_FACT_STORE_DUMP_LONG:
+		g_value_init (value, G_TYPE_LONG);
+		g_value_set_long (value, (gint64) raw);
+		break;
+	case OHM_FACT_STORE_DUMP_ULONG:
+		g_value_init (value, G_TYPE_ULONG);
+		g_value_set_ulong (value, raw);
+		break;
+	case OHM_FACT_STORE_DUMP_INT64:
+		g_value_init (value, G_TYPE_INT64);
+		g_value_set_int64 (value, (gint64) raw);
+		break;
+	case OHM_FACT_STORE_DUMP_UINT64:
+		g_value_init (value, G_TYPE_UINT64);
+		g_value_set_uint64 (value, raw);
+		break;
+	case OHM_FACT_STORE_DUMP_BOOLEAN:
+		g_value_init (value, G_TYPE_BOOLEAN);
+		g_value_set_boolean (value, raw != 0);
+		break;
+	case OHM_FACT_STORE_DUMP_CHAR:
+		g_value_init (value, G_TYPE_CHAR);
+		value->data[0].v_int = (gint8) raw;
+		break;
+	case OHM_FACT_STORE_DUMP_UCHAR:
+		g_value_init (value, G_TYPE_UCHAR);
+		g_value_set_uchar (value, raw);
+		break;
+	case OHM_FACT_STORE_DUMP_FLOAT: {
+		guint32 bits = raw;
+		gfloat f;
+
+		memcpy (&f, &bits, sizeof (f));
+		g_value_init (value, G_TYPE_FLOAT);
+		g_value_set_float (value, f);
+		break;
+	}
+	case OHM_FACT_STORE_DUMP_DOUBLE: {
+		gdouble d;
+
+		memcpy (&d, &raw, sizeof (d));
+		g_value_init (value, G_TYPE_DOUBLE);
+		g_value_set_double (value, d);
+		break;
+	}
+	case OHM_FACT_STORE_DUMP_STRING:
+		g_value_init (value, G_TYPE_STRING);
+		g_value_set_string (value, raw == OHM_FACT_STORE_DUMP_NONE ? NULL : g_ptr_array_index (self->strings, raw));
+		break;
+	case OHM_FACT_STORE_DUMP_FACT:
+		g_value_init (value, OHM_TYPE_FACT);
+		g_value_set_object (value, raw == OHM_FACT_STORE_DUMP_NONE ? NULL : g_ptr_array_index (self->facts, raw));
+		break;
+	}
+}
+
+
+/* read the fields of a fact, and store them in @fact unless it is %NULL */
+static gboolean _ohm_fact_store_restore_fields (OhmFactStoreRestore* self, OhmFact* fact) {
+	guint32 n_fields;
+	guint i;
+
+	n_fields = _ohm_fact_store_restore_read (self, 4);
+
+	for (i = 0; i < n_fields && self->valid; i++) {
+		GValue value = {0,};
+		guint32 field;
+		guint8 type;
+
+		field = _ohm_fact_store_restore_string (self, FALSE);
+		type = _ohm_fact_store_restore_read (self, 1);
+		if (type == 0) {
+			self->valid = FALSE;
+		}
+		_ohm_fact_store_restore_value (self, type, fact != NULL ? &value : NULL);
+
+		/* the fact is not in any store yet, nobody to notify */
+		if (fact != NULL && self->valid) {
+			_ohm_structure_store (OHM_STRUCTURE (fact), _ohm_fact_store_restore_quark (self, field), &value);
+		}
+	}
+
+	return self->valid;
+}
+
+
+/*
+ * Read a dump, from its magic on. The first pass checks it and creates
+ * the facts, which the fields read by the second pass may refer to. The
+ * facts in the store are then all inserted at once.
+ */
+static gboolean _ohm_fact_store_restore_dump (OhmFactStore* store, OhmFactStoreRestore* self) {
+	const guint8* facts_at;
+	OhmFactStoreOp* ops;
+	guint32 n_facts, n_stored;
+	guint i;
+
+	_ohm_fact_store_restore_header (self, OHM_FACT_STORE_DUMP_MAGIC, OHM_FACT_STORE_DUMP_VERSION);
+	_ohm_fact_store_restore_strings (self, _ohm_fact_store_restore_read (self, 4));
+
+	n_facts = _ohm_fact_store_restore_read (self, 4);
+	n_stored = _ohm_fact_store_restore_read (self, 4);
+	if (!self->valid || n_stored > n_facts || n_facts > (gsize) (self->end - self->pos) / 8) {
+		self->valid = FALSE;
+		return FALSE;
+	}
+
+	g_ptr_array_set_size (self->facts, n_facts);
+	facts_at = self->pos;
+	for (i = 0; i < n_facts && self->valid; i++) {
+		guint32 name;
+
+		name = _ohm_fact_store_restore_string (self, FALSE);
+		if (self->valid) {
+			g_ptr_array_index (self->facts, i) = ohm_fact_new (g_ptr_array_index (self->strings, name));
+			_ohm_fact_store_restore_fields (self, NULL);
+		}
+	}
+
+	self->pos = facts_at;
+	for (i = 0; i < n_facts && self->valid; i++) {
+		_ohm_fact_store_restore_string (self, FALSE);
+		_ohm_fact_store_restore_fields (self, g_ptr_array_index (self->facts, i));
+	}
+
+	if (!self->valid) {
+		return FALSE;
+	}
+
+	ops = g_new0 (OhmFactStoreOp, n_stored);
+	for (i = 0; i < n_stored; i++) {
+		ops[i].type = OHM_FACT_STORE_OP_INSERT;
+		ops[i].fact = g_ptr_array_index (self->facts, i);
+	}
+	ohm_fact_store_apply_batch (store, ops, n_stored);
+	g_free (ops);
+
+	return TRUE;
+}
+
+
+/**
+ * ohm_fact_store_restore:
+ * @self: a #OhmFactStore
+ * @fd: a file descriptor open for reading
+ * @error: return location for a #GError, or %NULL
+ *
+ * Read the facts written by ohm_fact_store_dump () from @fd and insert
+ * them all into @self at once, as ohm_fact_store_apply_batch () does.
+ * The facts are restored as they were dumped, including the facts that
+ * their fields refer to. Nothing is inserted if the dump is not valid.
+ *
+ * Returns: %TRUE on success, %FALSE if @error was set.
+ **/
+gboolean ohm_fact_store_restore (OhmFactStore* self, int fd, GError** error) {
+	OhmFactStoreRestore restore;
+	GByteArray* data;
+	gboolean valid;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (fd >= 0, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	data = g_byte_array_new ();
+	for (;;) {
+		guint8 buf[16384];
+		gssize n;
+
+		n = read (fd, buf, sizeof (buf));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			g_set_error (error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_IO,
+				     "cannot read the fact store dump: %s", g_strerror (errno));
+			g_byte_array_free (data, TRUE);
+			return FALSE;
+		}
+		if (n == 0) {
+			break;
+		}
+		g_byte_array_append (data, buf, n);
+	}
+
+	_ohm_fact_store_restore_init (&restore);
+	_ohm_fact_store_restore_feed (&restore, data->data, data->len);
+	valid = _ohm_fact_store_restore_dump (self, &restore);
+	if (!valid) {
+		g_set_error (error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_FORMAT,
+			     "invalid fact store dump");
+	}
+	_ohm_fact_store_restore_clear (&restore);
+	g_byte_array_free (data, TRUE);
+
+	return valid;
+}
+
+
+static guint32 _ohm_fact_store_journal_checksum (const guint8* data, gsize length) {
+	guint32 hash = 2166136261U;
+	gsize i;
+
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ data[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+
+static void _ohm_fact_store_journal_header (GByteArray* data, const gchar* magic, guint64 generation) {
+	g_byte_array_append (data, (const guint8*) magic, 4);
+	_ohm_fact_store_dump_u32 (data, OHM_FACT_STORE_JOURNAL_VERSION);
+	_ohm_fact_store_dump_u64 (data, generation);
+}
+
+
+/*
+ * Start a new generation, with all the shards of @store held and
+ * outside of any transaction: the encoder restarts from a dump of the
+ * store, which is returned as the snapshot of the generation.
+ */
+static GByteArray* _ohm_fact_store_journal_rebase (OhmFactStoreJournal* self, OhmFactStore* store) {
+	GByteArray* snapshot;
+	guint32 n_stored;
+	guint i;
+
+	_ohm_fact_store_dump_clear (&self->encoder);
+	_ohm_fact_store_dump_init (&self->encoder);
+	n_stored = _ohm_fact_store_dump_collect (store, &self->encoder);
+
+	self->generation++;
+	snapshot = g_byte_array_sized_new (OHM_FACT_STORE_JOURNAL_HEADER_SIZE + 16 +
+					   self->encoder.string_table->len + self->encoder.body->len);
+	_ohm_fact_store_journal_header (snapshot, OHM_FACT_STORE_JOURNAL_SNAPSHOT_MAGIC, self->generation);
+	_ohm_fact_store_dump_serialize (&self->encoder, n_stored, snapshot);
+
+	/* the records to come carry on the numbering of the strings and facts */
+	g_byte_array_set_size (self->encoder.string_table, 0);
+	g_byte_array_set_size (self->encoder.body, 0);
+	self->framed_strings = self->encoder.n_strings;
+	self->encoder.grow = FALSE;
+	for (i = 0; i < self->encoder.facts->len; i++) {
+		g_object_ref (g_ptr_array_index (self->encoder.facts, i));
+	}
+	g_ptr_array_set_free_func (self->encoder.facts, _ohm_fact_store_unref_fact);
+
+	return snapshot;
+}
+
+
+static int _ohm_fact_store_journal_create (const gchar* path, GByteArray* data, GError** error) {
+	gchar* tmp;
+	int fd;
+
+	tmp = g_strconcat (path, ".tmp", NULL);
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		g_set_error (error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_IO,
+			     "cannot create %s: %s", tmp, g_strerror (errno));
+		g_free (tmp);
+		return -1;
+	}
+
+	if (!_ohm_fact_store_write_all (fd, data->data, data->len, error)) {
+		close (fd);
+		fd = -1;
+	} else if (fsync (fd) < 0 || rename (tmp, path) < 0) {
+		g_set_error (error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_IO,
+			     "cannot write %s: %s", path, g_strerror (errno));
+		close (fd);
+		fd = -1;
+	}
+
+	if (fd < 0) {
+		unlink (tmp);
+	}
+	g_free (tmp);
+
+	return fd;
+}
+
+
+/*
+ * Make @snapshot the snapshot of its generation on disk, and start the
+ * journal of that generation. A crash in between leaves a journal of an
+ * older generation, which is ignored: the snapshot holds its records.
+ */
+static gboolean _ohm_fact_store_journal_switch (OhmFactStoreJournal* self, GByteArray* snapshot, GError** error) {
+	GByteArray* header;
+	guint64 generation;
+	gchar* dir;
+	int fd, dir_fd;
+
+	fd = _ohm_fact_store_journal_create (self->snapshot_path, snapshot, error);
+	if (fd < 0) {
+		return FALSE;
+	}
+	close (fd);
+
+	memcpy (&generation, snapshot->data + 8, sizeof (generation));
+	header = g_byte_array_new ();
+	_ohm_fact_store_journal_header (header, OHM_FACT_STORE_JOURNAL_MAGIC, GUINT64_FROM_LE (generation));
+	fd = _ohm_fact_store_journal_create (self->path, header, error);
+	g_byte_array_free (header, TRUE);
+	if (fd < 0) {
+		return FALSE;
+	}
+
+	/* make the renames durable */
+	dir = g_path_get_dirname (self->path);
+	dir_fd = open (dir, O_RDONLY);
+	if (dir_fd >= 0) {
+		fsync (dir_fd);
+		close (dir_fd);
+	}
+	g_free (dir);
+
+	if (self->fd >= 0) {
+		close (self->fd);
+	}
+	self->fd = fd;
+	self->size = OHM_FACT_STORE_JOURNAL_HEADER_SIZE;
+
+	return TRUE;
+}
+
+
+static gboolean _ohm_fact_store_journal_compact_idle (gpointer data) {
+	OhmFactStoreJournal* self = data;
+
+	g_mutex_lock (&self->lock);
+	self->compact_source = 0;
+	g_mutex_unlock (&self->lock);
+
+	ohm_fact_store_journal_compact (self->store);
+
+	return FALSE;
+}
+
+
+static void _ohm_fact_store_journal_sync (OhmFactStoreJournal* self) {
+	guint64 written;
+
+	written = self->written;
+	g_mutex_unlock (&self->lock);
+	if (fsync (self->fd) < 0) {
+		g_warning ("cannot sync the fact store journal: %s", g_strerror (errno));
+	}
+	g_mutex_lock (&self->lock);
+	self->synced = written;
+	g_cond_broadcast (&self->done);
+}
+
+
+/*
+ * The writer thread: write the queued snapshots and frames, all the
+ * frames queued at once in a single write, and sync the journal once
+ * @sync_commits frames are written, @sync_delay ms after the first
+ * frame not synced, or when flushing.
+ */
+static gpointer _ohm_fact_store_journal_writer (gpointer data) {
+	OhmFactStoreJournal* self = data;
+
+	g_mutex_lock (&self->lock);
+	while (!self->stop || self->pending->len > 0 || self->snapshot != NULL || self->written > self->synced) {
+		GByteArray* snapshot;
+		GByteArray* frames;
+		GError* error = NULL;
+		guint64 queued;
+
+		if (self->pending->len == 0 && self->snapshot == NULL) {
+			gint64 deadline;
+
+			if (self->written == self->synced) {
+				g_cond_wait (&self->wake, &self->lock);
+				continue;
+			}
+
+			deadline = self->sync_delay > 0 ? self->unsynced_since + (gint64) self->sync_delay * 1000 : G_MAXINT64;
+			if (!self->stop && self->flushing == 0 && g_get_monotonic_time () < deadline) {
+				if (deadline == G_MAXINT64) {
+					g_cond_wait (&self->wake, &self->lock);
+				} else {
+					g_cond_wait_until (&self->wake, &self->lock, deadline);
+				}
+				continue;
+			}
+
+			_ohm_fact_store_journal_sync (self);
+			continue;
+		}
+
+		snapshot = self->snapshot;
+		self->snapshot = NULL;
+		frames = self->pending;
+		self->pending = self->writing;
+		self->writing = frames;
+		queued = self->queued;
+		g_mutex_unlock (&self->lock);
+
+		if (snapshot != NULL) {
+			if (!_ohm_fact_store_journal_switch (self, snapshot, &error)) {
+				g_warning ("cannot compact the fact store journal: %s", error->message);
+				g_clear_error (&error);
+			}
+			g_byte_array_free (snapshot, TRUE);
+		}
+
+		if (frames->len > 0 && self->fd >= 0) {
+			if (_ohm_fact_store_write_all (self->fd, frames->data, frames->len, &error)) {
+				self->size += frames->len;
+			} else {
+				g_warning ("%s", error->message);
+				g_clear_error (&error);
+			}
+		}
+		g_byte_array_set_size (frames, 0);
+
+		g_mutex_lock (&self->lock);
+		if (self->written == self->synced) {
+			self->unsynced_since = g_get_monotonic_time ();
+		}
+		self->written = queued;
+		g_cond_broadcast (&self->done);
+
+		if (self->sync_commits > 0 && self->written - self->synced >= self->sync_commits) {
+			_ohm_fact_store_journal_sync (self);
+		}
+
+		if (self->compact_size > 0 && self->size > self->compact_size && self->compact_source == 0) {
+			self->compact_source = g_idle_add (_ohm_fact_store_journal_compact_idle, self);
+		}
+	}
+	g_mutex_unlock (&self->lock);
+
+	return NULL;
+}
+
+
+/* queue what was encoded since the last frame as a new frame, under @lock */
+static void _ohm_fact_store_journal_frame (OhmFactStoreJournal* self) {
+	OhmFactStoreDump* encoder;
+	guint32 header[2] = { 0, 0 };
+	guint32 n_strings;
+	guint start;
+
+	encoder = &self->encoder;
+	if (encoder->body->len == 0 && encoder->n_strings == self->framed_strings) {
+		return;
+	}
+
+	start = self->pending->len;
+	g_byte_array_append (self->pending, (const guint8*) header, sizeof (header));
+	n_strings = GUINT32_TO_LE (encoder->n_strings - self->framed_strings);
+	g_byte_array_append (self->pending, (const guint8*) &n_strings, sizeof (n_strings));
+	g_byte_array_append (self->pending, encoder->string_table->data, encoder->string_table->len);
+	g_byte_array_append (self->pending, encoder->body->data, encoder->body->len);
+
+	header[0] = GUINT32_TO_LE (self->pending->len - start - sizeof (header));
+	header[1] = GUINT32_TO_LE (_ohm_fact_store_journal_checksum (self->pending->data + start + sizeof (header),
+								      self->pending->len - start - sizeof (header)));
+	memcpy (self->pending->data + start, header, sizeof (header));
+
+	g_byte_array_set_size (encoder->string_table, 0);
+	g_byte_array_set_size (encoder->body, 0);
+	self->framed_strings = encoder->n_strings;
+	self->queued++;
+	g_cond_signal (&self->wake);
+
+	/* do not let a stalled disk eat the memory */
+	while (self->pending->len > OHM_FACT_STORE_JOURNAL_MAX_PENDING) {
+		g_cond_wait (&self->done, &self->lock);
+	}
+}
+
+
+/*
+ * Record a committed insertion, removal or change of @field of @fact.
+ * The changes undone by a rollback are not recorded.
+ */
+static void _ohm_fact_store_journal_log (OhmFactStore* self, OhmFactStoreOpType type, OhmFact* fact, GQuark field) {
+	OhmFactStoreJournal* journal;
+	OhmFactStoreDump* encoder;
+	gpointer index;
+	guint8 record;
+
+	journal = self->priv->journal;
+	if (journal == NULL) {
+		return;
+	}
+
+	g_mutex_lock (&journal->lock);
+	if (journal->muted > 0) {
+		g_mutex_unlock (&journal->lock);
+		return;
+	}
+
+	encoder = &journal->encoder;
+	index = g_hash_table_lookup (encoder->index, fact);
+
+	switch (type) {
+	case OHM_FACT_STORE_OP_INSERT:
+		if (index == NULL) {
+			g_ptr_array_add (encoder->facts, g_object_ref (fact));
+			index = GUINT_TO_POINTER (encoder->facts->len);
+			g_hash_table_insert (encoder->index, fact, index);
+		}
+		record = OHM_FACT_STORE_JOURNAL_INSERT;
+		g_byte_array_append (encoder->body, &record, 1);
+		_ohm_fact_store_dump_u32 (encoder->body, GPOINTER_TO_UINT (index) - 1);
+		_ohm_fact_store_dump_fact (encoder, fact);
+		break;
+	case OHM_FACT_STORE_OP_REMOVE:
+		if (index == NULL) {
+			break;
+		}
+		record = OHM_FACT_STORE_JOURNAL_REMOVE;
+		g_byte_array_append (encoder->body, &record, 1);
+		_ohm_fact_store_dump_u32 (encoder->body, GPOINTER_TO_UINT (index) - 1);
+
+		/* a rollback may put it back, with the same index */
+		if (journal->marks->len == 0) {
+			g_hash_table_remove (encoder->index, fact);
+			g_ptr_array_index (encoder->facts, GPOINTER_TO_UINT (index) - 1) = NULL;
+			g_object_unref (fact);
+		} else {
+			guint i;
+
+			i = GPOINTER_TO_UINT (index) - 1;
+			g_array_append_val (journal->removed, i);
+		}
+		break;
+	case OHM_FACT_STORE_OP_UPDATE:
+		if (index == NULL) {
+			break;
+		}
+		record = OHM_FACT_STORE_JOURNAL_SET;
+		g_byte_array_append (encoder->body, &record, 1);
+		_ohm_fact_store_dump_u32 (encoder->body, GPOINTER_TO_UINT (index) - 1);
+		if (!_ohm_fact_store_dump_field (encoder, field, ohm_structure_qget (OHM_STRUCTURE (fact), field))) {
+			record = 0;
+			_ohm_fact_store_dump_u32 (encoder->body, _ohm_fact_store_dump_string (encoder, g_quark_to_string (field)));
+			g_byte_array_append (encoder->body, &record, 1);
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (journal->marks->len == 0) {
+		_ohm_fact_store_journal_frame (journal);
+	}
+	g_mutex_unlock (&journal->lock);
+}
+
+
+/*
+ * Keep the records to come in one frame, until the matching release.
+ * Releasing with @rollback drops them.
+ */
+static void _ohm_fact_store_journal_hold (OhmFactStore* self) {
+	OhmFactStoreJournal* journal;
+	OhmFactStoreJournalMark mark;
+
+	journal = self->priv->journal;
+	if (journal == NULL) {
+		return;
+	}
+
+	g_mutex_lock (&journal->lock);
+	mark.body = journal->encoder.body->len;
+	mark.facts = journal->encoder.facts->len;
+	g_array_append_val (journal->marks, mark);
+	g_mutex_unlock (&journal->lock);
+}
+
+
+/*
+ * Forget the facts whose removal the outermost release commits, unless
+ * they came back since. An inner rollback may have given their index
+ * to another fact: one out of the store was removed too.
+ */
+static void _ohm_fact_store_journal_forget (OhmFactStoreJournal* journal) {
+	guint i;
+
+	for (i = 0; i < journal->removed->len; i++) {
+		OhmFact* fact;
+		guint index;
+
+		index = g_array_index (journal->removed, guint, i);
+		if (index >= journal->encoder.facts->len) {
+			continue;
+		}
+
+		fact = g_ptr_array_index (journal->encoder.facts, index);
+		if (fact == NULL || fact->priv->_fact_store == journal->store) {
+			continue;
+		}
+
+		g_hash_table_remove (journal->encoder.index, fact);
+		g_ptr_array_index (journal->encoder.facts, index) = NULL;
+		g_object_unref (fact);
+	}
+
+	g_array_set_size (journal->removed, 0);
+}
+
+
+static void _ohm_fact_store_journal_release (OhmFactStore* self, gboolean rollback) {
+	OhmFactStoreJournal* journal;
+	OhmFactStoreJournalMark mark;
+	guint i;
+
+	journal = self->priv->journal;
+	if (journal == NULL) {
+		return;
+	}
+
+	g_mutex_lock (&journal->lock);
+	if (journal->marks->len > 0) {
+		mark = g_array_index (journal->marks, OhmFactStoreJournalMark, journal->marks->len - 1);
+		g_array_set_size (journal->marks, journal->marks->len - 1);
+
+		/* and forget the facts inserted meanwhile, so the indexes have no gap */
+		if (rollback) {
+			g_byte_array_set_size (journal->encoder.body, mark.body);
+			for (i = mark.facts; i < journal->encoder.facts->len; i++) {
+				g_hash_table_remove (journal->encoder.index, g_ptr_array_index (journal->encoder.facts, i));
+			}
+			g_ptr_array_set_size (journal->encoder.facts, mark.facts);
+		}
+		if (journal->marks->len == 0) {
+			if (rollback) {
+				g_array_set_size (journal->removed, 0);
+			} else {
+				_ohm_fact_store_journal_forget (journal);
+			}
+			_ohm_fact_store_journal_frame (journal);
+		}
+	}
+	g_mutex_unlock (&journal->lock);
+}
+
+
+static void _ohm_fact_store_journal_mute (OhmFactStore* self, gboolean mute) {
+	OhmFactStoreJournal* journal;
+
+	journal = self->priv->journal;
+	if (journal == NULL) {
+		return;
+	}
+
+	g_mutex_lock (&journal->lock);
+	journal->muted += mute ? 1 : -1;
+	g_mutex_unlock (&journal->lock);
+}
+
+
+/* apply the frames of a journal, up to the first one torn or damaged */
+static void _ohm_fact_store_journal_replay (OhmFactStore* store, OhmFactStoreRestore* self) {
+	while ((gsize) (self->end - self->pos) >= 8) {
+		const guint8* end;
+		guint32 length;
+		guint32 checksum;
+
+		length = _ohm_fact_store_restore_read (self, 4);
+		checksum = _ohm_fact_store_restore_read (self, 4);
+		if (length > (gsize) (self->end - self->pos) ||
+		    checksum != _ohm_fact_store_journal_checksum (self->pos, length)) {
+			break;
+		}
+
+		end = self->end;
+		self->end = self->pos + length;
+		_ohm_fact_store_restore_strings (self, _ohm_fact_store_restore_read (self, 4));
+
+		while (self->valid && self->pos < self->end) {
+			OhmFact* fact;
+			guint32 id;
+			guint8 record;
+
+			record = _ohm_fact_store_restore_read (self, 1);
+			id = _ohm_fact_store_restore_read (self, 4);
+			if (!self->valid || id > self->facts->len) {
+				self->valid = FALSE;
+				break;
+			}
+			if (id >= self->facts->len) {
+				g_ptr_array_set_size (self->facts, id + 1);
+			}
+			fact = g_ptr_array_index (self->facts, id);
+
+			switch (record) {
+			case OHM_FACT_STORE_JOURNAL_INSERT: {
+				guint32 name;
+
+				name = _ohm_fact_store_restore_string (self, FALSE);
+				if (!self->valid) {
+					break;
+				}
+
+				/* a fact put back keeps its identity */
+				if (fact == NULL || ohm_fact_get_fact_store (fact) != NULL) {
+					_ohm_fact_store_unref_fact (fact);
+					fact = ohm_fact_new (g_ptr_array_index (self->strings, name));
+					g_ptr_array_index (self->facts, id) = fact;
+				}
+				while (OHM_STRUCTURE (fact)->priv->n_fields > 0) {
+					ohm_structure_qset (OHM_STRUCTURE (fact), OHM_STRUCTURE (fact)->priv->entries[0].field, NULL);
+				}
+				if (_ohm_fact_store_restore_fields (self, fact)) {
+					ohm_fact_store_insert (store, fact);
+				}
+				break;
+			}
+			case OHM_FACT_STORE_JOURNAL_REMOVE:
+				if (fact != NULL) {
+					ohm_fact_store_remove (store, fact);
+				}
+				break;
+			case OHM_FACT_STORE_JOURNAL_SET: {
+				GValue value = {0,};
+				guint32 field;
+				guint8 type;
+
+				field = _ohm_fact_store_restore_string (self, FALSE);
+				type = _ohm_fact_store_restore_read (self, 1);
+				_ohm_fact_store_restore_value (self, type, &value);
+				if (self->valid && fact != NULL) {
+					_ohm_fact_qset_inline (fact, _ohm_fact_store_restore_quark (self, field), type != 0 ? &value : NULL, OHM_FACT_SET_MOVE);
+				} else if (G_IS_VALUE (&value)) {
+					g_value_unset (&value);
+				}
+				break;
+			}
+			default:
+				self->valid = FALSE;
+				break;
+			}
+		}
+
+		self->end = end;
+		if (!self->valid) {
+			break;
+		}
+	}
+}
+
+
+/*
+ * Restore the snapshot at @path for a @generation of 0, or replay the
+ * journal at @path if it is of @generation. Returns the generation of
+ * the file, 0 if there is none.
+ */
+static guint64 _ohm_fact_store_journal_load (OhmFactStore* self, OhmFactStoreRestore* restore, const gchar* path,
+					     guint64 generation, GError** error) {
+	gchar* contents;
+	gsize length;
+	guint64 found;
+
+	if (!g_file_get_contents (path, &contents, &length, NULL)) {
+		return 0;
+	}
+
+	_ohm_fact_store_restore_feed (restore, (const guint8*) contents, length);
+	_ohm_fact_store_restore_header (restore, generation == 0 ? OHM_FACT_STORE_JOURNAL_SNAPSHOT_MAGIC : OHM_FACT_STORE_JOURNAL_MAGIC,
+					OHM_FACT_STORE_JOURNAL_VERSION);
+	found = _ohm_fact_store_restore_read (restore, 8);
+
+	if (generation == 0 && (!restore->valid || !_ohm_fact_store_restore_dump (self, restore))) {
+		g_set_error (error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_FORMAT,
+			     "invalid fact store snapshot %s", path);
+		found = 0;
+	} else if (generation != 0 && restore->valid && found == generation) {
+		_ohm_fact_store_journal_replay (self, restore);
+	}
+	g_free (contents);
+
+	return found;
+}
+
+
+static void _ohm_fact_store_journal_free (OhmFactStoreJournal* self) {
+	if (self->writer != NULL) {
+		g_mutex_lock (&self->lock);
+		self->stop = TRUE;
+		g_cond_signal (&self->wake);
+		g_mutex_unlock (&self->lock);
+		g_thread_join (self->writer);
+	}
+
+	if (self->compact_source != 0) {
+		g_source_remove (self->compact_source);
+	}
+	if (self->fd >= 0) {
+		close (self->fd);
+	}
+	if (self->snapshot != NULL) {
+		g_byte_array_free (self->snapshot, TRUE);
+	}
+	g_byte_array_free (self->pending, TRUE);
+	g_byte_array_free (self->writing, TRUE);
+	g_array_free (self->marks, TRUE);
+	g_array_free (self->removed, TRUE);
+	_ohm_fact_store_dump_clear (&self->encoder);
+	g_mutex_clear (&self->lock);
+	g_cond_clear (&self->wake);
+	g_cond_clear (&self->done);
+	g_free (self->path);
+	g_free (self->snapshot_path);
+	g_slice_free (OhmFactStoreJournal, self);
+}
+
+
+/**
+ * ohm_fact_store_journal_open:
  * @self: a #OhmFactStore
- * @fact: the fact to be added to the @self fact-store. (not %NULL)
+ * @path: the journal file
+ * @error: return location for a #GError, or %NULL
  *
- * Insert a @fact to the @self fact-store. The @fact will be
- * referenced by the fact-store and can hence be unrefed by the
- * caller. The @fact will be unrefed when it is removed or the
- * #OhmFactStore is destroyed.
+ * Make the committed changes of @self durable in a write-ahead
+ * journal at @path, with its snapshot at @path.snapshot, so that the
+ * facts survive a crash of the daemon.
  *
- * The insertion is reversible if there is a transaction on-going and it
- * is rolled back (for back-tracking purpose, for instance). In that
- * case, the @fact is referenced by the transaction itself, and stay
- * alive until the transaction ends.
+ * The facts of the snapshot and of the journal left by a previous
+ * instance are restored first, up to the last commit completely
+ * written. The current facts are then saved as a new snapshot, and a
+ * new journal started, so the store should be opened before anything
+ * else modifies it.
+ *
+ * From then on each insertion, removal and field change is recorded
+ * when it is committed: at once outside of a transaction, at the end
+ * of the outermost transaction, batch or ohm_fact_store_txn_commit ()
+ * otherwise. A writer thread writes the commits queued meanwhile
+ * together, and syncs the journal as set with
+ * ohm_fact_store_journal_set_sync (). Fields holding pointers or
+ * other objects are not recorded, nor the facts out of the store that
+ * a field refers to.
+ *
+ * Returns: %TRUE on success, %FALSE if @error was set.
+ **/
+gboolean ohm_fact_store_journal_open (OhmFactStore* self, const char* path, GError** error) {
+	OhmFactStoreJournal* journal;
+	OhmFactStoreRestore restore;
+	GByteArray* snapshot;
+	GError* local_error = NULL;
+	gboolean ok;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+	g_return_val_if_fail (path != NULL, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+	g_return_val_if_fail (self->priv->journal == NULL, FALSE);
+
+	if (!g_queue_is_empty (self->transaction)) {
+		g_set_error (error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_BUSY,
+			     "cannot open a journal within a transaction");
+		return FALSE;
+	}
+
+	journal = g_slice_new0 (OhmFactStoreJournal);
+	journal->store = self;
+	journal->path = g_strdup (path);
+	journal->snapshot_path = g_strconcat (path, ".snapshot", NULL);
+	journal->fd = -1;
+
+	/* the snapshot, then the journal of its generation */
+	_ohm_fact_store_restore_init (&restore);
+	journal->generation = _ohm_fact_store_journal_load (self, &restore, journal->snapshot_path, 0, &local_error);
+	if (journal->generation > 0) {
+		_ohm_fact_store_journal_load (self, &restore, journal->path, journal->generation, NULL);
+	}
+	_ohm_fact_store_restore_clear (&restore);
+
+	if (local_error != NULL) {
+		g_propagate_error (error, local_error);
+		g_free (journal->path);
+		g_free (journal->snapshot_path);
+		g_slice_free (OhmFactStoreJournal, journal);
+		return FALSE;
+	}
+
+	_ohm_fact_store_dump_init (&journal->encoder);
+	journal->marks = g_array_new (FALSE, FALSE, sizeof (OhmFactStoreJournalMark));
+	journal->removed = g_array_new (FALSE, FALSE, sizeof (guint));
+	g_mutex_init (&journal->lock);
+	g_cond_init (&journal->wake);
+	g_cond_init (&journal->done);
+	journal->pending = g_byte_array_new ();
+	journal->writing = g_byte_array_new ();
+	journal->sync_delay = 100;
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+	snapshot = _ohm_fact_store_journal_rebase (journal, self);
+	ok = _ohm_fact_store_journal_switch (journal, snapshot, error);
+	g_byte_array_free (snapshot, TRUE);
+	if (ok) {
+		self->priv->journal = journal;
+	}
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	if (!ok) {
+		_ohm_fact_store_journal_free (journal);
+		return FALSE;
+	}
+
+	journal->writer = g_thread_new ("ohm-journal", _ohm_fact_store_journal_writer, journal);
+
+	return TRUE;
+}
+
+
+/**
+ * ohm_fact_store_journal_close:
+ * @self: a #OhmFactStore
+ *
+ * Write and sync what is left to the journal of @self, and stop
+ * journaling. The store does it when it is destroyed.
+ **/
+void ohm_fact_store_journal_close (OhmFactStore* self) {
+	OhmFactStoreJournal* journal;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+	journal = self->priv->journal;
+	self->priv->journal = NULL;
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	if (journal != NULL) {
+		_ohm_fact_store_journal_free (journal);
+	}
+}
+
+
+/**
+ * ohm_fact_store_journal_set_sync:
+ * @self: a #OhmFactStore
+ * @n_commits: sync once this many commits are written, or 0
+ * @delay: sync at most this many milliseconds after a commit is written, or 0
+ *
+ * Set how often the journal is synced to disk, see fsync (2): a commit
+ * is durable once synced. Syncing every commit (@n_commits of 1) is the
+ * safest and the slowest; the default is a @delay of 100 ms. With both
+ * 0, the journal is only synced on ohm_fact_store_journal_flush (),
+ * compaction and close.
+ **/
+void ohm_fact_store_journal_set_sync (OhmFactStore* self, guint n_commits, guint delay) {
+	OhmFactStoreJournal* journal;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (self->priv->journal != NULL);
+
+	journal = self->priv->journal;
+	g_mutex_lock (&journal->lock);
+	journal->sync_commits = n_commits;
+	journal->sync_delay = delay;
+	g_cond_signal (&journal->wake);
+	g_mutex_unlock (&journal->lock);
+}
+
+
+/**
+ * ohm_fact_store_journal_set_compact_size:
+ * @self: a #OhmFactStore
+ * @size: the size of the journal in bytes, or 0
+ *
+ * Compact the journal of @self from the main loop once it grows over
+ * @size bytes, see ohm_fact_store_journal_compact (). It is not
+ * compacted automatically by default.
+ **/
+void ohm_fact_store_journal_set_compact_size (OhmFactStore* self, gsize size) {
+	OhmFactStoreJournal* journal;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (self->priv->journal != NULL);
+
+	journal = self->priv->journal;
+	g_mutex_lock (&journal->lock);
+	journal->compact_size = size;
+	g_mutex_unlock (&journal->lock);
+}
+
+
+/**
+ * ohm_fact_store_journal_compact:
+ * @self: a #OhmFactStore
+ *
+ * Replace the journal of @self by a snapshot of the facts, so that it
+ * does not grow forever and the next startup has less to replay. The
+ * facts are encoded right away, and written by the writer thread.
+ *
+ * Returns: %FALSE if @self has no journal or is within a transaction.
+ **/
+gboolean ohm_fact_store_journal_compact (OhmFactStore* self) {
+	OhmFactStoreJournal* journal;
+	GByteArray* snapshot;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
+
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	journal = self->priv->journal;
+	if (journal == NULL || !g_queue_is_empty (self->transaction)) {
+		_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+		return FALSE;
+	}
+
+	g_mutex_lock (&journal->lock);
+	snapshot = _ohm_fact_store_journal_rebase (journal, self);
+
+	/* the frames not written yet are part of the snapshot */
+	g_byte_array_set_size (journal->pending, 0);
+	if (journal->snapshot != NULL) {
+		g_byte_array_free (journal->snapshot, TRUE);
+	}
+	journal->snapshot = snapshot;
+	g_cond_signal (&journal->wake);
+	g_mutex_unlock (&journal->lock);
+
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+
+	return TRUE;
+}
+
+
+/**
+ * ohm_fact_store_journal_flush:
+ * @self: a #OhmFactStore
+ *
+ * Wait until all the changes committed so far are written to the
+ * journal of @self and synced.
+ **/
+void ohm_fact_store_journal_flush (OhmFactStore* self) {
+	OhmFactStoreJournal* journal;
+	guint64 queued;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+
+	journal = self->priv->journal;
+	if (journal == NULL) {
+		return;
+	}
+
+	g_mutex_lock (&journal->lock);
+	queued = journal->queued;
+	journal->flushing++;
+	g_cond_signal (&journal->wake);
+	while (journal->synced < queued || journal->snapshot != NULL) {
+		g_cond_wait (&journal->done, &journal->lock);
+	}
+	journal->flushing--;
+	g_mutex_unlock (&journal->lock);
+}
+
+
+static guint _ohm_fact_store_txn_key_hash (gconstpointer v) {
+	const OhmFactStoreTxnKey* key = v;
+
+	return g_direct_hash (key->fact) ^ key->field;
+}
+
+
+static gboolean _ohm_fact_store_txn_key_equal (gconstpointer a, gconstpointer b) {
+	const OhmFactStoreTxnKey* ka = a;
+	const OhmFactStoreTxnKey* kb = b;
+
+	return ka->fact == kb->fact && ka->field == kb->field;
+}
+
+
+static void _ohm_fact_store_txn_key_free (OhmFactStoreTxnKey* self) {
+	g_object_unref (self->fact);
+	g_slice_free (OhmFactStoreTxnKey, self);
+}
+
+
+/**
+ * ohm_fact_store_txn_begin:
+ * @self: a #OhmFactStore
  *
- * The views that match the @fact will get notified, unless the
- * transaction is canceled in between.
+ * Begin an optimistic transaction on @self. Unlike
+ * ohm_fact_store_transaction_push (), it does not change the store nor
+ * hold it: the changes are kept aside until ohm_fact_store_txn_commit (),
+ * and what the transaction reads is remembered. The commit then checks
+ * that nothing it read has changed in between, and either makes all
+ * the changes at once or none. Several threads may thus evaluate their
+ * transactions on a thread-safe store in parallel, each one with its
+ * own #OhmFactStoreTxn, and only wait for each other to commit.
  *
- * Returns: %TRUE on success.
+ * Returns: a new transaction, ended by ohm_fact_store_txn_commit () or
+ * ohm_fact_store_txn_abort ().
  **/
-gboolean ohm_fact_store_insert (OhmFactStore* self, OhmFact* fact) {
-	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
-	g_return_val_if_fail (OHM_IS_FACT (fact), FALSE);
+OhmFactStoreTxn* ohm_fact_store_txn_begin (OhmFactStore* self) {
+	OhmFactStoreTxn* txn;
 
-	if (ohm_fact_store_insert_internal (self, fact)) {
-		OhmFactStoreTransaction* t;
+	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
 
-		if (g_slist_find (self->priv->known_facts_qname, GINT_TO_POINTER (ohm_structure_get_qname (OHM_STRUCTURE (fact)))) == NULL) {
-			self->priv->known_facts_qname = g_slist_prepend (self->priv->known_facts_qname,
-									 GINT_TO_POINTER (ohm_structure_get_qname (OHM_STRUCTURE (fact))));
-		}
+	txn = g_slice_new0 (OhmFactStoreTxn);
+	txn->store = g_object_ref (self);
+	txn->reads = g_hash_table_new_full (_ohm_fact_store_txn_key_hash, _ohm_fact_store_txn_key_equal,
+					    (GDestroyNotify) _ohm_fact_store_txn_key_free, NULL);
+	txn->names = g_hash_table_new (g_direct_hash, g_direct_equal);
+	txn->ops = g_array_new (FALSE, TRUE, sizeof (OhmFactStoreOp));
+	txn->written = g_hash_table_new_full (_ohm_fact_store_txn_key_hash, _ohm_fact_store_txn_key_equal,
+					      (GDestroyNotify) _ohm_fact_store_txn_key_free, NULL);
 
-		t = (OhmFactStoreTransaction*) g_queue_peek_head (self->transaction);
-		if (t != NULL) {
-			t->modifications = g_slist_prepend (t->modifications, ohm_fact_store_transaction_cow_new (fact, OHM_FACT_STORE_EVENT_ADDED, 0, NULL));
-		}
+	return txn;
+}
 
-		_ohm_fact_store_update_transparent_views (self, fact, OHM_FACT_STORE_EVENT_ADDED, 0, NULL);
-	        
-		if (!_ohm_fact_store_transaction_rolledback(self) &&
-		    !_ohm_fact_store_transaction_active(self))
-			_ohm_fact_store_update_views (self, fact, OHM_FACT_STORE_EVENT_ADDED, 0, NULL);
 
-		return TRUE;
+/*
+ * Remember the current stamp of @field of @fact (the membership of
+ * @fact if @field is 0), unless read before. The caller holds the name.
+ */
+static void _ohm_fact_store_txn_read (OhmFactStoreTxn* self, OhmFact* fact, GQuark field) {
+	OhmFactStoreTxnKey lookup;
+	OhmFactStoreTxnKey* key;
+
+	lookup.fact = fact;
+	lookup.field = field;
+	if (g_hash_table_lookup (self->reads, &lookup) != NULL) {
+		return;
 	}
 
-	return FALSE;
+	key = g_slice_new (OhmFactStoreTxnKey);
+	key->fact = g_object_ref (fact);
+	key->field = field;
+	if (field == 0) {
+		key->n = fact->priv->_fact_store == self->store;
+	} else {
+		key->n = _ohm_fact_get_stamp (fact, field);
+	}
+
+	g_hash_table_insert (self->reads, key, key);
 }
 
 
-static gboolean ohm_fact_store_remove_internal (OhmFactStore* self, OhmFact* fact) {
-	GSList* facts;
-	GSList* found;
+static gboolean _ohm_fact_store_txn_valid (OhmFactStoreTxn* self) {
+	GHashTableIter iter;
+	gpointer k;
+	gpointer v;
 
-	g_return_val_if_fail (OHM_IS_FACT_STORE (self), FALSE);
-	g_return_val_if_fail (OHM_IS_FACT (fact), FALSE);
+	g_hash_table_iter_init (&iter, self->reads);
+	while (g_hash_table_iter_next (&iter, &k, NULL)) {
+		OhmFactStoreTxnKey* key = k;
+		guint now;
 
-	facts = ohm_fact_store_get_facts_by_quark (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)));
-	found = g_slist_find (facts, fact);
+		if (key->field == 0) {
+			now = key->fact->priv->_fact_store == self->store;
+		} else {
+			now = _ohm_fact_get_stamp (key->fact, key->field);
+		}
 
-	if (found != NULL) {
-		facts = g_slist_delete_link (facts, found);
-		g_object_set_qdata (G_OBJECT (self), ohm_structure_get_qname (OHM_STRUCTURE (fact)), facts);
-		ohm_fact_set_fact_store (fact, NULL);
-		g_object_unref (G_OBJECT (fact));
+		if (now != key->n) {
+			return FALSE;
+		}
+	}
 
-		return TRUE;
+	g_hash_table_iter_init (&iter, self->names);
+	while (g_hash_table_iter_next (&iter, &k, &v)) {
+		OhmFactStoreFacts* facts;
+
+		facts = _ohm_fact_store_lookup_facts (self->store, GPOINTER_TO_UINT (k));
+		if ((facts != NULL ? facts->version : 0) != GPOINTER_TO_UINT (v)) {
+			return FALSE;
+		}
 	}
 
-	return FALSE;
+	return TRUE;
+}
+
+
+static void _ohm_fact_store_txn_add_op (OhmFactStoreTxn* self, OhmFactStoreOpType type, OhmFact* fact, GQuark field, GValue* value) {
+	OhmFactStoreOp op;
+
+	memset (&op, 0, sizeof (op));
+	op.type = type;
+	op.fact = g_object_ref (fact);
+	op.field = field;
+	if (value != NULL) {
+		op.value = *value;
+	}
+
+	g_array_append_val (self->ops, op);
 }
 
 
 /**
- * ohm_fact_store_remove:
- * @self: a #OhmFactStore
- * @fact: the fact to be removed from @self fact-store. (not %NULL)
- *
- * Remove a @fact from the @self fact-store. The @fact will be
- * un-referenced.
+ * ohm_fact_store_txn_get:
+ * @self: a transaction
+ * @fact: a fact
+ * @field_name: the field to read
+ * @value: an uninitialized #GValue, to be unset by the caller
  *
- * The removal is reversible if there is a transaction on-going and it
- * is rolled back (for back-tracking purpose, for instance). In that
- * case, the @fact is referenced by the transaction itself, and stay
- * alive until the transaction ends.
+ * Read @field_name of @fact as the transaction sees it: the value it
+ * set, or else the current value, which the transaction then depends
+ * on.
  *
- * The views that match the @fact will be notified, unless the
- * transaction is canceled in between.
+ * Returns: %TRUE if the field is set, and @value holds a copy of it.
  **/
-void ohm_fact_store_remove (OhmFactStore* self, OhmFact* fact) {
-	g_return_if_fail (OHM_IS_FACT_STORE (self));
-	g_return_if_fail (OHM_IS_FACT (fact));
+gboolean ohm_fact_store_txn_get (OhmFactStoreTxn* self, OhmFact* fact, const char* field_name, GValue* value) {
+	OhmFactStoreTxnKey lookup;
+	OhmFactStoreTxnKey* key;
+	GValue* current;
+	GQuark qname;
 
-	if (ohm_fact_store_remove_internal (self, fact)) {
-		OhmFactStoreTransaction* t;
+	g_return_val_if_fail (self != NULL, FALSE);
+	g_return_val_if_fail (OHM_IS_FACT (fact), FALSE);
+	g_return_val_if_fail (field_name != NULL, FALSE);
+	g_return_val_if_fail (value != NULL, FALSE);
 
-		t = (OhmFactStoreTransaction*) g_queue_peek_head (self->transaction);
-		if (t != NULL) {
-			t->modifications = g_slist_prepend (t->modifications,
-							    ohm_fact_store_transaction_cow_new (fact, OHM_FACT_STORE_EVENT_REMOVED, 0, NULL));
+	lookup.fact = fact;
+	lookup.field = g_quark_from_string (field_name);
+
+	key = g_hash_table_lookup (self->written, &lookup);
+	if (key != NULL) {
+		current = &g_array_index (self->ops, OhmFactStoreOp, key->n - 1).value;
+		if (!G_IS_VALUE (current)) {
+			return FALSE;
 		}
 
-		_ohm_fact_store_update_transparent_views (self, fact, OHM_FACT_STORE_EVENT_REMOVED, 0, NULL);
+		_ohm_value_init_copy (value, current);
+		return TRUE;
+	}
 
-		if (!_ohm_fact_store_transaction_rolledback(self) &&
-		    !_ohm_fact_store_transaction_active(self))
-			_ohm_fact_store_update_views (self, fact, OHM_FACT_STORE_EVENT_REMOVED, 0, NULL);
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (fact));
+	_ohm_fact_store_lock_name (self->store, qname);
+
+	_ohm_fact_store_txn_read (self, fact, lookup.field);
+	current = ohm_structure_qget (OHM_STRUCTURE (fact), lookup.field);
+	if (current != NULL) {
+		_ohm_value_init_copy (value, current);
 	}
+
+	_ohm_fact_store_unlock_name (self->store, qname);
+
+	return current != NULL;
 }
 
 
 /**
- * ohm_fact_store_update:
- * @self: a #OhmFactStore
- * @fact: the fact to be updated. (not %NULL)
- *
- * <note>
- * <para>
- * This function is used internally. You should use ohm_fact_set ()
- * functions if you modify a fact.
- * </para>
- * </note>
- *
- * Update a @fact from the @self fact-store.
- *
- * The update is reversible if there is a transaction on-going and it
- * is rolled back (for back-tracking purpose, for instance). In that
- * case, the modification is saved by the transaction.
+ * ohm_fact_store_txn_contains:
+ * @self: a transaction
+ * @fact: a fact
  *
- * The views that match the @fact will be notified, unless the
- * transaction is canceled in between.
+ * Returns: whether @fact is in the store. The transaction then depends
+ * on it.
  **/
-void ohm_fact_store_update (OhmFactStore* self, OhmFact* fact, GQuark field, GValue* value) {
-	g_return_if_fail (OHM_IS_FACT_STORE (self));
-	g_return_if_fail (OHM_IS_FACT (fact));
+gboolean ohm_fact_store_txn_contains (OhmFactStoreTxn* self, OhmFact* fact) {
+	GQuark qname;
+	gboolean found;
 
-	_ohm_fact_store_update_transparent_views (self, fact, OHM_FACT_STORE_EVENT_UPDATED, field, value);
+	g_return_val_if_fail (self != NULL, FALSE);
+	g_return_val_if_fail (OHM_IS_FACT (fact), FALSE);
 
-	if (!_ohm_fact_store_transaction_rolledback(self) &&
-	    !_ohm_fact_store_transaction_active(self))
-		_ohm_fact_store_update_views (self, fact, OHM_FACT_STORE_EVENT_UPDATED, field, value);
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (fact));
+	_ohm_fact_store_lock_name (self->store, qname);
+	_ohm_fact_store_txn_read (self, fact, 0);
+	found = fact->priv->_fact_store == self->store;
+	_ohm_fact_store_unlock_name (self->store, qname);
+
+	return found;
 }
 
 
 /**
- * ohm_fact_store_get_facts_by_quark:
- * @self: a #OhmFactStore
- * @qname: #GQuark name of the facts to list
+ * ohm_fact_store_txn_get_facts_by_pattern:
+ * @self: a transaction
+ * @pattern: a @pattern (not %NULL)
  *
- * This function is used mostly for debugging purposes. Better use a
- * #OhmFactStoreView, for example, although you might need it.
+ * Like ohm_fact_store_get_facts_by_pattern (), the transaction then
+ * depends on the facts of the name of @pattern, and on the fields of
+ * @pattern in each of them. The changes made by the transaction itself
+ * are not taken into account.
  *
- * Returns: a weak list of weak #OhmFact that have the
- * name @qname. The caller should not free, modify or unref anything.
+ * Returns: a new list of #OhmPatternMatch.
  **/
-GSList* ohm_fact_store_get_facts_by_quark (OhmFactStore* self, GQuark qname) {
-	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
+GSList* ohm_fact_store_txn_get_facts_by_pattern (OhmFactStoreTxn* self, OhmPattern* pattern) {
+	OhmFactStoreFacts* facts;
+	GSList* result;
+	GList* l;
+	GQuark qname;
+	guint i;
+
+	g_return_val_if_fail (self != NULL, NULL);
+	g_return_val_if_fail (OHM_IS_PATTERN (pattern), NULL);
+
+	qname = ohm_structure_get_qname (OHM_STRUCTURE (pattern));
+	_ohm_fact_store_lock_name (self->store, qname);
+
+	facts = _ohm_fact_store_lookup_facts (self->store, qname);
+	if (!g_hash_table_lookup_extended (self->names, GUINT_TO_POINTER (qname), NULL, NULL)) {
+		g_hash_table_insert (self->names, GUINT_TO_POINTER (qname),
+				     GUINT_TO_POINTER (facts != NULL ? facts->version : 0));
+	}
+
+	/* a fact starting to match must be seen as a conflict too */
+	for (l = facts != NULL ? facts->facts : NULL; l != NULL; l = l->next) {
+		for (i = 0; i < OHM_STRUCTURE (pattern)->priv->n_fields; i++) {
+			_ohm_fact_store_txn_read (self, OHM_FACT (l->data), OHM_STRUCTURE (pattern)->priv->entries[i].field);
+		}
+	}
+
+	result = ohm_fact_store_get_facts_by_pattern (self->store, pattern);
+
+	_ohm_fact_store_unlock_name (self->store, qname);
 
-	return ((GSList*) g_object_get_qdata (G_OBJECT (self), qname));
+	return result;
 }
 
 
 /**
- * ohm_fact_store_get_facts_by_name:
- * @self: a #OhmFactStore
- * @name: name of the facts to list
+ * ohm_fact_store_txn_set:
+ * @self: a transaction
+ * @fact: a fact
+ * @field_name: the field to set
+ * @value: the value, or %NULL to remove the field
  *
- * String version of ohm_fact_store_get_facts_by_quark ().
- *
- * Returns: a weak list of weak #OhmFact.
+ * Set @field_name of @fact to @value at commit, see ohm_fact_set ().
+ * @value is owned by the transaction.
  **/
-GSList* ohm_fact_store_get_facts_by_name (OhmFactStore* self, const char* name) {
-	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
-	g_return_val_if_fail (name != NULL, NULL);
+void ohm_fact_store_txn_set (OhmFactStoreTxn* self, OhmFact* fact, const char* field_name, GValue* value) {
+	OhmFactStoreTxnKey lookup;
+	OhmFactStoreTxnKey* key;
 
-	return ((GSList*) g_object_get_data (G_OBJECT (self), name));
-}
+	g_return_if_fail (self != NULL);
+	g_return_if_fail (OHM_IS_FACT (fact));
+	g_return_if_fail (field_name != NULL);
 
+	lookup.fact = fact;
+	lookup.field = g_quark_from_string (field_name);
 
-static void _g_slist_free_g_object_unref (GSList* self) {
-	g_slist_foreach (self, ((GFunc) g_object_unref), NULL);
-	g_slist_free (self);
+	_ohm_fact_store_txn_add_op (self, OHM_FACT_STORE_OP_UPDATE, fact, lookup.field, value);
+	g_free (value);
+
+	key = g_hash_table_lookup (self->written, &lookup);
+	if (key == NULL) {
+		key = g_slice_new (OhmFactStoreTxnKey);
+		key->fact = g_object_ref (fact);
+		key->field = lookup.field;
+		g_hash_table_insert (self->written, key, key);
+	}
+	key->n = self->ops->len;
 }
 
 
 /**
- * ohm_fact_store_get_facts_by_pattern:
- * @self: a #OhmFactStore
- * @pattern: a @pattern (not %NULL)
+ * ohm_fact_store_txn_insert:
+ * @self: a transaction
+ * @fact: a fact
  *
- * Get the list of facts that match the #OhmPattern @pattern.
- *
- * Returns: a new list of #OhmFact. The caller is responsible to unref
- * elements and free the list.
+ * Insert @fact at commit, see ohm_fact_store_insert ().
  **/
-GSList* ohm_fact_store_get_facts_by_pattern (OhmFactStore* self, OhmPattern* pattern) {
-	GSList* facts;
-	GSList* result;
-	GSList* f_it;
+void ohm_fact_store_txn_insert (OhmFactStoreTxn* self, OhmFact* fact) {
+	g_return_if_fail (self != NULL);
+	g_return_if_fail (OHM_IS_FACT (fact));
 
-	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
-	g_return_val_if_fail (OHM_IS_PATTERN (pattern), NULL);
+	_ohm_fact_store_txn_add_op (self, OHM_FACT_STORE_OP_INSERT, fact, 0, NULL);
+}
 
-	facts = ((GSList*) g_object_get_qdata (G_OBJECT (self), ohm_structure_get_qname (OHM_STRUCTURE (pattern))));
 
-	result = NULL;
+/**
+ * ohm_fact_store_txn_remove:
+ * @self: a transaction
+ * @fact: a fact
+ *
+ * Remove @fact at commit, see ohm_fact_store_remove ().
+ **/
+void ohm_fact_store_txn_remove (OhmFactStoreTxn* self, OhmFact* fact) {
+	g_return_if_fail (self != NULL);
+	g_return_if_fail (OHM_IS_FACT (fact));
 
-	for (f_it = facts; f_it != NULL; f_it = f_it->next) {
-	  OhmFact* f;
-	  OhmPatternMatch* m;
+	_ohm_fact_store_txn_add_op (self, OHM_FACT_STORE_OP_REMOVE, fact, 0, NULL);
+}
 
-	  f = g_object_ref (f_it->data);
-	  m = ohm_pattern_match (pattern, f, OHM_FACT_STORE_EVENT_LOOKUP);
 
-	  if (m != NULL) {
-	    result = g_slist_prepend (result, m);
-	    m = NULL;
-	  }
+void ohm_fact_store_txn_abort (OhmFactStoreTxn* self) {
+	guint i;
+
+	g_return_if_fail (self != NULL);
+
+	for (i = 0; i < self->ops->len; i++) {
+		OhmFactStoreOp* op = &g_array_index (self->ops, OhmFactStoreOp, i);
 
-	  g_object_unref (f);
+		if (G_IS_VALUE (&op->value)) {
+			g_value_unset (&op->value);
+		}
+		g_object_unref (op->fact);
 	}
 
-	return result;
+	g_array_free (self->ops, TRUE);
+	g_hash_table_destroy (self->reads);
+	g_hash_table_destroy (self->names);
+	g_hash_table_destroy (self->written);
+	g_object_unref (self->store);
+	g_slice_free (OhmFactStoreTxn, self);
 }
 
 
 /**
- * ohm_fact_store_transaction_push:
- * @self: a #OhmFactStore
+ * ohm_fact_store_txn_commit:
+ * @self: a transaction
  *
- * Start a new transaction (on top of the previous).
+ * End the transaction: if none of the fields, facts and names it read
+ * has changed since, make its changes, in order, as a whole. Otherwise
+ * nothing is changed, and the caller may start over with a new
+ * transaction. Both ways @self is freed.
+ *
+ * In a thread-safe store, the names involved are held during the
+ * check and the changes, as with ohm_fact_store_lock_names ().
+ *
+ * Returns: %TRUE if committed, %FALSE on a conflict.
  **/
-void ohm_fact_store_transaction_push (OhmFactStore* self) {
-	OhmFactStoreTransaction* trans;
+gboolean ohm_fact_store_txn_commit (OhmFactStoreTxn* self) {
+	GHashTableIter iter;
+	gpointer k;
+	guint32 shards;
+	gboolean valid;
+	guint i;
+
+	g_return_val_if_fail (self != NULL, FALSE);
+
+	shards = 0;
+	g_hash_table_iter_init (&iter, self->reads);
+	while (g_hash_table_iter_next (&iter, &k, NULL)) {
+		shards |= 1u << OHM_FACT_STORE_SHARD (ohm_structure_get_qname (OHM_STRUCTURE (((OhmFactStoreTxnKey*) k)->fact)));
+	}
+	g_hash_table_iter_init (&iter, self->names);
+	while (g_hash_table_iter_next (&iter, &k, NULL)) {
+		shards |= 1u << OHM_FACT_STORE_SHARD (GPOINTER_TO_UINT (k));
+	}
+	for (i = 0; i < self->ops->len; i++) {
+		shards |= 1u << OHM_FACT_STORE_SHARD (ohm_structure_get_qname (OHM_STRUCTURE (g_array_index (self->ops, OhmFactStoreOp, i).fact)));
+	}
 
-	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	_ohm_fact_store_lock_shards (self->store, shards);
 
-	trans = ohm_fact_store_transaction_new (self, G_OBJECT (self));
+	valid = _ohm_fact_store_txn_valid (self);
+	if (valid) {
+		_ohm_fact_store_journal_hold (self->store);
+		for (i = 0; i < self->ops->len; i++) {
+			_ohm_fact_store_apply_op (self->store, &g_array_index (self->ops, OhmFactStoreOp, i));
+		}
+		_ohm_fact_store_journal_release (self->store, FALSE);
+	}
 
-	g_queue_push_head (self->transaction, trans);
+	_ohm_fact_store_unlock_shards (self->store, shards);
+
+	ohm_fact_store_txn_abort (self);
+
+	return valid;
 }
 
 
@@ -1604,6 +8865,12 @@ void ohm_fact_store_transaction_push (OhmFactStore* self) {
  * @rollback: wether to roll-back the transaction (%FALSE if not)
  *
  * Finish the top transaction and restore to the previous transaction state.
+ *
+ * Rolling back undoes the modifications made since the matching
+ * ohm_fact_store_transaction_push () only. Committing a nested
+ * transaction hands its modifications over to the enclosing one,
+ * which may still roll them back; committing the outermost transaction
+ * notifies the views. Without a pushed transaction, this does nothing.
  **/
 void ohm_fact_store_transaction_pop (OhmFactStore* self, gboolean rollback) {
 	OhmFactStoreTransaction* trans;
@@ -1611,6 +8878,13 @@ void ohm_fact_store_transaction_pop (OhmFactStore* self, gboolean rollback) {
 
 	g_return_if_fail (OHM_IS_FACT_STORE (self));
 
+	/* the shards are still locked by the push, if there was one */
+	_ohm_fact_store_lock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+	if (g_queue_is_empty (self->transaction)) {
+		_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+		return;
+	}
+
 	trans = ((OhmFactStoreTransaction*) g_queue_pop_head (self->transaction));
 	g_queue_push_head (self->transaction, NULL);
 
@@ -1620,20 +8894,24 @@ void ohm_fact_store_transaction_pop (OhmFactStore* self, gboolean rollback) {
 		GSList* p_it;
 		GSList* cow_collection;
 		GSList* cow_it;
+		guint n_cows;
+
+		n_cows = trans->priv->n_modifications;
+		_ohm_fact_store_lock_shared (self);
+		self->priv->stats.max_cow_length = MAX (self->priv->stats.max_cow_length, n_cows);
+		_ohm_fact_store_unlock_shared (self);
 		
 		if (rollback) {
 			p_collection = trans->matches;
 			for (p_it = p_collection; p_it != NULL; p_it = p_it->next) {
 				OhmPair* p;
-				OhmPatternMatch* m;
 				OhmFactStoreView* v;
 				gboolean          warned = FALSE;
 
 				p = ((OhmPair*) p_it->data);
 				
-				m = (OhmPatternMatch*) p->first;
 				v = (OhmFactStoreView*) p->second;
-				ohm_fact_store_change_set_remove_match (OHM_FACT_STORE_SIMPLE_VIEW (v)->change_set, m);
+				_ohm_fact_store_change_set_remove_record (OHM_FACT_STORE_SIMPLE_VIEW (v)->change_set, GPOINTER_TO_UINT (p->first));
 
 				if (!warned) {
 					g_warning("Hmm... transaction rollback with non-empty matches!");
@@ -1641,6 +8919,8 @@ void ohm_fact_store_transaction_pop (OhmFactStore* self, gboolean rollback) {
 				}
 			}
 			
+			/* undoing is not a change to record */
+			_ohm_fact_store_journal_mute (self, TRUE);
 			cow_collection = trans->modifications;
 			for (cow_it = cow_collection; cow_it != NULL; cow_it = cow_it->next) {
 				OhmFactStoreTransactionCOW* cow;
@@ -1669,41 +8949,225 @@ void ohm_fact_store_transaction_pop (OhmFactStore* self, gboolean rollback) {
 				  break;
 				}
 			}
+			_ohm_fact_store_journal_mute (self, FALSE);
 		}
 		else {
-			_ohm_fact_store_transaction_update_views(self, trans);
+			OhmFactStoreTransaction* parent;
+
+			parent = (OhmFactStoreTransaction*) g_queue_peek_nth (self->transaction, 1);
+			if (parent != NULL)
+				_ohm_fact_store_transaction_merge(parent, trans);
+			else
+				_ohm_fact_store_transaction_update_views(self, trans);
+		}
+	}
+	
+	_tmp3 = NULL;
+	_tmp3 = ((OhmFactStoreTransaction*) g_queue_pop_head (self->transaction));
+	(_tmp3 == NULL ? NULL : (_tmp3 = (g_object_unref (_tmp3), NULL)));
+
+	/* what the outermost transaction committed is now visible to the snapshots */
+	if (trans != NULL && !rollback) {
+		GSList* cow_it;
+
+		for (cow_it = trans->modifications; cow_it != NULL; cow_it = cow_it->next) {
+			OhmFact* fact;
+
+			fact = ((OhmFactStoreTransactionCOW*) cow_it->data)->fact;
+			_ohm_fact_store_touch (self, ohm_structure_get_qname (OHM_STRUCTURE (fact)), fact);
+		}
+	}
+
+	(trans == NULL ? NULL : (trans = (g_object_unref (trans), NULL)));
+
+	_ohm_fact_store_journal_release (self, rollback);
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+	_ohm_fact_store_unlock_shards (self, OHM_FACT_STORE_ALL_SHARDS);
+}
+
+
+static gboolean _ohm_fact_store_transaction_active(OhmFactStore *self) {
+	return (g_queue_peek_head (self->transaction) != NULL);
+}
+
+
+static gboolean _ohm_fact_store_transaction_rolledback(OhmFactStore *self) {
+	return (g_queue_peek_head (self->transaction) == NULL &&
+		g_queue_get_length (self->transaction) != 0);
+}
+
+
+/* remove the transaction lock
+*
+ * ohm_fact_store_new:
+ *
+ * Use ohm_get_fact_store () instead, to get the Ohm single one.
+ * Create a new #OhmFactStore.
+ *
+ * Returns: a new #OhmFactStore
+ **/
+OhmFactStore* ohm_fact_store_new (void) {
+	return g_object_new (OHM_TYPE_FACT_STORE, NULL);
+}
+
+
+/**
+ * ohm_fact_store_writer_new:
+ * @store: a #OhmFactStore
+ * @format: the format to write in
+ *
+ * Start a dump of the facts of @store, to be written in chunks with
+ * ohm_fact_store_writer_write () or ohm_fact_store_writer_write_fd (),
+ * for instance from an idle callback so that a large store does not
+ * block the main loop.
+ *
+ * The facts in @store now are written, in the order of
+ * ohm_fact_store_to_string (), each with its fields at the time it is
+ * written.
+ *
+ * Returns: a new #OhmFactStoreWriter, to free with
+ * ohm_fact_store_writer_free ().
+ **/
+OhmFactStoreWriter* ohm_fact_store_writer_new (OhmFactStore* store, OhmFactStoreFormat format) {
+	OhmFactStoreWriter* self;
+	GSList* q_it;
+
+	g_return_val_if_fail (OHM_IS_FACT_STORE (store), NULL);
+
+	self = g_slice_new0 (OhmFactStoreWriter);
+	self->store = g_object_ref (store);
+	self->format = format;
+	self->facts = g_ptr_array_new ();
+
+	_ohm_fact_store_lock_shards (store, OHM_FACT_STORE_ALL_SHARDS);
+	for (q_it = store->priv->known_facts_qname; q_it != NULL; q_it = q_it->next) {
+		OhmFactStoreFacts* facts;
+		GList* f_it;
+
+		facts = _ohm_fact_store_lookup_facts (store, GPOINTER_TO_UINT (q_it->data));
+		for (f_it = facts != NULL ? facts->facts : NULL; f_it != NULL; f_it = f_it->next) {
+			g_ptr_array_add (self->facts, g_object_ref (f_it->data));
+		}
+	}
+	_ohm_fact_store_unlock_shards (store, OHM_FACT_STORE_ALL_SHARDS);
+
+	return self;
+}
+
+
+/**
+ * ohm_fact_store_writer_write:
+ * @self: a #OhmFactStoreWriter
+ * @out: the string to append to
+ * @max_facts: the number of facts to write at most, 0 for all
+ *
+ * Append the next chunk of the dump to @out.
+ *
+ * Returns: %TRUE if there is more to write, %FALSE once done.
+ **/
+gboolean ohm_fact_store_writer_write (OhmFactStoreWriter* self, GString* out, guint max_facts) {
+	gboolean json;
+	guint end;
+
+	g_return_val_if_fail (self != NULL, FALSE);
+	g_return_val_if_fail (out != NULL, FALSE);
+
+	if (self->finished) {
+		return FALSE;
+	}
+
+	json = self->format == OHM_FACT_STORE_FORMAT_JSON;
+	if (!self->started) {
+		if (json) {
+			g_string_append_c (out, '[');
+		} else {
+			g_string_append_printf (out, "FactStore %p:\n\n", self->store);
 		}
+		self->started = TRUE;
+	}
+
+	end = self->facts->len;
+	if (max_facts > 0 && max_facts < end - self->next) {
+		end = self->next + max_facts;
 	}
-	
-	_tmp3 = NULL;
-	_tmp3 = ((OhmFactStoreTransaction*) g_queue_pop_head (self->transaction));
-	(_tmp3 == NULL ? NULL : (_tmp3 = (g_object_unref (_tmp3), NULL)));
-	(trans == NULL ? NULL : (trans = (g_object_unref (trans), NULL)));
-}
 
+	for (; self->next < end; self->next++) {
+		OhmStructure* fact;
+		GQuark qname;
 
-static gboolean _ohm_fact_store_transaction_active(OhmFactStore *self) {
-	return (g_queue_peek_head (self->transaction) != NULL);
-}
+		fact = OHM_STRUCTURE (g_ptr_array_index (self->facts, self->next));
+		if (json) {
+			g_string_append (out, self->next > 0 ? ",\n  " : "\n  ");
+		}
 
+		/* no change to the fact while it is written */
+		qname = ohm_structure_get_qname (fact);
+		_ohm_fact_store_lock_name (self->store, qname);
+		ohm_structure_write (fact, out, self->format);
+		_ohm_fact_store_unlock_name (self->store, qname);
 
-static gboolean _ohm_fact_store_transaction_rolledback(OhmFactStore *self) {
-	return (g_queue_peek_head (self->transaction) == NULL &&
-		g_queue_get_length (self->transaction) != 0);
+		if (!json) {
+			g_string_append_c (out, '\n');
+		}
+	}
+
+	if (self->next < self->facts->len) {
+		return TRUE;
+	}
+
+	if (json) {
+		g_string_append (out, "\n]\n");
+	}
+	self->finished = TRUE;
+
+	return FALSE;
 }
 
 
-/* remove the transaction lock
-*
- * ohm_fact_store_new:
+/**
+ * ohm_fact_store_writer_write_fd:
+ * @self: a #OhmFactStoreWriter
+ * @fd: a file descriptor open for writing
+ * @max_facts: the number of facts to write at most, 0 for all
+ * @error: return location for a #GError, or %NULL
  *
- * Use ohm_get_fact_store () instead, to get the Ohm single one.
- * Create a new #OhmFactStore.
+ * Write the next chunk of the dump to @fd.
  *
- * Returns: a new #OhmFactStore
+ * Returns: %TRUE if there is more to write, %FALSE once done or if
+ * @error was set.
  **/
-OhmFactStore* ohm_fact_store_new (void) {
-	return g_object_new (OHM_TYPE_FACT_STORE, NULL);
+gboolean ohm_fact_store_writer_write_fd (OhmFactStoreWriter* self, int fd, guint max_facts, GError** error) {
+	gboolean more;
+
+	g_return_val_if_fail (self != NULL, FALSE);
+	g_return_val_if_fail (fd >= 0, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	if (self->buffer == NULL) {
+		self->buffer = g_string_sized_new (4096);
+	}
+
+	more = ohm_fact_store_writer_write (self, self->buffer, max_facts);
+	if (!_ohm_fact_store_write_all (fd, (const guint8*) self->buffer->str, self->buffer->len, error)) {
+		self->finished = TRUE;
+		more = FALSE;
+	}
+	g_string_truncate (self->buffer, 0);
+
+	return more;
+}
+
+
+void ohm_fact_store_writer_free (OhmFactStoreWriter* self) {
+	g_return_if_fail (self != NULL);
+
+	g_ptr_array_foreach (self->facts, (GFunc) g_object_unref, NULL);
+	g_ptr_array_free (self->facts, TRUE);
+	if (self->buffer != NULL) {
+		g_string_free (self->buffer, TRUE);
+	}
+	g_object_unref (self->store);
+	g_slice_free (OhmFactStoreWriter, self);
 }
 
 
@@ -1716,45 +9180,17 @@ OhmFactStore* ohm_fact_store_new (void) {
  * Returns: a new string to be free by the caller.
  **/
 char* ohm_fact_store_to_string (OhmFactStore* self) {
-	GSList* q_collection;
-	GSList* q_it;
-	char* ret;
+	OhmFactStoreWriter* writer;
+	GString* out;
 
 	g_return_val_if_fail (OHM_IS_FACT_STORE (self), NULL);
 
-	ret = g_strdup_printf ("FactStore %p:\n\n", self);
-	q_collection = self->priv->known_facts_qname;
-	for (q_it = q_collection; q_it != NULL; q_it = q_it->next) {
-	  GQuark q;
-	  q = GPOINTER_TO_INT (q_it->data);
-	  {
-	    {
-	      GSList* f_collection;
-	      GSList* f_it;
-	      f_collection = ohm_fact_store_get_facts_by_quark (self, q);
-	      for (f_it = f_collection; f_it != NULL; f_it = f_it->next) {
-		OhmFact* _tmp3;
-		OhmFact* f;
-		_tmp3 = NULL;
-		f = (_tmp3 = ((OhmFact*) f_it->data), (_tmp3 == NULL ? NULL : g_object_ref (_tmp3)));
-		{
-		  char* _tmp1;
-		  char* _tmp0;
-		  char* _tmp2;
-		  _tmp1 = NULL;
-		  _tmp0 = NULL;
-		  ret = (_tmp1 = g_strconcat (ret, (_tmp0 = (ohm_structure_to_string (OHM_STRUCTURE (f)))), NULL), (ret = (g_free (ret), NULL)), _tmp1);
-		  _tmp0 = (g_free (_tmp0), NULL);
-		  _tmp2 = NULL;
-		  ret = (_tmp2 = g_strconcat (ret, ("\n"), NULL), (ret = (g_free (ret), NULL)), _tmp2);
-		  (f == NULL ? NULL : (f = (g_object_unref (f), NULL)));
-		}
-	      }
-	    }
-	  }
-	}
+	out = g_string_new (NULL);
+	writer = ohm_fact_store_writer_new (self, OHM_FACT_STORE_FORMAT_TEXT);
+	ohm_fact_store_writer_write (writer, out, 0);
+	ohm_fact_store_writer_free (writer);
 
-	return ret;
+	return g_string_free (out, FALSE);
 }
 
 
@@ -1805,77 +9241,461 @@ static void _ohm_fact_store_delete_func (GSList* l) {
 	  g_object_unref (G_OBJECT (p));
 	}
 
-	g_slist_free (l);
+	g_slist_free (l);
+}
+
+
+static void ohm_fact_store_set_view_interest (OhmFactStore* self, OhmFactStoreView* v) {
+	GSList* p_collection;
+	GSList* p_it;
+	GSList* patterns;
+	GSList* patts;
+	GData **interestptr;
+	GHashTable* alphas;
+	
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (OHM_FACT_STORE_IS_VIEW (v));
+
+	if (ohm_fact_store_view_is_transparent(v)) {
+	  interestptr = &self->priv->transp_interest;
+	  alphas = self->priv->transp_alpha;
+	} else {
+	  interestptr = &self->priv->interest;
+	  alphas = self->priv->alpha;
+	}
+
+	_ohm_fact_store_lock_interest (self, TRUE);
+
+	if (self->priv->locks != NULL) {
+	  _ohm_fact_store_change_set_make_thread_safe (OHM_FACT_STORE_SIMPLE_VIEW (v)->change_set);
+	}
+
+	p_collection = v->patterns;
+	for (p_it = p_collection; p_it != NULL; p_it = p_it->next) {
+	  OhmPattern* p;
+
+	  p = (OhmPattern*) p_it->data;
+	  patterns = g_datalist_id_remove_no_notify (interestptr, ohm_structure_get_qname (OHM_STRUCTURE (p)));
+	  patts = patterns;
+
+	  /* FIXME...*/
+	  if (g_slist_find (((gpointer) patterns), p) == NULL) {
+
+	    if (ohm_pattern_get_view (p) != NULL) {
+	      g_warning ("%p: pattern has already a view", p);
+	    }
+
+	    ohm_pattern_set_view (p, v);
+	    ohm_pattern_compile (p);
+	    patts = g_slist_prepend (patts, g_object_ref (p));
+	    _ohm_fact_store_alpha_add (_ohm_fact_store_alpha_lookup (self, alphas, ohm_structure_get_qname (OHM_STRUCTURE (p))), p);
+	    /* FIXME: match now?*/
+	    patterns = patts;
+	  }
+
+	  if (patterns != NULL) {
+	    g_datalist_id_set_data_full (interestptr, ohm_structure_get_qname (OHM_STRUCTURE (p)), patterns, ((GDestroyNotify) _ohm_fact_store_delete_func));
+	  }
+	}
+
+	_ohm_fact_store_unlock_interest (self, TRUE);
+}
+
+
+static void ohm_fact_store_pattern_del (OhmFactStore* self, OhmFactStoreView* v, OhmStructure *interest) {
+	GSList *patterns;
+	GQuark  id;
+	OhmPattern *p;
+	GData **interestptr;
+
+	g_return_if_fail (OHM_IS_FACT_STORE (self));
+	g_return_if_fail (OHM_FACT_STORE_IS_VIEW (v));
+	g_return_if_fail (OHM_IS_PATTERN(interest));
+
+	if (ohm_fact_store_view_is_transparent(v))
+	  interestptr = &self->priv->transp_interest;
+	else
+	  interestptr = &self->priv->interest;
+
+	id = ohm_structure_get_qname (interest);
+	p = OHM_PATTERN(interest);
+
+	_ohm_fact_store_lock_interest (self, TRUE);
+	patterns = g_datalist_id_remove_no_notify (interestptr, id);
+
+	if (g_slist_index(patterns, p) < 0) {
+		_ohm_fact_store_unlock_interest (self, TRUE);
+		return;
+	}
+
+	if (p->priv->alpha != NULL)
+		_ohm_fact_store_alpha_remove (p);
+	
+	if ((patterns = g_slist_remove(patterns, p)) != NULL)
+		g_datalist_id_set_data_full (interestptr, id, patterns, ((GDestroyNotify) _ohm_fact_store_delete_func));
+
+	_ohm_fact_store_unlock_interest (self, TRUE);
+}
+
+
+static void _ohm_fact_store_change_set_release (OhmFactStoreMatchRecord* r) {
+	g_object_unref (r->fact);
+	g_object_unref (r->pattern);
+	if (r->fields != NULL) {
+		g_array_free (r->fields, TRUE);
+	}
+	if (r->match != NULL) {
+		g_object_unref (r->match);
+	}
+}
+
+
+static void _ohm_fact_store_change_set_invalidate (OhmFactStoreChangeSet* self) {
+	g_slist_free (self->priv->_matches);
+	self->priv->_matches = NULL;
+	self->priv->n_listed = 0;
+}
+
+
+static guint _ohm_fact_store_coalesce_hash (gconstpointer p) {
+	const OhmFactStoreCoalesceKey* key = p;
+
+	return g_direct_hash (key->fact) * 31 + g_direct_hash (key->pattern);
+}
+
+
+static gboolean _ohm_fact_store_coalesce_equal (gconstpointer a, gconstpointer b) {
+	const OhmFactStoreCoalesceKey* ka = a;
+	const OhmFactStoreCoalesceKey* kb = b;
+
+	return ka->fact == kb->fact && ka->pattern == kb->pattern;
+}
+
+
+static void _ohm_fact_store_coalesce_free (gpointer p) {
+	g_slice_free (OhmFactStoreCoalesceKey, p);
+}
+
+
+static OhmFactStoreCoalesceKey* _ohm_fact_store_change_set_coalesced (OhmFactStoreChangeSet* self, OhmFact* fact, OhmPattern* pattern) {
+	OhmFactStoreCoalesceKey key;
+
+	key.fact = fact;
+	key.pattern = pattern;
+
+	return g_hash_table_lookup (self->priv->coalesce, &key);
+}
+
+
+/* Make the record at @i the newest of its fact and pattern. */
+static void _ohm_fact_store_change_set_coalesce_at (OhmFactStoreChangeSet* self, guint i) {
+	OhmFactStoreMatchRecord* r;
+	OhmFactStoreCoalesceKey* key;
+
+	r = &g_array_index (self->priv->records, OhmFactStoreMatchRecord, i);
+	key = _ohm_fact_store_change_set_coalesced (self, r->fact, r->pattern);
+	if (key == NULL) {
+		key = g_slice_new (OhmFactStoreCoalesceKey);
+		key->fact = r->fact;
+		key->pattern = r->pattern;
+		g_hash_table_insert (self->priv->coalesce, key, key);
+	}
+
+	key->pos = i + 1;
+}
+
+
+/*
+ * Squeeze the holes out of the records; each record is moved once for
+ * as many records dropped, so a drop stays O(1) on average.
+ */
+static void _ohm_fact_store_change_set_compact (OhmFactStoreChangeSet* self) {
+	OhmFactStoreChangeSetPrivate* priv;
+	guint i;
+	guint j;
+
+	priv = self->priv;
+	for (i = priv->head, j = 0; i < priv->records->len; i++) {
+		OhmFactStoreMatchRecord* r;
+
+		r = &g_array_index (priv->records, OhmFactStoreMatchRecord, i);
+		if (r->fact == NULL) {
+			continue;
+		}
+
+		if (priv->coalesce != NULL) {
+			OhmFactStoreCoalesceKey* key;
+
+			key = _ohm_fact_store_change_set_coalesced (self, r->fact, r->pattern);
+			if (key != NULL && key->pos == i + 1) {
+				key->pos = j + 1;
+			}
+		}
+
+		g_array_index (priv->records, OhmFactStoreMatchRecord, j) = *r;
+		j++;
+	}
+
+	g_array_set_size (priv->records, j);
+	priv->head = 0;
+}
+
+
+static void _ohm_fact_store_change_set_remove_at (OhmFactStoreChangeSet* self, guint i) {
+	OhmFactStoreChangeSetPrivate* priv;
+	OhmFactStoreMatchRecord* r;
+
+	priv = self->priv;
+	r = &g_array_index (priv->records, OhmFactStoreMatchRecord, i);
+	if (priv->coalesce != NULL) {
+		OhmFactStoreCoalesceKey* key;
+
+		key = _ohm_fact_store_change_set_coalesced (self, r->fact, r->pattern);
+		if (key != NULL && key->pos == i + 1) {
+			g_hash_table_remove (priv->coalesce, key);
+		}
+	}
+
+	_ohm_fact_store_change_set_release (r);
+	r->fact = NULL;
+	r->match = NULL;
+	priv->n_records--;
+
+	while (priv->head < priv->records->len &&
+	       g_array_index (priv->records, OhmFactStoreMatchRecord, priv->head).fact == NULL) {
+		priv->head++;
+	}
+
+	if (priv->n_records == 0) {
+		g_array_set_size (priv->records, 0);
+		priv->head = 0;
+	} else if (priv->records->len - priv->n_records > priv->n_records) {
+		_ohm_fact_store_change_set_compact (self);
+	}
+
+	/* the list of wrappers no longer lines up with the records */
+	_ohm_fact_store_change_set_invalidate (self);
+}
+
+
+static void _ohm_fact_store_change_set_add_field (OhmFactStoreMatchRecord* r, GQuark field) {
+	guint i;
+
+	if (r->fields == NULL) {
+		if (r->field == 0 || r->field == field) {
+			return;
+		}
+		r->fields = g_array_sized_new (FALSE, FALSE, sizeof (GQuark), 4);
+		g_array_append_val (r->fields, r->field);
+	}
+
+	for (i = 0; i < r->fields->len; i++) {
+		if (g_array_index (r->fields, GQuark, i) == field) {
+			return;
+		}
+	}
+
+	g_array_append_val (r->fields, field);
+}
+
+
+/*
+ * Fold @event into the entry @r already has for the same fact, so that
+ * the change set holds the net change: added then updated is added,
+ * updated then removed is removed, removed then added is an update of
+ * unknown fields and added then removed is nothing at all. Returns
+ * FALSE if the entry is to be dropped.
+ */
+static gboolean _ohm_fact_store_change_set_merge (OhmFactStoreChangeSet* self, OhmFactStoreMatchRecord* r, OhmFactStoreEvent event, GQuark field) {
+	OhmFactStoreEvent merged;
+
+	merged = event;
+	switch (r->event) {
+	case OHM_FACT_STORE_EVENT_ADDED:
+		if (event == OHM_FACT_STORE_EVENT_REMOVED) {
+			return FALSE;
+		}
+		merged = OHM_FACT_STORE_EVENT_ADDED;
+		break;
+	case OHM_FACT_STORE_EVENT_UPDATED:
+		if (event == OHM_FACT_STORE_EVENT_UPDATED) {
+			if (field == 0 || (r->field == 0 && r->fields == NULL)) {
+				r->field = 0;
+				if (r->fields != NULL) {
+					g_array_free (r->fields, TRUE);
+					r->fields = NULL;
+				}
+			} else {
+				_ohm_fact_store_change_set_add_field (r, field);
+			}
+			return TRUE;
+		}
+		break;
+	case OHM_FACT_STORE_EVENT_REMOVED:
+		if (event == OHM_FACT_STORE_EVENT_ADDED) {
+			merged = OHM_FACT_STORE_EVENT_UPDATED;
+			field = 0;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (merged != r->event) {
+		r->event = merged;
+		r->field = field;
+		if (r->fields != NULL) {
+			g_array_free (r->fields, TRUE);
+			r->fields = NULL;
+		}
+
+		/* the wrapper carries the event, it has to be made again */
+		if (r->match != NULL) {
+			g_object_unref (r->match);
+			r->match = NULL;
+			_ohm_fact_store_change_set_invalidate (self);
+		}
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Records are kept by value in one array which is emptied, but not
+ * shrunk, on reset: once a change set has seen its usual number of
+ * matches, recording a match allocates nothing. Returns the serial of
+ * the record, or 0 if nothing was recorded.
+ */
+static guint _ohm_fact_store_change_set_append (OhmFactStoreChangeSet* self, OhmFact* fact, OhmPattern* pattern, OhmFactStoreEvent event, GQuark field, OhmPatternMatch* match) {
+	static volatile gint serial = 0;
+	OhmFactStoreChangeSetPrivate* priv;
+	OhmFactStoreMatchRecord r;
+
+	priv = self->priv;
+	if (priv->coalesce != NULL) {
+		OhmFactStoreCoalesceKey* key;
+
+		key = _ohm_fact_store_change_set_coalesced (self, fact, pattern);
+		if (key != NULL) {
+			OhmFactStoreMatchRecord* prev;
+			guint i;
+
+			i = key->pos - 1;
+			prev = &g_array_index (priv->records, OhmFactStoreMatchRecord, i);
+			if (_ohm_fact_store_change_set_merge (self, prev, event, field)) {
+				return prev->serial;
+			}
+
+			_ohm_fact_store_change_set_remove_at (self, i);
+			return 0;
+		}
+	}
+
+	if (priv->high_water != 0 && priv->n_records >= priv->high_water) {
+		priv->overflowed = TRUE;
+		if (priv->overflow == OHM_FACT_STORE_OVERFLOW_DROP_NEWEST) {
+			return 0;
+		}
+		_ohm_fact_store_change_set_remove_at (self, priv->head);
+	}
+
+	r.fact = g_object_ref (fact);
+	r.pattern = g_object_ref (pattern);
+	r.event = event;
+	r.serial = (guint) g_atomic_int_add (&serial, 1) + 1;
+	r.field = event == OHM_FACT_STORE_EVENT_UPDATED ? field : 0;
+	r.fields = NULL;
+	r.match = match != NULL ? g_object_ref (match) : NULL;
+
+	g_array_append_val (priv->records, r);
+	priv->n_records++;
+
+	if (priv->coalesce != NULL) {
+		_ohm_fact_store_change_set_coalesce_at (self, priv->records->len - 1);
+	}
+
+	return r.serial;
+}
+
+
+static void _ohm_fact_store_change_set_lock (OhmFactStoreChangeSet* self) {
+	if (self->priv->lock != NULL) {
+		g_mutex_lock (self->priv->lock);
+	}
+}
+
+
+static void _ohm_fact_store_change_set_unlock (OhmFactStoreChangeSet* self) {
+	if (self->priv->lock != NULL) {
+		g_mutex_unlock (self->priv->lock);
+	}
+}
+
+
+/*
+ * The change sets of the views of a thread-safe store are filled by
+ * the writer threads while their listener reads them: from then on,
+ * every access goes through a lock of their own.
+ */
+static void _ohm_fact_store_change_set_make_thread_safe (OhmFactStoreChangeSet* self) {
+	if (self->priv->lock == NULL) {
+		self->priv->lock = g_new0 (GMutex, 1);
+		g_mutex_init (self->priv->lock);
+	}
 }
 
 
-static void ohm_fact_store_set_view_interest (OhmFactStore* self, OhmFactStoreView* v) {
-	GSList* p_collection;
-	GSList* p_it;
-	GSList* patterns;
-	GSList* patts;
-	GData **interestptr;
-	
-	g_return_if_fail (OHM_IS_FACT_STORE (self));
-	g_return_if_fail (OHM_FACT_STORE_IS_VIEW (v));
+static guint _ohm_fact_store_change_set_add_record (OhmFactStoreChangeSet* self, OhmFact* fact, OhmPattern* pattern, OhmFactStoreEvent event, GQuark field, OhmPatternMatch* match) {
+	guint serial;
 
-	if (ohm_fact_store_view_is_transparent(v))
-	  interestptr = &self->priv->transp_interest;
-	else
-	  interestptr = &self->priv->interest;
+	_ohm_fact_store_change_set_lock (self);
+	serial = _ohm_fact_store_change_set_append (self, fact, pattern, event, field, match);
+	_ohm_fact_store_change_set_unlock (self);
 
-	p_collection = v->patterns;
-	for (p_it = p_collection; p_it != NULL; p_it = p_it->next) {
-	  OhmPattern* p;
+	return serial;
+}
 
-	  p = (OhmPattern*) p_it->data;
-	  patterns = g_datalist_id_remove_no_notify (interestptr, ohm_structure_get_qname (OHM_STRUCTURE (p)));
-	  patts = patterns;
 
-	  /* FIXME...*/
-	  if (g_slist_find (((gpointer) patterns), p) == NULL) {
+static void _ohm_fact_store_change_set_remove_record (OhmFactStoreChangeSet* self, guint serial) {
+	guint i;
 
-	    if (ohm_pattern_get_view (p) != NULL) {
-	      g_warning ("%p: pattern has already a view", p);
-	    }
+	_ohm_fact_store_change_set_lock (self);
 
-	    ohm_pattern_set_view (p, v);
-	    patts = g_slist_prepend (patts, g_object_ref (p));
-	    /* FIXME: match now?*/
-	    patterns = patts;
-	  }
+	for (i = self->priv->records->len; i > self->priv->head; i--) {
+		OhmFactStoreMatchRecord* r;
 
-	  if (patterns != NULL) {
-	    g_datalist_id_set_data_full (interestptr, ohm_structure_get_qname (OHM_STRUCTURE (p)), patterns, ((GDestroyNotify) _ohm_fact_store_delete_func));
-	  }
+		r = &g_array_index (self->priv->records, OhmFactStoreMatchRecord, i - 1);
+		if (r->fact != NULL && r->serial == serial) {
+			_ohm_fact_store_change_set_remove_at (self, i - 1);
+			break;
+		}
 	}
+
+	_ohm_fact_store_change_set_unlock (self);
 }
 
 
-static void ohm_fact_store_pattern_del (OhmFactStore* self, OhmFactStoreView* v, OhmStructure *interest) {
-	GSList *patterns;
-	GQuark  id;
-	OhmPattern *p;
-	GData **interestptr;
+static void _ohm_fact_store_change_set_clear (OhmFactStoreChangeSet* self) {
+	guint i;
 
-	g_return_if_fail (OHM_IS_FACT_STORE (self));
-	g_return_if_fail (OHM_FACT_STORE_IS_VIEW (v));
-	g_return_if_fail (OHM_IS_PATTERN(interest));
+	for (i = self->priv->head; i < self->priv->records->len; i++) {
+		OhmFactStoreMatchRecord* r;
 
-	if (ohm_fact_store_view_is_transparent(v))
-	  interestptr = &self->priv->transp_interest;
-	else
-	  interestptr = &self->priv->interest;
+		r = &g_array_index (self->priv->records, OhmFactStoreMatchRecord, i);
+		if (r->fact != NULL) {
+			_ohm_fact_store_change_set_release (r);
+		}
+	}
 
-	id = ohm_structure_get_qname (interest);
-	patterns = g_datalist_id_remove_no_notify (interestptr, id);
-	p = OHM_PATTERN(interest);
-	
-	if (g_slist_index(patterns, p) < 0)
-		return;
-	
-	if ((patterns = g_slist_remove(patterns, p)) != NULL)
-		g_datalist_id_set_data_full (interestptr, id, patterns, ((GDestroyNotify) _ohm_fact_store_delete_func));
+	g_array_set_size (self->priv->records, 0);
+	self->priv->head = 0;
+	self->priv->n_records = 0;
+	if (self->priv->coalesce != NULL) {
+		g_hash_table_remove_all (self->priv->coalesce);
+	}
+	self->priv->overflowed = FALSE;
+	_ohm_fact_store_change_set_invalidate (self);
 }
 
 
@@ -1883,33 +9703,177 @@ void ohm_fact_store_change_set_add_match (OhmFactStoreChangeSet* self, OhmPatter
 	g_return_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self));
 	g_return_if_fail (OHM_PATTERN_IS_MATCH (match));
 
-	self->priv->_matches = g_slist_prepend (self->priv->_matches, g_object_ref (match));
+	_ohm_fact_store_change_set_add_record (self, ohm_pattern_match_get_fact (match),
+					       ohm_pattern_match_get_pattern (match),
+					       ohm_pattern_match_get_event (match), 0, match);
 }
 
 
 void ohm_fact_store_change_set_remove_match (OhmFactStoreChangeSet* self, OhmPatternMatch* match) {
+	guint i;
+
 	g_return_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self));
 	g_return_if_fail (OHM_PATTERN_IS_MATCH (match));
 
-	self->priv->_matches = g_slist_remove (self->priv->_matches, match);
+	_ohm_fact_store_change_set_lock (self);
+
+	for (i = self->priv->head; i < self->priv->records->len; i++) {
+		OhmFactStoreMatchRecord* r;
+
+		r = &g_array_index (self->priv->records, OhmFactStoreMatchRecord, i);
+		if (r->fact != NULL && r->match == match) {
+			_ohm_fact_store_change_set_remove_at (self, i);
+			break;
+		}
+	}
+
+	_ohm_fact_store_change_set_unlock (self);
 }
 
 
 void ohm_fact_store_change_set_reset (OhmFactStoreChangeSet* self) {
 	g_return_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self));
 
-	if (self->priv->_matches != NULL) {
-	  _g_slist_free_g_object_unref (self->priv->_matches);
+	_ohm_fact_store_change_set_lock (self);
+	_ohm_fact_store_change_set_clear (self);
+	_ohm_fact_store_change_set_unlock (self);
+}
+
+
+/**
+ * ohm_fact_store_change_set_set_coalesce:
+ * @self: a change set
+ * @coalesce: whether to keep only the net change of each fact
+ *
+ * When coalescing, the change set holds at most one entry per fact and
+ * pattern: a fact added and then updated is reported as added, one added and then
+ * removed is not reported at all, and successive updates make up one
+ * updated entry, see ohm_fact_store_change_set_get_fields (). The list
+ * returned by ohm_fact_store_change_set_get_matches () is then only
+ * valid until the next change of the change set.
+ *
+ * Change sets do not coalesce by default.
+ **/
+void ohm_fact_store_change_set_set_coalesce (OhmFactStoreChangeSet* self, gboolean coalesce) {
+	guint i;
+
+	g_return_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self));
+
+	_ohm_fact_store_change_set_lock (self);
+
+	if (!coalesce) {
+		if (self->priv->coalesce != NULL) {
+			g_hash_table_destroy (self->priv->coalesce);
+			self->priv->coalesce = NULL;
+		}
+	} else if (self->priv->coalesce == NULL) {
+		/* entries recorded so far stay as they are, later ones merge into the newest */
+		self->priv->coalesce = g_hash_table_new_full (_ohm_fact_store_coalesce_hash, _ohm_fact_store_coalesce_equal,
+							      _ohm_fact_store_coalesce_free, NULL);
+		for (i = self->priv->head; i < self->priv->records->len; i++) {
+			if (g_array_index (self->priv->records, OhmFactStoreMatchRecord, i).fact != NULL) {
+				_ohm_fact_store_change_set_coalesce_at (self, i);
+			}
+		}
 	}
 
-	self->priv->_matches = NULL;
+	_ohm_fact_store_change_set_unlock (self);
+}
+
+
+gboolean ohm_fact_store_change_set_get_coalesce (OhmFactStoreChangeSet* self) {
+	g_return_val_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self), FALSE);
+
+	return self->priv->coalesce != NULL;
+}
+
+
+/**
+ * ohm_fact_store_change_set_set_high_water:
+ * @self: a change set
+ * @limit: maximum number of entries, 0 for no limit
+ * @overflow: what to do with a new entry once @limit is reached
+ *
+ * Bounds the memory a change set uses while its listener lags behind.
+ * With %OHM_FACT_STORE_OVERFLOW_DROP_NEWEST further matches are
+ * ignored, with %OHM_FACT_STORE_OVERFLOW_DROP_OLDEST they push the
+ * oldest entry out. Either way ohm_fact_store_change_set_get_overflowed ()
+ * tells the listener, which should then rescan the store.
+ **/
+void ohm_fact_store_change_set_set_high_water (OhmFactStoreChangeSet* self, guint limit, OhmFactStoreOverflow overflow) {
+	g_return_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self));
+
+	_ohm_fact_store_change_set_lock (self);
+	self->priv->high_water = limit;
+	self->priv->overflow = overflow;
+	_ohm_fact_store_change_set_unlock (self);
+}
+
+
+/**
+ * ohm_fact_store_change_set_get_overflowed:
+ * @self: a change set
+ *
+ * Returns: %TRUE if entries were dropped because of the high-water mark
+ * since the last ohm_fact_store_change_set_reset ().
+ **/
+gboolean ohm_fact_store_change_set_get_overflowed (OhmFactStoreChangeSet* self) {
+	g_return_val_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self), FALSE);
+
+	return self->priv->overflowed;
+}
+
+
+/**
+ * ohm_fact_store_change_set_get_fields:
+ * @self: a change set
+ * @match: a match from ohm_fact_store_change_set_get_matches ()
+ * @n_fields: return location for the number of fields
+ *
+ * Returns: the fields whose update an %OHM_FACT_STORE_EVENT_UPDATED
+ * entry stands for, or %NULL if unknown (any field may have changed).
+ * The array belongs to the change set.
+ **/
+const GQuark* ohm_fact_store_change_set_get_fields (OhmFactStoreChangeSet* self, OhmPatternMatch* match, guint* n_fields) {
+	const GQuark* fields;
+	guint i;
+
+	g_return_val_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self), NULL);
+	g_return_val_if_fail (n_fields != NULL, NULL);
+
+	*n_fields = 0;
+	fields = NULL;
+	_ohm_fact_store_change_set_lock (self);
+
+	for (i = self->priv->head; i < self->priv->records->len; i++) {
+		OhmFactStoreMatchRecord* r;
+
+		r = &g_array_index (self->priv->records, OhmFactStoreMatchRecord, i);
+		if (r->fact == NULL || r->match != match) {
+			continue;
+		}
+
+		if (r->fields != NULL) {
+			*n_fields = r->fields->len;
+			fields = (const GQuark*) r->fields->data;
+		} else if (r->field != 0) {
+			*n_fields = 1;
+			fields = &r->field;
+		}
+
+		break;
+	}
+
+	_ohm_fact_store_change_set_unlock (self);
+
+	return fields;
 }
 
 
 char* ohm_fact_store_change_set_to_string (OhmFactStoreChangeSet* self) {
 	g_return_val_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self), NULL);
 
-	return g_strdup_printf ("n matches: %d", g_slist_length (ohm_fact_store_change_set_get_matches (self)));
+	return g_strdup_printf ("n matches: %u", self->priv->n_records);
 }
 
 
@@ -1928,10 +9892,41 @@ OhmFactStoreChangeSet* ohm_fact_store_change_set_new (void) {
 }
 
 
+/*
+ * The list is built on demand, newest match first, and only grows at
+ * its head while matches are added, so a list obtained earlier stays
+ * valid as long as nothing is removed from the change set.
+ */
 GSList* ohm_fact_store_change_set_get_matches (OhmFactStoreChangeSet* self) {
+	OhmFactStoreChangeSetPrivate* priv;
+	GSList* matches;
+
 	g_return_val_if_fail (OHM_FACT_STORE_IS_CHANGE_SET (self), NULL);
 
-	return self->priv->_matches;
+	priv = self->priv;
+	_ohm_fact_store_change_set_lock (self);
+
+	if (priv->n_listed < priv->head) {
+		priv->n_listed = priv->head;
+	}
+	for (; priv->n_listed < priv->records->len; priv->n_listed++) {
+		OhmFactStoreMatchRecord* r;
+
+		r = &g_array_index (priv->records, OhmFactStoreMatchRecord, priv->n_listed);
+		if (r->fact == NULL) {
+			continue;
+		}
+		if (r->match == NULL) {
+			r->match = ohm_pattern_match_new (r->fact, r->pattern, r->event);
+		}
+
+		priv->_matches = g_slist_prepend (priv->_matches, r->match);
+	}
+
+	matches = priv->_matches;
+	_ohm_fact_store_change_set_unlock (self);
+
+	return matches;
 }
 
 
@@ -1967,6 +9962,7 @@ static void ohm_fact_store_change_set_class_init (OhmFactStoreChangeSetClass * k
 
 static void ohm_fact_store_change_set_init (OhmFactStoreChangeSet * self) {
 	self->priv = OHM_FACT_STORE_CHANGE_SET_GET_PRIVATE (self);
+	self->priv->records = g_array_new (FALSE, FALSE, sizeof (OhmFactStoreMatchRecord));
 }
 
 
@@ -1975,9 +9971,21 @@ static void ohm_fact_store_change_set_dispose (GObject * obj) {
 
 	self = OHM_FACT_STORE_CHANGE_SET (obj);
 
-	if (self->priv->_matches != NULL) {
-	  _g_slist_free_g_object_unref (self->priv->_matches);
-	  self->priv->_matches = NULL;
+	if (self->priv->records != NULL) {
+	  _ohm_fact_store_change_set_clear (self);
+	  g_array_free (self->priv->records, TRUE);
+	  self->priv->records = NULL;
+	}
+
+	if (self->priv->coalesce != NULL) {
+	  g_hash_table_destroy (self->priv->coalesce);
+	  self->priv->coalesce = NULL;
+	}
+
+	if (self->priv->lock != NULL) {
+	  g_mutex_clear (self->priv->lock);
+	  g_free (self->priv->lock);
+	  self->priv->lock = NULL;
 	}
 
 	G_OBJECT_CLASS (ohm_fact_store_change_set_parent_class)->dispose (obj);
@@ -2150,7 +10158,7 @@ static void ohm_fact_store_simple_view_class_init (OhmFactStoreSimpleViewClass *
 							      G_PARAM_STATIC_NAME | G_PARAM_STATIC_NICK | G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
 
 
-	g_signal_new ("updated", OHM_FACT_STORE_TYPE_SIMPLE_VIEW, G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__OBJECT, G_TYPE_NONE, 1, OHM_FACT_STORE_TYPE_CHANGE_SET);
+	ohm_fact_store_simple_view_signals[OHM_FACT_STORE_SIMPLE_VIEW_UPDATED_SIGNAL] = g_signal_new ("updated", OHM_FACT_STORE_TYPE_SIMPLE_VIEW, G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__OBJECT, G_TYPE_NONE, 1, OHM_FACT_STORE_TYPE_CHANGE_SET);
 }
 
 
@@ -2217,6 +10225,44 @@ static void _g_slist_free_ohm_fact_store_transaction_cow_free (GSList* self) {
 }
 
 
+/*
+ * The logs are kept newest first, with their tail and length at hand so
+ * that a committed nested transaction is spliced into its parent in O(1).
+ */
+static void _ohm_fact_store_transaction_log (OhmFactStoreTransaction* self, OhmFactStoreTransactionCOW* cow) {
+	self->modifications = g_slist_prepend (self->modifications, cow);
+	if (self->modifications->next == NULL) {
+		self->priv->modifications_tail = self->modifications;
+	}
+	self->priv->n_modifications++;
+}
+
+
+static void _ohm_fact_store_transaction_merge (OhmFactStoreTransaction* self, OhmFactStoreTransaction* child) {
+	if (child->modifications != NULL) {
+		child->priv->modifications_tail->next = self->modifications;
+		if (self->modifications == NULL) {
+			self->priv->modifications_tail = child->priv->modifications_tail;
+		}
+		self->modifications = child->modifications;
+		self->priv->n_modifications += child->priv->n_modifications;
+		child->modifications = NULL;
+		child->priv->modifications_tail = NULL;
+		child->priv->n_modifications = 0;
+	}
+
+	if (child->matches != NULL) {
+		child->priv->matches_tail->next = self->matches;
+		if (self->matches == NULL) {
+			self->priv->matches_tail = child->priv->matches_tail;
+		}
+		self->matches = child->matches;
+		child->matches = NULL;
+		child->priv->matches_tail = NULL;
+	}
+}
+
+
 static OhmFactStoreTransaction* ohm_fact_store_transaction_new (OhmFactStore* fact_store, GObject* listener) {
 	g_return_val_if_fail (OHM_IS_FACT_STORE (fact_store), NULL);
 	g_return_val_if_fail (G_IS_OBJECT (listener), NULL);
@@ -2262,11 +10308,14 @@ void ohm_fact_store_transaction_cow_free (OhmFactStoreTransactionCOW* self) {
 static void ohm_fact_store_transaction_class_init (OhmFactStoreTransactionClass * klass) {
 	ohm_fact_store_transaction_parent_class = g_type_class_peek_parent (klass);
 
+	g_type_class_add_private (klass, sizeof (OhmFactStoreTransactionPrivate));
+
 	G_OBJECT_CLASS (klass)->dispose = ohm_fact_store_transaction_dispose;
 }
 
 
 static void ohm_fact_store_transaction_init (OhmFactStoreTransaction * self) {
+	self->priv = OHM_FACT_STORE_TRANSACTION_GET_PRIVATE (self);
 }
 
 
@@ -2382,6 +10431,36 @@ void ohm_fact_store_view_remove (OhmFactStoreView* self, OhmStructure* interest)
 }
 
 
+/**
+ * ohm_fact_store_view_write:
+ * @self: a #OhmFactStoreView
+ * @out: the string to append to
+ * @format: the format to write in
+ *
+ * Append a description of @self to @out.
+ **/
+void ohm_fact_store_view_write (OhmFactStoreView* self, GString* out, OhmFactStoreFormat format) {
+	OhmFactStoreSimpleView* view;
+	const char* fmt;
+
+	g_return_if_fail (OHM_FACT_STORE_IS_VIEW (self));
+	g_return_if_fail (out != NULL);
+
+	view = OHM_FACT_STORE_SIMPLE_VIEW (self);
+	if (format == OHM_FACT_STORE_FORMAT_JSON) {
+		fmt = "{\"listener\": \"%p\", \"fact_store\": \"%p\", \"patterns\": %u, \"matches\": %u}";
+	} else {
+		fmt = "listener: %p, factstore: %p, patterns: %u, changeset: n matches: %u";
+	}
+
+	g_string_append_printf (out, fmt,
+				ohm_fact_store_simple_view_get_listener (view),
+				ohm_fact_store_simple_view_get_fact_store (view),
+				g_slist_length (self->patterns),
+				view->change_set->priv->n_records);
+}
+
+
 /**
  * ohm_fact_store_view_to_string:
  * @self: a #OhmFactStoreView
@@ -2389,17 +10468,14 @@ void ohm_fact_store_view_remove (OhmFactStoreView* self, OhmStructure* interest)
  * Returns: a newly allocated string to debug the fact store.
  **/
 char* ohm_fact_store_view_to_string (OhmFactStoreView* self) {
-	char* ret;
+	GString* out;
 
 	g_return_val_if_fail (OHM_FACT_STORE_IS_VIEW (self), NULL);
 
-	ret = g_strdup_printf ("listener: %p, factstore: %p, patterns: %d, changeset: %s",
-			       ohm_fact_store_simple_view_get_listener (OHM_FACT_STORE_SIMPLE_VIEW (self)),
-			       ohm_fact_store_simple_view_get_fact_store (OHM_FACT_STORE_SIMPLE_VIEW (self)),
-			       g_slist_length (self->patterns),
-			       ohm_fact_store_change_set_to_string (OHM_FACT_STORE_SIMPLE_VIEW (self)->change_set));
+	out = g_string_new (NULL);
+	ohm_fact_store_view_write (self, out, OHM_FACT_STORE_FORMAT_TEXT);
 
-	return ret;
+	return g_string_free (out, FALSE);
 }
 
 
@@ -2492,7 +10568,7 @@ static void ohm_fact_store_class_init (OhmFactStoreClass * klass) {
 	 * </para>
 	 * </note>
 	 **/
-	g_signal_new ("inserted", OHM_TYPE_FACT_STORE, G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__OBJECT, G_TYPE_NONE, 1, OHM_TYPE_FACT);
+	ohm_fact_store_signals[OHM_FACT_STORE_INSERTED_SIGNAL] = g_signal_new ("inserted", OHM_TYPE_FACT_STORE, G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__OBJECT, G_TYPE_NONE, 1, OHM_TYPE_FACT);
 	/**
 	 * OhmFactStore::removed:
 	 * @arg1: the removed fact.
@@ -2507,7 +10583,7 @@ static void ohm_fact_store_class_init (OhmFactStoreClass * klass) {
 	 * </para>
 	 * </note>
 	 **/
-	g_signal_new ("removed", OHM_TYPE_FACT_STORE, G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__OBJECT, G_TYPE_NONE, 1, OHM_TYPE_FACT);
+	ohm_fact_store_signals[OHM_FACT_STORE_REMOVED_SIGNAL] = g_signal_new ("removed", OHM_TYPE_FACT_STORE, G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__OBJECT, G_TYPE_NONE, 1, OHM_TYPE_FACT);
 	/**
 	 * OhmFactStore::updated:
 	 * @arg1: the updated fact.
@@ -2522,7 +10598,7 @@ static void ohm_fact_store_class_init (OhmFactStoreClass * klass) {
 	 * </para>
 	 * </note>
 	 **/
-	g_signal_new ("updated", OHM_TYPE_FACT_STORE, G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_user_marshal_VOID__OBJECT_UINT_POINTER, G_TYPE_NONE, 3, OHM_TYPE_FACT, G_TYPE_UINT, G_TYPE_POINTER);
+	ohm_fact_store_signals[OHM_FACT_STORE_UPDATED_SIGNAL] = g_signal_new ("updated", OHM_TYPE_FACT_STORE, G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_user_marshal_VOID__OBJECT_UINT_POINTER, G_TYPE_NONE, 3, OHM_TYPE_FACT, G_TYPE_UINT, G_TYPE_POINTER);
 }
 
 
@@ -2530,38 +10606,87 @@ static void ohm_fact_store_init (OhmFactStore * self) {
 	self->priv = OHM_FACT_STORE_GET_PRIVATE (self);
 
 	self->priv->known_facts_qname = NULL;
+	self->priv->facts = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+						   (GDestroyNotify) _ohm_fact_store_facts_free);
+	self->priv->alpha = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+						   (GDestroyNotify) _ohm_fact_store_alpha_free);
+	self->priv->transp_alpha = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+							  (GDestroyNotify) _ohm_fact_store_alpha_free);
+	self->priv->symbols = _ohm_fact_store_symbols_new ();
 	self->transaction = g_queue_new ();
 }
 
 
 static void ohm_fact_store_dispose (GObject * obj) {
 	OhmFactStore * self;
-	GSList* q_collection;
-	GSList* q_it;
 
 	self = OHM_FACT_STORE (obj);
 
-	q_collection = self->priv->known_facts_qname;
-	for (q_it = q_collection; q_it != NULL; q_it = q_it->next) {
-		GQuark q;
-		GSList* facts;
-
-		q = GPOINTER_TO_INT (q_it->data);
-		{
-		  GSList* facts;
-		  GSList* f_it;
-
-		  facts = ohm_fact_store_get_facts_by_quark (self, q);
-		  
-		  for (f_it = facts; f_it != NULL; f_it = f_it->next) {
-		    OhmFact* f;
-		    f = (OhmFact*) f_it->data;
-		    g_object_unref (G_OBJECT (f));
-		  }
-		}
-		
-		facts = g_object_get_qdata (G_OBJECT (self), q);
-		g_slist_free (facts);
+	if (self->priv->notify_source != NULL) {
+	  g_source_destroy (self->priv->notify_source);
+	  self->priv->notify_source = NULL;
+	}
+
+	if (self->priv->wheel != NULL) {
+	  _ohm_fact_store_wheel_free (self->priv->wheel);
+	  self->priv->wheel = NULL;
+	}
+
+	if (self->priv->notify_views != NULL) {
+	  GHashTable* views;
+
+	  /* the views may go away with the queue */
+	  views = self->priv->notify_views;
+	  self->priv->notify_views = NULL;
+	  g_hash_table_destroy (views);
+	}
+
+	if (self->priv->journal != NULL) {
+	  _ohm_fact_store_journal_free (self->priv->journal);
+	  self->priv->journal = NULL;
+	}
+
+	if (self->priv->listeners != NULL) {
+	  g_ptr_array_unref (self->priv->listeners);
+	  self->priv->listeners = NULL;
+	}
+
+	if (self->priv->facts != NULL) {
+	  GHashTableIter iter;
+	  gpointer facts;
+
+	  g_hash_table_iter_init (&iter, self->priv->facts);
+	  while (g_hash_table_iter_next (&iter, NULL, &facts)) {
+	    GList* l;
+
+	    for (l = ((OhmFactStoreFacts*) facts)->facts; l != NULL; l = l->next) {
+	      _ohm_fact_store_thaw (OHM_FACT (l->data));
+	    }
+	  }
+
+	  g_hash_table_destroy (self->priv->facts);
+	  self->priv->facts = NULL;
+	}
+
+	if (self->priv->images != NULL) {
+	  g_hash_table_destroy (self->priv->images);
+	  self->priv->images = NULL;
+	}
+
+	if (self->priv->alpha != NULL) {
+	  g_hash_table_destroy (self->priv->alpha);
+	  self->priv->alpha = NULL;
+	}
+
+	if (self->priv->transp_alpha != NULL) {
+	  g_hash_table_destroy (self->priv->transp_alpha);
+	  self->priv->transp_alpha = NULL;
+	}
+
+	/* facts may outlive the store, and keep the symbols they hold */
+	if (self->priv->symbols != NULL) {
+	  _ohm_fact_store_symbols_unref (self->priv->symbols);
+	  self->priv->symbols = NULL;
 	}
 
 	/* FIXME: interest.foreach ((DataForeachFunc)_delete_func);*/
@@ -2578,6 +10703,11 @@ static void ohm_fact_store_dispose (GObject * obj) {
 	  self->transaction = NULL;
 	}
 
+	if (self->priv->locks != NULL) {
+	  _ohm_fact_store_locks_free (self->priv->locks);
+	  self->priv->locks = NULL;
+	}
+
 	G_OBJECT_CLASS (ohm_fact_store_parent_class)->dispose (obj);
 }
 
@@ -2611,8 +10741,8 @@ GType ohm_fact_store_get_type (void) {
  * Returns: the singleton of the Ohm fact-store, not referenced (caller should not unref).
  **/
 OhmFactStore* ohm_get_fact_store (void) {
-	if (ohm_fs == NULL) {
-	    ohm_fs = ohm_fact_store_new ();
+	if (g_once_init_enter (&ohm_fs)) {
+	    g_once_init_leave (&ohm_fs, (gsize) ohm_fact_store_new ());
 	}
 	return ohm_fs;
 }
@@ -2728,6 +10858,56 @@ static gint ohm_gpointer_cmp(gpointer v1, gpointer v2) {
 		return 1;
 }
 
+/*
+ * Per fundamental type comparators, called through ohm_value_cmp_table.
+ * The integer ones follow the historical ohm_value_cmp () convention of
+ * returning v2 - v1.
+ */
+static gint _ohm_value_cmp_char (const GValue* v1, const GValue* v2) {
+	return v2->data[0].v_int - v1->data[0].v_int;
+}
+
+static gint _ohm_value_cmp_boolean (const GValue* v1, const GValue* v2) {
+	gboolean b1 = v1->data[0].v_int;
+	gboolean b2 = v2->data[0].v_int;
+
+	if (b1 == b2)
+		return 0;
+	else if (b1)
+		return 1;
+	else
+		return -1;
+}
+
+static gint _ohm_value_cmp_int (const GValue* v1, const GValue* v2) {
+	return v2->data[0].v_int - v1->data[0].v_int;
+}
+
+static gint _ohm_value_cmp_string (const GValue* v1, const GValue* v2) {
+	const gchar* s1 = v1->data[0].v_pointer;
+	const gchar* s2 = v2->data[0].v_pointer;
+
+	/* interned strings compare by address */
+	if (s1 == s2)
+		return 0;
+
+	return strcmp (s1, s2);
+}
+
+static gint _ohm_value_cmp_pointer (const GValue* v1, const GValue* v2) {
+	return ohm_gpointer_cmp (v1->data[0].v_pointer, v2->data[0].v_pointer);
+}
+
+static gint (* const ohm_value_cmp_table[]) (const GValue* v1, const GValue* v2) = {
+	[G_TYPE_CHAR >> G_TYPE_FUNDAMENTAL_SHIFT] = _ohm_value_cmp_char,
+	[G_TYPE_BOOLEAN >> G_TYPE_FUNDAMENTAL_SHIFT] = _ohm_value_cmp_boolean,
+	[G_TYPE_INT >> G_TYPE_FUNDAMENTAL_SHIFT] = _ohm_value_cmp_int,
+	[G_TYPE_STRING >> G_TYPE_FUNDAMENTAL_SHIFT] = _ohm_value_cmp_string,
+	[G_TYPE_POINTER >> G_TYPE_FUNDAMENTAL_SHIFT] = _ohm_value_cmp_pointer,
+	[G_TYPE_BOXED >> G_TYPE_FUNDAMENTAL_SHIFT] = _ohm_value_cmp_pointer,
+	[G_TYPE_OBJECT >> G_TYPE_FUNDAMENTAL_SHIFT] = _ohm_value_cmp_pointer,
+};
+
 /**
  * ohm_value_cmp:
  * @v1: a value
@@ -2738,60 +10918,142 @@ static gint ohm_gpointer_cmp(gpointer v1, gpointer v2) {
  * Returns: -diff, 0 or diff, if v1 is <, == or >, respectively, than v2.
  **/
 gint ohm_value_cmp (GValue* v1, GValue* v2) {
+	GType type;
+	guint n;
+
 	if (v1 == v2) {
 		return 0;
 	}
 
 	g_return_val_if_fail (G_VALUE_TYPE (v1) == G_VALUE_TYPE (v2), -1);
 
-	if (G_VALUE_TYPE (v1) == G_TYPE_INT) {
-		return g_value_get_int (v2) - g_value_get_int (v1);
+	/* only the fundamental types themselves are compared: values of
+	 * derived types, such as a #OhmFact object, are all equal */
+	type = G_VALUE_TYPE (v1);
+	n = type >> G_TYPE_FUNDAMENTAL_SHIFT;
+	if (type != (n << G_TYPE_FUNDAMENTAL_SHIFT) || n >= G_N_ELEMENTS (ohm_value_cmp_table)
+	    || ohm_value_cmp_table[n] == NULL) {
+		return 0;
 	}
 
-	if (G_VALUE_TYPE (v1) == G_TYPE_STRING) {
-		return strcmp (g_value_get_string (v1), g_value_get_string (v2));
-	}
+	return ohm_value_cmp_table[n] (v1, v2);
+}
 
-	if (G_VALUE_TYPE (v1) == G_TYPE_BOOLEAN) {
-		gboolean b1 = g_value_get_boolean (v1);
-		gboolean b2 = g_value_get_boolean (v2);
-		if (b1 == b2)
-			return 0;
-		else if (b1)
-			return 1;
-		else
-			return -1;
-	}
 
-	if (G_VALUE_TYPE (v1) == G_TYPE_CHAR) {
-		return g_value_get_schar (v2) - g_value_get_schar (v1);
+/*
+ * Whether the values of @type can be compared with _ohm_value_order ().
+ */
+static gboolean _ohm_value_orderable (GType type) {
+	switch (type) {
+	case G_TYPE_CHAR:
+	case G_TYPE_UCHAR:
+	case G_TYPE_BOOLEAN:
+	case G_TYPE_INT:
+	case G_TYPE_UINT:
+	case G_TYPE_LONG:
+	case G_TYPE_ULONG:
+	case G_TYPE_INT64:
+	case G_TYPE_UINT64:
+	case G_TYPE_FLOAT:
+	case G_TYPE_DOUBLE:
+	case G_TYPE_STRING:
+		return TRUE;
+	default:
+		return FALSE;
 	}
+}
+
+
+/*
+ * The order of the comparison operators of the patterns and of the
+ * ordered indexes: unlike ohm_value_cmp (), the result is negative when
+ * @v1 is before @v2, and never overflows. Values of different types are
+ * ordered by type, a %NULL string is before any other.
+ */
+#define OHM_VALUE_ORDER(a, b) ((a) < (b) ? -1 : ((a) > (b) ? 1 : 0))
 
-	/*   if (v1.type () == typeof (double))
-	     return v2.get_double () - v1.get_double ();
-	   if (v1.type () == Type.ENUM)
-	     return (int) (v1.get_enum () == v2.get_enum ());
-	   if (v1.type () == Type.FLAGS)
-	     return (int) (v1.get_flags () == v2.get_flags ());*/
+static gint _ohm_value_order (const GValue* v1, const GValue* v2) {
+	const gchar* s1;
+	const gchar* s2;
 
-	if (G_VALUE_TYPE (v1) == G_TYPE_NONE) {
-		return ohm_gpointer_cmp (g_value_get_pointer (v1), g_value_get_pointer (v2));
+	if (G_VALUE_TYPE (v1) != G_VALUE_TYPE (v2)) {
+		return OHM_VALUE_ORDER (G_VALUE_TYPE (v1), G_VALUE_TYPE (v2));
 	}
 
-	if (G_VALUE_TYPE (v1) == G_TYPE_OBJECT) {
-		return ohm_gpointer_cmp (g_value_get_object (v1), g_value_get_object (v2));
+	switch (G_VALUE_TYPE (v1)) {
+	case G_TYPE_CHAR:
+	case G_TYPE_BOOLEAN:
+	case G_TYPE_INT:
+		return OHM_VALUE_ORDER (v1->data[0].v_int, v2->data[0].v_int);
+	case G_TYPE_UCHAR:
+	case G_TYPE_UINT:
+		return OHM_VALUE_ORDER (v1->data[0].v_uint, v2->data[0].v_uint);
+	case G_TYPE_LONG:
+		return OHM_VALUE_ORDER (v1->data[0].v_long, v2->data[0].v_long);
+	case G_TYPE_ULONG:
+		return OHM_VALUE_ORDER (v1->data[0].v_ulong, v2->data[0].v_ulong);
+	case G_TYPE_INT64:
+		return OHM_VALUE_ORDER (v1->data[0].v_int64, v2->data[0].v_int64);
+	case G_TYPE_UINT64:
+		return OHM_VALUE_ORDER (v1->data[0].v_uint64, v2->data[0].v_uint64);
+	case G_TYPE_FLOAT:
+		return OHM_VALUE_ORDER (v1->data[0].v_float, v2->data[0].v_float);
+	case G_TYPE_DOUBLE:
+		return OHM_VALUE_ORDER (v1->data[0].v_double, v2->data[0].v_double);
+	case G_TYPE_STRING:
+		s1 = v1->data[0].v_pointer;
+		s2 = v2->data[0].v_pointer;
+		if (s1 == s2) {
+			return 0;
+		} else if (s1 == NULL || s2 == NULL) {
+			return s1 == NULL ? -1 : 1;
+		}
+		return strcmp (s1, s2);
+	default:
+		return 0;
 	}
+}
+
+#undef OHM_VALUE_ORDER
+
 
-	if (G_VALUE_TYPE (v1) == G_TYPE_BOXED) {
-		return ohm_gpointer_cmp (g_value_get_boxed (v1), g_value_get_boxed (v2));
+/*
+ * Hash and equality of #GValue keys of the secondary indexes. Two values
+ * are equal when a pattern would consider them equal, that is when they
+ * have the same type and ohm_value_cmp () returns 0, so the hash must
+ * only look at what ohm_value_cmp () compares.
+ */
+static guint _ohm_value_hash (gconstpointer v) {
+	const GValue* value = v;
+	GType type = G_VALUE_TYPE (value);
+	guint h;
+
+	if (type == G_TYPE_INT) {
+		h = (guint) g_value_get_int (value);
+	} else if (type == G_TYPE_STRING) {
+		h = g_value_get_string (value) != NULL ? g_str_hash (g_value_get_string (value)) : 0;
+	} else if (type == G_TYPE_BOOLEAN) {
+		h = g_value_get_boolean (value) ? 1 : 0;
+	} else if (type == G_TYPE_CHAR) {
+		h = (guint) g_value_get_schar (value);
+	} else if (type == G_TYPE_POINTER) {
+		h = g_direct_hash (g_value_get_pointer (value));
+	} else if (type == G_TYPE_OBJECT) {
+		h = g_direct_hash (g_value_get_object (value));
+	} else {
+		h = 0;
 	}
 
-	if (G_VALUE_TYPE (v1) == G_TYPE_POINTER) {
-		g_assert (G_VALUE_TYPE (v2) == G_TYPE_POINTER);
-		return ohm_gpointer_cmp (g_value_get_pointer (v1), g_value_get_pointer (v2));
+	return h ^ (guint) type;
+}
+
+
+static gboolean _ohm_value_equal (gconstpointer v1, gconstpointer v2) {
+	if (G_VALUE_TYPE ((GValue*) v1) != G_VALUE_TYPE ((GValue*) v2)) {
+		return FALSE;
 	}
 
-	return 0;
+	return ohm_value_cmp ((GValue*) v1, (GValue*) v2) == 0;
 }
 
 
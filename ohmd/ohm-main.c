@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <glib.h>
@@ -42,6 +43,7 @@
 #include "ohm-dbus-manager.h"
 #include "ohm-dbus-internal.h"
 #include "ohm/ohm-plugin-log.h"
+#include "ohm/ohm-fact.h"
 
 #if _POSIX_MEMLOCK > 0
 #  include <errno.h>
@@ -58,6 +60,11 @@
 
 
 #define MAX_TRACE_FLAGS 64
+#define FACTS_FD_ENV    "OHM_FACTS_FD"
+#define JOURNAL_ENV     "OHM_FACT_JOURNAL"
+#define COMPACT_ENV     "OHM_FACT_JOURNAL_COMPACT"
+#define COMPACT_SIZE    (4 << 20)
+#define TIMING_ENV      "OHM_FACT_TIMING"
 
 static GMainLoop *loop;
 static int        verbosity;
@@ -342,10 +349,111 @@ save_args(int argc, char **argv)
 }
 
 
+/*
+ * Hand the facts over to the next instance across execv: they are
+ * dumped to an unlinked temporary file, the descriptor of which is
+ * left open and passed in the environment.
+ */
+static int
+save_facts(void)
+{
+	GError *error = NULL;
+	gchar  *path, fdstr[16];
+	int     fd;
+
+	fd = g_file_open_tmp("ohmd-facts-XXXXXX", &path, &error);
+	if (fd < 0) {
+		OHM_ERROR("ohmd: failed to save the facts (%s).", error->message);
+		g_error_free(error);
+		return -1;
+	}
+	unlink(path);
+	g_free(path);
+
+	if (!ohm_fact_store_dump(ohm_get_fact_store(), fd, &error)) {
+		OHM_ERROR("ohmd: failed to save the facts (%s).", error->message);
+		g_error_free(error);
+		close(fd);
+		return -1;
+	}
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		OHM_ERROR("ohmd: failed to save the facts (%s).", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	setenv(FACTS_FD_ENV, fdstr, 1);
+
+	return fd;
+}
+
+
+static void
+restore_facts(void)
+{
+	GError *error = NULL;
+	char   *fdstr;
+	int     fd;
+
+	if ((fdstr = getenv(FACTS_FD_ENV)) == NULL)
+		return;
+
+	fd = (int)strtol(fdstr, NULL, 10);
+	unsetenv(FACTS_FD_ENV);
+
+	/* the journal has them already */
+	if (getenv(JOURNAL_ENV) != NULL) {
+		close(fd);
+		return;
+	}
+
+	if (!ohm_fact_store_restore(ohm_get_fact_store(), fd, &error)) {
+		OHM_ERROR("ohmd: failed to restore the facts (%s).",
+			  error->message);
+		g_error_free(error);
+	}
+	else
+		OHM_INFO("ohmd: facts restored.");
+
+	close(fd);
+}
+
+
+static void
+open_journal(void)
+{
+	GError *error = NULL;
+	char   *path;
+	char   *size;
+	gsize   compact;
+
+	if ((path = getenv(JOURNAL_ENV)) == NULL)
+		return;
+
+	if (!ohm_fact_store_journal_open(ohm_get_fact_store(), path, &error)) {
+		OHM_ERROR("ohmd: failed to open the fact journal %s (%s).",
+			  path, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	/* the journal, and what it remembers, must not grow forever */
+	if ((size = getenv(COMPACT_ENV)) != NULL)
+		compact = (gsize)strtoul(size, NULL, 10);
+	else
+		compact = COMPACT_SIZE;
+	ohm_fact_store_journal_set_compact_size(ohm_get_fact_store(), compact);
+
+	OHM_INFO("ohmd: journaling the facts to %s.", path);
+}
+
+
 void
 ohm_restart(int delay)
 {
-  	int fd, max;
+  	int fd, max, facts;
 
 #ifdef _SC_OPEN_MAX
 	max = (int)sysconf(_SC_OPEN_MAX);
@@ -355,9 +463,13 @@ ohm_restart(int delay)
 
 	OHM_INFO("ohmd: re-execing after %d seconds", delay);
 	sleep(delay);
+
+	ohm_fact_store_journal_flush(ohm_get_fact_store());
+	facts = save_facts();
 	
 	for (fd = 3; fd < max; fd++)
-		close(fd);
+		if (fd != facts)
+			close(fd);
 
 	sleep(1);
 	execv(saved_argv[0], saved_argv);
@@ -469,6 +581,14 @@ main (int argc, char *argv[])
 	  g_error("%s failed to start.", OHM_NAME);
 	
 
+	/* the facts of the previous instance, before the plugins start */
+	restore_facts();
+	open_journal();
+
+	/* the dispatch times of the statistics cost two clock reads a change */
+	if (getenv(TIMING_ENV) != NULL)
+		ohm_fact_store_set_timing(ohm_get_fact_store(), TRUE);
+
 	ohm_debug ("Creating manager");
 	manager = ohm_manager_new ();
 	if (!ohm_object_register (connection, G_OBJECT (manager))) {
@@ -47,6 +47,7 @@
 #include "ohm-dbus-keystore.h"
 #endif
 #include "ohm-module.h"
+#include "ohm/ohm-fact.h"
 
 
 static void     ohm_manager_class_init	(OhmManagerClass *klass);
@@ -132,6 +133,33 @@ ohm_manager_get_plugins (OhmManager  *manager,
 	return TRUE;
 }
 
+/**
+ * ohm_manager_get_fact_store_stats:
+ *
+ * The statistics of the fact store as a JSON document, see
+ * ohm_fact_store_write_stats().
+ **/
+gboolean
+ohm_manager_get_fact_store_stats (OhmManager  *manager,
+				  gchar      **stats,
+				  GError     **error)
+{
+	GString *out;
+
+	g_return_val_if_fail (OHM_IS_MANAGER (manager), FALSE);
+
+	if (stats == NULL) {
+		return FALSE;
+	}
+
+	out = g_string_new (NULL);
+	ohm_fact_store_write_stats (ohm_get_fact_store (), out,
+				    OHM_FACT_STORE_FORMAT_JSON);
+	*stats = g_string_free (out, FALSE);
+
+	return TRUE;
+}
+
 
 static void
 ohm_manager_load_options(OhmManager *manager)
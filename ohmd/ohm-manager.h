@@ -66,6 +66,9 @@ gboolean	 ohm_manager_get_version		(OhmManager	*manager,
 gboolean	 ohm_manager_get_plugins		(OhmManager	*manager,
 							 gchar		***retval,
 							 GError		**error);
+gboolean	 ohm_manager_get_fact_store_stats	(OhmManager	*manager,
+							 gchar		**stats,
+							 GError		**error);
 
 
 gboolean         ohm_manager_get_boolean_option         (OhmManager *manager,
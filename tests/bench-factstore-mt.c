@@ -0,0 +1,122 @@
+/*
+ * Throughput of a thread-safe fact store with several writer threads,
+ * changing facts of distinct names (no contention on the name locks)
+ * or all of the same name (full contention), against a single thread
+ * on a store that is not thread-safe.
+ *
+ * usage: bench-factstore-mt [threads [operations per thread]]
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <ohm/ohm-fact.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef struct {
+    OhmFactStore* fs;
+    gchar* name;
+    gint n_ops;
+} Worker;
+
+static gpointer work(gpointer data)
+{
+    Worker* w = data;
+    OhmFact* f[16];
+    gint i;
+
+    for (i = 0; i < 16; i++) {
+        f[i] = ohm_fact_new(w->name);
+        ohm_fact_set_int(f[i], "id", i);
+        ohm_fact_store_insert(w->fs, f[i]);
+    }
+
+    for (i = 0; i < w->n_ops; i++) {
+        ohm_fact_set_int(f[i % 16], "value", i);
+    }
+
+    for (i = 0; i < 16; i++) {
+        ohm_fact_store_remove(w->fs, f[i]);
+        g_object_unref(f[i]);
+    }
+
+    return NULL;
+}
+
+static void run(const char* label, gboolean thread_safe, gint n_threads, gboolean same_name, gint n_ops)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView** views;
+    OhmPattern* p;
+    GThread** threads;
+    Worker* w;
+    gint64 start, elapsed;
+    gint i;
+
+    fs = ohm_fact_store_new();
+    ohm_fact_store_set_thread_safe(fs, thread_safe);
+
+    /* one interested view per writer, as plugins do */
+    views = g_new0(OhmFactStoreView*, n_threads);
+    for (i = 0; i < n_threads; i++) {
+        gchar* name = g_strdup_printf("bench.mt.%d", same_name ? 0 : i);
+
+        views[i] = ohm_fact_store_new_view(fs, NULL);
+        p = ohm_pattern_new(name);
+        ohm_fact_store_view_add(views[i], OHM_STRUCTURE(p));
+        ohm_fact_store_change_set_set_high_water(OHM_FACT_STORE_SIMPLE_VIEW(views[i])->change_set, 1024,
+                                                 OHM_FACT_STORE_OVERFLOW_DROP_OLDEST);
+        g_object_unref(p);
+        g_free(name);
+    }
+
+    w = g_new0(Worker, n_threads);
+    threads = g_new0(GThread*, n_threads);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < n_threads; i++) {
+        w[i].fs = fs;
+        w[i].name = g_strdup_printf("bench.mt.%d", same_name ? 0 : i);
+        w[i].n_ops = n_ops;
+        threads[i] = thread_safe ? g_thread_new("bench", work, &w[i]) : NULL;
+        if (!thread_safe)
+            work(&w[i]);
+    }
+    for (i = 0; i < n_threads; i++) {
+        if (threads[i] != NULL)
+            g_thread_join(threads[i]);
+        g_free(w[i].name);
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    printf("%-28s %2d thread(s) %10.0f updates/s\n", label,
+           thread_safe ? n_threads : 1,
+           (gdouble) n_threads * n_ops * G_USEC_PER_SEC / MAX(elapsed, 1));
+
+    for (i = 0; i < n_threads; i++)
+        g_object_unref(views[i]);
+    g_free(views);
+    g_free(threads);
+    g_free(w);
+    g_object_unref(fs);
+}
+
+int
+main(int argc, char* argv[])
+{
+    gint n_threads = 4;
+    gint n_ops = 200000;
+
+    if (argc > 1)
+        n_threads = CLAMP(strtol(argv[1], NULL, 10), 1, 64);
+    if (argc > 2)
+        n_ops = MAX(strtol(argv[2], NULL, 10), 1);
+
+    g_type_init();
+
+    run("not thread-safe, serial", FALSE, n_threads, FALSE, n_ops);
+    run("thread-safe, distinct names", TRUE, n_threads, FALSE, n_ops);
+    run("thread-safe, same name", TRUE, n_threads, TRUE, n_ops);
+
+    return 0;
+}
@@ -0,0 +1,364 @@
+/*
+ * Throughput and latency of the basic fact store operations:
+ *
+ *   insert, update, remove      N facts, for N = 1k, 10k, 100k, 1M
+ *   lookup-unbound              patterns with no field, among N facts
+ *   lookup-bound                patterns with a bound field, among N facts
+ *   lookup-indexed              the same, with an index on the field
+ *   lookup-range                a range of 10 values, with an ordered index
+ *   fanout                      updates seen by 1, 10, 100, 1000 views
+ *   commit, rollback            nested transactions of a few updates
+ *
+ * Each scenario reports its rate, the median and 99th percentile of
+ * the latency of one operation, and the peak resident set size of the
+ * process so far. With -j, one JSON object per line, to diff between
+ * builds.
+ *
+ * usage: bench-factstore [-j] [-n max facts] [scenario...]
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <ohm/ohm-fact.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define NAME "bench.fact"
+
+typedef struct {
+    const char* scenario;
+    guint64 param;
+    guint64* samples;
+    guint n_samples;
+    guint64 start;
+    guint64 elapsed;
+} Run;
+
+static gboolean json = FALSE;
+static char** scenarios;
+
+static gboolean wanted(const char* scenario)
+{
+    gint i;
+
+    for (i = 0; scenarios[i] != NULL; i++)
+        if (!strcmp(scenarios[i], scenario))
+            return TRUE;
+
+    return scenarios[0] == NULL;
+}
+
+static guint64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_begin(Run* r, const char* scenario, guint64 param, guint n_ops)
+{
+    r->scenario = scenario;
+    r->param = param;
+    r->samples = g_new(guint64, MAX(n_ops, 1));
+    r->n_samples = 0;
+    r->start = now_ns();
+}
+
+/* time one operation, started at @t0 */
+static inline void run_sample(Run* r, guint64 t0)
+{
+    r->samples[r->n_samples++] = now_ns() - t0;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    guint64 x = *(const guint64*) a;
+    guint64 y = *(const guint64*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void run_end(Run* r)
+{
+    struct rusage usage;
+    guint64 p50, p99;
+    gdouble rate;
+
+    r->elapsed = now_ns() - r->start;
+    if (!wanted(r->scenario)) {
+        g_free(r->samples);
+        return;
+    }
+
+    qsort(r->samples, r->n_samples, sizeof(guint64), cmp_u64);
+    p50 = r->n_samples ? r->samples[r->n_samples / 2] : 0;
+    p99 = r->n_samples ? r->samples[MIN(r->n_samples - 1, (guint64) r->n_samples * 99 / 100)] : 0;
+    rate = (gdouble) r->n_samples * 1000000000 / MAX(r->elapsed, 1);
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (json)
+        printf("{\"scenario\": \"%s\", \"param\": %" G_GUINT64_FORMAT ", \"ops\": %u, "
+               "\"ops_per_sec\": %.0f, \"p50_ns\": %" G_GUINT64_FORMAT ", \"p99_ns\": %" G_GUINT64_FORMAT ", "
+               "\"peak_rss_kb\": %ld}\n",
+               r->scenario, r->param, r->n_samples, rate, p50, p99, usage.ru_maxrss);
+    else
+        printf("%-16s %8" G_GUINT64_FORMAT " %8u ops %12.0f ops/s  p50 %8" G_GUINT64_FORMAT " ns  "
+               "p99 %8" G_GUINT64_FORMAT " ns  rss %8ld kB\n",
+               r->scenario, r->param, r->n_samples, rate, p50, p99, usage.ru_maxrss);
+    fflush(stdout);
+
+    g_free(r->samples);
+}
+
+static OhmFact** make_facts(guint n)
+{
+    OhmFact** f;
+    guint i;
+
+    f = g_new(OhmFact*, n);
+    for (i = 0; i < n; i++) {
+        f[i] = ohm_fact_new(NAME);
+        ohm_fact_set_int(f[i], "id", i);
+        ohm_fact_set_string(f[i], "state", i % 2 ? "on" : "off");
+    }
+
+    return f;
+}
+
+static void free_facts(OhmFact** f, guint n)
+{
+    guint i;
+
+    for (i = 0; i < n; i++)
+        g_object_unref(f[i]);
+    g_free(f);
+}
+
+static OhmFactStore* fill(OhmFact** f, guint n)
+{
+    OhmFactStore* fs;
+    guint i;
+
+    fs = ohm_fact_store_new();
+    for (i = 0; i < n; i++)
+        ohm_fact_store_insert(fs, f[i]);
+
+    return fs;
+}
+
+static void bench_crud(guint n)
+{
+    OhmFactStore* fs;
+    OhmFact** f;
+    guint64 t0;
+    guint i;
+    Run r;
+
+    f = make_facts(n);
+    fs = ohm_fact_store_new();
+
+    run_begin(&r, "insert", n, n);
+    for (i = 0; i < n; i++) {
+        t0 = now_ns();
+        ohm_fact_store_insert(fs, f[i]);
+        run_sample(&r, t0);
+    }
+    run_end(&r);
+
+    run_begin(&r, "update", n, n);
+    for (i = 0; i < n; i++) {
+        t0 = now_ns();
+        ohm_fact_set_int(f[i], "value", i);
+        run_sample(&r, t0);
+    }
+    run_end(&r);
+
+    run_begin(&r, "remove", n, n);
+    for (i = 0; i < n; i++) {
+        t0 = now_ns();
+        ohm_fact_store_remove(fs, f[i]);
+        run_sample(&r, t0);
+    }
+    run_end(&r);
+
+    g_object_unref(fs);
+    free_facts(f, n);
+}
+
+static void bench_lookup(const char* scenario, guint n, gboolean bound, gboolean indexed, gboolean range)
+{
+    OhmFactStore* fs;
+    OhmFact** f;
+    OhmPattern* p;
+    guint64 t0;
+    guint n_ops, i;
+    Run r;
+
+    f = make_facts(n);
+    fs = fill(f, n);
+    if (indexed && range)
+        ohm_fact_store_add_ordered_index(fs, NAME, "id");
+    else if (indexed)
+        ohm_fact_store_add_index(fs, NAME, "id");
+
+    /* a scan costs n matches, keep the scenario short */
+    n_ops = indexed ? 10000 : CLAMP(10000000 / n, 10, 10000);
+
+    run_begin(&r, scenario, n, n_ops);
+    for (i = 0; i < n_ops; i++) {
+        GSList* l;
+
+        p = ohm_pattern_new(NAME);
+        if (range) {
+            gint low = g_random_int_range(0, n);
+
+            ohm_pattern_set_range(p, "id", ohm_value_from_int(low), ohm_value_from_int(low + 9));
+        } else if (bound)
+            ohm_structure_set(OHM_STRUCTURE(p), "id", ohm_value_from_int(g_random_int_range(0, n)));
+        t0 = now_ns();
+        l = ohm_fact_store_get_facts_by_pattern(fs, p);
+        run_sample(&r, t0);
+        g_slist_foreach(l, (GFunc) g_object_unref, NULL);
+        g_slist_free(l);
+        g_object_unref(p);
+    }
+    run_end(&r);
+
+    g_object_unref(fs);
+    free_facts(f, n);
+}
+
+static void bench_fanout(guint n_views)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView** views;
+    OhmPattern* p;
+    OhmFact** f;
+    guint64 t0;
+    guint n_ops, i;
+    Run r;
+
+    f = make_facts(16);
+    fs = fill(f, 16);
+
+    views = g_new(OhmFactStoreView*, n_views);
+    for (i = 0; i < n_views; i++) {
+        views[i] = ohm_fact_store_new_view(fs, NULL);
+        p = ohm_pattern_new(NAME);
+        ohm_fact_store_view_add(views[i], OHM_STRUCTURE(p));
+        ohm_fact_store_change_set_set_high_water(OHM_FACT_STORE_SIMPLE_VIEW(views[i])->change_set, 1024,
+                                                 OHM_FACT_STORE_OVERFLOW_DROP_OLDEST);
+        g_object_unref(p);
+    }
+
+    n_ops = CLAMP(1000000 / n_views, 1000, 100000);
+    run_begin(&r, "fanout", n_views, n_ops);
+    for (i = 0; i < n_ops; i++) {
+        t0 = now_ns();
+        ohm_fact_set_int(f[i % 16], "value", i);
+        run_sample(&r, t0);
+    }
+    run_end(&r);
+
+    for (i = 0; i < n_views; i++)
+        g_object_unref(views[i]);
+    g_free(views);
+    g_object_unref(fs);
+    free_facts(f, 16);
+}
+
+static void bench_transaction(const char* scenario, guint depth, gboolean rollback)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmPattern* p;
+    OhmFact** f;
+    guint64 t0;
+    guint n_ops, i, d, k;
+    Run r;
+
+    f = make_facts(1000);
+    fs = fill(f, 1000);
+    v = ohm_fact_store_new_view(fs, NULL);
+    p = ohm_pattern_new(NAME);
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    ohm_fact_store_change_set_set_high_water(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set, 1024,
+                                             OHM_FACT_STORE_OVERFLOW_DROP_OLDEST);
+    g_object_unref(p);
+
+    n_ops = 10000;
+    run_begin(&r, scenario, depth, n_ops);
+    for (i = 0; i < n_ops; i++) {
+        t0 = now_ns();
+        for (d = 0; d < depth; d++) {
+            ohm_fact_store_transaction_push(fs);
+            for (k = 0; k < 4; k++)
+                ohm_fact_set_int(f[(i * 16 + d * 4 + k) % 1000], "value", i);
+        }
+        for (d = 0; d < depth; d++)
+            ohm_fact_store_transaction_pop(fs, rollback);
+        run_sample(&r, t0);
+    }
+    run_end(&r);
+
+    g_object_unref(v);
+    g_object_unref(fs);
+    free_facts(f, 1000);
+}
+
+int
+main(int argc, char* argv[])
+{
+    static const guint sizes[] = { 1000, 10000, 100000, 1000000 };
+    static const guint fanouts[] = { 1, 10, 100, 1000 };
+    guint max_facts = 1000000;
+    gint i, n;
+
+    scenarios = g_new0(char*, argc);
+    for (i = 1, n = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-j"))
+            json = TRUE;
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            max_facts = strtoul(argv[++i], NULL, 10);
+        else
+            scenarios[n++] = argv[i];
+    }
+
+    g_type_init();
+
+    for (i = 0; i < (gint) G_N_ELEMENTS(sizes) && sizes[i] <= max_facts; i++) {
+        if (wanted("insert") || wanted("update") || wanted("remove"))
+            bench_crud(sizes[i]);
+    }
+
+    for (i = 0; i < (gint) G_N_ELEMENTS(sizes) && sizes[i] <= max_facts; i++) {
+        if (wanted("lookup-unbound"))
+            bench_lookup("lookup-unbound", sizes[i], FALSE, FALSE, FALSE);
+        if (wanted("lookup-bound"))
+            bench_lookup("lookup-bound", sizes[i], TRUE, FALSE, FALSE);
+        if (wanted("lookup-indexed"))
+            bench_lookup("lookup-indexed", sizes[i], TRUE, TRUE, FALSE);
+        if (wanted("lookup-range"))
+            bench_lookup("lookup-range", sizes[i], TRUE, TRUE, TRUE);
+    }
+
+    for (i = 0; i < (gint) G_N_ELEMENTS(fanouts); i++) {
+        if (wanted("fanout"))
+            bench_fanout(fanouts[i]);
+    }
+
+    for (i = 1; i <= 3; i++) {
+        if (wanted("commit"))
+            bench_transaction("commit", i, FALSE);
+        if (wanted("rollback"))
+            bench_transaction("rollback", i, TRUE);
+    }
+
+    g_free(scenarios);
+
+    return 0;
+}
@@ -6,6 +6,7 @@
 
 #include <check.h>
 #include <stdio.h>
+#include <unistd.h>
 
 /* stubs for leading-bleeding glob test 'framework' */
 #define g_test_init(argc, argv, foo)
@@ -156,6 +157,139 @@ START_TEST (test_fact_fact_set_get)
 END_TEST
 
 
+START_TEST (test_fact_fact_fields)
+{
+    OhmFact* f;
+    GSList* l;
+    GSList* fields;
+    OhmFactStore* fs;
+    GValue* three;
+    gchar name[16];
+    gint i;
+
+    f = ohm_fact_new("org.freedesktop.ohm.test");
+    for (i = 0; i < 16; i++) {
+        g_snprintf(name, sizeof (name), "f%d", (i * 7) % 16);
+        ohm_fact_set(f, name, ohm_value_from_int((i * 7) % 16));
+    }
+    fail_unless(g_slist_length(ohm_fact_get_fields(f)) == 16);
+
+    /* overwrite, remove, then add back: the field list follows */
+    ohm_fact_set(f, "f3", ohm_value_from_string("three"));
+    ohm_fact_set(f, "f5", NULL);
+    fail_unless(g_slist_length(ohm_fact_get_fields(f)) == 15);
+    fail_unless(ohm_fact_get(f, "f5") == NULL);
+    ohm_fact_set(f, "f5", ohm_value_from_int(5));
+    fail_unless(g_slist_length(ohm_fact_get_fields(f)) == 16);
+
+    /* in the order the fields were added */
+    l = ohm_fact_get_fields(f);
+    fail_unless(GPOINTER_TO_UINT(l->data) == g_quark_from_string("f0"));
+    fail_unless(GPOINTER_TO_UINT(g_slist_last(l)->data) == g_quark_from_string("f5"));
+
+    /* the values and the list stay valid as other fields come and go */
+    three = ohm_fact_get(f, "f3");
+    fields = ohm_fact_get_fields(f);
+    for (i = 16; i < 64; i++) {
+        g_snprintf(name, sizeof (name), "f%d", i);
+        ohm_fact_set_int(f, name, i);
+    }
+    for (i = 16; i < 64; i++) {
+        g_snprintf(name, sizeof (name), "f%d", i);
+        ohm_fact_set(f, name, NULL);
+    }
+    fail_unless(three == ohm_fact_get(f, "f3"));
+    fail_unless(strcmp(g_value_get_string(three), "three") == 0);
+    fail_unless(fields == ohm_fact_get_fields(f) && g_slist_length(fields) == 16);
+
+    for (i = 0; i < 16; i++) {
+        g_snprintf(name, sizeof (name), "f%d", i);
+        if (i == 3)
+            fail_unless(strcmp(g_value_get_string(ohm_fact_get(f, name)), "three") == 0);
+        else
+            fail_unless(g_value_get_int(ohm_fact_get(f, name)) == i);
+    }
+
+    /* a set within a transaction keeps the place of the field */
+    fs = ohm_fact_store_new();
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_int(f, "f0", 100);
+    fail_unless(GPOINTER_TO_UINT(ohm_fact_get_fields(f)->data) == g_quark_from_string("f0"));
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    fail_unless(GPOINTER_TO_UINT(ohm_fact_get_fields(f)->data) == g_quark_from_string("f0"));
+    fail_unless(g_value_get_int(ohm_fact_get(f, "f0")) == 0);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_int(f, "f0", 100);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    fail_unless(GPOINTER_TO_UINT(ohm_fact_get_fields(f)->data) == g_quark_from_string("f0"));
+    fail_unless(g_value_get_int(ohm_fact_get(f, "f0")) == 100);
+    g_object_unref(fs);
+
+    g_object_unref(f);
+}
+END_TEST
+
+
+START_TEST (test_fact_fact_set_typed)
+{
+    OhmFactStore* fs;
+    OhmFact* f;
+    OhmPattern* p;
+    OhmPatternMatch* m;
+    gchar* name;
+
+    f = ohm_fact_new("org.freedesktop.ohm.test");
+    ohm_fact_set_int(f, "int", 42);
+    name = g_strdup("test1");
+    ohm_fact_set_string(f, "string", name);
+    g_free(name);
+    ohm_fact_set_boolean(f, "bool", TRUE);
+    ohm_fact_set_double(f, "double", 0.5);
+    ohm_fact_set_int(f, "__id", 1);
+    ohm_fact_set_int(f, "__id", 2);
+    fail_unless(g_value_get_int(ohm_fact_get(f, "int")) == 42);
+    fail_unless(strcmp(g_value_get_string(ohm_fact_get(f, "string")), "test1") == 0);
+    fail_unless(g_value_get_boolean(ohm_fact_get(f, "bool")));
+    fail_unless(g_value_get_double(ohm_fact_get(f, "double")) == 0.5);
+    fail_unless(g_value_get_int(ohm_fact_get(f, "__id")) == 1);
+
+    /* typed and GValue setters compare alike */
+    p = ohm_pattern_new("org.freedesktop.ohm.test");
+    ohm_structure_set(OHM_STRUCTURE(p), "int", ohm_value_from_int(42));
+    ohm_structure_set(OHM_STRUCTURE(p), "string", ohm_value_from_string("test1"));
+    ohm_structure_set(OHM_STRUCTURE(p), "double", ohm_value_from_double(0.5));
+    m = ohm_pattern_match(p, f, OHM_FACT_STORE_EVENT_LOOKUP);
+    fail_unless(m != NULL);
+    g_object_unref(m);
+    ohm_fact_set_int(f, "int", 41);
+    fail_unless(ohm_pattern_match(p, f, OHM_FACT_STORE_EVENT_LOOKUP) == NULL);
+    ohm_fact_set_int(f, "int", 42);
+
+    /* and are rolled back alike */
+    fs = ohm_fact_store_new();
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_int(f, "int", 43);
+    ohm_fact_set_string(f, "string", "test2");
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    fail_unless(g_value_get_int(ohm_fact_get(f, "int")) == 42);
+    fail_unless(strcmp(g_value_get_string(ohm_fact_get(f, "string")), "test1") == 0);
+
+    /* a fact out of the store again copies the string */
+    ohm_fact_store_remove(fs, f);
+    name = g_strdup("test3");
+    ohm_fact_set_string(f, "string", name);
+    g_free(name);
+    fail_unless(strcmp(g_value_get_string(ohm_fact_get(f, "string")), "test3") == 0);
+
+    g_object_unref(p);
+    g_object_unref(f);
+    g_object_unref(fs);
+}
+END_TEST
+
+
 static void do_test_fact_pattern_new(void)
 {
     void* p;
@@ -484,6 +618,88 @@ START_TEST (test_fact_store_to_string)
 END_TEST
 
 
+START_TEST (test_fact_store_writer)
+{
+    OhmFactStore* fs;
+    OhmFactStoreWriter* w;
+    OhmFact* f;
+    GString* out;
+    char* s;
+    char buf[256];
+    FILE* tmp;
+    gint i, n;
+
+    fs = ohm_fact_store_new();
+    for (i = 0; i < 5; i++) {
+        f = ohm_fact_new("org.test.writer");
+        ohm_fact_set_int(f, "id", i);
+        ohm_fact_store_insert(fs, f);
+        g_object_unref(f);
+    }
+
+    /* written in chunks, the same as at once */
+    out = g_string_new(NULL);
+    w = ohm_fact_store_writer_new(fs, OHM_FACT_STORE_FORMAT_TEXT);
+    for (n = 1; ohm_fact_store_writer_write(w, out, 2); n++)
+        ;
+    ohm_fact_store_writer_free(w);
+    fail_unless(n == 3);
+    s = ohm_fact_store_to_string(fs);
+    fail_unless(strcmp(s, out->str) == 0);
+    g_free(s);
+    g_string_free(out, TRUE);
+
+    /* JSON, escaped */
+    g_object_unref(fs);
+    fs = ohm_fact_store_new();
+    f = ohm_fact_new("org.test.writer");
+    ohm_fact_set_string(f, "s", "a \"b\"\n");
+    ohm_fact_set_boolean(f, "b", TRUE);
+    ohm_fact_set_double(f, "d", 0.5);
+    ohm_fact_store_insert(fs, f);
+    g_object_unref(f);
+    out = g_string_new(NULL);
+    w = ohm_fact_store_writer_new(fs, OHM_FACT_STORE_FORMAT_JSON);
+    fail_unless(!ohm_fact_store_writer_write(w, out, 0));
+    ohm_fact_store_writer_free(w);
+    fail_unless(g_str_has_prefix(out->str, "[\n  {\"name\": \"org.test.writer\", \"fields\": {"));
+    fail_unless(g_str_has_suffix(out->str, "}}\n]\n"));
+    fail_unless(strstr(out->str, "\"b\": true") != NULL);
+    fail_unless(strstr(out->str, "\"d\": 0.5") != NULL);
+    fail_unless(strstr(out->str, "\"s\": \"a \\\"b\\\"\\n\"") != NULL);
+
+    /* to a file descriptor */
+    tmp = tmpfile();
+    w = ohm_fact_store_writer_new(fs, OHM_FACT_STORE_FORMAT_JSON);
+    while (ohm_fact_store_writer_write_fd(w, fileno(tmp), 1, NULL))
+        ;
+    ohm_fact_store_writer_free(w);
+    lseek(fileno(tmp), 0, SEEK_SET);
+    n = read(fileno(tmp), buf, sizeof(buf) - 1);
+    fail_unless(n == (gint) out->len);
+    buf[n] = '\0';
+    fail_unless(strcmp(buf, out->str) == 0);
+    fclose(tmp);
+
+    g_string_free(out, TRUE);
+    g_object_unref(fs);
+}
+END_TEST
+
+
+static guint count_facts(OhmFactStore* fs, const char* name)
+{
+    GSList* l;
+    guint n;
+
+    l = ohm_fact_store_get_facts_by_name(fs, name);
+    n = g_slist_length(l);
+    g_slist_free(l);
+
+    return n;
+}
+
+
 static void do_test_fact_store_insert_remove(void)
 {
     void* p;
@@ -513,14 +729,14 @@ static void do_test_fact_store_insert_remove(void)
         ohm_fact_store_insert(fs, fact1);
         ohm_fact_store_insert(fs, fact1);
         ohm_fact_store_remove(fs, fact1);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.fact1")) == 0);
+        fail_unless(count_facts(fs, "org.test.fact1") == 0);
         ohm_fact_store_insert(fs, fact1);
         ohm_fact_store_insert(fs, fact2);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.fact1")) == 1);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.fact2")) == 1);
+        fail_unless(count_facts(fs, "org.test.fact1") == 1);
+        fail_unless(count_facts(fs, "org.test.fact2") == 1);
         ohm_fact_store_remove(fs, fact2);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.fact1")) == 1);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.fact2")) == 0);
+        fail_unless(count_facts(fs, "org.test.fact1") == 1);
+        fail_unless(count_facts(fs, "org.test.fact2") == 0);
         {
             gint i;
             i = 0;
@@ -542,7 +758,7 @@ static void do_test_fact_store_insert_remove(void)
                 (fact == NULL ? NULL : (fact = (g_object_unref(fact), NULL)));
             }
         }
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.fact1")) == 101);
+        fail_unless(count_facts(fs, "org.test.fact1") == 101);
         fail_unless(p != NULL);
         fail_unless(pfs != NULL);
         fail_unless(pf != NULL);
@@ -570,6 +786,131 @@ START_TEST (test_fact_store_free)
 END_TEST
 
 
+START_TEST (test_fact_store_insert_remove_many)
+{
+    OhmFactStore* fs;
+    OhmFact* facts[1000];
+    GSList* facts_list;
+    GSList* l;
+    gint i, n;
+
+    fs = ohm_fact_store_new();
+    for (i = 0; i < 1000; i++) {
+        facts[i] = ohm_fact_new("org.test.many");
+        ohm_fact_set(facts[i], "id", ohm_value_from_int(i));
+        fail_unless(ohm_fact_store_insert(fs, facts[i]));
+        fail_unless(!ohm_fact_store_insert(fs, facts[i]));
+    }
+    fail_unless(count_facts(fs, "org.test.many") == 1000);
+    /* newest first, in a list of the caller */
+    facts_list = ohm_fact_store_get_facts_by_name(fs, "org.test.many");
+    fail_unless(facts_list->data == facts[999]);
+    for (i = 0; i < 1000; i += 2)
+        ohm_fact_store_remove(fs, facts[i]);
+    fail_unless(g_slist_length(facts_list) == 1000);
+    g_slist_free(facts_list);
+    n = 0;
+    facts_list = ohm_fact_store_get_facts_by_name(fs, "org.test.many");
+    for (l = facts_list; l != NULL; l = l->next) {
+        fail_unless(g_value_get_int(ohm_fact_get(OHM_FACT(l->data), "id")) % 2 == 1);
+        n++;
+    }
+    g_slist_free(facts_list);
+    fail_unless(n == 500);
+    fail_unless(ohm_fact_store_get_facts_by_name(fs, "org.test.none") == NULL);
+
+    /* the name goes once its last fact does, and comes back with the next */
+    for (i = 1; i < 1000; i += 2)
+        ohm_fact_store_remove(fs, facts[i]);
+    fail_unless(ohm_fact_store_get_facts_by_name(fs, "org.test.many") == NULL);
+    fail_unless(ohm_fact_store_insert(fs, facts[0]));
+    fail_unless(count_facts(fs, "org.test.many") == 1);
+    for (i = 0; i < 1000; i++)
+        g_object_unref(facts[i]);
+    g_object_unref(fs);
+}
+END_TEST
+
+
+START_TEST (test_fact_store_symbols)
+{
+    OhmFactStore* fs;
+    OhmFactStoreSymbolStats stats;
+    OhmFactStoreView* v;
+    OhmPattern* p;
+    OhmFact* facts[10];
+    OhmFact* f;
+    const gchar* str;
+    gint i;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    p = ohm_pattern_new("org.test.device");
+    ohm_structure_set(OHM_STRUCTURE(p), "state", ohm_value_from_string("on"));
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    ohm_fact_store_get_symbol_stats(fs, &stats);
+    fail_unless(stats.symbols == 1 && stats.refs == 1);
+
+    for (i = 0; i < 10; i++) {
+        facts[i] = ohm_fact_new("org.test.device");
+        ohm_fact_set(facts[i], "state", ohm_value_from_string(i % 2 ? "on" : "off"));
+        ohm_fact_set_string(facts[i], "group", "speaker");
+        ohm_fact_store_insert(fs, facts[i]);
+    }
+    ohm_fact_store_get_symbol_stats(fs, &stats);
+    fail_unless(stats.symbols == 3 && stats.refs == 21);
+    fail_unless(g_value_get_string(ohm_fact_get(facts[0], "group")) == g_value_get_string(ohm_fact_get(facts[1], "group")));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 5);
+
+    ohm_fact_set_string(facts[0], "state", "on");
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 6);
+
+    /* the facts keep their symbols after leaving the store */
+    str = g_value_get_string(ohm_fact_get(facts[3], "group"));
+    for (i = 0; i < 10; i++)
+        ohm_fact_store_remove(fs, facts[i]);
+    ohm_fact_store_get_symbol_stats(fs, &stats);
+    fail_unless(stats.symbols == 3 && stats.refs == 21);
+    fail_unless(strcmp(str, "speaker") == 0);
+
+    /* and release them when set, or disposed */
+    for (i = 0; i < 10; i++)
+        ohm_fact_set_string(facts[i], "state", "off");
+    ohm_fact_store_get_symbol_stats(fs, &stats);
+    fail_unless(stats.symbols == 2 && stats.refs == 11 && stats.bytes == 11);
+    ohm_fact_set(facts[0], "group", NULL);
+    ohm_fact_store_get_symbol_stats(fs, &stats);
+    fail_unless(stats.symbols == 2 && stats.refs == 10);
+
+    /* a value changed behind the store's back keeps its symbol */
+    g_value_set_string(ohm_fact_get(facts[1], "group"), "other");
+    ohm_fact_set_string(facts[1], "group", "speaker");
+    ohm_fact_store_get_symbol_stats(fs, &stats);
+    fail_unless(stats.symbols == 2 && stats.refs == 9);
+
+    f = ohm_fact_new("org.test.device");
+    ohm_fact_set_string(f, "state", "off");
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_store_view_remove(v, OHM_STRUCTURE(p));
+    ohm_fact_store_get_symbol_stats(fs, &stats);
+    fail_unless(stats.symbols == 2 && stats.refs == 9);
+
+    /* the strings outlive the store and the removal */
+    str = g_value_get_string(ohm_fact_get(f, "state"));
+    ohm_fact_store_remove(fs, f);
+    g_object_unref(fs);
+    fail_unless(strcmp(str, "off") == 0);
+    fail_unless(strcmp(g_value_get_string(ohm_fact_get(facts[2], "group")), "speaker") == 0);
+
+    for (i = 0; i < 10; i++)
+        g_object_unref(facts[i]);
+    g_object_unref(f);
+    g_object_unref(v);
+    g_object_unref(p);
+}
+END_TEST
+
+
 static void do_test_fact_store_view_new(void)
 {
     void* p;
@@ -589,6 +930,732 @@ static void do_test_fact_store_view_new(void)
 }
 
 
+static gint _count_and_free_matches(GSList* matches)
+{
+    gint n = g_slist_length(matches);
+    g_slist_foreach(matches, (GFunc) g_object_unref, NULL);
+    g_slist_free(matches);
+    return n;
+}
+
+
+START_TEST (test_fact_store_index)
+{
+    OhmFactStore* fs;
+    OhmFactStoreLookupStats stats;
+    OhmPattern* p;
+    OhmFact* f;
+    OhmFact* first;
+    gint i;
+
+    fs = ohm_fact_store_new();
+    first = NULL;
+    for (i = 0; i < 100; i++) {
+        f = ohm_fact_new("org.test.stream");
+        ohm_fact_set(f, "pid", ohm_value_from_int(i % 10));
+        ohm_fact_set(f, "name", ohm_value_from_string("stream"));
+        ohm_fact_store_insert(fs, f);
+        if (first == NULL)
+            first = f;
+        else
+            g_object_unref(f);
+    }
+
+    p = ohm_pattern_new("org.test.stream");
+    ohm_structure_set(OHM_STRUCTURE(p), "pid", ohm_value_from_int(3));
+    fail_unless(_count_and_free_matches(ohm_fact_store_get_facts_by_pattern(fs, p)) == 10);
+    ohm_fact_store_get_lookup_stats(fs, &stats);
+    fail_unless(stats.lookups == 1 && stats.indexed == 0 && stats.candidates == 100);
+
+    fail_unless(ohm_fact_store_add_index(fs, "org.test.stream", "pid"));
+    fail_unless(!ohm_fact_store_add_index(fs, "org.test.stream", "pid"));
+    fail_unless(_count_and_free_matches(ohm_fact_store_get_facts_by_pattern(fs, p)) == 10);
+    ohm_fact_store_get_lookup_stats(fs, &stats);
+    fail_unless(stats.lookups == 2 && stats.indexed == 1 && stats.candidates == 110);
+    fail_unless(ohm_fact_store_get_index_probes(fs, "org.test.stream", "pid") == 1);
+
+    /* updates, removals and rollbacks keep the index in sync */
+    ohm_fact_set(first, "pid", ohm_value_from_int(3));
+    fail_unless(_count_and_free_matches(ohm_fact_store_get_facts_by_pattern(fs, p)) == 11);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set(first, "pid", ohm_value_from_int(4));
+    fail_unless(_count_and_free_matches(ohm_fact_store_get_facts_by_pattern(fs, p)) == 10);
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    fail_unless(_count_and_free_matches(ohm_fact_store_get_facts_by_pattern(fs, p)) == 11);
+    ohm_fact_store_remove(fs, first);
+    fail_unless(_count_and_free_matches(ohm_fact_store_get_facts_by_pattern(fs, p)) == 10);
+
+    ohm_structure_set(OHM_STRUCTURE(p), "pid", ohm_value_from_int(42));
+    fail_unless(_count_and_free_matches(ohm_fact_store_get_facts_by_pattern(fs, p)) == 0);
+
+    fail_unless(ohm_fact_store_drop_index(fs, "org.test.stream", "pid"));
+    fail_unless(!ohm_fact_store_drop_index(fs, "org.test.stream", "pid"));
+    ohm_structure_set(OHM_STRUCTURE(p), "pid", ohm_value_from_int(3));
+    fail_unless(_count_and_free_matches(ohm_fact_store_get_facts_by_pattern(fs, p)) == 10);
+    ohm_fact_store_get_lookup_stats(fs, &stats);
+    fail_unless(stats.indexed == 6);
+
+    g_object_unref(p);
+    g_object_unref(first);
+    g_object_unref(fs);
+}
+END_TEST
+
+
+static gint _count_range_matches(OhmFactStore* fs, OhmPattern* p)
+{
+    GSList* l;
+    GSList* m;
+    gint last, n;
+
+    /* through an ordered index, the facts come in the order of the
+     * field: -1 if they do not */
+    l = ohm_fact_store_get_facts_by_pattern(fs, p);
+    last = G_MININT;
+    n = 0;
+    for (m = l; m != NULL; m = m->next) {
+        GValue* v = ohm_fact_get(ohm_pattern_match_get_fact(m->data), "pid");
+
+        if (n >= 0 && v != NULL && G_VALUE_TYPE(v) == G_TYPE_INT) {
+            n = g_value_get_int(v) >= last ? n + 1 : -1;
+            last = g_value_get_int(v);
+        } else if (n >= 0) {
+            n++;
+        }
+        g_object_unref(m->data);
+    }
+    g_slist_free(l);
+
+    return n;
+}
+
+START_TEST (test_fact_store_ordered_index)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmFactStoreLookupStats stats;
+    OhmPattern* lt;
+    OhmPattern* range;
+    OhmPattern* prefix;
+    OhmPattern* gt;
+    OhmFact* f;
+    OhmFact* first;
+    gint i, pass;
+
+    fs = ohm_fact_store_new();
+    first = NULL;
+    for (i = 0; i < 100; i++) {
+        gchar* name = g_strdup_printf("stream-%02d", i);
+
+        f = ohm_fact_new("org.test.stream");
+        ohm_fact_set(f, "pid", ohm_value_from_int(i - 50));
+        ohm_fact_set(f, "name", ohm_value_from_string(name));
+        ohm_fact_store_insert(fs, f);
+        if (first == NULL)
+            first = f;
+        else
+            g_object_unref(f);
+        g_free(name);
+    }
+
+    lt = ohm_pattern_new("org.test.stream");
+    ohm_pattern_set_op(lt, "pid", OHM_PATTERN_OP_LT, ohm_value_from_int(-40));
+    fail_unless(ohm_pattern_get_op(lt, "pid") == OHM_PATTERN_OP_LT);
+    gt = ohm_pattern_new("org.test.stream");
+    ohm_pattern_set_op(gt, "pid", OHM_PATTERN_OP_GT, ohm_value_from_int(45));
+    range = ohm_pattern_new("org.test.stream");
+    ohm_pattern_set_range(range, "pid", ohm_value_from_int(-5), ohm_value_from_int(4));
+    fail_unless(ohm_pattern_get_op(range, "pid") == OHM_PATTERN_OP_RANGE);
+    prefix = ohm_pattern_new("org.test.stream");
+    ohm_pattern_set_prefix(prefix, "name", "stream-1");
+    fail_unless(ohm_pattern_get_op(prefix, "name") == OHM_PATTERN_OP_PREFIX);
+    fail_unless(ohm_pattern_get_op(prefix, "pid") == OHM_PATTERN_OP_EQ);
+
+    /* the same results by a scan and through the indexes */
+    for (pass = 0; pass < 2; pass++) {
+        fail_unless(_count_range_matches(fs, lt) == 10);
+        fail_unless(_count_range_matches(fs, gt) == 4);
+        fail_unless(_count_range_matches(fs, range) == 10);
+        fail_unless(_count_range_matches(fs, prefix) == 10);
+        fail_unless(ohm_fact_store_add_ordered_index(fs, "org.test.stream", "pid") == !pass);
+        fail_unless(ohm_fact_store_add_ordered_index(fs, "org.test.stream", "name") == !pass);
+    }
+    ohm_fact_store_get_lookup_stats(fs, &stats);
+    fail_unless(stats.indexed == 4 && stats.candidates == 400 + 10 + 4 + 10 + 10);
+    fail_unless(ohm_fact_store_get_index_probes(fs, "org.test.stream", "pid") == 3);
+
+    /* updates and removals keep the index in sync */
+    ohm_fact_set(first, "pid", ohm_value_from_int(0));
+    fail_unless(_count_range_matches(fs, lt) == 9);
+    fail_unless(_count_range_matches(fs, range) == 11);
+    ohm_fact_set(first, "pid", ohm_value_from_string("none"));
+    fail_unless(_count_range_matches(fs, range) == 10);
+    ohm_fact_store_remove(fs, first);
+    fail_unless(_count_range_matches(fs, prefix) == 10);
+    ohm_fact_set(first, "name", ohm_value_from_string("stream-1x"));
+    ohm_fact_set(first, "pid", ohm_value_from_int(46));
+    ohm_fact_store_insert(fs, first);
+    fail_unless(_count_range_matches(fs, prefix) == 11);
+    fail_unless(_count_range_matches(fs, gt) == 5);
+
+    /* a view on a range is only told about the facts within */
+    v = ohm_fact_store_new_view(fs, NULL);
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(range));
+    ohm_fact_set(first, "pid", ohm_value_from_int(100));
+    ohm_fact_set(first, "pid", ohm_value_from_int(4));
+    ohm_fact_set(first, "pid", ohm_value_from_int(5));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 1);
+
+    /* setting the field again tests it for equality */
+    ohm_structure_set(OHM_STRUCTURE(range), "pid", ohm_value_from_int(5));
+    fail_unless(ohm_pattern_get_op(range, "pid") == OHM_PATTERN_OP_EQ);
+    fail_unless(_count_range_matches(fs, range) == 2);
+
+    fail_unless(ohm_fact_store_drop_ordered_index(fs, "org.test.stream", "pid"));
+    fail_unless(!ohm_fact_store_drop_ordered_index(fs, "org.test.stream", "pid"));
+    fail_unless(_count_range_matches(fs, lt) == 9);
+
+    g_object_unref(v);
+    g_object_unref(lt);
+    g_object_unref(gt);
+    g_object_unref(range);
+    g_object_unref(prefix);
+    g_object_unref(first);
+    g_object_unref(fs);
+}
+END_TEST
+
+
+typedef struct {
+    OhmFactStore* fs;
+    gint id;
+} MtWorker;
+
+static gpointer mt_write(gpointer data)
+{
+    MtWorker* w = data;
+    OhmFact* f[50];
+    gchar* name;
+    gint i, j;
+
+    name = g_strdup_printf("org.test.mt%d", w->id);
+    for (i = 0; i < 50; i++) {
+        f[i] = ohm_fact_new(name);
+        ohm_fact_set_int(f[i], "id", i);
+        ohm_fact_store_insert(w->fs, f[i]);
+    }
+    for (j = 0; j < 4; j++)
+        for (i = 0; i < 50; i++)
+            ohm_fact_set_int(f[i], "value", j);
+    for (i = 0; i < 50; i++) {
+        if (i % 2)
+            ohm_fact_store_remove(w->fs, f[i]);
+        g_object_unref(f[i]);
+    }
+    g_free(name);
+
+    return NULL;
+}
+
+static gpointer mt_transact(gpointer data)
+{
+    MtWorker* w = data;
+    OhmFactStoreSnapshot* s;
+    GQuark names[2];
+    OhmFact* f;
+    GSList* l;
+    gint i, errors = 0;
+
+    names[0] = g_quark_from_string("org.test.mt.tx");
+    names[1] = g_quark_from_string("org.test.mt0");
+    for (i = 0; i < 20; i++) {
+        ohm_fact_store_transaction_push(w->fs);
+        f = ohm_fact_new("org.test.mt.tx");
+        ohm_fact_store_insert(w->fs, f);
+        g_object_unref(f);
+        ohm_fact_store_transaction_pop(w->fs, FALSE);
+
+        /* a snapshot is a consistent cut of all the names */
+        s = ohm_fact_store_snapshot(w->fs);
+        if (g_slist_length(ohm_fact_store_snapshot_get_facts_by_name(s, "org.test.mt.tx")) != (guint) i + 1)
+            errors++;
+        ohm_fact_store_snapshot_unref(s);
+
+        ohm_fact_store_lock_names(w->fs, names, 2);
+        l = ohm_fact_store_get_facts_by_quark(w->fs, names[0]);
+        if (g_slist_length(l) != (guint) i + 1)
+            errors++;
+        g_slist_free(l);
+        ohm_fact_store_unlock_names(w->fs, names, 2);
+    }
+
+    return GINT_TO_POINTER(errors);
+}
+
+START_TEST (test_fact_store_thread_safe)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmPattern* p;
+    MtWorker w[5];
+    GThread* threads[5];
+    gchar* name;
+    int i;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    for (i = 0; i < 4; i++) {
+        name = g_strdup_printf("org.test.mt%d", i);
+        p = ohm_pattern_new(name);
+        ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+        g_object_unref(p);
+        g_free(name);
+    }
+    fail_unless(!ohm_fact_store_get_thread_safe(fs));
+    ohm_fact_store_set_thread_safe(fs, TRUE);
+    fail_unless(ohm_fact_store_get_thread_safe(fs));
+
+    for (i = 0; i < 5; i++) {
+        w[i].fs = fs;
+        w[i].id = i;
+        threads[i] = g_thread_new("mt", i < 4 ? mt_write : mt_transact, &w[i]);
+    }
+    for (i = 0; i < 4; i++)
+        g_thread_join(threads[i]);
+    fail_unless(g_thread_join(threads[4]) == NULL);
+
+    for (i = 0; i < 4; i++) {
+        name = g_strdup_printf("org.test.mt%d", i);
+        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, name)) == 25);
+        g_free(name);
+    }
+    fail_unless(count_facts(fs, "org.test.mt.tx") == 20);
+    /* 50 added, 200 updated and 25 removed per name */
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 4 * 275);
+
+    ohm_fact_store_set_thread_safe(fs, FALSE);
+    g_object_unref(v);
+    g_object_unref(fs);
+}
+END_TEST
+
+static gpointer txn_increment(gpointer data)
+{
+    OhmFact* counter = data;
+    OhmFactStoreTxn* txn;
+    GValue v = { 0, };
+    gint i, conflicts = 0;
+
+    for (i = 0; i < 200; i++) {
+        do {
+            txn = ohm_fact_store_txn_begin(ohm_fact_get_fact_store(counter));
+            ohm_fact_store_txn_get(txn, counter, "n", &v);
+            ohm_fact_store_txn_set(txn, counter, "n", ohm_value_from_int(g_value_get_int(&v) + 1));
+            g_value_unset(&v);
+        } while (!ohm_fact_store_txn_commit(txn) && ++conflicts);
+    }
+
+    return GINT_TO_POINTER(conflicts);
+}
+
+START_TEST (test_fact_store_txn)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmFactStoreTxn* txn;
+    OhmPattern* p;
+    OhmFact* f1;
+    OhmFact* f2;
+    OhmFact* f3;
+    GSList* l;
+    GValue val = { 0, };
+    GThread* threads[2];
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    p = ohm_pattern_new("org.test.txn");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    f1 = ohm_fact_new("org.test.txn");
+    ohm_fact_set_int(f1, "n", 0);
+    ohm_fact_store_insert(fs, f1);
+    ohm_fact_store_change_set_reset(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set);
+
+    /* the changes are kept aside, the transaction sees its own */
+    txn = ohm_fact_store_txn_begin(fs);
+    fail_unless(ohm_fact_store_txn_get(txn, f1, "n", &val));
+    fail_unless(g_value_get_int(&val) == 0);
+    g_value_unset(&val);
+    ohm_fact_store_txn_set(txn, f1, "n", ohm_value_from_int(1));
+    fail_unless(ohm_fact_store_txn_get(txn, f1, "n", &val));
+    fail_unless(g_value_get_int(&val) == 1);
+    g_value_unset(&val);
+    fail_unless(g_value_get_int(ohm_fact_get(f1, "n")) == 0);
+    fail_unless(ohm_fact_store_txn_commit(txn));
+    fail_unless(g_value_get_int(ohm_fact_get(f1, "n")) == 1);
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 1);
+
+    /* a field read and changed in between is a conflict */
+    txn = ohm_fact_store_txn_begin(fs);
+    fail_unless(ohm_fact_store_txn_get(txn, f1, "n", &val));
+    g_value_unset(&val);
+    ohm_fact_store_txn_set(txn, f1, "n", ohm_value_from_int(10));
+    ohm_fact_set_int(f1, "n", 2);
+    fail_unless(!ohm_fact_store_txn_commit(txn));
+    fail_unless(g_value_get_int(ohm_fact_get(f1, "n")) == 2);
+
+    /* other fields do not conflict */
+    txn = ohm_fact_store_txn_begin(fs);
+    fail_unless(!ohm_fact_store_txn_get(txn, f1, "other", &val));
+    ohm_fact_set_int(f1, "n", 3);
+    ohm_fact_store_txn_set(txn, f1, "other", ohm_value_from_int(1));
+    fail_unless(ohm_fact_store_txn_commit(txn));
+    fail_unless(g_value_get_int(ohm_fact_get(f1, "other")) == 1);
+
+    /* nor does a fact inserted elsewhere, unless the name was listed */
+    f2 = ohm_fact_new("org.test.txn");
+    txn = ohm_fact_store_txn_begin(fs);
+    fail_unless(ohm_fact_store_txn_contains(txn, f1));
+    l = ohm_fact_store_txn_get_facts_by_pattern(txn, p);
+    fail_unless(g_slist_length(l) == 1);
+    g_slist_foreach(l, (GFunc) g_object_unref, NULL);
+    g_slist_free(l);
+    ohm_fact_store_txn_remove(txn, f1);
+    ohm_fact_store_insert(fs, f2);
+    fail_unless(!ohm_fact_store_txn_commit(txn));
+    fail_unless(ohm_fact_get_fact_store(f1) == fs);
+
+    txn = ohm_fact_store_txn_begin(fs);
+    fail_unless(ohm_fact_store_txn_contains(txn, f1));
+    ohm_fact_store_txn_remove(txn, f2);
+    f3 = ohm_fact_new("org.test.txn");
+    ohm_fact_store_insert(fs, f3);
+    fail_unless(ohm_fact_store_txn_commit(txn));
+    fail_unless(ohm_fact_get_fact_store(f2) == NULL);
+    ohm_fact_store_remove(fs, f3);
+    g_object_unref(f3);
+
+    /* concurrent read-modify-write cycles all make it, by retrying */
+    ohm_fact_store_set_thread_safe(fs, TRUE);
+    ohm_fact_set_int(f1, "n", 0);
+    threads[0] = g_thread_new("txn", txn_increment, f1);
+    threads[1] = g_thread_new("txn", txn_increment, f1);
+    g_thread_join(threads[0]);
+    g_thread_join(threads[1]);
+    fail_unless(g_value_get_int(ohm_fact_get(f1, "n")) == 400);
+
+    ohm_fact_store_set_thread_safe(fs, FALSE);
+    g_object_unref(f1);
+    g_object_unref(f2);
+    g_object_unref(p);
+    g_object_unref(v);
+    g_object_unref(fs);
+}
+END_TEST
+
+START_TEST (test_fact_store_dump)
+{
+    OhmFactStore* fs;
+    OhmFactStore* fs2;
+    OhmFact* f1;
+    OhmFact* f2;
+    OhmFact* other;
+    OhmFact* ref;
+    GValue* v;
+    GSList* l;
+    GError* error = NULL;
+    FILE* tmp;
+    int fd;
+
+    fs = ohm_fact_store_new();
+    f1 = ohm_fact_new("org.test.dump");
+    ohm_fact_set_int(f1, "id", 1);
+    ohm_fact_set_string(f1, "state", "on");
+    ohm_fact_set_double(f1, "level", 0.5);
+    ohm_fact_set_boolean(f1, "enabled", TRUE);
+    ohm_fact_set(f1, "ptr", ohm_value_from_pointer(f1));
+    ohm_fact_store_insert(fs, f1);
+    f2 = ohm_fact_new("org.test.dump");
+    ohm_fact_set_int(f2, "id", 2);
+    ohm_fact_set_string(f2, "state", "on");
+    ohm_fact_set(f2, "peer", ohm_value_from_fact(f1));
+    ohm_fact_store_insert(fs, f2);
+    /* a fact out of the store, only known by reference */
+    other = ohm_fact_new("org.test.other");
+    ohm_fact_set_int(other, "id", 3);
+    ohm_fact_set(f1, "peer", ohm_value_from_fact(other));
+
+    tmp = tmpfile();
+    fd = fileno(tmp);
+    fail_unless(ohm_fact_store_dump(fs, fd, &error));
+    fail_unless(error == NULL);
+    lseek(fd, 0, SEEK_SET);
+
+    fs2 = ohm_fact_store_new();
+    fail_unless(ohm_fact_store_restore(fs2, fd, &error));
+    fail_unless(error == NULL);
+    fail_unless(ohm_fact_store_get_facts_by_name(fs2, "org.test.other") == NULL);
+
+    /* same order, same fields */
+    l = ohm_fact_store_get_facts_by_name(fs2, "org.test.dump");
+    fail_unless(g_slist_length(l) == 2);
+    fail_unless(g_value_get_int(ohm_fact_get(l->data, "id")) == 2);
+    fail_unless(g_value_get_int(ohm_fact_get(l->next->data, "id")) == 1);
+    fail_unless(strcmp(g_value_get_string(ohm_fact_get(l->next->data, "state")), "on") == 0);
+    fail_unless(g_value_get_double(ohm_fact_get(l->next->data, "level")) == 0.5);
+    fail_unless(g_value_get_boolean(ohm_fact_get(l->next->data, "enabled")));
+    fail_unless(ohm_fact_get(l->next->data, "ptr") == NULL);
+
+    /* the references point at the restored facts */
+    v = ohm_fact_get(l->data, "peer");
+    fail_unless(ohm_value_get_fact(v) == l->next->data);
+    ref = ohm_value_get_fact(ohm_fact_get(l->next->data, "peer"));
+    fail_unless(ref != other);
+    fail_unless(ohm_fact_get_fact_store(ref) == NULL);
+    fail_unless(g_value_get_int(ohm_fact_get(ref, "id")) == 3);
+
+    /* a truncated dump restores nothing */
+    fail_unless(ftruncate(fd, 20) == 0);
+    lseek(fd, 0, SEEK_SET);
+    g_object_unref(fs2);
+    fs2 = ohm_fact_store_new();
+    fail_unless(!ohm_fact_store_restore(fs2, fd, &error));
+    fail_unless(g_error_matches(error, OHM_FACT_STORE_ERROR, OHM_FACT_STORE_ERROR_FORMAT));
+    fail_unless(ohm_fact_store_get_facts_by_name(fs2, "org.test.dump") == NULL);
+    g_error_free(error);
+
+    fclose(tmp);
+    ohm_fact_set(f1, "peer", NULL);
+    g_object_unref(other);
+    g_object_unref(f1);
+    g_object_unref(f2);
+    g_object_unref(fs2);
+    g_object_unref(fs);
+}
+END_TEST
+
+START_TEST (test_fact_store_stats)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmFactStoreView* tv;
+    OhmPattern* p;
+    OhmPattern* tp;
+    OhmFact* f[3];
+    OhmFactStoreStats stats;
+    OhmFactStorePatternStats* ps;
+    OhmFactStoreNameStats* ns;
+    OhmFactStoreViewStats* vs;
+    GArray* a;
+    GString* out;
+    guint64 n;
+    gint i;
+
+    fs = ohm_fact_store_new();
+    fail_unless(!ohm_fact_store_get_timing(fs));
+    ohm_fact_store_set_timing(fs, TRUE);
+    v = ohm_fact_store_new_view(fs, NULL);
+    p = ohm_pattern_new("org.test.stats");
+    ohm_structure_set(OHM_STRUCTURE(p), "x", ohm_value_from_int(1));
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    tv = ohm_fact_store_new_transparent_view(fs, NULL);
+    tp = ohm_pattern_new("org.test.stats");
+    ohm_fact_store_view_add(tv, OHM_STRUCTURE(tp));
+
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_store_transaction_push(fs);
+    for (i = 0; i < 3; i++) {
+        f[i] = ohm_fact_new("org.test.stats");
+        ohm_fact_set_int(f[i], "x", i);
+        ohm_fact_store_insert(fs, f[i]);
+    }
+    ohm_fact_store_get_stats(fs, &stats);
+    fail_unless(stats.transaction_depth == 2);
+    fail_unless(stats.cow_length == 3);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+
+    ohm_fact_store_get_stats(fs, &stats);
+    fail_unless(stats.facts == 3);
+    fail_unless(stats.names == 1);
+    fail_unless(stats.patterns == 1);
+    fail_unless(stats.transparent_patterns == 1);
+    fail_unless(stats.views == 2);
+    fail_unless(stats.transaction_depth == 0);
+    fail_unless(stats.max_transaction_depth == 2);
+    fail_unless(stats.max_cow_length == 3);
+    fail_unless(stats.dispatches == 6);
+    for (i = 0, n = 0; i < OHM_FACT_STORE_STATS_BUCKETS; i++)
+        n += stats.dispatch_histogram[i];
+    fail_unless(n == stats.dispatches);
+
+    /* the plain pattern is only tried on the fact it tests for */
+    a = ohm_fact_store_get_pattern_stats(fs);
+    fail_unless(a->len == 2);
+    ps = &g_array_index(a, OhmFactStorePatternStats, 0);
+    fail_unless(ps->pattern == tp && ps->transparent);
+    fail_unless(ps->evaluations == 3 && ps->hits == 3);
+    ps = &g_array_index(a, OhmFactStorePatternStats, 1);
+    fail_unless(ps->pattern == p && ps->view == v);
+    fail_unless(ps->evaluations == 1 && ps->hits == 1);
+    g_array_free(a, TRUE);
+
+    a = ohm_fact_store_get_name_stats(fs);
+    ns = &g_array_index(a, OhmFactStoreNameStats, 0);
+    fail_unless(a->len == 1);
+    fail_unless(ns->name == g_quark_from_string("org.test.stats"));
+    fail_unless(ns->facts == 3 && ns->evaluations == 4 && ns->hits == 4);
+    g_array_free(a, TRUE);
+
+    a = ohm_fact_store_get_view_stats(fs);
+    fail_unless(a->len == 2);
+    vs = &g_array_index(a, OhmFactStoreViewStats, 1);
+    fail_unless(vs->view == v && vs->patterns == 1 && vs->backlog == 1);
+    g_array_free(a, TRUE);
+
+    out = g_string_new(NULL);
+    ohm_fact_store_write_stats(fs, out, OHM_FACT_STORE_FORMAT_JSON);
+    fail_unless(g_str_has_prefix(out->str, "{\"facts\": 3, "));
+    fail_unless(strstr(out->str, "{\"name\": \"org.test.stats\", \"facts\": 3, ") != NULL);
+    g_string_free(out, TRUE);
+
+    ohm_fact_store_reset_stats(fs);
+    ohm_fact_store_get_stats(fs, &stats);
+    fail_unless(stats.facts == 3);
+    fail_unless(stats.evaluations == 0 && stats.dispatches == 0);
+    fail_unless(stats.max_transaction_depth == 0);
+
+    /* untimed dispatches are counted only */
+    ohm_fact_store_set_timing(fs, FALSE);
+    ohm_fact_set_int(f[0], "y", 1);
+    ohm_fact_store_get_stats(fs, &stats);
+    fail_unless(stats.dispatches == 2);
+    for (i = 0, n = 0; i < OHM_FACT_STORE_STATS_BUCKETS; i++)
+        n += stats.dispatch_histogram[i];
+    fail_unless(n == 0 && stats.dispatch_time == 0);
+
+    for (i = 0; i < 3; i++)
+        g_object_unref(f[i]);
+    g_object_unref(p);
+    g_object_unref(tp);
+    g_object_unref(v);
+    g_object_unref(tv);
+    g_object_unref(fs);
+}
+END_TEST
+
+
+static OhmFact* journal_fact(OhmFactStore* fs, gint id)
+{
+    GSList* l;
+
+    for (l = ohm_fact_store_get_facts_by_name(fs, "org.test.journal"); l != NULL; l = l->next)
+        if (g_value_get_int(ohm_fact_get(l->data, "id")) == id)
+            return l->data;
+    return NULL;
+}
+
+START_TEST (test_fact_store_journal)
+{
+    OhmFactStore* fs;
+    OhmFact* f[4];
+    OhmFact* r;
+    OhmFactStoreOp ops[2];
+    GError* error = NULL;
+    gchar* dir;
+    gchar* path;
+    gchar* snapshot;
+    gint i;
+
+    dir = g_dir_make_tmp("test-fact-XXXXXX", NULL);
+    fail_unless(dir != NULL);
+    path = g_build_filename(dir, "facts", NULL);
+    snapshot = g_strconcat(path, ".snapshot", NULL);
+
+    fs = ohm_fact_store_new();
+    fail_unless(ohm_fact_store_journal_open(fs, path, &error));
+    fail_unless(error == NULL);
+    ohm_fact_store_journal_set_sync(fs, 1, 0);
+    for (i = 0; i < 4; i++) {
+        f[i] = ohm_fact_new("org.test.journal");
+        ohm_fact_set_int(f[i], "id", i);
+        ohm_fact_store_insert(fs, f[i]);
+    }
+    ohm_fact_set_string(f[0], "state", "on");
+    ohm_fact_set(f[1], "peer", ohm_value_from_fact(f[0]));
+    ohm_fact_store_remove(fs, f[2]);
+
+    /* a rolled back transaction leaves no trace */
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_string(f[0], "state", "off");
+    ohm_fact_store_remove(fs, f[3]);
+    ohm_fact_store_transaction_pop(fs, TRUE);
+
+    /* a batch is recorded once committed */
+    memset(ops, 0, sizeof(ops));
+    ops[0].type = OHM_FACT_STORE_OP_UPDATE;
+    ops[0].fact = f[3];
+    ops[0].field = g_quark_from_string("level");
+    g_value_init(&ops[0].value, G_TYPE_DOUBLE);
+    g_value_set_double(&ops[0].value, 0.25);
+    ops[1].type = OHM_FACT_STORE_OP_INSERT;
+    ops[1].fact = f[2];
+    ohm_fact_store_apply_batch(fs, ops, 2);
+    ohm_fact_set_int(f[2], "id", 5);
+
+    /* a removal committed within transactions lets the fact go */
+    r = ohm_fact_new("org.test.journal");
+    ohm_fact_set_int(r, "id", 6);
+    ohm_fact_store_insert(fs, r);
+    g_object_unref(r);
+    g_object_add_weak_pointer(G_OBJECT(r), (gpointer*) &r);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_store_remove(fs, r);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    fail_unless(r != NULL);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    fail_unless(r == NULL);
+
+    ohm_fact_store_journal_flush(fs);
+    for (i = 0; i < 4; i++)
+        g_object_unref(f[i]);
+    g_object_unref(fs);
+
+    /* replayed from the journal */
+    fs = ohm_fact_store_new();
+    fail_unless(ohm_fact_store_journal_open(fs, path, &error));
+    fail_unless(count_facts(fs, "org.test.journal") == 4);
+    fail_unless(strcmp(g_value_get_string(ohm_fact_get(journal_fact(fs, 0), "state")), "on") == 0);
+    fail_unless(ohm_value_get_fact(ohm_fact_get(journal_fact(fs, 1), "peer")) == journal_fact(fs, 0));
+    fail_unless(g_value_get_double(ohm_fact_get(journal_fact(fs, 3), "level")) == 0.25);
+    fail_unless(journal_fact(fs, 2) == NULL);
+    fail_unless(journal_fact(fs, 5) != NULL);
+    fail_unless(journal_fact(fs, 6) == NULL);
+
+    /* replayed from a compacted snapshot */
+    r = journal_fact(fs, 3);
+    ohm_fact_store_remove(fs, r);
+    fail_unless(ohm_fact_store_journal_compact(fs));
+    ohm_fact_set_string(journal_fact(fs, 0), "state", "off");
+    ohm_fact_store_journal_close(fs);
+    g_object_unref(fs);
+
+    fs = ohm_fact_store_new();
+    fail_unless(ohm_fact_store_journal_open(fs, path, &error));
+    fail_unless(count_facts(fs, "org.test.journal") == 3);
+    fail_unless(strcmp(g_value_get_string(ohm_fact_get(journal_fact(fs, 0), "state")), "off") == 0);
+    fail_unless(journal_fact(fs, 3) == NULL);
+    g_object_unref(fs);
+
+    unlink(path);
+    unlink(snapshot);
+    rmdir(dir);
+    g_free(snapshot);
+    g_free(path);
+    g_free(dir);
+}
+END_TEST
+
 START_TEST (test_fact_store_view_new)
 {
     do_test_fact_store_view_new();
@@ -596,6 +1663,781 @@ START_TEST (test_fact_store_view_new)
 END_TEST
 
 
+START_TEST (test_fact_store_view_pattern_fields)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmPattern* p;
+    OhmFact* f;
+    GSList* l;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    p = ohm_pattern_new("org.test.policy");
+    ohm_structure_set(OHM_STRUCTURE(p), "state", ohm_value_from_string("on"));
+    ohm_structure_set(OHM_STRUCTURE(p), "level", ohm_value_from_int(2));
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+
+    f = ohm_fact_new("org.test.policy");
+    ohm_fact_set(f, "level", ohm_value_from_int(2));
+    ohm_fact_set(f, "state", ohm_value_from_string("off"));
+    ohm_fact_set(f, "extra", ohm_value_from_int(7));
+    ohm_fact_store_insert(fs, f);
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 0);
+
+    ohm_fact_set(f, "state", ohm_value_from_string("on"));
+    l = ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set);
+    fail_unless(g_slist_length(l) == 1);
+    fail_unless(ohm_pattern_match_get_fact(OHM_PATTERN_MATCH(l->data)) == f);
+
+    /* a field of the wrong type never matches */
+    ohm_fact_set(f, "level", ohm_value_from_string("2"));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 1);
+
+    /* changing a pattern already in a view changes what it matches */
+    ohm_structure_set(OHM_STRUCTURE(p), "level", ohm_value_from_string("2"));
+    ohm_fact_set(f, "extra", ohm_value_from_int(8));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 2);
+
+    g_object_unref(p);
+    g_object_unref(f);
+    g_object_unref(v);
+    g_object_unref(fs);
+}
+END_TEST
+
+
+START_TEST (test_fact_store_view_alpha)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* views[20];
+    OhmPattern* patterns[20];
+    OhmFactStoreView* any;
+    OhmPattern* all;
+    OhmFact* f;
+    gint i;
+
+    fs = ohm_fact_store_new();
+    for (i = 0; i < 20; i++) {
+        views[i] = ohm_fact_store_new_view(fs, NULL);
+        patterns[i] = ohm_pattern_new("org.test.alpha");
+        ohm_structure_set(OHM_STRUCTURE(patterns[i]), "id", ohm_value_from_int(i % 10));
+        if (i >= 10)
+            ohm_structure_set(OHM_STRUCTURE(patterns[i]), "kind", ohm_value_from_string("odd"));
+        ohm_fact_store_view_add(views[i], OHM_STRUCTURE(patterns[i]));
+    }
+    any = ohm_fact_store_new_view(fs, NULL);
+    all = ohm_pattern_new("org.test.alpha");
+    ohm_fact_store_view_add(any, OHM_STRUCTURE(all));
+
+    for (i = 0; i < 10; i++) {
+        f = ohm_fact_new("org.test.alpha");
+        ohm_fact_set(f, "id", ohm_value_from_int(i));
+        if (i % 2)
+            ohm_fact_set(f, "kind", ohm_value_from_string("odd"));
+        ohm_fact_store_insert(fs, f);
+        g_object_unref(f);
+    }
+
+    for (i = 0; i < 20; i++)
+        fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(views[i])->change_set)) == (i < 10 || i % 2 ? 1 : 0));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(any)->change_set)) == 10);
+
+    /* removed and modified patterns are dropped from the network */
+    ohm_fact_store_view_remove(views[3], OHM_STRUCTURE(patterns[3]));
+    ohm_structure_set(OHM_STRUCTURE(patterns[5]), "id", ohm_value_from_int(42));
+    for (i = 0; i < 20; i++)
+        ohm_fact_store_change_set_reset(OHM_FACT_STORE_SIMPLE_VIEW(views[i])->change_set);
+    f = ohm_fact_new("org.test.alpha");
+    ohm_fact_set(f, "id", ohm_value_from_int(3));
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_set(f, "id", ohm_value_from_int(42));
+    g_object_unref(f);
+    for (i = 0; i < 20; i++)
+        fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(views[i])->change_set)) == (i == 5 ? 1 : 0));
+
+    g_object_unref(fs);
+    for (i = 0; i < 20; i++) {
+        g_object_unref(views[i]);
+        g_object_unref(patterns[i]);
+    }
+    g_object_unref(any);
+    g_object_unref(all);
+}
+END_TEST
+
+
+START_TEST (test_fact_store_view_updated_fields)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmFactStoreView* tv;
+    OhmPattern* p;
+    OhmPattern* tp;
+    OhmFact* f;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    tv = ohm_fact_store_new_transparent_view(fs, NULL);
+    p = ohm_pattern_new("org.test.stream");
+    ohm_structure_set(OHM_STRUCTURE(p), "pid", ohm_value_from_int(1));
+    ohm_structure_set(OHM_STRUCTURE(p), "state", ohm_value_from_string("playing"));
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    tp = ohm_pattern_new("org.test.stream");
+    ohm_structure_set(OHM_STRUCTURE(tp), "state", ohm_value_from_string("playing"));
+    ohm_fact_store_view_add(tv, OHM_STRUCTURE(tp));
+
+    f = ohm_fact_new("org.test.stream");
+    ohm_fact_set(f, "pid", ohm_value_from_int(1));
+    ohm_fact_set(f, "state", ohm_value_from_string("playing"));
+    ohm_fact_set(f, "volume", ohm_value_from_int(10));
+    ohm_fact_store_insert(fs, f);
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 1);
+
+    /* updates of fields no pattern tests still report the match */
+    ohm_fact_set(f, "volume", ohm_value_from_int(20));
+    ohm_fact_set(f, "volume", ohm_value_from_int(30));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 3);
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(tv)->change_set)) == 3);
+
+    ohm_fact_set(f, "state", ohm_value_from_string("paused"));
+    ohm_fact_set(f, "volume", ohm_value_from_int(40));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 3);
+
+    /* moving away and back on the filed field */
+    ohm_fact_set(f, "state", ohm_value_from_string("playing"));
+    ohm_fact_set(f, "pid", ohm_value_from_int(2));
+    ohm_fact_set(f, "volume", ohm_value_from_int(50));
+    ohm_fact_set(f, "pid", ohm_value_from_int(1));
+    ohm_fact_set(f, "volume", ohm_value_from_int(60));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 6);
+
+    /* a rolled back change is seen by the transparent view only */
+    ohm_fact_store_change_set_reset(OHM_FACT_STORE_SIMPLE_VIEW(tv)->change_set);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set(f, "state", ohm_value_from_string("stopped"));
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    ohm_fact_store_change_set_reset(OHM_FACT_STORE_SIMPLE_VIEW(tv)->change_set);
+    ohm_fact_set(f, "volume", ohm_value_from_int(70));
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(tv)->change_set)) == 1);
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 7);
+
+    g_object_unref(f);
+    g_object_unref(fs);
+    g_object_unref(v);
+    g_object_unref(tv);
+    g_object_unref(p);
+    g_object_unref(tp);
+}
+END_TEST
+
+
+START_TEST (test_fact_store_view_change_set)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmFactStoreChangeSet* cs;
+    OhmPattern* p;
+    OhmFact* f;
+    GSList* l;
+    GSList* l2;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    cs = OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set;
+    p = ohm_pattern_new("org.test.match");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+
+    f = ohm_fact_new("org.test.match");
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_set(f, "a", ohm_value_from_int(1));
+
+    /* matches are handed out newest first, with fact, pattern and event */
+    l = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l) == 2);
+    fail_unless(ohm_pattern_match_get_fact(OHM_PATTERN_MATCH(l->data)) == f);
+    fail_unless(ohm_pattern_match_get_pattern(OHM_PATTERN_MATCH(l->data)) == p);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->data)) == OHM_FACT_STORE_EVENT_UPDATED);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->next->data)) == OHM_FACT_STORE_EVENT_ADDED);
+    fail_unless(ohm_fact_store_change_set_get_matches(cs) == l);
+
+    /* a list obtained earlier remains the tail of the current one */
+    ohm_fact_store_remove(fs, f);
+    l2 = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l2) == 3);
+    fail_unless(l2->next == l);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l2->data)) == OHM_FACT_STORE_EVENT_REMOVED);
+
+    ohm_fact_store_change_set_remove_match(cs, OHM_PATTERN_MATCH(l->data));
+    l = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l) == 2);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->data)) == OHM_FACT_STORE_EVENT_REMOVED);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->next->data)) == OHM_FACT_STORE_EVENT_ADDED);
+
+    ohm_fact_store_change_set_reset(cs);
+    fail_unless(ohm_fact_store_change_set_get_matches(cs) == NULL);
+
+    g_object_unref(f);
+    g_object_unref(fs);
+    g_object_unref(v);
+    g_object_unref(p);
+}
+END_TEST
+
+
+START_TEST (test_fact_store_view_coalesce)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmFactStoreChangeSet* cs;
+    OhmPattern* p;
+    OhmFact* f;
+    OhmFact* f2;
+    OhmFact* g[10];
+    OhmPattern* p2;
+    GSList* l;
+    const GQuark* fields;
+    guint n;
+    int i;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    cs = OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set;
+    ohm_fact_store_change_set_set_coalesce(cs, TRUE);
+    fail_unless(ohm_fact_store_change_set_get_coalesce(cs));
+    p = ohm_pattern_new("org.test.match");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+
+    /* added + updated is added, added + removed is nothing */
+    f = ohm_fact_new("org.test.match");
+    ohm_fact_store_insert(fs, f);
+    for (i = 0; i < 50; i++)
+        ohm_fact_set_int(f, "a", i);
+    l = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l) == 1);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->data)) == OHM_FACT_STORE_EVENT_ADDED);
+    ohm_fact_store_remove(fs, f);
+    fail_unless(ohm_fact_store_change_set_get_matches(cs) == NULL);
+
+    /* updated + updated is one update with the union of the fields */
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_store_change_set_reset(cs);
+    ohm_fact_set_int(f, "a", 1);
+    ohm_fact_set_int(f, "b", 2);
+    ohm_fact_set_int(f, "a", 3);
+    l = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l) == 1);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->data)) == OHM_FACT_STORE_EVENT_UPDATED);
+    fields = ohm_fact_store_change_set_get_fields(cs, OHM_PATTERN_MATCH(l->data), &n);
+    fail_unless(n == 2);
+    fail_unless(fields[0] == g_quark_from_string("a"));
+    fail_unless(fields[1] == g_quark_from_string("b"));
+
+    /* ... and updated + removed is removed */
+    ohm_fact_store_remove(fs, f);
+    l = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l) == 1);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->data)) == OHM_FACT_STORE_EVENT_REMOVED);
+    fail_unless(ohm_fact_store_change_set_get_fields(cs, OHM_PATTERN_MATCH(l->data), &n) == NULL && n == 0);
+    ohm_fact_store_change_set_reset(cs);
+
+    /* high-water mark */
+    f2 = ohm_fact_new("org.test.match");
+    ohm_fact_store_change_set_set_high_water(cs, 1, OHM_FACT_STORE_OVERFLOW_DROP_OLDEST);
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_store_insert(fs, f2);
+    l = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l) == 1);
+    fail_unless(ohm_pattern_match_get_fact(OHM_PATTERN_MATCH(l->data)) == f2);
+    fail_unless(ohm_fact_store_change_set_get_overflowed(cs));
+    ohm_fact_store_change_set_reset(cs);
+    fail_unless(!ohm_fact_store_change_set_get_overflowed(cs));
+
+    ohm_fact_store_change_set_set_high_water(cs, 1, OHM_FACT_STORE_OVERFLOW_DROP_NEWEST);
+    ohm_fact_set_int(f, "a", 4);
+    ohm_fact_set_int(f2, "a", 4);
+    ohm_fact_set_int(f, "b", 4);
+    l = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l) == 1);
+    fail_unless(ohm_pattern_match_get_fact(OHM_PATTERN_MATCH(l->data)) == f);
+    fail_unless(ohm_fact_store_change_set_get_overflowed(cs));
+
+    /* one entry per fact and pattern, the oldest dropped first */
+    p2 = ohm_pattern_new("org.test.match");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p2));
+    ohm_fact_store_change_set_reset(cs);
+    ohm_fact_store_change_set_set_high_water(cs, 4, OHM_FACT_STORE_OVERFLOW_DROP_OLDEST);
+    ohm_fact_set_int(f, "c", 1);
+    ohm_fact_set_int(f, "c", 2);
+    l = ohm_fact_store_change_set_get_matches(cs);
+    fail_unless(g_slist_length(l) == 2);
+    fail_unless(ohm_pattern_match_get_pattern(OHM_PATTERN_MATCH(l->data)) != ohm_pattern_match_get_pattern(OHM_PATTERN_MATCH(l->next->data)));
+    for (i = 0; i < 10; i++) {
+        g[i] = ohm_fact_new("org.test.match");
+        ohm_fact_store_insert(fs, g[i]);
+    }
+    for (l = ohm_fact_store_change_set_get_matches(cs), n = 0; l != NULL; l = l->next, n++)
+        fail_unless(ohm_pattern_match_get_fact(OHM_PATTERN_MATCH(l->data)) == g[9 - n / 2]);
+    fail_unless(n == 4);
+    ohm_fact_set_int(g[8], "a", 1);
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(cs)) == 4);
+
+    for (i = 0; i < 10; i++)
+        g_object_unref(g[i]);
+    g_object_unref(f);
+    g_object_unref(f2);
+    g_object_unref(fs);
+    g_object_unref(v);
+    g_object_unref(p);
+    g_object_unref(p2);
+}
+END_TEST
+
+
+static void count_view_updated(OhmFactStoreView* v, OhmFactStoreChangeSet* cs, gint* count)
+{
+    (*count)++;
+}
+
+START_TEST (test_fact_store_apply_batch)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmPattern* p;
+    OhmPattern* p2;
+    OhmFact* f[3];
+    OhmFactStoreOp ops[6];
+    gint updated = 0;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    p = ohm_pattern_new("org.test.a");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    p2 = ohm_pattern_new("org.test.b");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p2));
+    g_signal_connect(v, "updated", G_CALLBACK(count_view_updated), &updated);
+
+    f[0] = ohm_fact_new("org.test.a");
+    f[1] = ohm_fact_new("org.test.b");
+    f[2] = ohm_fact_new("org.test.a");
+
+    memset(ops, 0, sizeof(ops));
+    ops[0].type = OHM_FACT_STORE_OP_INSERT;
+    ops[0].fact = f[0];
+    ops[1].type = OHM_FACT_STORE_OP_INSERT;
+    ops[1].fact = f[1];
+    ops[2].type = OHM_FACT_STORE_OP_UPDATE;
+    ops[2].fact = f[0];
+    ops[2].field = g_quark_from_string("x");
+    g_value_init(&ops[2].value, G_TYPE_INT);
+    g_value_set_int(&ops[2].value, 7);
+    ops[3].type = OHM_FACT_STORE_OP_INSERT;
+    ops[3].fact = f[2];
+    ops[4].type = OHM_FACT_STORE_OP_REMOVE;
+    ops[4].fact = f[2];
+    ops[5].type = OHM_FACT_STORE_OP_UPDATE;
+    ops[5].fact = f[1];
+    ops[5].field = g_quark_from_string("y");
+    g_value_init(&ops[5].value, G_TYPE_STRING);
+    g_value_set_string(&ops[5].value, "z");
+    ohm_fact_store_apply_batch(fs, ops, 6);
+
+    fail_unless(updated == 1);
+    fail_unless(!G_IS_VALUE(&ops[2].value));
+    fail_unless(g_value_get_int(ohm_fact_get(f[0], "x")) == 7);
+    fail_unless(strcmp(g_value_get_string(ohm_fact_get(f[1], "y")), "z") == 0);
+    fail_unless(count_facts(fs, "org.test.a") == 1);
+    fail_unless(count_facts(fs, "org.test.b") == 1);
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 6);
+
+    /* removing a field */
+    memset(ops, 0, sizeof(ops));
+    ops[0].type = OHM_FACT_STORE_OP_UPDATE;
+    ops[0].fact = f[0];
+    ops[0].field = g_quark_from_string("x");
+    ohm_fact_store_apply_batch(fs, ops, 1);
+    fail_unless(ohm_fact_get(f[0], "x") == NULL);
+    fail_unless(updated == 2);
+
+    g_object_unref(f[0]);
+    g_object_unref(f[1]);
+    g_object_unref(f[2]);
+    g_object_unref(fs);
+    g_object_unref(v);
+    g_object_unref(p);
+    g_object_unref(p2);
+}
+END_TEST
+
+
+START_TEST (test_fact_store_deferred_notify)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmFactStoreChangeSet* cs;
+    OhmPattern* p;
+    OhmFact* f[10];
+    OhmFactStoreOp op;
+    gint updated = 0;
+    gint i;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    cs = OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set;
+    p = ohm_pattern_new("org.test.deferred");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    ohm_fact_store_change_set_set_coalesce(cs, TRUE);
+    g_signal_connect(v, "updated", G_CALLBACK(count_view_updated), &updated);
+    ohm_fact_store_set_deferred_notify(fs, TRUE, G_PRIORITY_DEFAULT);
+
+    /* a burst is one callback, from the main loop */
+    for (i = 0; i < 10; i++) {
+        f[i] = ohm_fact_new("org.test.deferred");
+        ohm_fact_store_insert(fs, f[i]);
+        ohm_fact_set(f[i], "id", ohm_value_from_int(i));
+    }
+    fail_unless(updated == 0);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    fail_unless(updated == 1);
+    fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(cs)) == 10);
+
+    /* nothing to tell of a rolled back transaction, nor of a reset */
+    ohm_fact_store_change_set_reset(cs);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set(f[0], "id", ohm_value_from_int(42));
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    ohm_fact_set(f[1], "id", ohm_value_from_int(42));
+    ohm_fact_store_change_set_reset(cs);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    fail_unless(updated == 1);
+
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set(f[0], "id", ohm_value_from_int(43));
+    ohm_fact_set(f[1], "id", ohm_value_from_int(43));
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    fail_unless(updated == 2);
+
+    /* a batch is notified from the main loop too */
+    memset(&op, 0, sizeof(op));
+    op.type = OHM_FACT_STORE_OP_REMOVE;
+    op.fact = f[2];
+    ohm_fact_store_apply_batch(fs, &op, 1);
+    fail_unless(updated == 2);
+    ohm_fact_store_flush_notify(fs);
+    fail_unless(updated == 3);
+    fail_unless(!g_main_context_pending(NULL));
+
+    /* going back to immediate notification flushes the queue */
+    ohm_fact_store_remove(fs, f[3]);
+    ohm_fact_store_set_deferred_notify(fs, FALSE, G_PRIORITY_DEFAULT);
+    fail_unless(updated == 4);
+    ohm_fact_store_remove(fs, f[4]);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    fail_unless(updated == 4);
+
+    /* a pending notification does not outlive the store */
+    ohm_fact_store_set_deferred_notify(fs, TRUE, G_PRIORITY_DEFAULT_IDLE);
+    ohm_fact_store_remove(fs, f[5]);
+    g_object_unref(fs);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    fail_unless(updated == 4);
+
+    for (i = 0; i < 10; i++)
+        g_object_unref(f[i]);
+    g_object_unref(v);
+    g_object_unref(p);
+}
+END_TEST
+
+
+typedef struct {
+    gint events[3];
+    GQuark field;
+    gboolean destroyed;
+} Listened;
+
+static void listen_fact(OhmFactStore* fs, OhmFact* fact, OhmFactStoreEvent event, GQuark field,
+                        GValue* value, gpointer data)
+{
+    Listened* l = data;
+
+    l->events[event]++;
+    if (event == OHM_FACT_STORE_EVENT_UPDATED)
+        l->field = field;
+}
+
+static void listened_destroy(gpointer data)
+{
+    ((Listened*) data)->destroyed = TRUE;
+}
+
+static void count_signal(OhmFactStore* fs, OhmFact* fact, gint* count)
+{
+    (*count)++;
+}
+
+START_TEST (test_fact_store_listener)
+{
+    OhmFactStore* fs;
+    OhmFact* f;
+    Listened l1, l2;
+    guint id1, id2;
+    gint inserted = 0;
+
+    memset(&l1, 0, sizeof(l1));
+    memset(&l2, 0, sizeof(l2));
+    fs = ohm_fact_store_new();
+    id1 = ohm_fact_store_add_listener(fs, listen_fact, &l1, listened_destroy);
+    id2 = ohm_fact_store_add_listener(fs, listen_fact, &l2, NULL);
+    fail_unless(id1 != 0 && id2 != 0 && id1 != id2);
+    g_signal_connect(fs, "inserted", G_CALLBACK(count_signal), &inserted);
+
+    f = ohm_fact_new("org.test.listener");
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_set(f, "state", ohm_value_from_string("on"));
+    fail_unless(l1.events[OHM_FACT_STORE_EVENT_ADDED] == 1 && inserted == 1);
+    fail_unless(l1.events[OHM_FACT_STORE_EVENT_UPDATED] == 1 && l1.field == g_quark_from_string("state"));
+
+    /* a transaction tells about what it commits only */
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set(f, "state", ohm_value_from_string("off"));
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    fail_unless(l2.events[OHM_FACT_STORE_EVENT_UPDATED] == 1);
+
+    fail_unless(ohm_fact_store_remove_listener(fs, id1));
+    fail_unless(!ohm_fact_store_remove_listener(fs, id1));
+    fail_unless(l1.destroyed);
+    ohm_fact_store_remove(fs, f);
+    fail_unless(l1.events[OHM_FACT_STORE_EVENT_REMOVED] == 0);
+    fail_unless(l2.events[OHM_FACT_STORE_EVENT_REMOVED] == 1);
+    fail_unless(!l2.destroyed);
+
+    g_object_unref(fs);
+    g_object_unref(f);
+}
+END_TEST
+
+
+static void expire_fact(OhmFactStore* fs, OhmFact* fact, OhmFactStoreEvent event, GQuark field,
+                        GValue* value, gpointer data)
+{
+    gint* removed = data;
+
+    if (event != OHM_FACT_STORE_EVENT_REMOVED)
+        return;
+
+    /* never early */
+    if (ohm_fact_get_expiry(fact) <= g_get_monotonic_time())
+        (*removed)++;
+}
+
+START_TEST (test_fact_store_expiry)
+{
+    OhmFactStore* fs;
+    OhmFact* f[100];
+    OhmFact* late;
+    OhmFact* kept;
+    gint64 start, deadline;
+    gint removed = 0;
+    int i;
+
+    fs = ohm_fact_store_new();
+    ohm_fact_store_add_listener(fs, expire_fact, &removed, NULL);
+    start = g_get_monotonic_time();
+
+    /* set before or after the insertion, across the first two levels */
+    for (i = 0; i < 100; i++) {
+        f[i] = ohm_fact_new("org.test.expiry");
+        ohm_fact_set_int(f[i], "id", i);
+        if (i % 2)
+            ohm_fact_set_expiry(f[i], start + g_random_int_range(0, 200000));
+        ohm_fact_store_insert(fs, f[i]);
+        if (!(i % 2))
+            ohm_fact_set_expiry(f[i], start + g_random_int_range(0, 200000));
+    }
+    fail_unless(ohm_fact_get_expiry(f[0]) >= start);
+
+    /* cancelled, removed early, or far away */
+    ohm_fact_set_expiry(f[0], 0);
+    ohm_fact_store_remove(fs, f[1]);
+    kept = ohm_fact_new("org.test.expiry");
+    ohm_fact_set_expiry(kept, start + G_GINT64_CONSTANT(3600) * G_USEC_PER_SEC);
+    ohm_fact_store_insert(fs, kept);
+    late = ohm_fact_new("org.test.expiry");
+    ohm_fact_set_expiry(late, start + G_GINT64_CONSTANT(360000) * G_USEC_PER_SEC);
+    ohm_fact_store_insert(fs, late);
+
+    deadline = start + 5 * G_USEC_PER_SEC;
+    while (removed < 98 && g_get_monotonic_time() < deadline)
+        g_main_context_iteration(NULL, TRUE);
+    fail_unless(removed == 98);
+
+    for (i = 2; i < 100; i++)
+        fail_unless(ohm_fact_get_fact_store(f[i]) == NULL);
+    fail_unless(ohm_fact_get_fact_store(f[0]) == fs);
+    fail_unless(ohm_fact_get_fact_store(kept) == fs);
+    fail_unless(ohm_fact_get_fact_store(late) == fs);
+
+    /* the facts left in the wheel outlive the store */
+    g_object_unref(fs);
+    fail_unless(ohm_fact_get_expiry(kept) != 0);
+    for (i = 0; i < 100; i++)
+        g_object_unref(f[i]);
+    g_object_unref(kept);
+    g_object_unref(late);
+}
+END_TEST
+
+
+static gpointer read_snapshot(gpointer data)
+{
+    OhmPattern* p;
+    GSList* l;
+    gint i, n = 0;
+
+    p = ohm_pattern_new("org.test.snap");
+    ohm_structure_set(OHM_STRUCTURE(p), "kind", ohm_value_from_string("odd"));
+    for (i = 0; i < 100; i++) {
+        l = ohm_fact_store_snapshot_get_facts_by_pattern(data, p);
+        n += g_slist_length(l);
+        g_slist_foreach(l, (GFunc) g_object_unref, NULL);
+        g_slist_free(l);
+    }
+    g_object_unref(p);
+    ohm_fact_store_snapshot_unref(data);
+
+    return GINT_TO_POINTER(n);
+}
+
+START_TEST (test_fact_store_snapshot)
+{
+    OhmFactStore* fs;
+    OhmFactStoreSnapshot* s1;
+    OhmFactStoreSnapshot* s2;
+    OhmFactStoreSnapshot* s3;
+    OhmFactStoreSnapshot* s4;
+    OhmPattern* p;
+    OhmFact* f[10];
+    OhmFact* g[2];
+    OhmFact* fnew;
+    GSList* l;
+    GThread* thread;
+    int i;
+
+    fs = ohm_fact_store_new();
+    ohm_fact_store_add_index(fs, "org.test.snap", "kind");
+    for (i = 0; i < 10; i++) {
+        f[i] = ohm_fact_new("org.test.snap");
+        ohm_fact_set_int(f[i], "id", i);
+        ohm_fact_set_string(f[i], "kind", i % 2 ? "odd" : "even");
+        ohm_fact_store_insert(fs, f[i]);
+    }
+
+    /* unchanged facts are shared between snapshots */
+    s1 = ohm_fact_store_snapshot(fs);
+    s2 = ohm_fact_store_snapshot(fs);
+    fail_unless(ohm_fact_store_snapshot_get_version(s1) == ohm_fact_store_snapshot_get_version(s2));
+    fail_unless(g_slist_length(ohm_fact_store_snapshot_get_facts_by_name(s1, "org.test.snap")) == 10);
+    fail_unless(ohm_fact_store_snapshot_get_facts_by_name(s1, "org.test.snap") == ohm_fact_store_snapshot_get_facts_by_name(s2, "org.test.snap"));
+    fail_unless(ohm_fact_store_snapshot_get_facts_by_name(s1, "org.test.snap")->data != f[9]);
+    ohm_fact_store_snapshot_unref(s2);
+
+    /* the open transactions are not visible, later changes neither */
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_string(f[0], "kind", "odd");
+    ohm_fact_store_remove(fs, f[1]);
+    fnew = ohm_fact_new("org.test.snap");
+    ohm_fact_store_insert(fs, fnew);
+    g_object_unref(fnew);
+    s2 = ohm_fact_store_snapshot(fs);
+    fail_unless(ohm_fact_store_snapshot_get_version(s1) == ohm_fact_store_snapshot_get_version(s2));
+    fail_unless(g_slist_length(ohm_fact_store_snapshot_get_facts_by_name(s2, "org.test.snap")) == 10);
+    fail_unless(ohm_fact_store_snapshot_get_facts_by_name(s2, "org.test.snap")->data == ohm_fact_store_snapshot_get_facts_by_name(s1, "org.test.snap")->data);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+
+    s3 = ohm_fact_store_snapshot(fs);
+    fail_unless(ohm_fact_store_snapshot_get_version(s3) > ohm_fact_store_snapshot_get_version(s1));
+    fail_unless(g_slist_length(ohm_fact_store_snapshot_get_facts_by_name(s3, "org.test.snap")) == 10);
+
+    /* only the changed facts are copied again */
+    i = 0;
+    for (l = ohm_fact_store_snapshot_get_facts_by_name(s3, "org.test.snap"); l != NULL; l = l->next) {
+        if (g_slist_find(ohm_fact_store_snapshot_get_facts_by_name(s1, "org.test.snap"), l->data) != NULL)
+            i++;
+    }
+    fail_unless(i == 8);
+    p = ohm_pattern_new("org.test.snap");
+    ohm_structure_set(OHM_STRUCTURE(p), "kind", ohm_value_from_string("odd"));
+    l = ohm_fact_store_snapshot_get_facts_by_pattern(s1, p);
+    fail_unless(g_slist_length(l) == 5);
+    g_slist_foreach(l, (GFunc) g_object_unref, NULL);
+    g_slist_free(l);
+    l = ohm_fact_store_snapshot_get_facts_by_pattern(s3, p);
+    fail_unless(g_slist_length(l) == 5);
+    g_slist_foreach(l, (GFunc) g_object_unref, NULL);
+    g_slist_free(l);
+
+    /* a fact removed, changed, put back and changed again within a
+       transaction is seen as it was committed, frozen before or not */
+    g[0] = ohm_fact_new("org.test.snap2");
+    ohm_fact_set_int(g[0], "id", 1);
+    ohm_fact_store_insert(fs, g[0]);
+    s4 = ohm_fact_store_snapshot(fs);
+    ohm_fact_store_snapshot_unref(s4);
+    g[1] = ohm_fact_new("org.test.snap2");
+    ohm_fact_set_int(g[1], "id", 1);
+    ohm_fact_store_insert(fs, g[1]);
+    ohm_fact_store_transaction_push(fs);
+    for (i = 0; i < 2; i++) {
+        ohm_fact_store_remove(fs, g[i]);
+        ohm_fact_set_int(g[i], "id", 2);
+        ohm_fact_store_insert(fs, g[i]);
+        ohm_fact_set_int(g[i], "id", 3);
+    }
+    s4 = ohm_fact_store_snapshot(fs);
+    fail_unless(g_slist_length(ohm_fact_store_snapshot_get_facts_by_name(s4, "org.test.snap2")) == 2);
+    for (l = ohm_fact_store_snapshot_get_facts_by_name(s4, "org.test.snap2"); l != NULL; l = l->next)
+        fail_unless(g_value_get_int(ohm_fact_get(OHM_FACT(l->data), "id")) == 1);
+    ohm_fact_store_snapshot_unref(s4);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    s4 = ohm_fact_store_snapshot(fs);
+    for (l = ohm_fact_store_snapshot_get_facts_by_name(s4, "org.test.snap2"); l != NULL; l = l->next)
+        fail_unless(g_value_get_int(ohm_fact_get(OHM_FACT(l->data), "id")) == 3);
+    ohm_fact_store_snapshot_unref(s4);
+    g_object_unref(g[0]);
+    g_object_unref(g[1]);
+
+    /* snapshots are read from another thread while the store changes */
+    thread = g_thread_new("snapshot", read_snapshot, ohm_fact_store_snapshot_ref(s1));
+    for (i = 0; i < 10; i++) {
+        ohm_fact_set_string(f[i], "kind", "odd");
+        ohm_fact_set_int(f[i], "id", -i);
+    }
+    fail_unless(GPOINTER_TO_INT(g_thread_join(thread)) == 500);
+    l = ohm_fact_store_snapshot_get_facts_by_pattern(s1, p);
+    fail_unless(g_slist_length(l) == 5);
+    g_slist_foreach(l, (GFunc) g_object_unref, NULL);
+    g_slist_free(l);
+
+    ohm_fact_store_snapshot_unref(s1);
+    ohm_fact_store_snapshot_unref(s2);
+    g_object_unref(fs);
+    /* snapshots outlive the store */
+    fail_unless(g_slist_length(ohm_fact_store_snapshot_get_facts_by_name(s3, "org.test.snap")) == 10);
+    ohm_fact_store_snapshot_unref(s3);
+    g_object_unref(p);
+    for (i = 0; i < 10; i++)
+        g_object_unref(f[i]);
+}
+END_TEST
+
+
 static void do_test_fact_store_view_two(void)
 {
     OhmFactStore* fs;
@@ -691,6 +2533,13 @@ START_TEST (test_fact_store_transaction_push_pop)
         }
     }
     ohm_fact_store_transaction_pop(fs, FALSE);
+
+    /* an unmatched pop leaves the locks of a thread-safe store alone */
+    ohm_fact_store_set_thread_safe(fs, TRUE);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    ohm_fact_store_set_thread_safe(fs, FALSE);
     (fs == NULL ? NULL : (fs = (g_object_unref(fs), NULL)));
 }
 END_TEST
@@ -705,16 +2554,16 @@ START_TEST (test_fact_store_transaction_push_and_watch)
     fact = ohm_fact_new("org.test.match");
     ohm_fact_set(fact, "field", ohm_value_from_int(42));
     ohm_fact_store_insert(fs, fact);
-    fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 1);
+    fail_unless(count_facts(fs, "org.test.match") == 1);
     ohm_fact_set(fact, "field", ohm_value_from_int(43));
     ohm_fact_store_transaction_pop(fs, FALSE);
-    fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 1);
+    fail_unless(count_facts(fs, "org.test.match") == 1);
     ohm_fact_store_transaction_push(fs);
     ohm_fact_store_transaction_push(fs);
     ohm_fact_store_remove(fs, fact);
     ohm_fact_store_transaction_pop(fs, FALSE);
     ohm_fact_store_transaction_pop(fs, FALSE);
-    fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 0);
+    fail_unless(count_facts(fs, "org.test.match") == 0);
     (fs == NULL ? NULL : (fs = (g_object_unref(fs), NULL)));
     (fact == NULL ? NULL : (fact = (g_object_unref(fact), NULL)));
 }
@@ -746,14 +2595,14 @@ static void do_test_fact_store_transaction_push_and_cancel(void)
         fact = ohm_fact_new("org.test.match");
         ohm_fact_set(fact, "field", ohm_value_from_int(42));
         ohm_fact_store_insert(fs, fact);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 1);
+        fail_unless(count_facts(fs, "org.test.match") == 1);
         fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 0);
         (fact == NULL ? NULL : (fact = (g_object_unref(fact), NULL)));
     }
     ohm_fact_store_transaction_pop(fs, TRUE);
     fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 0);
     /* and from the fact store*/
-    fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 0);
+    fail_unless(count_facts(fs, "org.test.match") == 0);
     /* retract/remove*/
     fact = ohm_fact_new("org.test.match");
     ohm_fact_set(fact, "field", ohm_value_from_int(42));
@@ -762,14 +2611,14 @@ static void do_test_fact_store_transaction_push_and_cancel(void)
     ohm_fact_store_transaction_push(fs);
     {
         ohm_fact_store_remove(fs, fact);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 0);
+        fail_unless(count_facts(fs, "org.test.match") == 0);
         fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 1);
     }
     ohm_fact_store_transaction_pop(fs, TRUE);
     /* pop should remove from the view change_set*/
     fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 1);
     /* and reinsert in the fact store*/
-    fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 1);
+    fail_unless(count_facts(fs, "org.test.match") == 1);
     /* update*/
     ohm_fact_store_transaction_push(fs);
     {
@@ -800,6 +2649,118 @@ START_TEST (test_fact_store_transaction_push_and_cancel)
 END_TEST
 
 
+START_TEST (test_fact_store_transaction_commit_duplicates)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmPattern* p;
+    OhmFact* f;
+    OhmFact* f2;
+    GSList* l;
+    int i;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    p = ohm_pattern_new("org.test.match");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    f = ohm_fact_new("org.test.match");
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_store_change_set_reset(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set);
+
+    /* only the last update of each field is replayed */
+    ohm_fact_store_transaction_push(fs);
+    for (i = 0; i < 20; i++) {
+        ohm_fact_set_int(f, "a", i);
+        ohm_fact_set_int(f, "b", i);
+    }
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    l = ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set);
+    fail_unless(g_slist_length(l) == 2);
+    ohm_fact_store_change_set_reset(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set);
+
+    /* added and updated is added, added and removed is nothing */
+    ohm_fact_store_transaction_push(fs);
+    f2 = ohm_fact_new("org.test.match");
+    ohm_fact_store_insert(fs, f2);
+    ohm_fact_set_int(f2, "a", 1);
+    ohm_fact_set_int(f2, "a", 2);
+    ohm_fact_store_insert(fs, f2);
+    ohm_fact_store_remove(fs, f);
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_store_remove(fs, f);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    l = ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set);
+    fail_unless(g_slist_length(l) == 2);
+    fail_unless(ohm_pattern_match_get_fact(OHM_PATTERN_MATCH(l->data)) == f);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->data)) == OHM_FACT_STORE_EVENT_REMOVED);
+    fail_unless(ohm_pattern_match_get_fact(OHM_PATTERN_MATCH(l->next->data)) == f2);
+    fail_unless(ohm_pattern_match_get_event(OHM_PATTERN_MATCH(l->next->data)) == OHM_FACT_STORE_EVENT_ADDED);
+
+    g_object_unref(f);
+    g_object_unref(f2);
+    g_object_unref(fs);
+    g_object_unref(v);
+    g_object_unref(p);
+}
+END_TEST
+
+
+START_TEST (test_fact_store_transaction_nested)
+{
+    OhmFactStore* fs;
+    OhmFactStoreView* v;
+    OhmPattern* p;
+    OhmFact* f;
+    OhmFact* f2;
+    GSList* l;
+
+    fs = ohm_fact_store_new();
+    v = ohm_fact_store_new_view(fs, NULL);
+    p = ohm_pattern_new("org.test.match");
+    ohm_fact_store_view_add(v, OHM_STRUCTURE(p));
+    f = ohm_fact_new("org.test.match");
+    ohm_fact_set_int(f, "a", 1);
+    ohm_fact_store_insert(fs, f);
+    ohm_fact_store_change_set_reset(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set);
+
+    /* an inner commit is undone by the outer rollback, and notifies nobody */
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_int(f, "a", 2);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_int(f, "a", 3);
+    f2 = ohm_fact_new("org.test.match");
+    ohm_fact_store_insert(fs, f2);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    fail_unless(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set) == NULL);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_int(f, "a", 4);
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    fail_unless(g_value_get_int(ohm_fact_get(f, "a")) == 3);
+    ohm_fact_store_transaction_pop(fs, TRUE);
+    fail_unless(g_value_get_int(ohm_fact_get(f, "a")) == 1);
+    fail_unless(count_facts(fs, "org.test.match") == 1);
+    fail_unless(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set) == NULL);
+
+    /* the outermost commit notifies the views once */
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_store_transaction_push(fs);
+    ohm_fact_set_int(f, "a", 5);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    ohm_fact_set_int(f, "a", 6);
+    ohm_fact_store_transaction_pop(fs, FALSE);
+    l = ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set);
+    fail_unless(g_slist_length(l) == 1);
+    fail_unless(g_value_get_int(ohm_fact_get(f, "a")) == 6);
+
+    g_object_unref(f);
+    g_object_unref(f2);
+    g_object_unref(fs);
+    g_object_unref(v);
+    g_object_unref(p);
+}
+END_TEST
+
+
 START_TEST (test_fact_store_transaction_push_and_commit)
 {
     OhmFactStore* fs;
@@ -830,28 +2791,28 @@ START_TEST (test_fact_store_transaction_push_and_commit)
         fact = ohm_fact_new("org.test.match");
         ohm_fact_set(fact, "field", ohm_value_from_int(42));
         ohm_fact_store_insert(fs, fact);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 1);
+        fail_unless(count_facts(fs, "org.test.match") == 1);
         fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 0);
         fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(tpv)->change_set)) == 1);
     }
     ohm_fact_store_transaction_pop(fs, FALSE);
     fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 1);
     /* and from the fact store*/
-    fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 1);
+    fail_unless(count_facts(fs, "org.test.match") == 1);
     ohm_fact_set(fact, "field", ohm_value_from_int(43));
     fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 2);
     fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(tpv)->change_set)) == 2);
     ohm_fact_store_transaction_push(fs);
     {
         ohm_fact_store_remove(fs, fact);
-        fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 0);
+        fail_unless(count_facts(fs, "org.test.match") == 0);
         fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 2);
         fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(tpv)->change_set)) == 3);
     }
     ohm_fact_store_transaction_pop(fs, FALSE);
     fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(v)->change_set)) == 3);
     fail_unless(g_slist_length(ohm_fact_store_change_set_get_matches(OHM_FACT_STORE_SIMPLE_VIEW(tpv)->change_set)) == 3);
-    fail_unless(g_slist_length(ohm_fact_store_get_facts_by_name(fs, "org.test.match")) == 0);
+    fail_unless(count_facts(fs, "org.test.match") == 0);
     /* update*/
     fact = ohm_fact_new("org.test.match");
     ohm_fact_set(fact, "field", ohm_value_from_int(41));
@@ -913,6 +2874,8 @@ factstore_case (int desired_step_id)
     PREPARE_TEST (tc_factstore, test_fact_structure_to_string);
     PREPARE_TEST (tc_factstore, test_fact_fact_new);
     PREPARE_TEST (tc_factstore, test_fact_fact_set_get);
+    PREPARE_TEST (tc_factstore, test_fact_fact_fields);
+    PREPARE_TEST (tc_factstore, test_fact_fact_set_typed);
     PREPARE_TEST (tc_factstore, test_fact_pattern_new);
     PREPARE_TEST (tc_factstore, test_fact_pattern_new_for_fact);
     PREPARE_TEST (tc_factstore, test_fact_pattern_set_get);
@@ -924,17 +2887,39 @@ factstore_case (int desired_step_id)
     PREPARE_TEST (tc_factstore, test_fact_store_new);
     PREPARE_TEST (tc_factstore, test_fact_store_insert);
     PREPARE_TEST (tc_factstore, test_fact_store_to_string);
+    PREPARE_TEST (tc_factstore, test_fact_store_writer);
     PREPARE_TEST (tc_factstore, test_fact_store_insert_remove);
     PREPARE_LOOP_TEST (tc_factstore, test_fact_store_free, 1000);
+    PREPARE_TEST (tc_factstore, test_fact_store_insert_remove_many);
+    PREPARE_TEST (tc_factstore, test_fact_store_index);
+    PREPARE_TEST (tc_factstore, test_fact_store_ordered_index);
+    PREPARE_TEST (tc_factstore, test_fact_store_symbols);
+    PREPARE_TEST (tc_factstore, test_fact_store_apply_batch);
+    PREPARE_TEST (tc_factstore, test_fact_store_deferred_notify);
+    PREPARE_TEST (tc_factstore, test_fact_store_listener);
+    PREPARE_TEST (tc_factstore, test_fact_store_expiry);
+    PREPARE_TEST (tc_factstore, test_fact_store_snapshot);
+    PREPARE_TEST (tc_factstore, test_fact_store_thread_safe);
+    PREPARE_TEST (tc_factstore, test_fact_store_txn);
+    PREPARE_TEST (tc_factstore, test_fact_store_dump);
+    PREPARE_TEST (tc_factstore, test_fact_store_journal);
+    PREPARE_TEST (tc_factstore, test_fact_store_stats);
     PREPARE_TEST (tc_factstore, test_fact_store_view_new);
     PREPARE_TEST (tc_factstore, test_fact_store_view_two);
     PREPARE_LOOP_TEST (tc_factstore, test_fact_store_view_free, 1000);
+    PREPARE_TEST (tc_factstore, test_fact_store_view_pattern_fields);
+    PREPARE_TEST (tc_factstore, test_fact_store_view_alpha);
+    PREPARE_TEST (tc_factstore, test_fact_store_view_updated_fields);
+    PREPARE_TEST (tc_factstore, test_fact_store_view_change_set);
+    PREPARE_TEST (tc_factstore, test_fact_store_view_coalesce);
     PREPARE_TEST (tc_factstore, test_fact_store_transaction_push_pop);
     PREPARE_TEST (tc_factstore, test_fact_store_transaction_push_and_watch);
     PREPARE_TEST (tc_factstore, test_fact_store_transaction_push_and_cancel);
     PREPARE_LOOP_TEST (tc_factstore, test_fact_store_transaction_free, 1000);
     PREPARE_TEST (tc_factstore, test_fact_store_pattern_delete);
     PREPARE_TEST (tc_factstore, test_fact_store_transaction_push_and_commit);
+    PREPARE_TEST (tc_factstore, test_fact_store_transaction_commit_duplicates);
+    PREPARE_TEST (tc_factstore, test_fact_store_transaction_nested);
 
     return tc_factstore;
 }